@@ -0,0 +1,1041 @@
+/*
+ * Benchmarks for the cache store library. These run the store in-process
+ * (no network layer), so the numbers reflect the store alone.
+ */
+
+#include "cache.hh"
+#include "flat_table.hh"
+#include "lru_evictor.hh"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using clock_type = std::chrono::steady_clock;
+
+//count every heap allocation made by the process
+std::atomic<std::uint64_t> nallocs {0};
+
+void* operator new(std::size_t size) {
+  nallocs.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+//kept out of line: inlined into a caller, GCC takes the free() for a
+//mismatch with the operator new the pointer came from
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept {
+  std::free(p);
+}
+
+//a single pre-generated cache operation
+struct op {
+  char type;               // 'g'et, 's'et or 'd'el
+  std::string key;
+  Cache::size_type size;   // value size for sets
+};
+
+//values of every size up to max_value_size, NUL terminated at size-1
+//so that they can be passed to Cache::set directly
+const Cache::size_type max_value_size = 4096;
+std::vector<std::string> values;
+
+void make_values() {
+  values.clear();
+  values.push_back("");
+  for (Cache::size_type s = 1; s <= max_value_size; s++) {
+    values.push_back(std::string(s - 1, 'b'));
+  }
+}
+
+Cache::val_type value_of(Cache::size_type size) {
+  return Cache::val_type {values[size].c_str(), size};
+}
+
+//generate nops operations over nkeys distinct keys using the driver's
+//20:1:7 get/set/del mix and gamma(1, 200) distributed value sizes
+std::vector<op> gen_ops(unsigned nops, unsigned nkeys, unsigned seed) {
+  std::mt19937_64 gen(seed);
+  std::uniform_int_distribution<unsigned> key_dis(0, nkeys - 1);
+  std::uniform_int_distribution<unsigned> type_dis(0, 27);
+  std::gamma_distribution<double> size_dis(1, 200);
+
+  std::vector<op> ops;
+  ops.reserve(nops);
+  for (unsigned i = 0; i < nops; i++) {
+    auto t = type_dis(gen);
+    char type = t < 20 ? 'g' : (t < 21 ? 's' : 'd');
+    auto size = static_cast<Cache::size_type>(size_dis(gen)) + 1;
+    size = std::min(size, max_value_size);
+    ops.push_back(op {type, "key:" + std::to_string(key_dis(gen)), size});
+  }
+  return ops;
+}
+
+//set every key once so that gets start out hitting
+void warm_up(Cache& c, unsigned nkeys) {
+  for (unsigned i = 0; i < nkeys; i++) {
+    c.set("key:" + std::to_string(i), value_of(200));
+  }
+}
+
+void run_op(Cache& c, const op& o) {
+  if (o.type == 'g') {
+    delete[] c.get(o.key).data_;
+  } else if (o.type == 's') {
+    c.set(o.key, value_of(o.size));
+  } else {
+    c.del(o.key);
+  }
+}
+
+//run every thread's operations against c concurrently and return ops/s.
+//if global is non-null every operation is serialized on it, which is how
+//the server used the store before it was sharded.
+double run_threads(Cache& c, const std::vector<std::vector<op>>& ops, std::mutex* global) {
+  std::vector<std::thread> threads;
+  auto t1 = clock_type::now();
+  for (auto& thread_ops : ops) {
+    threads.emplace_back([&c, &thread_ops, global]() {
+      for (auto& o : thread_ops) {
+        if (global != nullptr) {
+          std::lock_guard guard(*global);
+          run_op(c, o);
+        } else {
+          run_op(c, o);
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto t2 = clock_type::now();
+  double secs = std::chrono::duration<double>(t2 - t1).count();
+  double total = 0;
+  for (auto& thread_ops : ops) {
+    total += thread_ops.size();
+  }
+  return total / secs;
+}
+
+//ops/s for 1..max_threads threads, single global lock vs sharded store
+void bench_scaling(unsigned max_threads, unsigned nshards) {
+  const unsigned nkeys = 100000;
+  const unsigned nops = 1000000;
+  const Cache::size_type maxmem = 256 << 20;
+
+  std::cout << "threads,global_lock_ops_per_s,sharded_ops_per_s" << std::endl;
+  for (unsigned nthreads = 1; nthreads <= max_threads; nthreads++) {
+    std::vector<std::vector<op>> ops;
+    for (unsigned i = 0; i < nthreads; i++) {
+      ops.push_back(gen_ops(nops / nthreads, nkeys, i));
+    }
+
+    Cache single {maxmem, 0.75, nullptr, std::hash<key_view>(), 1};
+    std::mutex global;
+    warm_up(single, nkeys);
+    double single_tp = run_threads(single, ops, &global);
+
+    Cache sharded {maxmem, 0.75, nullptr, std::hash<key_view>(), nshards};
+    warm_up(sharded, nkeys);
+    double sharded_tp = run_threads(sharded, ops, nullptr);
+
+    std::cout << nthreads << "," << single_tp << "," << sharded_tp << std::endl;
+  }
+}
+
+//sorted latencies (ns) -> percentile
+double percentile(std::vector<double>& lat, double p) {
+  std::sort(lat.begin(), lat.end());
+  return lat[static_cast<std::size_t>(p * (lat.size() - 1))];
+}
+
+//allocations per get and latency percentiles on a hit-only workload,
+//copying get() vs get_ref()
+void bench_hits(unsigned nops) {
+  const unsigned nkeys = 10000;
+  Cache c {256 << 20, 0.75, nullptr, std::hash<key_view>(), 16};
+  warm_up(c, nkeys);
+
+  std::mt19937_64 gen(0);
+  std::uniform_int_distribution<unsigned> key_dis(0, nkeys - 1);
+  std::vector<key_type> keys;
+  for (unsigned i = 0; i < nops; i++) {
+    keys.push_back("key:" + std::to_string(key_dis(gen)));
+  }
+
+  std::cout << "api,allocs_per_get,p50_ns,p99_ns" << std::endl;
+  for (int use_ref = 0; use_ref < 2; use_ref++) {
+    std::vector<double> lat;
+    lat.reserve(nops);
+    std::uint64_t allocs = 0;
+    for (auto& k : keys) {
+      auto a1 = nallocs.load(std::memory_order_relaxed);
+      auto t1 = clock_type::now();
+      if (use_ref) {
+        Cache::value_handle h = c.get_ref(k);
+      } else {
+        delete[] c.get(k).data_;
+      }
+      auto t2 = clock_type::now();
+      allocs += nallocs.load(std::memory_order_relaxed) - a1;
+      lat.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count());
+    }
+    std::cout << (use_ref ? "get_ref" : "get") << ","
+              << static_cast<double>(allocs) / nops << ","
+              << percentile(lat, 0.5) << "," << percentile(lat, 0.99) << std::endl;
+  }
+}
+
+//resident set size of the process in bytes
+double rss_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  double pages = 0;
+  double resident = 0;
+  statm >> pages >> resident;
+  return resident * 4096;
+}
+
+//steady-state set churn against a full cache with LRU eviction: heap
+//allocations per set once warmed up, RSS, and slab occupancy per class
+void bench_slabs(unsigned nops) {
+  const unsigned nkeys = 1000000;
+  const Cache::size_type maxmem = 64 << 20;
+  Lru_evictor lru;
+  Cache c {maxmem, 0.75, &lru, std::hash<key_view>(), 16};
+
+  std::mt19937_64 gen(0);
+  std::uniform_int_distribution<unsigned> key_dis(0, nkeys - 1);
+  std::gamma_distribution<double> size_dis(1, 200);
+  std::vector<op> ops;
+  for (unsigned i = 0; i < nops; i++) {
+    auto size = std::min(static_cast<Cache::size_type>(size_dis(gen)) + 1, max_value_size);
+    ops.push_back(op {'s', "key:" + std::to_string(key_dis(gen)), size});
+  }
+
+  std::cout << "phase,allocs_per_set,ns_per_set,rss_mb,slab_mb" << std::endl;
+  for (int phase = 0; phase < 3; phase++) {
+    auto a1 = nallocs.load(std::memory_order_relaxed);
+    auto t1 = clock_type::now();
+    for (auto& o : ops) {
+      run_op(c, o);
+    }
+    auto t2 = clock_type::now();
+    auto allocs = nallocs.load(std::memory_order_relaxed) - a1;
+    auto stats = c.stats();
+    std::cout << phase << "," << static_cast<double>(allocs) / nops << ","
+              << std::chrono::duration<double, std::nano>(t2 - t1).count() / nops << ","
+              << rss_bytes() / (1 << 20) << "," << stats["slab_memory_used"] / (1 << 20) << std::endl;
+  }
+
+  std::cout << "class,chunk_size,pages,utilization,fragmentation" << std::endl;
+  auto stats = c.stats();
+  for (unsigned i = 0; i < 64; i++) {
+    auto prefix = "slab_class_" + std::to_string(i) + "_";
+    if (stats.count(prefix + "pages")) {
+      std::cout << i << "," << stats[prefix + "chunk_size"] << "," << stats[prefix + "pages"] << ","
+                << stats[prefix + "utilization"] << "," << stats[prefix + "fragmentation"] << std::endl;
+    }
+  }
+}
+
+//memory and allocations per stored item, and hit latency, for nkeys small
+//items (short keys, 32-byte values) in a cache large enough to hold them all
+void bench_items(unsigned nkeys) {
+  std::vector<key_type> keys;
+  for (unsigned i = 0; i < nkeys; i++) {
+    keys.push_back("key:" + std::to_string(i));
+  }
+  std::vector<key_type> shuffled = keys;
+  std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937_64(0));
+
+  auto rss1 = rss_bytes();
+  Cache c {Cache::size_type(1) << 30, 0.75, nullptr, std::hash<key_view>(), 16};
+  auto a1 = nallocs.load(std::memory_order_relaxed);
+  for (auto& k : keys) {
+    c.set(k, value_of(32));
+  }
+  auto a2 = nallocs.load(std::memory_order_relaxed);
+  auto rss2 = rss_bytes();
+
+  auto t1 = clock_type::now();
+  for (auto& k : shuffled) {
+    Cache::value_handle h = c.get_ref(k);
+  }
+  auto t2 = clock_type::now();
+
+  std::cout << "keys,allocs_per_set,rss_bytes_per_item,ns_per_get_ref" << std::endl;
+  std::cout << nkeys << "," << static_cast<double>(a2 - a1) / nkeys << ","
+            << (rss2 - rss1) / nkeys << ","
+            << std::chrono::duration<double, std::nano>(t2 - t1).count() / nkeys << std::endl;
+}
+
+//allocations and ns per get_ref hit, overwriting set and del with 28-byte
+//keys taken as views into a single buffer, the way the server takes them
+//from a request's target, against a store with LRU eviction
+void bench_keys(unsigned nkeys) {
+  std::string buffer;
+  for (unsigned i = 0; i < nkeys; i++) {
+    auto k = "user:session:" + std::to_string(i);
+    buffer += k + std::string(28 - k.size(), '.');
+  }
+  std::vector<key_view> keys;
+  for (unsigned i = 0; i < nkeys; i++) {
+    keys.push_back(key_view(buffer).substr(i * 28, 28));
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(0));
+
+  Lru_evictor lru;
+  Cache c {Cache::size_type(1) << 30, 0.75, &lru, std::hash<key_view>(), 16};
+  for (auto k : keys) {
+    c.set(k, value_of(32));
+  }
+
+  std::cout << "op,allocs_per_op,ns_per_op" << std::endl;
+  for (auto name : {"get_ref", "set", "del"}) {
+    std::string op = name;
+    auto a1 = nallocs.load(std::memory_order_relaxed);
+    auto t1 = clock_type::now();
+    for (auto k : keys) {
+      if (op == "get_ref") {
+        Cache::value_handle h = c.get_ref(k);
+      } else if (op == "set") {
+        c.set(k, value_of(32));
+      } else {
+        c.del(k);
+      }
+    }
+    auto t2 = clock_type::now();
+    auto a2 = nallocs.load(std::memory_order_relaxed);
+    std::cout << op << "," << static_cast<double>(a2 - a1) / nkeys << ","
+              << std::chrono::duration<double, std::nano>(t2 - t1).count() / nkeys << std::endl;
+  }
+}
+
+//ns per key of get/set/del one key at a time vs mget/mset/mdel in batches of
+//1, 8, 64 and 512 random keys, over a store large enough that index
+//lookups miss the CPU caches
+void bench_batch(unsigned nkeys) {
+  std::vector<key_type> names;
+  for (unsigned i = 0; i < nkeys; i++) {
+    names.push_back("key:" + std::to_string(i));
+  }
+  std::vector<key_view> keys(names.begin(), names.end());
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(0));
+
+  Lru_evictor lru;
+  Cache c {Cache::size_type(1) << 30, 0.75, &lru, std::hash<key_view>(), 16};
+  for (auto k : keys) {
+    c.set(k, value_of(32));
+  }
+
+  std::cout << "batch,single_get_ns,mget_ns,single_set_ns,mset_ns,single_del_ns,mdel_ns" << std::endl;
+  for (unsigned size : {1u, 8u, 64u, 512u}) {
+    unsigned nbatches = nkeys / size;
+    std::vector<std::vector<key_view>> batches(nbatches);
+    std::vector<std::vector<std::pair<key_view, Cache::val_type>>> items(nbatches);
+    for (unsigned b = 0; b < nbatches; b++) {
+      for (unsigned i = 0; i < size; i++) {
+        batches[b].push_back(keys[b * size + i]);
+        items[b].emplace_back(keys[b * size + i], value_of(32));
+      }
+    }
+    auto ns_per_key = [nbatches, size](auto f) {
+      auto t1 = clock_type::now();
+      for (unsigned b = 0; b < nbatches; b++) {
+        f(b);
+      }
+      auto t2 = clock_type::now();
+      return std::chrono::duration<double, std::nano>(t2 - t1).count() / (double(nbatches) * size);
+    };
+
+    auto single_get = ns_per_key([&](unsigned b) {
+      for (auto k : batches[b]) {
+        Cache::value_handle h = c.get_ref(k);
+      }
+    });
+    auto mget = ns_per_key([&](unsigned b) { c.mget(batches[b]); });
+    auto single_set = ns_per_key([&](unsigned b) {
+      for (auto& item : items[b]) {
+        c.set(item.first, item.second);
+      }
+    });
+    auto mset = ns_per_key([&](unsigned b) { c.mset(items[b]); });
+    auto single_del = ns_per_key([&](unsigned b) {
+      for (auto k : batches[b]) {
+        c.del(k);
+      }
+    });
+    for (unsigned b = 0; b < nbatches; b++) {
+      c.mset(items[b]);
+    }
+    auto mdel = ns_per_key([&](unsigned b) { c.mdel(batches[b]); });
+    for (unsigned b = 0; b < nbatches; b++) {
+      c.mset(items[b]);
+    }
+
+    std::cout << size << "," << single_get << "," << mget << "," << single_set << "," << mset << ","
+              << single_del << "," << mdel << std::endl;
+  }
+}
+
+//latency percentiles of sets that grow an empty store to nkeys keys, in
+//windows of a tenth of the keys each, so that stalls from growing the index
+//show up in the tail of the window where they happen
+void bench_growth(unsigned nkeys, unsigned nshards) {
+  Cache c {Cache::size_type(4) << 30, 0.75, nullptr, std::hash<key_view>(), nshards};
+  std::vector<double> lat;
+  lat.reserve(nkeys / 10 + 1);
+  std::string key;
+
+  std::cout << "keys,p50_ns,p99_ns,p99.9_ns,p99.99_ns,max_ns" << std::endl;
+  for (unsigned i = 0; i < nkeys; i++) {
+    key = "key:" + std::to_string(i);
+    auto t1 = clock_type::now();
+    c.set(key, value_of(1));
+    auto t2 = clock_type::now();
+    lat.push_back(std::chrono::duration<double, std::nano>(t2 - t1).count());
+    if (lat.size() == nkeys / 10 || i == nkeys - 1) {
+      std::cout << i + 1 << "," << percentile(lat, 0.5) << "," << percentile(lat, 0.99) << ","
+                << percentile(lat, 0.999) << "," << percentile(lat, 0.9999) << "," << lat.back() << std::endl;
+      lat.clear();
+    }
+  }
+}
+
+//ns per operation of f applied to every key
+template <class F>
+double time_per_key(const std::vector<key_type>& keys, F f) {
+  auto t1 = clock_type::now();
+  for (auto& k : keys) {
+    f(k);
+  }
+  auto t2 = clock_type::now();
+  return std::chrono::duration<double, std::nano>(t2 - t1).count() / keys.size();
+}
+
+std::uint64_t mixed_hash(const key_type& key) {
+  std::uint64_t h = std::hash<key_view>()(key);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+struct key_of_ptr {
+  std::string_view operator()(const key_type* k) const { return *k; }
+};
+
+//insert, lookup (hits, in random order) and erase of nkeys keys in the
+//store's index vs the std::unordered_map it replaced
+void bench_index(unsigned nkeys) {
+  std::vector<key_type> keys;
+  for (unsigned i = 0; i < nkeys; i++) {
+    keys.push_back("key:" + std::to_string(i));
+  }
+  std::vector<key_type> shuffled = keys;
+  std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937_64(0));
+
+  std::cout << "table,keys,insert_ns,lookup_ns,erase_ns" << std::endl;
+  {
+    std::unordered_map<key_type, void*> map;
+    void* volatile sink = nullptr;
+    auto ins = time_per_key(keys, [&map](const key_type& k) { map[k] = nullptr; });
+    auto look = time_per_key(shuffled, [&map, &sink](const key_type& k) { sink = map.find(k)->second; });
+    auto era = time_per_key(shuffled, [&map](const key_type& k) { map.erase(k); });
+    std::cout << "unordered_map," << nkeys << "," << ins << "," << look << "," << era << std::endl;
+  }
+  {
+    //entries point at their keys, as the store's point at its items
+    Flat_table<const key_type*, key_of_ptr> table {0.75};
+    const key_type* volatile sink = nullptr;
+    auto ins = time_per_key(keys, [&table](const key_type& k) { table.insert(mixed_hash(k), &k); });
+    auto look = time_per_key(shuffled, [&table, &sink](const key_type& k) {
+      sink = table.value(table.find(mixed_hash(k), k));
+    });
+    auto era = time_per_key(shuffled, [&table](const key_type& k) { table.erase(table.find(mixed_hash(k), k)); });
+    std::cout << "flat_table," << nkeys << "," << ins << "," << look << "," << era << std::endl;
+  }
+}
+
+//time to the first request and to a full hit rate after a restart, for a
+//store of nkeys items with 256-byte values, starting empty (every key is
+//fetched from a backend costing backend_us, then set) vs from a snapshot.
+//The snapshot is dropped from the page cache first, so its values are read
+//from the disk as they're asked for.
+void bench_restart(unsigned nkeys, double backend_us) {
+  std::vector<key_type> keys;
+  for (unsigned i = 0; i < nkeys; i++) {
+    keys.push_back("key:" + std::to_string(i));
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(0));
+  const std::string path = "bench_cache_store.snapshot";
+  const Cache::size_type maxmem = Cache::size_type(nkeys) * 512;
+
+  auto saving = clock_type::now();
+  {
+    Cache c {maxmem, 0.75, nullptr, std::hash<key_view>(), 16};
+    for (auto& k : keys) {
+      c.set(k, value_of(256));
+    }
+    saving = clock_type::now();
+    if (!c.save_snapshot(path)) {
+      std::cerr << "Could not write " << path << std::endl;
+      return;
+    }
+  }
+  auto saved = clock_type::now();
+  int fd = open(path.c_str(), O_RDONLY);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  std::cout << "save_ms," << std::chrono::duration<double, std::milli>(saved - saving).count() << std::endl;
+
+  std::cout << "start,ms_to_first_request,ms_to_touch_all,backend_fetches,ms_to_full_hit_rate" << std::endl;
+  for (std::string start : {"cold", "warm"}) {
+    auto t1 = clock_type::now();
+    Cache c {maxmem, 0.75, nullptr, std::hash<key_view>(), 16};
+    if (start == "warm" && !c.load_snapshot(path)) {
+      std::cerr << "Could not load " << path << std::endl;
+      break;
+    }
+    auto t2 = clock_type::now();
+    unsigned fetches = 0;
+    for (auto& k : keys) {
+      if (!c.get_ref(k)) {
+        fetches++;
+        c.set(k, value_of(256));
+      }
+    }
+    auto t3 = clock_type::now();
+    std::chrono::duration<double, std::milli> first = t2 - t1;
+    std::chrono::duration<double, std::milli> touch = t3 - t2;
+    std::cout << start << "," << first.count() << "," << touch.count() << "," << fetches << ","
+              << first.count() + touch.count() + fetches * backend_us / 1000 << std::endl;
+  }
+  std::remove(path.c_str());
+}
+
+//sets per second from nthreads threads, each setting its own keys to
+//100-byte values, with no mutation log, a log synced once a second, and a
+//log synced every batch (each set waiting for its batch's sync)
+void bench_log(unsigned nops, unsigned nthreads) {
+  const std::string path = "bench_cache_store.log";
+  std::cout << "log,threads,sets_per_s,log_bytes" << std::endl;
+  for (std::string mode : {"none", "sync_1s", "sync_batch"}) {
+    std::remove(path.c_str());
+    Cache c {Cache::size_type(1) << 30, 0.75, nullptr, std::hash<key_view>(), 16};
+    if (mode != "none") {
+      c.open_log(path, std::chrono::milliseconds(mode == "sync_1s" ? 1000 : 0));
+    }
+    std::vector<std::thread> threads;
+    auto t1 = clock_type::now();
+    for (unsigned t = 0; t < nthreads; t++) {
+      threads.emplace_back([&c, t, nops, nthreads]() {
+        for (unsigned i = t; i < nops; i += nthreads) {
+          c.set("key:" + std::to_string(i), value_of(100));
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    auto t2 = clock_type::now();
+    std::ifstream log(path, std::ios::binary | std::ios::ate);
+    std::cout << mode << "," << nthreads << ","
+              << nops / std::chrono::duration<double>(t2 - t1).count() << ","
+              << (mode == "none" ? 0 : static_cast<long long>(log.tellg())) << std::endl;
+  }
+  std::remove(path.c_str());
+}
+
+//how long reset() holds up the caller on stores of a growing number of
+//items, and how long the background release takes to free every chunk
+void bench_reset(unsigned nkeys) {
+  std::cout << "keys,reset_us,ms_until_freed" << std::endl;
+  for (unsigned n : {nkeys / 100, nkeys / 10, nkeys}) {
+    Cache c {Cache::size_type(n) * 512, 0.75, nullptr, std::hash<key_view>(), 16};
+    for (unsigned i = 0; i < n; i++) {
+      c.set("key:" + std::to_string(i), value_of(100));
+    }
+    auto t1 = clock_type::now();
+    c.reset();
+    auto t2 = clock_type::now();
+    //emptied pages stay pooled, so wait for the chunks in use instead
+    for (double used = 1; used > 0; ) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+      used = 0;
+      for (auto& stat : c.stats()) {
+        if (stat.first.find("_used_chunks") != std::string::npos) {
+          used += stat.second;
+        }
+      }
+    }
+    auto t3 = clock_type::now();
+    std::cout << n << "," << std::chrono::duration<double, std::micro>(t2 - t1).count() << ","
+              << std::chrono::duration<double, std::milli>(t3 - t1).count() << std::endl;
+  }
+}
+
+//hit rates and read latency per tier at a fixed maxmem, with and without a
+//spill file, on the driver's op mix with gets that miss setting the key as
+//a read-through cache would. The file is put in the current directory.
+void bench_spill(unsigned nops) {
+  const unsigned nkeys = 100000;
+  const Cache::size_type maxmem = 4 << 20;
+  const Cache::size_type spill_size = 64 << 20;
+  const std::string path = "bench_cache_store.spill";
+  auto ops = gen_ops(nops, nkeys, 0);
+
+  std::cout << "tier,hit_rate,memory_hit_rate,spill_hit_rate,spill_read_us,spills,spills_dropped,direct_io,ops_per_s"
+            << std::endl;
+  for (bool with_spill : {false, true}) {
+    Lru_evictor lru;
+    Cache c {maxmem, 0.75, &lru, std::hash<key_view>(), 16};
+    if (with_spill && !c.open_spill(path, spill_size)) {
+      std::cerr << "Could not open spill file " << path << std::endl;
+      return;
+    }
+    auto t1 = clock_type::now();
+    for (auto& o : ops) {
+      if (o.type == 'g') {
+        if (!c.get_ref(o.key)) {
+          c.set(o.key, value_of(o.size));
+        }
+      } else if (o.type == 's') {
+        c.set(o.key, value_of(o.size));
+      } else {
+        c.del(o.key);
+      }
+    }
+    auto t2 = clock_type::now();
+    auto stats = c.stats();
+    std::cout << (with_spill ? "memory+file" : "memory") << "," << c.hit_rate() << ","
+              << stats["memory_hit_rate"] << "," << stats["spill_hit_rate"] << ","
+              << stats["spill_read_latency_ns"] / 1000 << "," << stats["spills"] << ","
+              << stats["spills_dropped"] << "," << stats["spill_direct_io"] << ","
+              << nops / std::chrono::duration<double>(t2 - t1).count() << std::endl;
+  }
+}
+
+//heap bytes in use by the process
+double heap_bytes() {
+  auto info = mallinfo2();
+  return static_cast<double>(info.uordblks) + info.hblkhd;
+}
+
+//bytes per item for nkeys 28-byte keys (the workload's mean) with 32-byte
+//values, with no evictor and with LRU: the whole heap plus the slabs' pages
+//(mapped outside it), the item chunks handed out by the slabs, and the rest
+//(the index, and the evictor's own structures when there is one)
+void bench_footprint(unsigned nkeys) {
+  std::vector<key_type> keys;
+  for (unsigned i = 0; i < nkeys; i++) {
+    auto k = "user:session:" + std::to_string(i);
+    keys.push_back(k + std::string(28 - k.size(), '.'));
+  }
+
+  std::cout << "evictor,heap_bytes_per_item,item_bytes_per_item,other_bytes_per_item" << std::endl;
+  for (bool with_lru : {false, true}) {
+    auto heap1 = heap_bytes();
+    {
+      Lru_evictor lru;
+      Cache c {Cache::size_type(1) << 30, 0.75, with_lru ? &lru : nullptr, std::hash<key_view>(), 16};
+      for (auto& k : keys) {
+        c.set(k, value_of(32));
+      }
+      auto stats = c.stats();
+      auto other = heap_bytes() - heap1;
+      auto heap = other + stats["slab_memory_used"];
+      double items = 0;
+      for (unsigned i = 0; i < 64; i++) {
+        auto prefix = "slab_class_" + std::to_string(i) + "_";
+        if (stats.count(prefix + "pages")) {
+          items += stats[prefix + "chunk_size"] * stats[prefix + "used_chunks"];
+        }
+      }
+      std::cout << (with_lru ? "lru" : "none") << "," << heap / nkeys << "," << items / nkeys << ","
+                << other / nkeys << std::endl;
+    }
+  }
+}
+
+//hit rate at a fixed maxmem with and without compression, on the driver's
+//op mix and value sizes, with gets that miss setting the key as a
+//read-through cache would. Values are cut from JSON-ish records, or from
+//random letters as workload.cc generates them.
+void bench_compression(unsigned nops) {
+  const unsigned nkeys = 100000;
+  const Cache::size_type maxmem = 4 << 20;
+  auto ops = gen_ops(nops, nkeys, 0);
+
+  std::mt19937_64 gen(1);
+  std::string json;
+  while (json.size() < 2 * max_value_size) {
+    json += "{\"id\":" + std::to_string(gen() % 1000000) + ",\"user\":\"user" + std::to_string(gen() % 10000)
+        + "\",\"active\":" + (gen() % 2 ? "true" : "false") + ",\"score\":" + std::to_string(gen() % 100)
+        + ",\"tags\":[\"news\",\"sports\"]},";
+  }
+  std::string letters;
+  for (unsigned i = 0; i < 2 * max_value_size; i++) {
+    letters += char('a' + gen() % 26);
+  }
+
+  std::cout << "values,compress_min,hit_rate,compression_ratio,compress_ns_per_value,"
+            << "decompress_ns_per_value,ops_per_s" << std::endl;
+  for (std::string content : {"json", "letters"}) {
+    const std::string& text = content == "json" ? json : letters;
+    for (Cache::size_type min : {0, 64}) {
+      Lru_evictor lru;
+      Cache c {maxmem, 0.75, &lru, std::hash<key_view>(), 16};
+      c.compress_values(min);
+      auto value_for = [&text](const op& o) {
+        auto offset = std::hash<std::string>()(o.key) % max_value_size;
+        return Cache::val_type {text.data() + offset, o.size};
+      };
+      auto t1 = clock_type::now();
+      for (auto& o : ops) {
+        if (o.type == 'g') {
+          if (!c.get_ref(o.key)) {
+            c.set(o.key, value_for(o));
+          }
+        } else if (o.type == 's') {
+          c.set(o.key, value_for(o));
+        } else {
+          c.del(o.key);
+        }
+      }
+      auto t2 = clock_type::now();
+      auto stats = c.stats();
+      auto per = [](double total, double n) { return n == 0 ? 0.0 : total / n; };
+      std::cout << content << "," << min << "," << c.hit_rate() << "," << stats["compression_ratio"] << ","
+                << per(stats["compress_ns"], stats["compressions"] + stats["incompressible"]) << ","
+                << per(stats["decompress_ns"], stats["decompressions"]) << ","
+                << nops / std::chrono::duration<double>(t2 - t1).count() << std::endl;
+    }
+  }
+}
+
+//a counter of the data TLB misses the calling thread takes in user space,
+//or -1 if the system has no such counter (no PMU, as in most VMs, or
+//perf_event_paranoid forbids it)
+int open_dtlb_misses() {
+  perf_event_attr attr {};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+//anonymous memory of the process backed by transparent huge pages, in bytes
+double anon_huge_bytes() {
+  std::ifstream smaps("/proc/self/smaps_rollup");
+  std::string field;
+  double kb = 0;
+  while (smaps >> field) {
+    if (field == "AnonHugePages:") {
+      smaps >> kb;
+      break;
+    }
+  }
+  return kb * 1024;
+}
+
+//dTLB misses and ns per get_ref hit, in random order over nkeys items with
+//28-byte keys and 64-byte values, with the slabs on normal pages and on
+//huge pages. Misses read n/a where the system has no counter for them.
+void bench_tlb(unsigned nkeys) {
+  std::vector<key_type> keys;
+  for (unsigned i = 0; i < nkeys; i++) {
+    auto k = "user:session:" + std::to_string(i);
+    keys.push_back(k + std::string(28 - k.size(), '.'));
+  }
+  std::vector<key_type> shuffled = keys;
+  std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937_64(0));
+
+  std::cout << "pages,huge_page_shards,anon_huge_mb,dtlb_misses_per_get,ns_per_get_ref" << std::endl;
+  for (bool huge : {false, true}) {
+    Cache c {Cache::size_type(1) << 30, 0.75, nullptr, std::hash<key_view>(), 16};
+    c.use_huge_pages(huge);
+    for (auto& k : keys) {
+      c.set(k, value_of(64));
+    }
+
+    int fd = open_dtlb_misses();
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto t1 = clock_type::now();
+    for (auto& k : shuffled) {
+      Cache::value_handle h = c.get_ref(k);
+    }
+    auto t2 = clock_type::now();
+    std::string misses = "n/a";
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      std::uint64_t count = 0;
+      if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+        misses = std::to_string(static_cast<double>(count) / nkeys);
+      }
+      close(fd);
+    }
+    std::cout << (huge ? "huge" : "normal") << "," << c.stats()["slab_huge_page_shards"] << ","
+              << anon_huge_bytes() / (1 << 20) << "," << misses << ","
+              << std::chrono::duration<double, std::nano>(t2 - t1).count() / nkeys << std::endl;
+  }
+}
+
+//gets at several miss ratios, with and without a miss filter in front of
+//the index; the missing keys look like the stored ones
+void bench_misses(unsigned nkeys, unsigned nops) {
+  auto key_of = [](unsigned i) { return "user:session:" + std::to_string(i); };
+  std::cout << "miss_ratio,filter,ns_per_get,filter_false_positive_rate,filter_bytes_per_key" << std::endl;
+  for (double ratio : {0.04, 0.5, 0.9, 0.99}) {
+    std::mt19937_64 gen(1);
+    std::bernoulli_distribution miss(ratio);
+    std::uniform_int_distribution<unsigned> pick(0, nkeys - 1);
+    std::vector<key_type> keys(nops);
+    for (auto& k : keys) {
+      auto i = pick(gen);
+      k = key_of(miss(gen) ? nkeys + i : i);
+    }
+    for (bool filter : {false, true}) {
+      Cache c {Cache::size_type(1) << 30, 0.75, nullptr, std::hash<key_view>(), 16};
+      if (filter) {
+        c.filter_misses(nkeys);
+      }
+      for (unsigned i = 0; i < nkeys; i++) {
+        c.set(key_of(i), value_of(64));
+      }
+      auto t1 = clock_type::now();
+      for (auto& k : keys) {
+        Cache::value_handle h = c.get_ref(k);
+      }
+      auto t2 = clock_type::now();
+      auto stats = c.stats();
+      std::cout << ratio << "," << (filter ? "bloom" : "none") << ","
+                << std::chrono::duration<double, std::nano>(t2 - t1).count() / nops << ","
+                << stats["filter_false_positive_rate"] << "," << stats["filter_bytes"] / nkeys << std::endl;
+    }
+  }
+}
+
+//a day of set churn on a full cache with LRU eviction, slabs vs log: each
+//"hour" sets nops / 24 gamma-distributed values whose mean drifts between
+//50 and 800 bytes over the day, and reports the bytes of the items stored
+//against the process's RSS. Each mode runs in a process of its own, so
+//that one's freed memory does not count against the other.
+void bench_churn(unsigned nops) {
+  const unsigned nkeys = 1000000;
+  const Cache::size_type maxmem = 64 << 20;
+  std::cout << "memory,hour,mean_size,live_mb,rss_mb,efficiency,evictions,bytes_relocated_mb" << std::endl;
+  for (bool log : {false, true}) {
+    auto pid = fork();
+    if (pid != 0) {
+      waitpid(pid, nullptr, 0);
+      continue;
+    }
+    auto base = rss_bytes();
+    Lru_evictor lru;
+    Cache c {maxmem, 0.75, &lru, std::hash<key_view>(), 16};
+    c.use_log_memory(log);
+    std::mt19937_64 gen(0);
+    std::uniform_int_distribution<unsigned> key_dis(0, nkeys - 1);
+    for (unsigned hour = 0; hour < 24; hour++) {
+      double mean = 200 * std::pow(2.0, 2 * std::sin(2 * M_PI * hour / 24));
+      std::gamma_distribution<double> size_dis(1, mean);
+      for (unsigned i = 0; i < nops / 24; i++) {
+        auto size = std::min(static_cast<Cache::size_type>(size_dis(gen)) + 1, max_value_size);
+        c.set("key:" + std::to_string(key_dis(gen)), value_of(size));
+      }
+      auto stats = c.stats();
+      double live = 0;
+      if (log) {
+        live = stats["log_live_bytes"];
+      } else {
+        for (unsigned i = 0; i < 64; i++) {
+          auto prefix = "slab_class_" + std::to_string(i) + "_";
+          if (stats.count(prefix + "pages")) {
+            //requested bytes of the chunks in use: used chunks times chunk
+            //size, less the fragmentation
+            live += stats[prefix + "used_chunks"] * stats[prefix + "chunk_size"] * (1 - stats[prefix + "fragmentation"]);
+          }
+        }
+      }
+      auto rss = rss_bytes() - base;
+      std::cout << (log ? "log" : "slabs") << "," << hour << "," << mean << ","
+                << live / (1 << 20) << "," << rss / (1 << 20) << "," << live / rss << ","
+                << stats["evictions"] << "," << stats["bytes_relocated"] / (1 << 20) << std::endl;
+    }
+    std::exit(0);
+  }
+}
+
+//gets/s for threads reading mostly one key, with and without hot-key
+//replicas; the rest of the gets spread over nkeys keys
+void bench_hot(unsigned max_threads, unsigned nkeys) {
+  const unsigned nops = 1000000;
+  auto key_of = [](unsigned i) { return "user:session:" + std::to_string(i); };
+  std::cout << "threads,replicas,gets_per_s,replica_hits" << std::endl;
+  for (unsigned nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    for (bool replicas : {false, true}) {
+      Cache c {Cache::size_type(1) << 30, 0.75, nullptr, std::hash<key_view>(), 16};
+      c.track_hot_keys(replicas ? 16 : 0);
+      for (unsigned i = 0; i < nkeys; i++) {
+        c.set(key_of(i), value_of(256));
+      }
+      std::vector<std::thread> threads;
+      auto t1 = clock_type::now();
+      for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+          std::mt19937_64 gen(t);
+          std::uniform_int_distribution<unsigned> pick(0, nkeys - 1);
+          std::string hot = key_of(0);
+          for (unsigned i = 0; i < nops; i++) {
+            Cache::value_handle h = c.get_ref(i % 10 == 0 ? key_type(key_of(pick(gen))) : hot);
+          }
+        });
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+      auto t2 = clock_type::now();
+      std::cout << nthreads << "," << (replicas ? "on" : "off") << ","
+                << nthreads * nops / std::chrono::duration<double>(t2 - t1).count() << ","
+                << c.stats()["replica_hits"] << std::endl;
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr <<
+        "Usage: bench_cache_store <mode> [args]\n" <<
+        "Modes:\n" <<
+        "    scaling [max_threads] [shards]   ops/s for 1..max_threads threads, global lock vs sharded\n" <<
+        "    hits [nops]                      allocations and latency per hit, get vs get_ref\n" <<
+        "    slabs [nops]                     set churn on a full cache: allocations, RSS, slab occupancy\n" <<
+        "    index [nkeys...]                 index insert/lookup/erase, flat table vs unordered_map\n" <<
+        "    items [nkeys]                    allocations and memory per stored item, hit latency\n" <<
+        "    keys [nkeys]                     allocations per get/set/del with keys passed as views\n" <<
+        "    growth [nkeys] [shards]          set latency percentiles while the store grows to nkeys\n" <<
+        "    batch [nkeys]                    ns per key, single-key calls vs mget/mset/mdel batches\n" <<
+        "    restart [nkeys] [backend_us]     time to first request and full hit rate, cold vs snapshot\n" <<
+        "    log [nops] [threads]             sets/s with no log, a log synced each second, and each batch\n" <<
+        "    reset [nkeys]                    reset pause and time until memory is freed, by store size\n" <<
+        "    compression [nops]               hit rate at a fixed maxmem with and without value compression\n" <<
+        "    footprint [nkeys]                bytes per item for 28-byte keys, without an evictor and with LRU\n" <<
+        "    spill [nops]                     hit rate and read latency per tier, with and without a spill file\n" <<
+        "    tlb [nkeys]                      dTLB misses and ns per lookup, slabs on normal vs huge pages\n" <<
+        "    misses [nkeys] [nops]            ns per get by miss ratio, with and without a miss filter\n" <<
+        "    hot [max_threads] [nkeys]        gets/s on one hot key by thread count, with and without replicas\n" <<
+        "    churn [nops]                     live bytes / RSS over a day of drifting value sizes, slabs vs log\n";
+    return EXIT_FAILURE;
+  }
+
+  make_values();
+  std::string mode = argv[1];
+
+  if (mode == "scaling") {
+    unsigned hw = std::max(std::thread::hardware_concurrency(), 1u);
+    unsigned max_threads = argc > 2 ? std::atoi(argv[2]) : std::max(hw, 4u);
+    unsigned nshards = argc > 3 ? std::atoi(argv[3]) : 16;
+    bench_scaling(max_threads, nshards);
+  } else if (mode == "hits") {
+    unsigned nops = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    bench_hits(nops);
+  } else if (mode == "slabs") {
+    unsigned nops = argc > 2 ? std::atoi(argv[2]) : 2000000;
+    bench_slabs(nops);
+  } else if (mode == "index") {
+    if (argc == 2) {
+      bench_index(1000000);
+      bench_index(10000000);
+    }
+    for (int i = 2; i < argc; i++) {
+      bench_index(std::atoi(argv[i]));
+    }
+  } else if (mode == "items") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    bench_items(nkeys);
+  } else if (mode == "keys") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    bench_keys(nkeys);
+  } else if (mode == "growth") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 10000000;
+    unsigned nshards = argc > 3 ? std::atoi(argv[3]) : 1;
+    bench_growth(nkeys, nshards);
+  } else if (mode == "batch") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    bench_batch(nkeys);
+  } else if (mode == "restart") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    double backend_us = argc > 3 ? std::atof(argv[3]) : 500;
+    bench_restart(nkeys, backend_us);
+  } else if (mode == "log") {
+    unsigned nops = argc > 2 ? std::atoi(argv[2]) : 200000;
+    unsigned nthreads = argc > 3 ? std::atoi(argv[3]) : 16;
+    bench_log(nops, nthreads);
+  } else if (mode == "reset") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    bench_reset(nkeys);
+  } else if (mode == "compression") {
+    unsigned nops = argc > 2 ? std::atoi(argv[2]) : 2000000;
+    bench_compression(nops);
+  } else if (mode == "footprint") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    bench_footprint(nkeys);
+  } else if (mode == "spill") {
+    unsigned nops = argc > 2 ? std::atoi(argv[2]) : 2000000;
+    bench_spill(nops);
+  } else if (mode == "tlb") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 4000000;
+    bench_tlb(nkeys);
+  } else if (mode == "misses") {
+    unsigned nkeys = argc > 2 ? std::atoi(argv[2]) : 1000000;
+    unsigned nops = argc > 3 ? std::atoi(argv[3]) : 2000000;
+    bench_misses(nkeys, nops);
+  } else if (mode == "churn") {
+    unsigned nops = argc > 2 ? std::atoi(argv[2]) : 24000000;
+    bench_churn(nops);
+  } else if (mode == "hot") {
+    unsigned hw = std::max(std::thread::hardware_concurrency(), 1u);
+    unsigned max_threads = argc > 2 ? std::atoi(argv[2]) : std::max(hw, 4u);
+    unsigned nkeys = argc > 3 ? std::atoi(argv[3]) : 100000;
+    bench_hot(max_threads, nkeys);
+  } else {
+    std::cerr << "Unknown mode " << mode << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return 0;
+}
@@ -5,11 +5,18 @@
 
 #pragma once
 
+#include <chrono>
 #include <functional>
+#include <map>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "evictor.hh"
 
+class Numa_topology;
+
 class Cache {
  private:
    // All internal data and functionality is hidden using the Pimpl idiom
@@ -20,13 +27,50 @@ class Cache {
  public:
   using byte_type = char;
   using size_type = uint64_t;         // Internal indexing to K-V elements
-  struct val_type  {   // Values for K-V pairs
-    const byte_type* data_;
+  struct val_type  {   // Values for K-V pairs: size_ bytes of binary data
+    const byte_type* data_;   // need not be NUL terminated
     size_type size_;
   };
 
+  // A read-only, reference-counted handle to a value stored in the cache.
+  // The referenced bytes stay valid for as long as the handle (or a copy of
+  // it) exists, even if the key is overwritten, deleted or evicted in the
+  // meantime. Copying a handle only bumps a reference count.
+  // An empty handle (data() == nullptr, size() == 0) denotes a miss.
+  // Each stored value has a version, which changes whenever the key is set
+  // again: pass it to cas() to replace the value only if it is unchanged.
+  // A handle keeps the size and version the value had when it was taken,
+  // so appending to the value in place changes neither.
+  class value_handle {
+   public:
+    // Reference-counted value storage, defined by the implementation.
+    struct block;
+
+    value_handle() = default;
+    value_handle(const value_handle& other);
+    value_handle(value_handle&& other) noexcept;
+    value_handle& operator=(value_handle other) noexcept;
+    ~value_handle();
+
+    const byte_type* data() const;
+    size_type size() const { return size_; }
+    // The version of the value, or 0 for a miss
+    std::uint64_t version() const { return version_; }
+    explicit operator bool() const { return blk_ != nullptr; }
+
+   private:
+    friend class Cache;
+    explicit value_handle(block* blk);
+    block* blk_ = nullptr;
+    size_type size_ = 0;
+    std::uint64_t version_ = 0;
+  };
+
   // A function that takes a key and returns an index to the internal data
-  using hash_func = std::function<std::size_t(key_type)>;
+  using hash_func = std::function<std::size_t(key_view)>;
+
+  // How long a stored value lives; zero means until it is deleted or evicted
+  using ttl_type = std::chrono::milliseconds;
 
   // There are two possible constructors, one for a cache object (library),
   // that initializes the actual cache store, and another for a client
@@ -36,50 +80,203 @@ class Cache {
 
   // Create a new cache object with the following parameters:
   // maxmem: The maximum allowance for storage used by values.
-  // max_load_factor: Maximum allowed ratio between buckets and table rows.
+  // max_load_factor: Maximum ratio of used slots to slots in the store's
+  // open-addressing index before it grows (at most 15/16).
   // evictor: Eviction policy implementation (if nullptr, no evictions occur
-  // and new insertions fail after maxmem has been exceeded).
-  // hasher: Hash function to use on the keys. Defaults to C++'s std::hash.
+  // and new insertions fail after maxmem has been exceeded). The store
+  // tells it about its items by handle, so it must not be shared with
+  // another store.
+  // hasher: Hash function to use on the keys. Defaults to C++'s std::hash
+  // (which hashes a std::string_view and the equal std::string alike).
+  // nshards: Number of independently locked partitions of the store. Keys are
+  // assigned to a shard by hash, and each shard gets an equal slice of maxmem
+  // and its own evictor (a fresh copy of the given one), so operations on
+  // keys in different shards never contend.
   Cache(size_type maxmem,
         float max_load_factor = 0.75,
         Evictor* evictor = nullptr,
-        hash_func hasher = std::hash<key_type>());
+        hash_func hasher = std::hash<key_view>(),
+        unsigned nshards = 1);
 
   // Create a new Cache networked client with a given host and port.
   Cache(std::string host, std::string port);
 
   ~Cache();
 
+  // All operations on a cache object (library) are thread-safe.
+
   // Disallow cache copies, to simplify memory management.
   Cache(const Cache&) = delete;
   Cache& operator=(const Cache&) = delete;
 
+  // Keys are passed as views: the store only copies a key's bytes when it
+  // inserts a new item, so lookups never allocate for the key.
+
   // Add a <key, value> pair to the cache.
   // If key already exists, it will overwrite the old value.
   // Both the key and the value are to be deep-copied (not just pointer copied).
   // If maxmem capacity is exceeded, enough values will be removed
   // from the cache to accomodate the new value. If unable, the new value
   // isn't inserted to the cache.
+  // If ttl is non-zero, the pair expires after that long: it is no longer
+  // returned, and its memory is reclaimed in the background.
+  // Values of 4 GiB or more are never stored.
   // Returns true iff the insertion of the data to the store was successful.
-  bool set(key_type key, val_type val);
+  bool set(key_view key, val_type val, ttl_type ttl = ttl_type::zero());
 
   // Retrieve a copy of the value associated with key in the cache,
   // or nullptr (in data_) with size_ = 0 if not found.
   // Note that the data_ pointer in the return key is a newly-allocated
   // copy of the data. It is the caller's responsibility to free it.
-  val_type get(key_type key) const;
+  val_type get(key_view key) const;
+
+  // Retrieve a handle to the value associated with key in the cache, or an
+  // empty handle if not found. Unlike get(), no copy of the data is made.
+  value_handle get_ref(key_view key) const;
 
   // Delete an object from the cache, if it's still there.
   // Returns true iff the object was deleted from the store.
-  bool del(key_type key);
+  bool del(key_view key);
+
+  // Add delta to the decimal integer value of key, and set value to the
+  // result. A missing key counts as 0 and is created with ttl. Returns
+  // false, changing nothing, if the value is not an integer, the result
+  // would overflow, or the key could not be created.
+  bool incr(key_view key, std::int64_t delta, std::int64_t& value, ttl_type ttl = ttl_type::zero());
+  // Subtract delta, as incr() adds it
+  bool decr(key_view key, std::int64_t delta, std::int64_t& value, ttl_type ttl = ttl_type::zero());
+
+  // Add val's bytes after (append) or before (prepend) key's value, keeping
+  // its ttl. Returns false if key is not in the cache or the longer value
+  // could not be stored.
+  bool append(key_view key, val_type val);
+  bool prepend(key_view key, val_type val);
+
+  // Compare and swap: set the pair as set() would, but only if key's value
+  // still has version expected_version (or, for 0, key is not in the
+  // cache). Returns false otherwise, or if the value could not be stored.
+  bool cas(key_view key, val_type val, std::uint64_t expected_version,
+           ttl_type ttl = ttl_type::zero());
+  // As above, also setting current_version to key's version when the
+  // value was compared (0 if key was not in the cache): it equals
+  // expected_version iff a false return means the value did not fit.
+  bool cas(key_view key, val_type val, std::uint64_t expected_version,
+           std::uint64_t& current_version, ttl_type ttl = ttl_type::zero());
+
+  // Batch versions of get_ref, set and del, for callers that need many keys
+  // at once. The store hashes the whole batch first and prefetches each
+  // key's index slots, then handles the keys of each shard together, under
+  // one lock acquisition (or none, for lookups). The client sends a batch
+  // as a single request. Keys must not contain newlines.
+
+  // Handles for every key, in order: empty for the keys not found.
+  std::vector<value_handle> mget(const std::vector<key_view>& keys) const;
+
+  // Set every pair as set() would, in order, all with the same ttl; element
+  // i is true iff pair i was stored.
+  std::vector<bool> mset(const std::vector<std::pair<key_view, val_type>>& items,
+                         ttl_type ttl = ttl_type::zero());
 
-  // Compute the total amount of memory used up by all cache values (not keys)
+  // Delete every key, returning how many were in the cache.
+  size_type mdel(const std::vector<key_view>& keys);
+
+  // Store values of at least min_size bytes compressed when that makes
+  // them smaller; 0 (the default) never compresses. Applies to values set
+  // from then on. Returns false for the client.
+  bool compress_values(size_type min_size);
+
+  // Back the memory holding the items with huge pages (the default) or
+  // not. Each shard reserves an arena of its share of maxmem when the store
+  // is created, with explicit huge pages if enough are set aside and
+  // otherwise transparent ones, so that lookups spread over many items need
+  // few TLB entries. Call before storing anything. Returns false if a shard
+  // already holds items, or the store cannot choose (the client).
+  bool use_huge_pages(bool use);
+
+  // Keep items in a log of segments instead of the slabs (or go back to
+  // the slabs), cleaning segments with at most clean_below of their bytes
+  // live in the background. Call before storing anything. Returns false if
+  // a shard already holds items, or for the client.
+  bool use_log_memory(bool use, double clean_below = 0.75);
+
+  // Put a counting Bloom filter, sized for about keys keys, in front of the
+  // index, or remove it for 0, so that most gets of missing keys are
+  // answered without a probe. Returns false for the client.
+  bool filter_misses(size_type keys);
+
+  // Track the k most read keys (at most 64), or stop for 0. Each thread
+  // serves hot keys from private copies, checked against the stored
+  // version; those gets do not touch the evictor. Returns false for the
+  // client.
+  bool track_hot_keys(unsigned k);
+
+  // The keys tracked as hot, most read first, with their estimated gets.
+  // Empty when not tracking.
+  std::vector<std::pair<std::string, std::uint64_t>> hot_keys() const;
+
+  // Compute the total amount of memory used up by all cache values (not keys),
+  // as stored: compressed values count their compressed size.
   size_type space_used() const;
 
   // Return the ratio of gets that had been successful
   double hit_rate() const;
 
-  // Delete all data and metdata from the cache and return true iff successful
+  // Named statistics about the store: event counts since the last reset
+  // ("hits", "misses", "sets", "evictions", "bytes_in", ...), rates derived
+  // from them ("compression_ratio", "memory_hit_rate", ...), the state of
+  // each tier, and slab or log occupancy (e.g. "slab_class_3_utilization").
+  using stats_type = std::map<std::string, double>;
+  stats_type stats() const;
+
+  // Delete all data and metdata from the cache and return true iff successful.
+  // Takes about as long on a full cache as on an empty one: the memory the
+  // old items held is freed by a background thread afterwards.
   bool reset();
+
+  // Snapshots let a restarted store serve its old contents at once.
+
+  // Write every pair (and its remaining TTL) to a snapshot file at path,
+  // replacing it only once the new one is complete. Writers on a shard only
+  // wait while its items are gathered, not while they're written. Returns
+  // true iff the file was written. The client asks the server to write the
+  // snapshot it was started with, and ignores path.
+  bool save_snapshot(const std::string& path) const;
+
+  // Map a snapshot written by save_snapshot() (by the same build) and serve
+  // its pairs, in addition to or in place of the stored ones. The file's
+  // pairs are not read or copied: the pages holding a value are faulted in
+  // by its first lookup. Pairs that expired or do not fit are left out.
+  // The file must not change while the store exists. Returns true iff the
+  // whole snapshot was valid. Not supported by the client.
+  bool load_snapshot(const std::string& path);
+
+  // Replay the mutation log at path into the store, if there is one, then
+  // append every later set, del and reset to it. With a zero sync_interval,
+  // writes return once their record is synced to disk; otherwise the log is
+  // synced every sync_interval. Evictions and expirations are not logged.
+  // Returns false if path does not hold a log or a log is already open.
+  // Not supported by the client.
+  bool open_log(const std::string& path,
+                std::chrono::milliseconds sync_interval = std::chrono::milliseconds::zero());
+
+  // Keep pairs evicted from memory in a file of about capacity bytes at
+  // path, created afresh, as a second tier: a get that misses in memory
+  // reads the pair from the file and moves it back to memory. Returns false
+  // if the file cannot be created or a tier is already open. Not supported
+  // by the client.
+  bool open_spill(const std::string& path, size_type capacity);
+
+  // Spread the shards over the nodes of topology, round robin, and place
+  // the memory holding each shard's values on its node, both what it holds
+  // already and what it takes from then on. Keys are then best served by
+  // threads running on numa_node(key). With a single node, as on most
+  // machines, every shard is on node 0. Call before the store is shared
+  // between threads. Returns false if the store cannot place its memory
+  // (the client).
+  bool bind_numa(const Numa_topology& topology);
+
+  // The node, of the topology given to bind_numa(), whose memory holds
+  // key's shard; 0 if the store was never bound.
+  unsigned numa_node(key_view key) const;
 };
 
@@ -4,15 +4,18 @@
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 
 #include <algorithm>
 #include "cache.hh"
 #include <iostream>
+#include <sstream>
 #include <unordered_map>
 #include <vector>
 #include "assert.h"
 #include <memory>
+#include <atomic>
 
 namespace beast = boost::beast;     // from <boost/beast.hpp>
 namespace http = beast::http;       // from <boost/beast/http.hpp>
@@ -28,6 +31,56 @@ using tcp = net::ip::tcp;           // from <boost/asio/ip/tcp.hpp>
   // and new insertions fail after maxmem has been exceeded).
   // hasher: Hash function to use on the keys. Defaults to C++'s std::hash.
 
+// Values handed out by get_ref are copies of the server's response held in
+// a single reference-counted allocation: this header followed by the bytes.
+// The version comes from the response's ETag (or mget size line).
+struct Cache::value_handle::block {
+  std::atomic<std::uint32_t> refs;
+  size_type size;
+  std::uint64_t version;
+
+  byte_type* data() { return reinterpret_cast<byte_type*>(this + 1); }
+};
+
+Cache::value_handle::value_handle(block* blk) : blk_(blk) {
+  if (blk_ != nullptr) {
+    size_ = blk_ -> size;
+    version_ = blk_ -> version;
+  }
+}
+
+Cache::value_handle::value_handle(const value_handle& other)
+    : blk_(other.blk_), size_(other.size_), version_(other.version_) {
+  if (blk_ != nullptr) {
+    blk_ -> refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+Cache::value_handle::value_handle(value_handle&& other) noexcept
+    : blk_(other.blk_), size_(other.size_), version_(other.version_) {
+  other.blk_ = nullptr;
+  other.size_ = 0;
+  other.version_ = 0;
+}
+
+Cache::value_handle& Cache::value_handle::operator=(value_handle other) noexcept {
+  std::swap(blk_, other.blk_);
+  std::swap(size_, other.size_);
+  std::swap(version_, other.version_);
+  return *this;
+}
+
+Cache::value_handle::~value_handle() {
+  if (blk_ != nullptr && blk_ -> refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    blk_ -> ~block();
+    ::operator delete(blk_);
+  }
+}
+
+const Cache::byte_type* Cache::value_handle::data() const {
+  return blk_ == nullptr ? nullptr : blk_ -> data();
+}
+
 class Cache::Impl
 {
   public:
@@ -40,6 +93,16 @@ class Cache::Impl
 	Impl(std::string host, std::string port);
 
   ~Impl();
+
+  // Send a POST of body to target and return the response body
+  // A ttl other than zero is sent in a TTL header. The response's status
+  // goes in *status, if given.
+  std::string post(std::string target, std::string body,
+                   ttl_type ttl = ttl_type::zero(), unsigned* status = nullptr);
+
+  // A handle holding a copy of size bytes of a server response, and the
+  // value's version
+  static value_handle make_handle(const byte_type* data, size_type size, std::uint64_t version);
   private: 
 };	
 
@@ -53,6 +116,8 @@ Cache::Impl::Impl(std::string host, std::string port):
   //establish connection to server
   auto results = resolver_.resolve(host,port);
 	stream_.connect(results);
+  //requests are written as a header and then a body: send each at once
+  stream_.socket().set_option(tcp::no_delay(true));
 }
 
 
@@ -64,6 +129,26 @@ Cache::Impl::~Impl() {
 
 }
 
+std::string Cache::Impl::post(std::string target, std::string body, ttl_type ttl, unsigned* status) {
+  http::request<http::string_body> req{http::verb::post, target, 11};
+  req.set(http::field::host, host_);
+  req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+  if (ttl != ttl_type::zero()) {
+    req.set("TTL", std::to_string(ttl.count()));
+  }
+  req.body() = std::move(body);
+  req.prepare_payload();
+  http::write(stream_, req);
+
+  beast::flat_buffer buffer;
+  http::response<http::string_body> res;
+  http::read(stream_, buffer, res);
+  if (status != nullptr) {
+    *status = res.result_int();
+  }
+  return std::move(res.body());
+}
+
 // Cache::Cache(size_type maxmem,
 //     float max_load_factor,
 //     Evictor* evictor,
@@ -90,18 +175,18 @@ Cache::~Cache() {
 
 
 
-bool Cache::set(key_type key, val_type val) {
-  //write http target
-  std::string skey {key};
-  std::string sval {std::string(val.data_)};
-  std::string starg {"/" + skey + "/" + sval};
-  const char* targ {starg.c_str()};
-
-  //assemble request
-  http::request<http::string_body> req{http::verb::put, targ, 11};
+bool Cache::set(key_view key, val_type val, ttl_type ttl) {
+  //the key goes in the target, the value's bytes in the body, and the
+  //time to live, if any, in a TTL header in milliseconds
+  http::request<http::string_body> req{http::verb::put, "/" + std::string(key), 11};
   req.set(http::field::host, pImpl_->host_);
   req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-  req.target(targ);
+  req.set(http::field::content_type, "application/octet-stream");
+  if (ttl != ttl_type::zero()) {
+    req.set("TTL", std::to_string(ttl.count()));
+  }
+  req.body().assign(val.data_, val.size_);
+  req.prepare_payload();
 
   //send request to server
   http::write(pImpl_->stream_, req);
@@ -116,9 +201,24 @@ bool Cache::set(key_type key, val_type val) {
 }	
 
 
-Cache::val_type Cache::get(key_type key) const {
+Cache::val_type Cache::get(key_view key) const {
+    auto ref = get_ref(key);
+    if (!ref) {
+      return val_type {nullptr, 0};
+    }
+
+    //the caller owns the copy
+    char* val = new char[ref.size()];
+    std::memcpy(val, ref.data(), ref.size());
+    return val_type {val, ref.size()};
+}
+
+
+// Retrieve a handle to the value associated with key in the cache, or an
+// empty handle if not found. The client holds its own copy of the response.
+Cache::value_handle Cache::get_ref(key_view key) const {
     //assemble request
-    std::string skey = static_cast<std::string>(key);
+    std::string skey {key};
     http::request<http::string_body> req{http::verb::get, "/" + skey, 11};
 
     //set request fields and send to server
@@ -128,41 +228,39 @@ Cache::val_type Cache::get(key_type key) const {
 
     //store server response
     beast::flat_buffer buffer;
-    http::response<http::dynamic_body> res;
+    http::response<http::string_body> res;
     http::read(pImpl_->stream_, buffer, res);
 
-
-    //if status is not found, return nullptr valtype
+    //if status is not found, return an empty handle
     if (res.result() == http::status::not_found) {
-      val_type out {nullptr,0};
-      return out;
+      return value_handle();
     }
 
-    //store response body
-    std::string jsonTuple = beast::buffers_to_string(res.body().data());
-
-    //parse jsontuple, assume gets json tuple
-    size_t pos = 0;
-    pos = jsonTuple.find(":");
-    jsonTuple.erase(0, pos+1);
-    pos = jsonTuple.find("}");
-
-    //make val_type from json tuple
-    auto sval = jsonTuple.substr(0, pos);   
-    auto size = static_cast<size_type>(sval.size()+1); 
-    char* val = new char[size];
-    strcpy(val,sval.c_str());
-    
-    val_type out {val,size};
-    return out;
+    //the body is the value's raw bytes, and the ETag its quoted version
+    std::uint64_t version = 0;
+    auto etag = res.find(http::field::etag);
+    if (etag != res.end() && etag->value().size() > 2) {
+      version = std::strtoull(std::string(etag->value().substr(1)).c_str(), nullptr, 10);
+    }
+    auto const& body = res.body();
+    return Impl::make_handle(body.data(), static_cast<size_type>(body.size()), version);
 }
 
+Cache::value_handle Cache::Impl::make_handle(const byte_type* data, size_type size, std::uint64_t version) {
+    void* mem = ::operator new(sizeof(value_handle::block) + size);
+    auto blk = new (mem) value_handle::block;
+    blk -> refs.store(1, std::memory_order_relaxed);
+    blk -> size = size;
+    blk -> version = version;
+    std::copy(data, data + size, blk -> data());
+    return value_handle(blk);
+}
 
 // Delete an object from the cache, if it's still there.
 // Returns true iff the object was deleted from the store.
-bool Cache::del(key_type key) {
+bool Cache::del(key_view key) {
   //assemble request
-  http::request<http::string_body> req{http::verb::delete_, "/" + key, 11};
+  http::request<http::string_body> req{http::verb::delete_, "/" + std::string(key), 11};
   req.set(http::field::host, pImpl_->host_);
   req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
 
@@ -176,6 +274,147 @@ bool Cache::del(key_type key) {
   return res.result_int() == 204;
 }
 
+bool Cache::cas(key_view key, val_type val, std::uint64_t expected_version, ttl_type ttl) {
+  std::uint64_t current_version;
+  return cas(key, val, expected_version, current_version, ttl);
+}
+
+// A PUT conditional on the key's version: If-Match with the version as an
+// entity tag, or If-None-Match: * for a key that must not exist. The server
+// answers 412 if the version no longer matches, with the current one as the
+// ETag if the key is there.
+bool Cache::cas(key_view key, val_type val, std::uint64_t expected_version, std::uint64_t& current_version,
+    ttl_type ttl) {
+  http::request<http::string_body> req{http::verb::put, "/" + std::string(key), 11};
+  req.set(http::field::host, pImpl_->host_);
+  req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+  req.set(http::field::content_type, "application/octet-stream");
+  if (expected_version == 0) {
+    req.set(http::field::if_none_match, "*");
+  } else {
+    req.set(http::field::if_match, "\"" + std::to_string(expected_version) + "\"");
+  }
+  if (ttl != ttl_type::zero()) {
+    req.set("TTL", std::to_string(ttl.count()));
+  }
+  req.body().assign(val.data_, val.size_);
+  req.prepare_payload();
+  http::write(pImpl_->stream_, req);
+
+  beast::flat_buffer buffer;
+  http::response<http::dynamic_body> res;
+  http::read(pImpl_->stream_, buffer, res);
+  current_version = expected_version;
+  if (res.result() == http::status::precondition_failed) {
+    current_version = 0;
+    auto etag = res.find(http::field::etag);
+    if (etag != res.end() && etag->value().size() > 2) {
+      current_version = std::strtoull(std::string(etag->value().substr(1)).c_str(), nullptr, 10);
+    }
+  }
+  return res.result_int() == 204;
+}
+
+// POST /incr/<key> with the delta as the body; the server answers with the
+// new value.
+bool Cache::incr(key_view key, std::int64_t delta, std::int64_t& value, ttl_type ttl) {
+  unsigned status = 0;
+  auto res = pImpl_ -> post("/incr/" + std::string(key), std::to_string(delta), ttl, &status);
+  if (status != 200) {
+    return false;
+  }
+  value = std::stoll(res);
+  return true;
+}
+
+bool Cache::decr(key_view key, std::int64_t delta, std::int64_t& value, ttl_type ttl) {
+  unsigned status = 0;
+  auto res = pImpl_ -> post("/decr/" + std::string(key), std::to_string(delta), ttl, &status);
+  if (status != 200) {
+    return false;
+  }
+  value = std::stoll(res);
+  return true;
+}
+
+// POST /append/<key> or /prepend/<key> with the bytes to add as the body
+bool Cache::append(key_view key, val_type val) {
+  unsigned status = 0;
+  pImpl_ -> post("/append/" + std::string(key), std::string(val.data_, val.size_), ttl_type::zero(), &status);
+  return status == 204;
+}
+
+bool Cache::prepend(key_view key, val_type val) {
+  unsigned status = 0;
+  pImpl_ -> post("/prepend/" + std::string(key), std::string(val.data_, val.size_), ttl_type::zero(), &status);
+  return status == 204;
+}
+
+// Fetch every key in one POST /mget round trip. The response holds, per
+// key, a "<size> <version>" line and the value's bytes, or "-" for a miss.
+std::vector<Cache::value_handle> Cache::mget(const std::vector<key_view>& keys) const {
+  std::string body;
+  for (auto key : keys) {
+    body.append(key.data(), key.size());
+    body += '\n';
+  }
+  auto res = pImpl_ -> post("/mget", std::move(body));
+
+  std::vector<value_handle> out;
+  out.reserve(keys.size());
+  std::size_t pos = 0;
+  while (out.size() < keys.size() && pos < res.size()) {
+    auto end = res.find('\n', pos);
+    if (end == std::string::npos) {
+      break;
+    }
+    if (res.compare(pos, end - pos, "-") == 0) {
+      out.emplace_back();
+      pos = end + 1;
+      continue;
+    }
+    auto line = res.substr(pos, end - pos);
+    auto space = line.find(' ');
+    auto size = static_cast<size_type>(std::stoull(line.substr(0, space)));
+    std::uint64_t version = space == std::string::npos ? 0 : std::stoull(line.substr(space + 1));
+    out.push_back(Impl::make_handle(res.data() + end + 1, size, version));
+    pos = end + 1 + size;
+  }
+  out.resize(keys.size());
+  return out;
+}
+
+// Set every pair in one POST /mset round trip: a "<key> <size>" line and
+// the value's bytes per pair. The response has a 1 or 0 per pair.
+std::vector<bool> Cache::mset(const std::vector<std::pair<key_view, val_type>>& items,
+                              ttl_type ttl) {
+  std::string body;
+  for (auto& item : items) {
+    body.append(item.first.data(), item.first.size());
+    body += ' ' + std::to_string(item.second.size_) + '\n';
+    body.append(item.second.data_, item.second.size_);
+  }
+  auto res = pImpl_ -> post("/mset", std::move(body), ttl);
+
+  std::vector<bool> out(items.size());
+  for (std::size_t i = 0; i < items.size() && i < res.size(); i++) {
+    out[i] = res[i] == '1';
+  }
+  return out;
+}
+
+// Delete every key in one POST /mdel round trip, which answers with the
+// number deleted.
+Cache::size_type Cache::mdel(const std::vector<key_view>& keys) {
+  std::string body;
+  for (auto key : keys) {
+    body.append(key.data(), key.size());
+    body += '\n';
+  }
+  auto res = pImpl_ -> post("/mdel", std::move(body));
+  return res.empty() ? 0 : static_cast<size_type>(std::stoull(res));
+}
+
 // Compute the total amount of memory used up by all cache values (not keys)
 Cache::size_type Cache::space_used() const {
   //assemble request
@@ -218,6 +457,106 @@ double Cache::hit_rate() const {
   return static_cast<double>(std::stof(sHitRate));
 }
 
+// Fetch the server's statistics, sent as one "name value" line each
+Cache::stats_type Cache::stats() const {
+  //assemble request and send to server
+  http::request<http::string_body> req{http::verb::post, "/stats", 11};
+  req.set(http::field::host, pImpl_->host_);
+  req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+  http::write(pImpl_->stream_, req);
+
+  //store server response
+  beast::flat_buffer buffer;
+  http::response<http::string_body> res;
+  http::read(pImpl_->stream_, buffer, res);
+
+  //parse the lines
+  stats_type out;
+  std::istringstream lines(res.body());
+  std::string name;
+  double value;
+  while (lines >> name >> value) {
+    out[name] = value;
+  }
+  return out;
+}
+
+// Ask the server to write the snapshot file it was started with; path
+// only means something to the server's own store
+bool Cache::save_snapshot(const std::string&) const {
+  http::request<http::string_body> req{http::verb::post, "/snapshot", 11};
+  req.set(http::field::host, pImpl_->host_);
+  req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+  http::write(pImpl_->stream_, req);
+
+  beast::flat_buffer buffer;
+  http::response<http::dynamic_body> res;
+  http::read(pImpl_->stream_, buffer, res);
+  return res.result_int() == 204;
+}
+
+// The server's files cannot be mapped from here
+bool Cache::load_snapshot(const std::string&) {
+  return false;
+}
+
+// The server opens its log itself, at startup
+bool Cache::open_log(const std::string&, std::chrono::milliseconds) {
+  return false;
+}
+
+// The server opens its spill tier itself, at startup
+bool Cache::open_spill(const std::string&, size_type) {
+  return false;
+}
+
+// Placing memory is the server's business
+bool Cache::use_huge_pages(bool) {
+  return false;
+}
+
+bool Cache::use_log_memory(bool, double) {
+  return false;
+}
+
+bool Cache::filter_misses(size_type) {
+  return false;
+}
+
+// The server tracks hot keys in its own store, as started
+bool Cache::track_hot_keys(unsigned) {
+  return false;
+}
+
+// The server sends one "key count" line per key; the count follows the
+// last space, as keys may hold spaces themselves
+std::vector<std::pair<std::string, std::uint64_t>> Cache::hot_keys() const {
+  std::vector<std::pair<std::string, std::uint64_t>> keys;
+  std::istringstream lines(pImpl_->post("/hotkeys", ""));
+  std::string line;
+  while (std::getline(lines, line)) {
+    auto space = line.rfind(' ');
+    if (space == std::string::npos) {
+      continue;
+    }
+    keys.emplace_back(line.substr(0, space), std::stoull(line.substr(space + 1)));
+  }
+  return keys;
+}
+
+bool Cache::bind_numa(const Numa_topology&) {
+  return false;
+}
+
+unsigned Cache::numa_node(key_view) const {
+  return 0;
+}
+
+// Compression is the server's choice, made at startup
+bool Cache::compress_values(size_type) {
+  return false;
+}
+
 // Delete all data from the cache and return true iff successful
 bool Cache::reset() {
   //assemble request and send to server
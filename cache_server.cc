@@ -17,10 +17,15 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/signal_set.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/program_options.hpp>
 #include <boost/config.hpp>
+#include <boost/optional.hpp>
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstdlib>
 #include <functional>
 #include <iostream>
@@ -28,13 +33,14 @@
 #include <string>
 #include <thread>
 #include <vector>
-#include <mutex>
+#include <unistd.h>
 
 
 #include "cache.hh"
-// #include "lru_evictor.hh"
+#include "lru_evictor.hh"
+#include "numa.hh"
 
-//we will be using the default eviction policy
+//no eviction unless asked for with --evictor
 
 namespace po = boost::program_options; 	// from <boost/program_options.hpp>
 namespace beast = boost::beast;         // from <boost/beast.hpp>
@@ -43,6 +49,217 @@ namespace net = boost::asio;            // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
 
+// A response body that writes a value straight out of a cache value handle.
+// The handle keeps the stored bytes alive until the asynchronous write
+// completes, so a hit is served without copying the value.
+struct value_body
+{
+    using value_type = Cache::value_handle;
+
+    static std::uint64_t
+    size(value_type const& body)
+    {
+        return body.size();
+    }
+
+    class writer
+    {
+        value_type const& body_;
+
+    public:
+        using const_buffers_type = net::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(http::header<isRequest, Fields> const&, value_type const& body)
+            : body_(body)
+        {
+        }
+
+        void
+        init(beast::error_code& ec)
+        {
+            ec = {};
+        }
+
+        boost::optional<std::pair<const_buffers_type, bool>>
+        get(beast::error_code& ec)
+        {
+            ec = {};
+            return {{const_buffers_type(body_.data(), body_.size()), false}};
+        }
+    };
+};
+
+
+// A response body made of text lines, each followed by the bytes of a
+// value handle (empty for a line alone), written as one buffer sequence so
+// that batched hits are served without copying the values either.
+struct batch_body
+{
+    using value_type = std::vector<std::pair<std::string, Cache::value_handle>>;
+
+    static std::uint64_t
+    size(value_type const& body)
+    {
+        std::uint64_t n = 0;
+        for (auto const& part : body)
+            n += part.first.size() + part.second.size();
+        return n;
+    }
+
+    class writer
+    {
+        value_type const& body_;
+
+    public:
+        using const_buffers_type = std::vector<net::const_buffer>;
+
+        template<bool isRequest, class Fields>
+        writer(http::header<isRequest, Fields> const&, value_type const& body)
+            : body_(body)
+        {
+        }
+
+        void
+        init(beast::error_code& ec)
+        {
+            ec = {};
+        }
+
+        boost::optional<std::pair<const_buffers_type, bool>>
+        get(beast::error_code& ec)
+        {
+            ec = {};
+            const_buffers_type buffers;
+            buffers.reserve(2 * body_.size());
+            for (auto const& part : body_) {
+                buffers.emplace_back(part.first.data(), part.first.size());
+                if (part.second)
+                    buffers.emplace_back(part.second.data(), part.second.size());
+            }
+            return {{std::move(buffers), false}};
+        }
+    };
+};
+
+
+// The key named by a "/<key>" request target, as a view into the request
+key_view
+target_key(beast::string_view target)
+{
+    return key_view(target.data() + 1, target.size() - 1);
+}
+
+
+// Whether target is "<op><key>" for a nonempty key, and if so, the key as a
+// view into the request
+bool
+post_key(beast::string_view target, beast::string_view op, key_view& key)
+{
+    if (target.size() <= op.size() || target.substr(0, op.size()) != op)
+        return false;
+    key = key_view(target.data() + op.size(), target.size() - op.size());
+    return true;
+}
+
+
+// The keys of a batch request body, one per line, as views into the body
+std::vector<key_view>
+body_keys(std::string const& body)
+{
+    std::vector<key_view> keys;
+    std::size_t start = 0;
+    while (start < body.size()) {
+        auto end = body.find('\n', start);
+        if (end == std::string::npos)
+            end = body.size();
+        keys.emplace_back(body.data() + start, end - start);
+        start = end + 1;
+    }
+    return keys;
+}
+
+
+// The pairs of a batch set request body: for each, a "<key> <size>" line
+// and then size bytes of value. Returns false if the body is malformed.
+bool
+body_items(std::string const& body, std::vector<std::pair<key_view, Cache::val_type>>& items)
+{
+    std::size_t start = 0;
+    while (start < body.size()) {
+        auto end = body.find('\n', start);
+        if (end == std::string::npos)
+            return false;
+        auto space = body.rfind(' ', end);
+        if (space == std::string::npos || space < start || space + 1 == end)
+            return false;
+        char* size_end = nullptr;
+        auto size = std::strtoull(body.c_str() + space + 1, &size_end, 10);
+        if (size_end != body.c_str() + end || size > body.size() - end - 1)
+            return false;
+        items.emplace_back(key_view(body.data() + start, space - start),
+                           Cache::val_type {body.data() + end + 1, size});
+        start = end + 1 + size;
+    }
+    return true;
+}
+
+
+// The time to live named by a request's "TTL" header, in milliseconds;
+// zero when there is none. Returns false if the header is malformed.
+template<class Fields>
+bool
+request_ttl(Fields const& fields, Cache::ttl_type& ttl)
+{
+    auto it = fields.find("TTL");
+    if (it == fields.end()) {
+        ttl = Cache::ttl_type::zero();
+        return true;
+    }
+    std::string text(it->value());
+    char* end = nullptr;
+    auto ms = std::strtoull(text.c_str(), &end, 10);
+    if (text.empty() || text[0] == '-' || end != text.c_str() + text.size())
+        return false;
+    ttl = Cache::ttl_type(ms);
+    return true;
+}
+
+
+// The version a conditional PUT expects, from its "If-Match" header (an
+// entity tag holding a version, as a GET's "ETag" gives it) or its
+// "If-None-Match: *" header (0: the key must not be in the cache). Sets
+// conditional to whether there is either. Returns false if the header is
+// malformed.
+template<class Fields>
+bool
+request_version(Fields const& fields, bool& conditional, std::uint64_t& version)
+{
+    auto match = fields.find(http::field::if_match);
+    auto none_match = fields.find(http::field::if_none_match);
+    conditional = match != fields.end() || none_match != fields.end();
+    version = 0;
+    if (match == fields.end())
+        return none_match == fields.end() || none_match->value() == "*";
+    if (none_match != fields.end())
+        return false;
+    std::string text(match->value());
+    if (text.size() < 3 || text.front() != '"' || text.back() != '"' || text[1] == '-')
+        return false;
+    char* end = nullptr;
+    version = std::strtoull(text.c_str() + 1, &end, 10);
+    return end == text.c_str() + text.size() - 1 && version != 0;
+}
+
+
+// The entity tag of a value's version
+std::string
+version_tag(std::uint64_t version)
+{
+    return "\"" + std::to_string(version) + "\"";
+}
+
+
 // This function produces an HTTP response for the given
 // request. The type of the response object depends on the
 // contents of the request, so the interface requires the
@@ -53,7 +270,7 @@ template<
 void
 handle_request(
     Cache &cache_,
-    std::mutex &mutex_,
+    std::string const& snapshot_,
     http::request<Body, http::basic_fields<Allocator>>&& req,
     Send&& send)
 {
@@ -98,6 +315,22 @@ handle_request(
         return res;
     };
 
+    // Returns a precondition failed response, tagged with the key's current
+    // version unless it is not in the cache
+    auto const precondition_failed =
+    [&req](std::uint64_t current)
+    {
+        http::response<http::string_body> res{http::status::precondition_failed, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        if (current != 0)
+            res.set(http::field::etag, version_tag(current));
+        res.set(http::field::content_type, "text/html");
+        res.keep_alive(req.keep_alive());
+        res.body() = "The value has changed.";
+        res.prepare_payload();
+        return res;
+    };
+
     // Returns a server error response
     auto const server_error =
     [&req](beast::string_view what)
@@ -127,55 +360,51 @@ handle_request(
     if(ec)
         return send(server_error(ec.message()));
 
- 	// Respond to PUT request
+ 	// Respond to PUT request: the key is the target, the value is the body.
+ 	// With an If-Match or If-None-Match header the value is only stored if
+ 	// the key's version still matches, and 412 is returned if it does not.
     if(req.method() == http::verb::put) {
     	http::response<http::empty_body> res; 
 
-    	//parse out request body
-    	auto targ = req.target();
-    	auto target_string = std::string(targ);
-
     	// Request key must exist
-		if( req.target().empty() ||
+		if( req.target().size() < 2 ||
 		    req.target()[0] != '/')
 		    return send(bad_request("Illegal request-key"));
 
-		size_t pos = 0;
-		target_string.erase(0, pos + 1);
-		pos = target_string.find("/");
-
-		//Request value must exist 
-		if (pos == std::string::npos)
-			return send(bad_request("Illegal request-key"));
-
-    	auto key = target_string.substr(0, pos);
-    	target_string.erase(0, pos + 1);
-    	auto val = target_string;
-
-    	//Request value and key must be valid
-    	if (key.size() == 0 || val.size() == 0)
-    		return send(bad_request("Illegal request-key"));
-
-    	//create new val type
-    	char* new_array = new char[val.size()+1];
-    	strcpy(new_array, val.c_str());
-    	Cache::val_type new_val {new_array, static_cast<Cache::size_type>(val.size()+1)};
-
-    	//lock since we are modifying the cache
-    	{
-    		std::lock_guard guard(mutex_);
-
-    		//return error if value could not be placed
-	    	if (!cache_.set(key, new_val)) {
-	    		return send(server_error("Could not place key"));
-	    	}
+    	auto key = target_key(req.target());
+
+    	//Request value must exist; it is taken as raw bytes, whose length
+    	//the parser already knows from Content-Length
+    	auto const& val = req.body();
+    	if (val.size() == 0)
+    		return send(bad_request("Illegal request-value"));
+
+    	//an optional TTL header gives the value's time to live
+    	Cache::ttl_type ttl;
+    	if (!request_ttl(req, ttl))
+    		return send(bad_request("Illegal TTL"));
+
+    	bool conditional;
+    	std::uint64_t version;
+    	if (!request_version(req, conditional, version))
+    		return send(bad_request("Illegal version"));
+
+    	//the store locks the key's shard internally and copies the value
+    	//return error if value could not be placed
+    	Cache::val_type new_val {val.data(), static_cast<Cache::size_type>(val.size())};
+    	if (conditional) {
+    		//a cas that stored nothing either lost the race or did not fit;
+    		//the version it compared tells them apart
+    		std::uint64_t current;
+    		if (!cache_.cas(key, new_val, version, current, ttl)) {
+    			if (current != version)
+    				return send(precondition_failed(current));
+    			return send(server_error("Could not place key"));
+    		}
+    	} else if (!cache_.set(key, new_val, ttl)) {
+    		return send(server_error("Could not place key"));
     	}
 
-    	
-
-    	//delete the previously allocated array
-    	delete[] new_array;
-
     	//send the response
 		res.version(req.version());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING); 
@@ -187,30 +416,24 @@ handle_request(
 
     // Respond to GET request
     if(req.method() == http::verb::get) {
-    	http::response<http::string_body> res; 
+    	http::response<value_body> res; 
 
-    	//parse out request body
+    	//the key is looked up straight out of the request's target
     	auto targ = req.target();
-    	auto target_string = std::string(targ);
 
     	// Request key must be valid.
 		if( req.target().empty() ||
 		    req.target()[0] != '/')
 		    return send(bad_request("Illegal request-key"));
 
-    	auto key = target_string.substr(target_string.find("/")+1, target_string.size()-1);
-
-    	const Cache::byte_type* value;
-
-    	//lock since we are modifying the cache (hit rate to be specific)
-    	{
-    		std::lock_guard guard(mutex_);
+    	auto key = target_key(targ);
 
-    		value = cache_.get(key).data_;
-    	}
+    	//the store looks the key up without taking any lock and hands back
+    	//a reference to the stored bytes rather than a copy
+    	auto value = cache_.get_ref(key);
 
     	//return error if key not found
-    	if (value == nullptr) {
+    	if (!value) {
     		return send(not_found(targ));
     	}
 
@@ -219,12 +442,11 @@ handle_request(
 		res.version(req.version());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING); 
 		res.result(http::status::ok);
+		res.set(http::field::content_type, "application/octet-stream");
+		res.set(http::field::etag, version_tag(value.version()));
 
-		//json tuple format
-		res.body() = "{" + key + ":" + value + "}"; 
-
-		//make sure to deallocate
-		delete[] value;
+		//the raw value bytes, written straight from the handle
+		res.body() = std::move(value);
 		res.prepare_payload();
 		res.keep_alive(req.keep_alive());
 		return send(std::move(res));
@@ -235,7 +457,7 @@ handle_request(
 
     	http::response<http::empty_body> res; 
 
-    	//no need to lock since these operations do not write
+    	//the store aggregates these over its shards
 
     	//create new fields
     	res.insert("Space-used", std::to_string(cache_.space_used()));
@@ -260,25 +482,17 @@ handle_request(
     if(req.method() == http::verb::delete_) {
     	http::response<http::empty_body> res; 
 
-    	//parse out request target
-    	auto targ = req.target();
-    	auto target_string = std::string(targ);
-
     	// Request key must be valid.
 		if( req.target().empty() ||
 		    req.target()[0] != '/')
 		    return send(bad_request("Illegal request-key"));
 
-    	auto key = target_string.substr(target_string.find("/")+1, target_string.size()-1);
+    	auto key = target_key(req.target());
 
 
-    	//lock since we are modifying the cache
-    	{
-    		std::lock_guard guard(mutex_);
-	    	//return error if not deleted
-	    	if (!cache_.del(key)) {
-	    		return send(server_error("Could not delete"));
-	    	}
+    	//return error if not deleted
+    	if (!cache_.del(key)) {
+    		return send(server_error("Could not delete"));
     	}
 
     	//send response
@@ -291,6 +505,190 @@ handle_request(
 
 
 
+    // Respond to POST /mget: the body lists keys, one per line. The response
+    // has, for each key in order, a "<size> <version>" line followed by the
+    // value's bytes, or a "-" line for a miss.
+    if(req.method() == http::verb::post && req.target() == "/mget") {
+    	http::response<batch_body> res;
+
+    	auto keys = body_keys(req.body());
+    	auto values = cache_.mget(keys);
+    	for (auto& value : values) {
+    		if (value) {
+    			auto line = std::to_string(value.size()) + " " + std::to_string(value.version()) + "\n";
+    			res.body().emplace_back(std::move(line), std::move(value));
+    		} else {
+    			res.body().emplace_back("-\n", Cache::value_handle());
+    		}
+    	}
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_type, "application/octet-stream");
+		res.result(http::status::ok);
+		res.prepare_payload();
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    }
+
+    // Respond to POST /mset: the body holds, for each pair, a "<key> <size>"
+    // line followed by the value's bytes, and an optional TTL header gives
+    // all of them a time to live. The response has one character per pair,
+    // 1 if it was stored and 0 if not.
+    if(req.method() == http::verb::post && req.target() == "/mset") {
+    	http::response<http::string_body> res;
+
+    	std::vector<std::pair<key_view, Cache::val_type>> items;
+    	if (!body_items(req.body(), items))
+    		return send(bad_request("Illegal batch"));
+    	Cache::ttl_type ttl;
+    	if (!request_ttl(req, ttl))
+    		return send(bad_request("Illegal TTL"));
+    	for (bool stored : cache_.mset(items, ttl)) {
+    		res.body() += stored ? '1' : '0';
+    	}
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_type, "text/plain");
+		res.result(http::status::ok);
+		res.prepare_payload();
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    }
+
+    // Respond to POST /mdel: the body lists keys, one per line. The response
+    // is the number of keys deleted.
+    if(req.method() == http::verb::post && req.target() == "/mdel") {
+    	http::response<http::string_body> res;
+
+    	res.body() = std::to_string(cache_.mdel(body_keys(req.body())));
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_type, "text/plain");
+		res.result(http::status::ok);
+		res.prepare_payload();
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    }
+
+     // Respond to POST /stats request with one "name value" line per statistic
+    if(req.method() == http::verb::post && req.target() == "/stats") {
+    	http::response<http::string_body> res; 
+
+    	for (auto& stat : cache_.stats()) {
+    		res.body() += stat.first + " " + std::to_string(stat.second) + "\n";
+    	}
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING); 
+		res.set(http::field::content_type, "text/plain");
+		res.result(http::status::ok);
+		res.prepare_payload();
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    } 
+
+    // Respond to POST /hotkeys with one "key count" line per hot key, most
+    // read first
+    if(req.method() == http::verb::post && req.target() == "/hotkeys") {
+    	http::response<http::string_body> res;
+
+    	for (auto& hot : cache_.hot_keys()) {
+    		res.body() += hot.first + " " + std::to_string(hot.second) + "\n";
+    	}
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_type, "text/plain");
+		res.result(http::status::ok);
+		res.prepare_payload();
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    }
+
+    // Respond to POST /snapshot by writing the snapshot file the server
+    // was started with
+    if(req.method() == http::verb::post && req.target() == "/snapshot") {
+    	http::response<http::empty_body> res;
+
+    	if (snapshot_.empty())
+    		return send(not_found(req.target()));
+    	if (!cache_.save_snapshot(snapshot_))
+    		return send(server_error("Could not write snapshot"));
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.result(204); //request processed, no content
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    }
+
+    // Respond to POST /incr/<key> and /decr/<key>: the body is the delta
+    // (1 if empty), and the response body the key's new value. A key not in
+    // the cache starts at 0, with the TTL header's time to live.
+    key_view key;
+    bool decr = false;
+    if(req.method() == http::verb::post &&
+       (post_key(req.target(), "/incr/", key) || (decr = post_key(req.target(), "/decr/", key)))) {
+    	http::response<http::string_body> res;
+
+    	std::int64_t delta = 1;
+    	if (!req.body().empty()) {
+    		auto const& text = req.body();
+    		char* end = nullptr;
+    		errno = 0;
+    		delta = std::strtoll(text.c_str(), &end, 10);
+    		if (end != text.c_str() + text.size() || errno == ERANGE)
+    			return send(bad_request("Illegal delta"));
+    	}
+
+    	Cache::ttl_type ttl;
+    	if (!request_ttl(req, ttl))
+    		return send(bad_request("Illegal TTL"));
+
+    	std::int64_t value;
+    	if (!(decr ? cache_.decr(key, delta, value, ttl) : cache_.incr(key, delta, value, ttl)))
+    		return send(server_error("Could not update key"));
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_type, "text/plain");
+		res.result(http::status::ok);
+		res.body() = std::to_string(value);
+		res.prepare_payload();
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    }
+
+    // Respond to POST /append/<key> and /prepend/<key>: the body is added
+    // after or before the key's value
+    bool prepend = false;
+    if(req.method() == http::verb::post &&
+       (post_key(req.target(), "/append/", key) || (prepend = post_key(req.target(), "/prepend/", key)))) {
+    	http::response<http::empty_body> res;
+
+    	auto const& val = req.body();
+    	Cache::val_type more {val.data(), static_cast<Cache::size_type>(val.size())};
+    	if (!(prepend ? cache_.prepend(key, more) : cache_.append(key, more)))
+    		return send(server_error("Could not update key"));
+
+    	//send response
+		res.version(req.version());
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.result(204); //request processed, no content
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+    }
+
      // Respond to POST request
     if(req.method() == http::verb::post) {
     	http::response<http::empty_body> res; 
@@ -304,14 +702,10 @@ handle_request(
     		return send(not_found(targ));
     	} 
 
-    	//lock since we are modifying the cache
-    	{
-    		std::lock_guard guard(mutex_);
-	    	//reset cache
-	    	if (!cache_.reset()) {
-	    		return send(server_error("Could not reset"));
-	    	}
-	    }
+    	//reset cache
+    	if (!cache_.reset()) {
+    		return send(server_error("Could not reset"));
+    	}
 
     	//send response
 		res.version(req.version());
@@ -326,6 +720,9 @@ handle_request(
 
 //------------------------------------------------------------------------------
 
+// One io_context per NUMA node, each run by threads on the node's CPUs
+using node_contexts = std::vector<std::unique_ptr<net::io_context>>;
+
 // Report a failure
 void
 fail(beast::error_code ec, char const* what)
@@ -376,31 +773,81 @@ class session : public std::enable_shared_from_this<session>
         }
     };
 
+    // Sends a response made by a thread of another node: the response is
+    // handed back to the session's strand, and written from there.
+    struct post_send
+    {
+        session& self_;
+
+        template<bool isRequest, class Body, class Fields>
+        void
+        operator()(http::message<isRequest, Body, Fields>&& msg) const
+        {
+            auto sp = std::make_shared<
+                http::message<isRequest, Body, Fields>>(std::move(msg));
+            net::post(
+                self_.stream_.get_executor(),
+                [self = self_.shared_from_this(), sp]()
+                {
+                    self->lambda_(std::move(*sp));
+                });
+        }
+    };
+
     beast::tcp_stream stream_;
     beast::flat_buffer buffer_;
 
     //replace with cache
    	Cache &cache_;
+    std::string const& snapshot_;
 
-   	//Store mutex
-   	std::mutex &mutex_;
+    //the contexts of every node, and the node this connection's strand is on
+    node_contexts& contexts_;
+    unsigned node_;
 
     http::request<http::string_body> req_;
     std::shared_ptr<void> res_;
     send_lambda lambda_;
 
+    // The node whose memory holds the key a request is for: a get, put or
+    // delete of one key, or an incr, decr, append or prepend of it. Any
+    // other request stays on the session's node.
+    unsigned
+    request_node() const
+    {
+        if (contexts_.size() == 1)
+            return node_;
+        key_view key;
+        if (req_.method() == http::verb::post) {
+            for (auto op : {"/incr/", "/decr/", "/append/", "/prepend/"})
+                if (post_key(req_.target(), op, key))
+                    return cache_.numa_node(key);
+            return node_;
+        }
+        if ((req_.method() != http::verb::get &&
+             req_.method() != http::verb::put &&
+             req_.method() != http::verb::delete_) ||
+            req_.target().size() < 2 ||
+            req_.target()[0] != '/')
+            return node_;
+        return cache_.numa_node(target_key(req_.target()));
+    }
+
 public:
     // Take ownership of the stream
     session(
         tcp::socket&& socket,
 
         Cache &cache_,
-
-        std::mutex &mutex_)
+        std::string const& snapshot_,
+        node_contexts& contexts,
+        unsigned node)
 
         : stream_(std::move(socket))
-        , cache_(cache_) 
-        , mutex_(mutex_)
+        , cache_(cache_)
+        , snapshot_(snapshot_)
+        , contexts_(contexts)
+        , node_(node)
         , lambda_(*this)
 
     {
@@ -452,9 +899,20 @@ public:
             return fail(ec, "read");
 
 
+        // A request for a key whose shard is on another node is handled by
+        // that node's threads, next to the key's memory
+        auto node = request_node();
+        if (node != node_)
+            return net::post(
+                *contexts_[node],
+                [self = shared_from_this()]()
+                {
+                    handle_request(self->cache_, self->snapshot_, std::move(self->req_), post_send{*self});
+                });
+
         //should recieve input on how to handle request
         // Send the response
-        handle_request(cache_, mutex_, std::move(req_), lambda_);
+        handle_request(cache_, snapshot_, std::move(req_), lambda_);
     }
 
     void
@@ -498,20 +956,23 @@ public:
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener>
 {
-    net::io_context& ioc_;
+    node_contexts& contexts_;
     tcp::acceptor acceptor_;
-    Cache cache_;
-    std::mutex mutex_;
+    Cache& cache_;
+    std::string snapshot_;
+    unsigned next_node_;
 
 public:
     listener(
-        net::io_context& ioc,
+        node_contexts& contexts,
         tcp::endpoint endpoint,
-        Cache::size_type maxmem)
-        : ioc_(ioc)
-        , acceptor_(net::make_strand(ioc))
-        , cache_(maxmem)
-        , mutex_()
+        Cache& cache,
+        std::string snapshot)
+        : contexts_(contexts)
+        , acceptor_(net::make_strand(*contexts[0]))
+        , cache_(cache)
+        , snapshot_(std::move(snapshot))
+        , next_node_(0)
     {
         beast::error_code ec;
 
@@ -560,16 +1021,18 @@ private:
     void
     do_accept()
     {
-        // The new connection gets its own strand
+        // The new connection gets its own strand, on the nodes in turn
+        auto node = next_node_++ % contexts_.size();
         acceptor_.async_accept(
-            net::make_strand(ioc_),
+            net::make_strand(*contexts_[node]),
             beast::bind_front_handler(
                 &listener::on_accept,
-                shared_from_this()));
+                shared_from_this(),
+                node));
     }
 
     void
-    on_accept(beast::error_code ec, tcp::socket socket)
+    on_accept(unsigned node, beast::error_code ec, tcp::socket socket)
     {
         if(ec)
         {
@@ -577,10 +1040,19 @@ private:
         }
         else
         {
+            // Responses go out as several writes (header, then body
+            // buffers); without this, Nagle's algorithm holds the later
+            // ones back until the client's delayed ACK arrives
+            beast::error_code nodelay_ec;
+            socket.set_option(tcp::no_delay(true), nodelay_ec);
+
             // Create the session and run it
             std::make_shared<session>(
                 std::move(socket),
-                cache_, mutex_)->run(); //pass reference to cache and the mutex
+                cache_,
+                snapshot_,
+                contexts_,
+                node)->run(); //pass reference to the (internally locked) cache
         }
 
         // Accept another connection
@@ -608,16 +1080,51 @@ int main(int argc, char* argv[])
     std::string server;
     unsigned short port;
     int threads;
+    unsigned shards;
+    std::string snapshot;
+    std::string log;
+    unsigned sync_ms;
+    Cache::size_type compress_min;
+    std::string evictor;
+    std::string spill_file;
+    Cache::size_type spill_size;
+    bool huge_pages;
+    bool log_memory;
+    Cache::size_type filter_keys;
+    unsigned hot_keys;
 
     //create option menu
     po::options_description desc("Allowed Options");
 
     desc.add_options()
-    	("help", "This function (main) receives four optional command line arguments, -m maxmem, -s server, -p port, and -t threads. \n Usage: cache_server -m <maxmem> -s <server> -p <port> -t <threads>")
+    	("help", "This function (main) receives seven optional command line arguments, -m maxmem, -s server, -p port, -t threads, -d shards, -f snapshot, and -l log. \n Usage: cache_server -m <maxmem> -s <server> -p <port> -t <threads> -d <shards> -f <snapshot> -l <log> [--sync-ms <ms>] [--compress-min <bytes>] [--evictor <none|lru>] [--spill-file <path>] [--spill-size <bytes>] [--huge-pages <true|false>] [--log-memory <true|false>] [--filter-keys <keys>] [--hot-keys <k>]")
  		("maxmem,m", po::value<Cache::size_type>(&maxmem) -> default_value(1000000))
  		("server,s", po::value<std::string>(&server) -> default_value("127.0.0.1"))
  		("port,p", po::value<unsigned short>(&port) -> default_value(8555))
  		("threads,t", po::value<int>(&threads) -> default_value(1))
+ 		("shards,d", po::value<unsigned>(&shards) -> default_value(1))
+ 		("snapshot,f", po::value<std::string>(&snapshot) -> default_value(""),
+ 		 "Snapshot file: served from at startup if it exists, and written on POST /snapshot and on SIGINT or SIGTERM")
+ 		("log,l", po::value<std::string>(&log) -> default_value(""),
+ 		 "Mutation log: replayed at startup, then appended to by every set, delete and reset")
+ 		("sync-ms", po::value<unsigned>(&sync_ms) -> default_value(0),
+ 		 "How often the mutation log is synced, in ms; 0 syncs each batch before replying")
+ 		("compress-min", po::value<Cache::size_type>(&compress_min) -> default_value(0),
+ 		 "Store values of at least this many bytes compressed when that saves space; 0 never compresses")
+ 		("evictor", po::value<std::string>(&evictor) -> default_value("none"),
+ 		 "Eviction policy once maxmem is used up: none (sets fail) or lru")
+ 		("spill-file", po::value<std::string>(&spill_file) -> default_value(""),
+ 		 "File to keep evicted pairs in as a second tier, read back on a miss in memory")
+ 		("spill-size", po::value<Cache::size_type>(&spill_size) -> default_value(Cache::size_type(1) << 30),
+ 		 "Size of the spill file in bytes")
+ 		("huge-pages", po::value<bool>(&huge_pages) -> default_value(false),
+ 		 "Back the memory of stored values with huge pages, explicit ones if enough are set aside and transparent ones otherwise")
+ 		("log-memory", po::value<bool>(&log_memory) -> default_value(false),
+ 		 "Append stored values to a log of segments compacted in the background, rather than to size-class slabs")
+ 		("filter-keys", po::value<Cache::size_type>(&filter_keys) -> default_value(0),
+ 		 "Answer gets for missing keys from a Bloom filter sized for this many keys; 0 for no filter")
+ 		("hot-keys", po::value<unsigned>(&hot_keys) -> default_value(0),
+ 		 "Track this many of the most read keys (at most 64), listed on POST /hotkeys, and serve them from per-thread copies; 0 for none")
  	;
 
  	po::variables_map vm;
@@ -633,25 +1140,97 @@ int main(int argc, char* argv[])
  	auto const address = net::ip::make_address(server);
 
 
-    // The io_context is required for all I/O
-    net::io_context ioc{threads};
+    if (evictor != "none" && evictor != "lru") {
+        std::cerr << "Unknown evictor " << evictor << std::endl;
+        return EXIT_FAILURE;
+    }
+    Lru_evictor lru;
+
+    // The cache outlives the sessions, which are destroyed with the io_context
+    Cache cache(maxmem, 0.75, evictor == "lru" ? &lru : nullptr, std::hash<key_view>(), shards);
+    cache.compress_values(compress_min);
+    cache.use_huge_pages(huge_pages);
+    cache.use_log_memory(log_memory);
+    cache.filter_misses(filter_keys);
+    cache.track_hot_keys(hot_keys);
+
+    // Spread the shards over the NUMA nodes before any value is stored, so
+    // that each one's memory is on its node from the start
+    auto const topology = Numa_topology::detect();
+    cache.bind_numa(topology);
+
+    if (!spill_file.empty() && !cache.open_spill(spill_file, spill_size)) {
+        std::cerr << "Could not open spill file " << spill_file << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Serve the last snapshot straight away; its values are paged in as
+    // they're asked for
+    if (!snapshot.empty() && access(snapshot.c_str(), F_OK) == 0) {
+        auto start = std::chrono::steady_clock::now();
+        if (cache.load_snapshot(snapshot)) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "Mapped snapshot " << snapshot << " in " << elapsed.count() << " ms" << std::endl;
+        } else {
+            std::cerr << "Could not load snapshot " << snapshot << std::endl;
+        }
+    }
+
+    // Replay the mutations logged since, and log the ones to come
+    if (!log.empty() && !cache.open_log(log, std::chrono::milliseconds(sync_ms))) {
+        std::cerr << "Could not open log " << log << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // The io_contexts are required for all I/O: one per node, each run by
+    // its share of the threads (at least one), pinned to the node's CPUs.
+    // The work guards keep the contexts that have nothing to do yet running.
+    unsigned const nodes = topology.nodes();
+    unsigned const nthreads = std::max<unsigned>(threads, nodes);
+    node_contexts contexts;
+    std::vector<net::executor_work_guard<net::io_context::executor_type>> work;
+    for(unsigned n = 0; n < nodes; ++n)
+    {
+        contexts.emplace_back(new net::io_context((nthreads - n + nodes - 1) / nodes));
+        work.push_back(net::make_work_guard(*contexts.back()));
+    }
+
+    // Stop serving on SIGINT or SIGTERM, so that the snapshot gets written
+    net::signal_set signals(*contexts[0], SIGINT, SIGTERM);
+    signals.async_wait(
+        [&contexts](beast::error_code const&, int)
+        {
+            for(auto& ioc : contexts)
+                ioc->stop();
+        });
 
     // Create and launch a listening port
     std::make_shared<listener>(
-        ioc,
+        contexts,
         tcp::endpoint{address, port},
-        maxmem)->run();
+        cache,
+        snapshot)->run();
 
-    // Run the I/O service on the requested number of threads
+    // Run the I/O service on the requested number of threads, thread i on
+    // node i % nodes; this one runs node 0's
     std::vector<std::thread> v;
-    v.reserve(threads - 1);
-    for(auto i = threads - 1; i > 0; --i)
+    v.reserve(nthreads - 1);
+    for(auto i = nthreads - 1; i > 0; --i)
         v.emplace_back(
-        [&ioc]
+        [&topology, &contexts, node = i % nodes]
         {
-            ioc.run();
+            topology.bind_thread(node);
+            contexts[node]->run();
         });
-    ioc.run();
+    topology.bind_thread(0);
+    contexts[0]->run();
+    for(auto& t : v)
+        t.join();
+
+    if (!snapshot.empty() && !cache.save_snapshot(snapshot)) {
+        std::cerr << "Could not write snapshot " << snapshot << std::endl;
+        return EXIT_FAILURE;
+    }
 
     return EXIT_SUCCESS;
 }
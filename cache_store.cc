@@ -1,192 +1,2685 @@
 
 #include <algorithm>
+#include <atomic>
 #include "cache.hh"
+#include "counting_bloom.hh"
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <unordered_map>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
+#include "epoch.hh"
+#include "flat_table.hh"
+#include "log_allocator.hh"
+#include "lz_codec.hh"
+#include "mutation_log.hh"
+#include "numa.hh"
+#include "slab_allocator.hh"
+#include "space_saving.hh"
+#include "spill_store.hh"
+#include "stat_counters.hh"
+#include "thread_index.hh"
+#include "timing_wheel.hh"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
   // Create a new cache object with the following parameters:
   // maxmem: The maximum allowance for storage used by values.
-  // max_load_factor: Maximum allowed ratio between buckets and table rows.
+  // max_load_factor: Maximum ratio of used slots to slots in a shard's
+  // open-addressing index before it grows (at most 15/16).
   // evictor: Eviction policy implementation (if nullptr, no evictions occur
   // and new insertions fail after maxmem has been exceeded).
   // hasher: Hash function to use on the keys. Defaults to C++'s std::hash.
+  // nshards: Number of independently locked partitions of the store.
+
+// Items start on a cache line boundary
+const Cache::size_type item_alignment = 64;
+// except in a log, which packs them as tightly as their fields allow
+const Cache::size_type log_item_alignment = 16;
+
+namespace {
+
+// Wall clock time in milliseconds since the Unix epoch, which is how TTLs
+// are kept outside the process, where store ticks mean nothing
+std::int64_t wall_clock_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}
 
 class Cache::Impl
 {
   public:
-    size_type maxmem;
-    float max_load_factor;
-    size_type curmem;
+    // The index finds items by the key stored in them
+    struct item_key {
+      std::string_view operator()(value_handle::block* blk) const;
+    };
+
+    // Items with a TTL are linked into their shard's timing wheel, whose
+    // ticks are milliseconds since the store was created
+    struct item_ttl;
+    using wheel_type = Timing_wheel<value_handle::block, item_ttl>;
+    struct item_ttl {
+      wheel_type::links& operator()(value_handle::block* blk) const;
+    };
+
+    using index_type = Flat_table<value_handle::block*, item_key>;
+
+    // A shard is a self-contained cache over the subset of keys that hash
+    // to it, with its own lock, memory budget, slab allocator (or log) and
+    // evictor.
+    // Writers take the lock. Lookups read the index without it, inside an
+    // epoch guard, and retry if seq changed (or was odd, meaning a write
+    // to the index was under way) while they looked. Lookups ask the
+    // filter, if there is one, first.
+    struct Shard {
+      std::mutex mutex;
+      std::atomic<std::uint64_t> seq;
+      size_type maxmem;
+      size_type curmem;
+      Evictor* evictor;
+      Epoch_manager& epochs;
+      Slab_allocator slabs;
+      index_type index;
+      wheel_type wheel;
+      // Bumped by every reset(), under the mutex. Items dropped by a reset
+      // keep their linked flag and their evictor handle, which the evictor
+      // may give out again, so a reader that found one checks that no
+      // reset happened since before telling the evictor.
+      std::atomic<std::uint64_t> resets;
+      // Node of the topology given to bind_numa() that holds the slabs
+      unsigned node;
+      // Version of the last item stored, changed under the mutex; starts
+      // from the wall clock
+      std::uint32_t version;
+      // Set by filter_misses(), under the mutex; a filter it replaces is
+      // retired through the epochs, as lookups read it inside their guard
+      std::atomic<Counting_bloom*> filter;
+      // Set by use_log_memory() before anything is stored, after which
+      // items are appended to its segments instead of the slabs. The
+      // cleaner moves them, under the mutex.
+      std::unique_ptr<Log_allocator> segments;
+      // Hits that found the mutex taken, each holding a reference to its
+      // item and the resets seen before the lookup, for the evictor to be
+      // told of by the next thread to hold the mutex
+      struct touch {
+        value_handle::block* blk;
+        std::uint64_t resets;
+      };
+      static constexpr std::size_t max_touches = 64;
+      std::mutex touches_mutex;
+      std::vector<touch> touches;
+
+      Shard(size_type maxmem, Evictor* evictor, float max_load_factor, Epoch_manager& epochs);
+      ~Shard();
+
+      // The version for the next item stored, never 0. The mutex must be
+      // held.
+      std::uint32_t next_version();
+
+      // Memory for an item, from the segments if the shard has them (in
+      // the relocations' stream for the cleaner) or else from the slabs
+      void* allocate(size_type size, bool relocating = false);
+      void deallocate(void* p, size_type size);
+
+      // Tell the evictor of a hit on blk, found after the shard had seen
+      // resets resets. Takes the mutex if it is free, and otherwise queues
+      // the hit, waiting for the mutex only once the queue is full.
+      void touch_item(value_handle::block* blk, std::uint64_t resets);
+      // Tell the evictor of the queued hits. The mutex must be held.
+      void drain_touches();
+
+      // Marks a change to the index: seq is odd for as long as it lasts.
+      // The shard mutex must be held.
+      class write_section {
+        public:
+          explicit write_section(Shard& shard);
+          ~write_section();
+        private:
+          Shard& shard_;
+      };
+
+      // Find key and take a reference to its item, or return nullptr.
+      // Does not need the shard mutex. filtered, if given, tells whether
+      // there was a filter, and rejected whether it answered.
+      value_handle::block* lookup(std::uint64_t hash, key_view key, bool* filtered = nullptr,
+          bool* rejected = nullptr);
+
+      // Put blk, with the given hash, in the index and the filter. The
+      // shard mutex must be held.
+      void link(std::uint64_t hash, value_handle::block* blk);
+
+      // Take key's item out of the index and the wheel, and return it
+      // with the index's reference, or nullptr if key is not here. The
+      // shard mutex must be held.
+      value_handle::block* take(std::uint64_t hash, key_view key);
+
+      // take() for an item known to be in the index
+      void unlink(value_handle::block* blk);
+      // What take() and unlink() do to the item itself
+      void forget(value_handle::block* blk);
+    };
+
+    // Event counts reported by stats(), named in counter_names
+    enum counter : unsigned {
+      hits, misses, sets, overwrites, rejected_sets, deletes, evictions, expirations,
+      bytes_in, bytes_out, bytes_evicted, bytes_expired, cas_mismatches,
+      incrs, appends, in_place_updates,
+      compressions, incompressible, bytes_uncompressed, bytes_compressed, compress_ns,
+      decompressions, decompress_ns,
+      spills, spills_dropped, bytes_spilled, spill_hits, spill_misses, spill_read_ns, promotions,
+      filter_rejections, filter_false_positives,
+      segments_cleaned, items_relocated, bytes_relocated,
+      replica_hits, replicas_made, replicas_dropped,
+      ncounters
+    };
+    static const char* const counter_names[ncounters];
+
+    // Most items expired per acquisition of a shard's lock, so that a burst
+    // of expirations does not hold up the shard's writers
+    static constexpr std::size_t expire_batch = 256;
+    // How often the expirer thread wakes up
+    static constexpr std::chrono::milliseconds expire_interval {10};
+
+    // Times a set short of chunks, with nothing to evict, yields to the
+    // readers holding back the epoch before it gives up
+    static constexpr unsigned collect_tries = 8;
+
   	hash_func hasher;
-    Evictor* evictor;
-    std::unordered_map<key_type, val_type*, hash_func> cache_map; //std::function<size_t(const key_type &key)>
-  	std::uint32_t hits;
-  	std::uint32_t misses;
+    Epoch_manager epochs;
+    Stat_counters counters;
+    std::chrono::steady_clock::time_point start;
+    std::vector<std::unique_ptr<Shard>> shards;
+    // Evictors created for shards other than the first one, which uses the
+    // evictor given by the caller.
+    std::vector<std::unique_ptr<Evictor>> shard_evictors;
+
+    // Background thread expiring items with a TTL, started by the first
+    // set that has one
+    std::atomic<bool> expirer_started;
+    std::mutex expirer_mutex;
+    std::condition_variable expirer_wakeup;
+    bool expirer_stopping;
+    std::thread expirer;
+
+    // Background thread moving the live items out of the shards' sparse
+    // log segments, started by use_log_memory(). clean_below is the most
+    // of a segment that may be live for it to be cleaned.
+    std::mutex cleaner_mutex;
+    std::condition_variable cleaner_wakeup;
+    bool cleaner_stopping;
+    std::thread cleaner;
+    std::atomic<double> clean_below;
+    // How often the cleaner wakes up, and the most segments it cleans per
+    // acquisition of a shard's lock
+    static constexpr std::chrono::milliseconds clean_interval {10};
+    static constexpr std::size_t clean_batch = 4;
+    // Sparseness of the segments a set out of space cleans before it
+    // evicts, and that the cleaner cleans when segments run low
+    static constexpr double reclaim_below = 0.8;
+    static constexpr unsigned reclaim_tries = 8;
+    static constexpr std::size_t low_free_segments = 8;
+
+    // Background thread releasing the items reset() dropped, started by
+    // the first reset. releases_pending counts the detached indexes queued
+    // or being released.
+    std::mutex release_mutex;
+    std::condition_variable release_wakeup;
+    std::condition_variable released;
+    std::vector<index_type::detached> to_release;
+    std::atomic<std::size_t> releases_pending;
+    bool releaser_stopping;
+    std::thread releaser;
+
+    // Snapshot files mapped by load_snapshot(), as (address, length). Their
+    // items are served in place, so they stay mapped until the store is
+    // destroyed.
+    std::mutex mappings_mutex;
+    std::vector<std::pair<void*, std::size_t>> mappings;
+
+    // Where mutations are logged, once open_log() has been called
+    std::unique_ptr<Mutation_log> log;
+
+    // Where evicted pairs go, once open_spill() has been called. A pair is
+    // in at most one tier.
+    std::unique_ptr<Spill_store> spill;
+
+    // The nodes the shards are spread over, once bind_numa() has been
+    // called; the slabs place their pages through it
+    std::unique_ptr<Numa_topology> numa;
+
+    // Values of at least this many bytes are stored compressed, when that
+    // saves space; 0 for never
+    std::atomic<size_type> compress_min;
+
+    // Hot keys, once track_hot_keys() has been called. One get in
+    // hot_sample per thread feeds the sketch; each thread serves the hot
+    // keys it reads from copies in its own replica table.
+    static constexpr unsigned hot_sample = 32;
+    static constexpr unsigned max_hot_keys = 64;
+    // Samples before a key can be hot, and before the counts are halved
+    static constexpr std::uint64_t hot_min_samples = 256;
+    static constexpr std::uint64_t hot_decay = 1 << 16;
+    struct replica {
+      std::uint64_t hash;
+      value_handle item;        // holds the item so that it can be checked
+      std::uint32_t version;    // of the item when copied
+      std::uint64_t resets;     // of its shard then
+      value_handle copy;
+    };
+    struct alignas(64) replica_table {
+      std::vector<replica> entries;
+      unsigned countdown = 1;   // gets until the next sample
+      unsigned next = 0;        // entry replaced when the table is full
+    };
+    std::atomic<unsigned> hot_k;   // 0 when not tracking
+    std::mutex hot_mutex;
+    Space_saving hot_sketch;       // monitoring 8 keys per key tracked
+    std::unique_ptr<replica_table[]> replicas;
+    // Every store, so that a thread can empty its replica tables when it
+    // exits rather than leave their items held until its index is reused
+    struct store_list {
+      std::mutex mutex;
+      std::vector<Impl*> list;
+    };
+    static store_list& stores();
+    struct replica_owner {
+      unsigned index;
+      ~replica_owner();
+    };
 
     Impl(size_type maxmem,
     float max_load_factor,
     Evictor* evictor,
-    hash_func hasher);
+    hash_func hasher,
+    unsigned nshards);
     ~Impl();
-  private: 
-};	
 
-Cache::Impl::Impl(size_type maxmem,
-    float max_load_factor,
-    Evictor* evictor,
-    hash_func hasher)
-    : maxmem(maxmem),max_load_factor(max_load_factor),curmem(0),hasher(hasher),
-	evictor(evictor),cache_map(0, hasher),hits(0),misses(0)
+    // Well-mixed hash of a key, used both to pick its shard and as its
+    // hash within the shard's index.
+    std::uint64_t hash_of(key_view key) const;
+    unsigned shard_index(std::uint64_t hash) const;
+    Shard& shard_for(std::uint64_t hash);
+
+    // Milliseconds since the store was created
+    std::uint64_t now() const;
+
+    // A value as it is to be stored. A compressed value is the value's
+    // size, as 8 bytes, followed by the codec's output.
+    struct packed_value {
+      val_type stored;
+      size_type size;       // of the value as set
+      bool compressed;
+      std::string buffer;   // holds the compressed form
+      bool integer = false; // stored is a native std::int64_t
+    };
+    // Prepare val for storing, compressed into out's buffer if that saves
+    // space. Done without any lock held.
+    void pack(val_type val, packed_value& out);
+    // blk itself, or else an owned copy with the value decompressed (or an
+    // integer in decimal), taking over blk's reference. Returns nullptr if
+    // the value does not decompress.
+    value_handle::block* unpack(value_handle::block* blk);
+
+    // The integer held by blk, which must be an integer item. Its shard
+    // mutex must be held, as integers change in place under it.
+    static std::int64_t integer_of(value_handle::block* blk);
+
+    // Store a pair in its shard, as Cache::set does, expiring at tick
+    // expires (0 for never), or move it back from the spill tier if
+    // promoted. The shard mutex must be held.
+    bool set(Shard& shard, std::uint64_t hash, key_view key, const packed_value& val, std::uint64_t expires,
+        bool promoted = false);
+
+    // Look key up in the spill tier after a miss in memory, and move it
+    // back to memory (or to a heap copy, if it no longer fits). Returns
+    // nullptr if it is not there.
+    value_handle::block* fetch_spilled(Shard& shard, std::uint64_t hash, key_view key);
+
+    // shard.lookup(), counting the gets the shard's filter answered and
+    // the ones it let through to a miss
+    value_handle::block* find(Shard& shard, std::uint64_t hash, key_view key);
+
+    // The calling thread's replica table, if hot keys are tracked (and the
+    // thread has one). Empties it if they no longer are.
+    replica_table* hot_table();
+    // A copy of key's value from table, if it holds one whose item has not
+    // changed since, or else an empty handle (dropping a stale copy)
+    value_handle read_replica(replica_table& table, Shard& shard, std::uint64_t hash, key_view key);
+    // Count a sampled get of key, which returned value from item, and copy
+    // it into table if key is hot. Takes over item's reference.
+    void sample_hot(replica_table& table, std::uint64_t hash, key_view key,
+        value_handle::block* item, const value_handle& value, std::uint64_t resets);
+
+    // Version of key's live item in the shard, or 0 if there is none. The
+    // shard mutex must be held.
+    std::uint64_t version_of(Shard& shard, std::uint64_t hash, key_view key);
+
+    // Move key back to memory if it is only in the spill tier, so that it
+    // can be changed where it is. Takes the shard lock.
+    void promote(Shard& shard, std::uint64_t hash, key_view key);
+
+    // Key's live item in the shard, or nullptr. The shard mutex must be
+    // held.
+    value_handle::block* live_item(Shard& shard, std::uint64_t hash, key_view key);
+
+    // What Cache::incr and Cache::append do, in the shard. The shard mutex
+    // must be held, and for a positive ttl the expirer started.
+    bool incr(Shard& shard, std::uint64_t hash, key_view key, std::int64_t delta, std::int64_t& value,
+        ttl_type ttl);
+    bool append(Shard& shard, std::uint64_t hash, key_view key, val_type val, bool prepend);
+
+    // Tick at which a pair set now with ttl expires, or 0 for never
+    std::uint64_t expiry_for(ttl_type ttl);
+
+    // Remove key from its shard, counting it under reason, or as expired if
+    // its TTL ran out. Evicted items go to the spill tier. Returns true iff
+    // a live item was removed. The shard mutex must be held.
+    bool remove(Shard& shard, std::uint64_t hash, key_view key, counter reason);
+
+    // Remove the item (or key) the shard's evictor offers. Returns false if
+    // it has nothing to offer. The shard mutex must be held.
+    bool evict(Shard& shard);
+
+    // Remove up to limit items of the shard whose TTL ran out by now.
+    // Returns the number removed. The shard mutex must be held.
+    std::size_t expire(Shard& shard, std::uint64_t now, std::size_t limit);
+
+    // Start the expirer thread if it is not running yet.
+    void start_expirer();
+    void run_expirer();
+
+    // Move the indexed items out of up to limit segments with at most
+    // max_live of their bytes live. Returns the number of segments cleaned.
+    // The shard mutex must be held.
+    std::size_t clean(Shard& shard, double max_live, std::size_t limit);
+    void start_cleaner();
+    void run_cleaner();
+
+    // Hand the items taken out of an index to the releaser thread,
+    // starting it if needed.
+    void release_later(index_type::detached items);
+    void run_releaser();
+    // Wait until every item handed to the releaser has been released. May
+    // be called with shard locks held: the releaser takes none.
+    void wait_released();
+
+    // Wall clock deadline of an item expiring at tick expires (0 for never)
+    std::int64_t wall_deadline(std::uint64_t expires) const;
+    // Tick of a wall clock deadline (0 for never), or 0 if it has passed
+    std::uint64_t tick_of(std::int64_t deadline) const;
+
+    // Log a set of key made under its shard's lock, so that the log orders
+    // mutations of a key as the store does. A set that failed is logged as
+    // a del, since the old value is gone either way.
+    void log_set(key_view key, val_type val, std::uint64_t expires, bool stored);
+    // Wait for logged mutations to be durable, if the log syncs every batch.
+    // Called without any shard lock held.
+    void commit_log();
+
+    // Take a reference to every item of a shard that has not expired
+    void gather(Shard& shard, std::vector<value_handle::block*>& items);
+
+    // Serve the item image at blk, in a mapped snapshot, from its shard,
+    // expiring at tick expires (0 for never); key is a copy of its key
+    // read from outside the image. Returns false if the shard is full.
+    bool insert_mapped(value_handle::block* blk, std::uint64_t hash, key_view key,
+        size_type size, std::uint64_t expires);
+
+    // Hash the n keys of a batch (key_at(i) is key i) into hashes and
+    // prefetch their index slots, so that the cache misses of the whole
+    // batch overlap. Returns the batch positions ordered by shard.
+    template <class KeyAt>
+    std::vector<unsigned> plan_batch(std::size_t n, KeyAt key_at, std::vector<std::uint64_t>& hashes) {
+      hashes.resize(n);
+      std::vector<unsigned> order(n);
+      Epoch_manager::guard guard(epochs);
+      for (unsigned i = 0; i < n; i++) {
+        hashes[i] = hash_of(key_at(i));
+        shard_for(hashes[i]).index.prefetch(hashes[i]);
+        order[i] = i;
+      }
+      if (shards.size() > 1) {
+        std::stable_sort(order.begin(), order.end(), [this, &hashes](unsigned a, unsigned b) {
+          return shard_index(hashes[a]) < shard_index(hashes[b]);
+        });
+      }
+      return order;
+    }
+  private:
+};
+
+// A stored item is a single reference-counted slab chunk, aligned to a cache
+// line: this header, then the key bytes, then the value bytes. A lookup that
+// matches a hash in the index reads the header and key from the item's first
+// cache line, and a hit hands out the same chunk. The store's index holds one
+// reference and every value_handle holds another, so an item removed from
+// the index is only freed once the last reader lets go of it. Lookups that
+// run without the shard lock may still be reading an item whose last
+// reference is gone, so its chunk goes back to the slabs through the
+// store's epochs rather than at once.
+//
+// An item with a TTL also carries its timing wheel links, after the value.
+// Only those items pay for them, and lookups read the deadline only for
+// them.
+//
+// An item loaded from a snapshot lives in the snapshot's mapping instead of
+// the slabs. It has no shard pointer and is never freed on its own.
+//
+// A compressed item holds the packed form (see packed_value). Readers get an
+// owned copy, decompressed on the heap, with no shard pointer.
+//
+// The shard's evictor knows a linked item by the handle it gave out for it,
+// so the key is stored here alone.
+//
+// Every item stored gets the next version of its shard, for cas(). Versions
+// are 32 bits, as are sizes, which limits values to 4 GiB.
+//
+// incr and append change a linked item in place, under the shard lock. An
+// integer item holds a native std::int64_t, which readers get in decimal in
+// an owned copy. An append writes past the value, then publishes the size
+// and version, which readers load in the opposite order.
+struct Cache::value_handle::block {
+  std::atomic<std::uint32_t> refs;
+  std::uint32_t key_size;
+  Evictor::handle_type evictor_handle;   // changed under the shard lock
+  std::uint8_t flags;
+  bool expiring;   // has a TTL; never changes, so lock-free readers may test it
+  bool mapped;     // lives in a mapped snapshot
+  bool compressed;
+  std::uint32_t size;
+  std::uint32_t version;
+  std::uint64_t hash;
+  Cache::Impl::Shard* shard;
+
+  // Set while the item is in a shard's index
+  static constexpr std::uint8_t linked = 1;
+  // Set, for good, on items whose value is a native std::int64_t
+  static constexpr std::uint8_t integer = 2;
+
+  // A decompressed copy on the heap
+  bool owned() const { return shard == nullptr && !mapped; }
+  // Whether readers get a copy rather than the item itself
+  bool encoded() const { return compressed || (flags & integer); }
+
+  // The value's size for a reader that does not hold the shard lock, and
+  // the writer's side of an append made in place
+  std::uint32_t current_size() const { return __atomic_load_n(&size, __ATOMIC_ACQUIRE); }
+  void publish(std::uint32_t new_size, std::uint32_t new_version) {
+    __atomic_store_n(&size, new_size, __ATOMIC_RELEASE);
+    __atomic_store_n(&version, new_version, __ATOMIC_RELEASE);
+  }
+
+  char* key_data() { return reinterpret_cast<char*>(this + 1); }
+  std::string_view key() { return std::string_view(key_data(), key_size); }
+  byte_type* data() { return key_data() + key_size; }
+
+  // Offset of the wheel links: past the value, aligned for them
+  static size_type ttl_offset(size_type key_size, size_type size) {
+    auto align = alignof(Cache::Impl::wheel_type::links);
+    return (sizeof(block) + key_size + size + align - 1) / align * align;
+  }
+  Cache::Impl::wheel_type::links& ttl() {
+    return *reinterpret_cast<Cache::Impl::wheel_type::links*>(reinterpret_cast<char*>(this) + ttl_offset(key_size, size));
+  }
+  bool expired(std::uint64_t now) { return expiring && ttl().expires <= now; }
+
+  // Size of the value as it was set
+  size_type raw_size() {
+    if (!compressed) {
+      return current_size();
+    }
+    std::uint64_t raw;
+    std::memcpy(&raw, data(), sizeof(raw));
+    return raw;
+  }
+
+  static size_type total_size(size_type key_size, size_type size, bool expiring) {
+    return expiring ? ttl_offset(key_size, size) + sizeof(Cache::Impl::wheel_type::links) : sizeof(block) + key_size + size;
+  }
+  size_type total_size() const { return total_size(key_size, size, expiring); }
+
+  // Allocate an item holding copies of key and data (compressed, an integer
+  // or neither), with one reference, expiring at tick expires (0 for
+  // never). Returns nullptr if the shard is out of memory.
+  static block* create(Cache::Impl::Shard& shard, std::uint64_t hash, key_view key,
+      const byte_type* data, size_type size, bool compressed, bool integer, std::uint64_t expires);
+  // Allocate a copy on the heap, with one reference, holding key and room
+  // for size bytes of value
+  static block* create_owned(std::uint64_t hash, key_view key, size_type size, bool compressed);
+  void acquire() { refs.fetch_add(1, std::memory_order_relaxed); }
+  // Take a reference unless the last one is already gone, for readers
+  // that found the item without holding the shard lock.
+  bool try_acquire();
+  void release();
+  // Hand the memory of an item whose last reference is gone back to its shard.
+  static void free(void* p);
+};
+
+std::string_view Cache::Impl::item_key::operator()(value_handle::block* blk) const {
+  return blk -> key();
+}
+
+Cache::Impl::wheel_type::links& Cache::Impl::item_ttl::operator()(value_handle::block* blk) const {
+  return blk -> ttl();
+}
+
+Cache::value_handle::block* Cache::value_handle::block::create(Cache::Impl::Shard& shard, std::uint64_t hash,
+    key_view key, const byte_type* data, size_type size, bool compressed, bool integer, std::uint64_t expires) {
+  void* mem = shard.allocate(total_size(key.size(), size, expires != 0));
+  if (mem == nullptr) {
+    return nullptr;
+  }
+  block* blk = new (mem) block;
+  blk -> refs.store(1, std::memory_order_relaxed);
+  blk -> key_size = static_cast<std::uint32_t>(key.size());
+  blk -> evictor_handle = Evictor::no_handle;
+  blk -> flags = integer ? block::integer : 0;
+  blk -> expiring = expires != 0;
+  blk -> mapped = false;
+  blk -> compressed = compressed;
+  blk -> size = size;
+  blk -> hash = hash;
+  blk -> version = shard.next_version();
+  blk -> shard = &shard;
+  std::memcpy(blk -> key_data(), key.data(), key.size());
+  std::memcpy(blk -> data(), data, size);
+  if (blk -> expiring) {
+    blk -> ttl() = Cache::Impl::wheel_type::links {expires, nullptr, nullptr};
+  }
+  return blk;
+}
+
+Cache::value_handle::block* Cache::value_handle::block::create_owned(std::uint64_t hash, key_view key,
+    size_type size, bool compressed) {
+  void* mem = ::operator new(sizeof(block) + key.size() + size);
+  block* blk = new (mem) block;
+  blk -> refs.store(1, std::memory_order_relaxed);
+  blk -> key_size = static_cast<std::uint32_t>(key.size());
+  blk -> evictor_handle = Evictor::no_handle;
+  blk -> flags = 0;
+  blk -> expiring = false;
+  blk -> mapped = false;
+  blk -> compressed = compressed;
+  blk -> size = size;
+  blk -> hash = hash;
+  blk -> version = 0;
+  blk -> shard = nullptr;
+  std::memcpy(blk -> key_data(), key.data(), key.size());
+  return blk;
+}
+
+bool Cache::value_handle::block::try_acquire() {
+  auto n = refs.load(std::memory_order_relaxed);
+  while (n != 0) {
+    if (refs.compare_exchange_weak(n, n + 1, std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Cache::value_handle::block::release() {
+  if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1 || mapped) {
+    return;
+  }
+  //nothing but handles ever saw an owned copy
+  if (owned()) {
+    this -> ~block();
+    ::operator delete(this);
+  } else {
+    shard -> epochs.retire(this, free);
+  }
+}
+
+void Cache::value_handle::block::free(void* p) {
+  auto blk = static_cast<block*>(p);
+  auto shard = blk -> shard;
+  auto bytes = blk -> total_size();
+  blk -> ~block();
+  shard -> deallocate(blk, bytes);
+}
+
+// The version is loaded before the size: see the block
+Cache::value_handle::value_handle(block* blk) : blk_(blk) {
+  if (blk_ != nullptr) {
+    version_ = __atomic_load_n(&blk_ -> version, __ATOMIC_ACQUIRE);
+    size_ = blk_ -> current_size();
+  }
+}
+
+Cache::value_handle::value_handle(const value_handle& other)
+    : blk_(other.blk_), size_(other.size_), version_(other.version_) {
+  if (blk_ != nullptr) {
+    blk_ -> acquire();
+  }
+}
+
+Cache::value_handle::value_handle(value_handle&& other) noexcept
+    : blk_(other.blk_), size_(other.size_), version_(other.version_) {
+  other.blk_ = nullptr;
+  other.size_ = 0;
+  other.version_ = 0;
+}
+
+Cache::value_handle& Cache::value_handle::operator=(value_handle other) noexcept {
+  std::swap(blk_, other.blk_);
+  std::swap(size_, other.size_);
+  std::swap(version_, other.version_);
+  return *this;
+}
+
+Cache::value_handle::~value_handle() {
+  if (blk_ != nullptr) {
+    blk_ -> release();
+  }
+}
+
+const Cache::byte_type* Cache::value_handle::data() const {
+  return blk_ == nullptr ? nullptr : blk_ -> data();
+}
+
+Cache::Impl::Shard::Shard(size_type maxmem, Evictor* evictor, float max_load_factor, Epoch_manager& epochs)
+    : mutex(),seq(0),maxmem(maxmem),curmem(0),evictor(evictor),epochs(epochs),
+	slabs(maxmem, Slab_allocator::page_size_for(maxmem), 1.25, item_alignment),
+	index(max_load_factor, &epochs),wheel(0),resets(0),node(0),
+	version(static_cast<std::uint32_t>(wall_clock_ms())),filter(nullptr)
 { }
 
-Cache::Impl::~Impl() { 
+Cache::Impl::Shard::~Shard() {
+  delete filter.load(std::memory_order_relaxed);
 }
 
-Cache::Cache(size_type maxmem,
+void Cache::Impl::Shard::touch_item(value_handle::block* blk, std::uint64_t resets) {
+  {
+    std::unique_lock guard(mutex, std::try_to_lock);
+    if (guard.owns_lock()) {
+      drain_touches();
+      if ((blk -> flags & value_handle::block::linked) && this -> resets.load(std::memory_order_relaxed) == resets) {
+        evictor -> touch_item(blk -> evictor_handle, blk -> key());
+      }
+      return;
+    }
+  }
+  blk -> acquire();
+  bool full;
+  {
+    std::lock_guard guard(touches_mutex);
+    touches.push_back(touch {blk, resets});
+    full = touches.size() >= max_touches;
+  }
+  if (full) {
+    std::lock_guard guard(mutex);
+    drain_touches();
+  }
+}
+
+// An item dropped or replaced since its hit is no longer linked, or was
+// dropped by a reset, and is only released
+void Cache::Impl::Shard::drain_touches() {
+  std::vector<touch> queued;
+  {
+    std::lock_guard guard(touches_mutex);
+    if (touches.empty()) {
+      return;
+    }
+    queued.swap(touches);
+  }
+  auto now_resets = resets.load(std::memory_order_relaxed);
+  for (auto& t : queued) {
+    if ((t.blk -> flags & value_handle::block::linked) && t.resets == now_resets) {
+      evictor -> touch_item(t.blk -> evictor_handle, t.blk -> key());
+    }
+    t.blk -> release();
+  }
+}
+
+void* Cache::Impl::Shard::allocate(size_type size, bool relocating) {
+  if (segments) {
+    return segments -> allocate(size, relocating ? Log_allocator::relocations : Log_allocator::writes);
+  }
+  return slabs.allocate(size);
+}
+
+void Cache::Impl::Shard::deallocate(void* p, size_type size) {
+  if (segments) {
+    segments -> deallocate(p, size);
+  } else {
+    slabs.deallocate(p, size);
+  }
+}
+
+std::uint32_t Cache::Impl::Shard::next_version() {
+  if (++version == 0) {
+    version++;
+  }
+  return version;
+}
+
+Cache::Impl::Shard::write_section::write_section(Shard& shard) : shard_(shard) {
+  shard_.seq.store(shard_.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+Cache::Impl::Shard::write_section::~write_section() {
+  shard_.seq.store(shard_.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Seqlock read of the index. The epoch guard keeps every item and table the
+// lookup can reach allocated, even if a write retires it meanwhile, and seq
+// tells whether what was read is consistent. Lookups that keep losing to
+// writers fall back to the shard lock.
+Cache::value_handle::block* Cache::Impl::Shard::lookup(std::uint64_t hash, key_view key, bool* filtered,
+    bool* rejected) {
+  const int attempts = 64;
+  {
+    Epoch_manager::guard guard(epochs);
+    auto f = filter.load(std::memory_order_acquire);
+    if (filtered != nullptr) {
+      *filtered = f != nullptr;
+      *rejected = f != nullptr && !f -> may_contain(hash);
+      if (*rejected) {
+        return nullptr;
+      }
+    } else if (f != nullptr && !f -> may_contain(hash)) {
+      return nullptr;
+    }
+    for (int i = 0; i < attempts; i++) {
+      auto before = seq.load(std::memory_order_acquire);
+      if (before & 1) {
+        continue;
+      }
+      value_handle::block* blk = nullptr;
+      bool found = index.read(hash, key, blk);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq.load(std::memory_order_relaxed) != before) {
+        continue;
+      }
+      if (!found) {
+        return nullptr;
+      }
+      //the item was in the index when seq was checked, but may have been
+      //deleted and released since
+      if (blk -> try_acquire()) {
+        return blk;
+      }
+    }
+  }
+
+  std::lock_guard guard(mutex);
+  auto pos = index.find(hash, key);
+  if (pos == index.npos) {
+    return nullptr;
+  }
+  auto blk = index.value(pos);
+  blk -> acquire();
+  return blk;
+}
+
+Cache::Impl::Impl(size_type maxmem,
     float max_load_factor,
     Evictor* evictor,
-    hash_func hasher):
-	pImpl_(new Impl(maxmem,
-    max_load_factor,
-	evictor,
-	hasher)) 
-{ }
+    hash_func hasher,
+    unsigned nshards)
+    : hasher(hasher), counters(ncounters), start(std::chrono::steady_clock::now()),
+    expirer_started(false), expirer_stopping(false), cleaner_stopping(false), clean_below(0),
+    releases_pending(0), releaser_stopping(false),
+    compress_min(0), hot_k(0), hot_sketch(8),
+    replicas(new replica_table[Stat_counters::max_threads])
+{
+  {
+    auto& all = stores();
+    std::lock_guard guard(all.mutex);
+    all.list.push_back(this);
+  }
+  nshards = std::max(nshards, 1u);
+  for (unsigned i = 0; i < nshards; i++) {
+    Evictor* shard_evictor = evictor;
+    if (evictor != nullptr && i > 0) {
+      shard_evictors.push_back(evictor -> clone_empty());
+      shard_evictor = shard_evictors.back().get();
+    }
+    shards.emplace_back(new Shard(maxmem / nshards, shard_evictor, max_load_factor, epochs));
+  }
+}
 
-Cache::~Cache() {
-  reset();
-  //delete pImpl_;
+const char* const Cache::Impl::counter_names[ncounters] = {
+  "hits", "misses", "sets", "overwrites", "rejected_sets", "deletes", "evictions", "expirations",
+  "bytes_in", "bytes_out", "bytes_evicted", "bytes_expired", "cas_mismatches",
+  "incrs", "appends", "in_place_updates",
+  "compressions", "incompressible", "bytes_uncompressed", "bytes_compressed", "compress_ns",
+  "decompressions", "decompress_ns",
+  "spills", "spills_dropped", "bytes_spilled", "spill_hits", "spill_misses", "spill_read_ns", "promotions",
+  "filter_rejections", "filter_false_positives",
+  "segments_cleaned", "items_relocated", "bytes_relocated",
+  "replica_hits", "replicas_made", "replicas_dropped"
+};
+
+Cache::Impl::~Impl() {
+  //compaction reads the shards, and the log's last batch still has to go out
+  log.reset();
+  if (expirer.joinable()) {
+    {
+      std::lock_guard guard(expirer_mutex);
+      expirer_stopping = true;
+    }
+    expirer_wakeup.notify_one();
+    expirer.join();
+  }
+  if (cleaner.joinable()) {
+    {
+      std::lock_guard guard(cleaner_mutex);
+      cleaner_stopping = true;
+    }
+    cleaner_wakeup.notify_one();
+    cleaner.join();
+  }
+  //whatever reset() dropped is released before the thread stops
+  if (releaser.joinable()) {
+    {
+      std::lock_guard guard(release_mutex);
+      releaser_stopping = true;
+    }
+    release_wakeup.notify_one();
+    releaser.join();
+  }
+  //replicas hold items, which go back to the slabs
+  {
+    auto& all = stores();
+    std::lock_guard guard(all.mutex);
+    all.list.erase(std::find(all.list.begin(), all.list.end(), this));
+  }
+  replicas.reset();
+  for (auto& shard : shards) {
+    if (shard -> evictor != nullptr) {
+      std::lock_guard guard(shard -> mutex);
+      shard -> drain_touches();
+    }
+  }
+  //items still retired must go back before the shards' slabs are destroyed
+  epochs.drain();
+  for (auto& m : mappings) {
+    munmap(m.first, m.second);
+  }
 }
 
-// Add a <key, value> pair to the cache.
-// If key already exists, it will overwrite the old value.
-// Both the key and the value are to be deep-copied (not just pointer copied).
-// If maxmem capacity is exceeded, enough values will be removed
-// from the cache to accomodate the new value. If unable, the new value
-// isn't inserted to the cache.
-   // Returns true iff the insertion of the data to the store was successful.
-bool Cache::set(key_type key, val_type val) {
-  //delete old value if it exists
-  del(key);
-
-  //if no eviction and not enough space, or size greater than total space, cache overflow
-  if((pImpl_ -> curmem + val.size_ > pImpl_ -> maxmem && pImpl_ -> evictor == nullptr) || val.size_ > pImpl_ -> maxmem) {
-  } else { 
-  
-	//evict until enough space, then insert key
-    while (pImpl_ -> curmem + val.size_ > pImpl_ -> maxmem) {
-      key_type toEvict = (pImpl_ -> evictor) -> evict();
-      del(toEvict);
-    }
-	
-	// insert the key
-    byte_type *b = new byte_type[val.size_];
-
-    strcpy(b, val.data_);
-    val_type *nval = new val_type {b, val.size_};
-    pImpl_ -> cache_map[key] = nval;
-	
-	//resize the cache if the load factor exceeds max_load_factor
-	if(pImpl_ -> cache_map.load_factor() > pImpl_ -> max_load_factor) {
-		pImpl_ -> cache_map.rehash(2 * pImpl_ -> cache_map.size());
-	}
-	
-    //touch evictor
-    if (pImpl_ -> evictor != nullptr) {
-      (pImpl_ -> evictor) -> touch_key(key);
-    }
-	
-    //add new size
-	pImpl_ -> curmem += val.size_;
-    return true;
+// The user's hash is remixed so that weak hash functions still spread keys
+// over the shards and over the index's groups and tags.
+std::uint64_t Cache::Impl::hash_of(key_view key) const {
+  std::uint64_t h = hasher(key);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+std::uint64_t Cache::Impl::now() const {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+}
+
+std::uint64_t Cache::Impl::expiry_for(ttl_type ttl) {
+  if (ttl <= ttl_type::zero()) {
+    return 0;
   }
-	return false;
-}	
+  start_expirer();
+  return now() + ttl.count();
+}
 
+void Cache::Impl::start_expirer() {
+  if (expirer_started.load(std::memory_order_acquire)) {
+    return;
+  }
+  std::lock_guard guard(expirer_mutex);
+  if (!expirer.joinable()) {
+    expirer = std::thread(&Impl::run_expirer, this);
+    expirer_started.store(true, std::memory_order_release);
+  }
+}
 
-// Retrieve a copy of the value associated with key in the cache,
-// or nullptr with size 0 if not found.
-// Note that the data_ pointer in the return key is a newly-allocated
-// copy of the data. It is the caller's responsibility to free it.
-Cache::val_type Cache::get(key_type key) const {
-	if((pImpl_ -> cache_map).count(key) == 0) {
-		val_type val = val_type {nullptr,0};
-		pImpl_ -> misses += 1;
-		return val;
-	} else {
-    //touch evictor
-    if (pImpl_ -> evictor != nullptr) {
-      (pImpl_ -> evictor) -> touch_key(key);
-    } 
-	
-	
-    pImpl_ -> hits += 1;
-    val_type old_val = *(pImpl_ -> cache_map.at(key));
-    size_type size = old_val.size_;
-    byte_type* data = new byte_type[size];
-
-    //perform deep copy
-    strcpy(data, old_val.data_);
-    val_type val = val_type {data, size};
-    return(val);
+// Advance every shard's wheel to the current time, a bounded batch of
+// expirations per lock acquisition, then sleep until the next round.
+void Cache::Impl::run_expirer() {
+  std::unique_lock lock(expirer_mutex);
+  while (!expirer_stopping) {
+    lock.unlock();
+    for (auto& shard : shards) {
+      auto t = now();
+      std::size_t n;
+      do {
+        std::lock_guard guard(shard -> mutex);
+        n = expire(*shard, t, expire_batch);
+      } while (n == expire_batch);
+    }
+    lock.lock();
+    expirer_wakeup.wait_for(lock, expire_interval, [this]() { return expirer_stopping; });
   }
 }
 
-// Delete an object from the cache, if it's still there.
-// Returns true iff the object was deleted from the store.
-bool Cache::del(key_type key) {
-  //get iterator to val
-  auto iter = (pImpl_ -> cache_map).find(key);
-  if(iter == (pImpl_ -> cache_map).end()) {
-    return false;
-  } else {
-    auto val = iter ->second;
-    pImpl_ -> curmem -= val->size_;
+// A moved item keeps its version, TTL and place with the evictor; the old
+// copy is freed after its last reader
+std::size_t Cache::Impl::clean(Shard& shard, double max_live, std::size_t limit) {
+  using block = value_handle::block;
+  if (!shard.segments) {
+    return 0;
+  }
+  std::size_t cleaned = 0;
+  for (auto segment : shard.segments -> sparse_segments(max_live, shard.segments -> segments())) {
+    if (cleaned == limit) {
+      break;
+    }
+    bool moved = false;
+    for (void* p : shard.segments -> live_in(segment)) {
+      auto old = static_cast<block*>(p);
+      auto pos = shard.index.find(old -> hash, old -> key());
+      if (pos == shard.index.npos || shard.index.value(pos) != old) {
+        continue;
+      }
+      auto bytes = old -> total_size();
+      auto blk = static_cast<block*>(shard.allocate(bytes, true));
+      if (blk == nullptr) {
+        return cleaned;
+      }
+      if (old -> expiring && wheel_type::contains(old)) {
+        shard.wheel.remove(old);
+      }
+      std::memcpy(static_cast<void*>(blk), old, bytes);
+      blk -> refs.store(1, std::memory_order_relaxed);
+      {
+        Shard::write_section write(shard);
+        shard.index.value(pos) = blk;
+      }
+      if (blk -> expiring) {
+        shard.wheel.insert(blk);
+      }
+      if (blk -> evictor_handle != Evictor::no_handle) {
+        shard.evictor -> move_item(blk -> evictor_handle, blk);
+      }
+      old -> evictor_handle = Evictor::no_handle;
+      old -> flags &= ~block::linked;
+      old -> release();
+      moved = true;
+      counters.add(items_relocated);
+      counters.add(bytes_relocated, bytes);
+    }
+    if (moved) {
+      cleaned++;
+      counters.add(segments_cleaned);
+    }
+  }
+  return cleaned;
+}
 
-    //delete data, not just pointer
-    delete[] val->data_;
-    delete val;
-    (pImpl_ -> cache_map).erase(iter);
-    return true;
+void Cache::Impl::start_cleaner() {
+  std::lock_guard guard(cleaner_mutex);
+  if (!cleaner.joinable()) {
+    cleaner = std::thread(&Impl::run_cleaner, this);
   }
 }
 
-// Compute the total amount of memory used up by all cache values (not keys)
-Cache::size_type Cache::space_used() const {
-  return pImpl_->curmem;
+// Clean every shard a batch of segments per lock acquisition, more eagerly
+// when it is short of free segments, then collect, so that the emptied
+// segments are freed, and sleep until the next round.
+void Cache::Impl::run_cleaner() {
+  std::unique_lock lock(cleaner_mutex);
+  while (!cleaner_stopping) {
+    lock.unlock();
+    for (auto& shard : shards) {
+      std::size_t n;
+      do {
+        std::lock_guard guard(shard -> mutex);
+        auto max_live = clean_below.load(std::memory_order_relaxed);
+        if (shard -> segments
+            && shard -> segments -> free_segments() * low_free_segments < shard -> segments -> segments()) {
+          max_live = reclaim_below;
+        }
+        n = clean(*shard, max_live, clean_batch);
+      } while (n == clean_batch);
+      epochs.collect();
+    }
+    lock.lock();
+    cleaner_wakeup.wait_for(lock, clean_interval, [this]() { return cleaner_stopping; });
+  }
 }
 
-// Return the ratio of successful gets to all gets
-double Cache::hit_rate() const {
-	if((pImpl_ -> hits) + (pImpl_ -> misses) == 0) {
-		return 0.0;
-	}
-	double hit_rate = (double)(pImpl_ -> hits) / ((pImpl_ -> hits) + (pImpl_ -> misses));
-	return hit_rate;
+void Cache::Impl::release_later(index_type::detached items) {
+  std::lock_guard guard(release_mutex);
+  to_release.push_back(std::move(items));
+  releases_pending.fetch_add(1, std::memory_order_relaxed);
+  if (!releaser.joinable()) {
+    releaser = std::thread(&Impl::run_releaser, this);
+  }
+  release_wakeup.notify_one();
 }
 
-// Delete all data from the cache and return true iff successful
-bool Cache::reset() {
+// Drop the index's reference to every item of each detached index, then
+// collect, so that the items' chunks go back to their slabs.
+void Cache::Impl::run_releaser() {
+  std::unique_lock lock(release_mutex);
+  for (;;) {
+    release_wakeup.wait(lock, [this]() { return !to_release.empty() || releaser_stopping; });
+    if (to_release.empty()) {
+      break;
+    }
+    auto batch = std::move(to_release);
+    to_release.clear();
+    lock.unlock();
+    for (auto& dropped : batch) {
+      dropped.for_each([](value_handle::block* blk) { blk -> release(); });
+    }
+    auto n = batch.size();
+    //the tables go back through the epochs too
+    batch.clear();
+    epochs.collect();
+    lock.lock();
+    releases_pending.fetch_sub(n, std::memory_order_release);
+    released.notify_all();
+  }
+}
 
-	pImpl_ -> hits = 0;
-	pImpl_ -> misses = 0;
-	
-	std::vector<key_type> keynames; 
-	//get all the key names
-	for (auto i : pImpl_ -> cache_map) {
-		keynames.push_back(i.first);
-	}
+void Cache::Impl::wait_released() {
+  std::unique_lock lock(release_mutex);
+  released.wait(lock, [this]() { return releases_pending.load(std::memory_order_relaxed) == 0; });
+}
 
-	for (auto i : keynames) {
-		del(i);
-	}
+void Cache::Impl::pack(val_type val, packed_value& out) {
+  out.stored = val;
+  out.size = val.size_;
+  out.compressed = false;
+  auto min = compress_min.load(std::memory_order_relaxed);
+  const size_type header = sizeof(std::uint64_t);
+  if (min == 0 || val.size_ < min || val.size_ <= header + 1) {
+    return;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  out.buffer.resize(val.size_);
+  std::uint64_t raw = val.size_;
+  std::memcpy(&out.buffer[0], &raw, header);
+  //only a result smaller than the value is worth storing
+  auto n = Lz_codec::compress(val.data_, val.size_, &out.buffer[header], val.size_ - header - 1);
+  auto t2 = std::chrono::steady_clock::now();
+  counters.add(compress_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count());
+  if (n == 0) {
+    counters.add(incompressible);
+    return;
+  }
+  out.buffer.resize(header + n);
+  out.stored = val_type {out.buffer.data(), out.buffer.size()};
+  out.compressed = true;
+  counters.add(compressions);
+  counters.add(bytes_uncompressed, val.size_);
+  counters.add(bytes_compressed, out.buffer.size());
+}
 
-	pImpl_ -> cache_map.clear();
-    return true;
+Cache::value_handle::block* Cache::Impl::unpack(value_handle::block* blk) {
+  if (blk -> flags & value_handle::block::integer) {
+    std::string text;
+    std::uint32_t version;
+    {
+      std::lock_guard guard(shard_for(blk -> hash).mutex);
+      text = std::to_string(integer_of(blk));
+      version = blk -> version;
+    }
+    auto copy = value_handle::block::create_owned(blk -> hash, blk -> key(), text.size(), false);
+    std::memcpy(copy -> data(), text.data(), text.size());
+    copy -> version = version;
+    blk -> release();
+    return copy;
+  }
+  if (!blk -> compressed) {
+    return blk;
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  const size_type header = sizeof(std::uint64_t);
+  auto raw = blk -> raw_size();
+  value_handle::block* copy = nullptr;
+  //no compressed form expands more than 255 times
+  if (blk -> size >= header && raw / 256 <= blk -> size) {
+    copy = value_handle::block::create_owned(blk -> hash, blk -> key(), raw, false);
+    copy -> version = blk -> version;
+    if (!Lz_codec::decompress(blk -> data() + header, blk -> size - header, copy -> data(), raw)) {
+      copy -> release();
+      copy = nullptr;
+    }
+  }
+  blk -> release();
+  auto t2 = std::chrono::steady_clock::now();
+  counters.add(decompressions);
+  counters.add(decompress_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count());
+  return copy;
+}
+
+std::int64_t Cache::Impl::integer_of(value_handle::block* blk) {
+  std::int64_t value;
+  std::memcpy(&value, blk -> data(), sizeof(value));
+  return value;
+}
+
+std::int64_t Cache::Impl::wall_deadline(std::uint64_t expires) const {
+  return expires == 0 ? 0 : wall_clock_ms() + (std::int64_t(expires) - std::int64_t(now()));
+}
+
+std::uint64_t Cache::Impl::tick_of(std::int64_t deadline) const {
+  auto wall_now = wall_clock_ms();
+  return deadline <= wall_now ? 0 : now() + std::uint64_t(deadline - wall_now);
 }
 
+void Cache::Impl::log_set(key_view key, val_type val, std::uint64_t expires, bool stored) {
+  if (stored) {
+    log -> log_set(key, std::string_view(val.data_, val.size_), wall_deadline(expires));
+  } else {
+    log -> log_del(key);
+  }
+}
+
+void Cache::Impl::commit_log() {
+  if (log) {
+    log -> commit();
+  }
+}
 
+void Cache::Impl::gather(Shard& shard, std::vector<value_handle::block*>& items) {
+  std::lock_guard guard(shard.mutex);
+  auto t = now();
+  shard.index.for_each([&items, t](value_handle::block* blk) {
+    if (!blk -> expired(t)) {
+      blk -> acquire();
+      items.push_back(blk);
+    }
+  });
+}
 
+std::size_t Cache::Impl::expire(Shard& shard, std::uint64_t now, std::size_t limit) {
+  return shard.wheel.advance(now, limit, [this, &shard](value_handle::block* blk) {
+    counters.add(expirations);
+    counters.add(bytes_expired, blk -> size);
+    shard.unlink(blk);
+    blk -> release();
+  });
+}
 
+bool Cache::Impl::remove(Shard& shard, std::uint64_t hash, key_view key, counter reason) {
+  auto blk = shard.take(hash, key);
+  if (blk == nullptr) {
+    //a pair deleted while spilled is deleted all the same
+    if (reason == deletes && spill && spill -> erase(hash, key, wall_clock_ms())) {
+      counters.add(deletes);
+      return true;
+    }
+    return false;
+  }
+  bool live = !(blk -> expiring && blk -> expired(now()));
+  if (!live) {
+    counters.add(expirations);
+    counters.add(bytes_expired, blk -> size);
+  } else {
+    counters.add(reason);
+    if (reason == evictions) {
+      counters.add(bytes_evicted, blk -> size);
+    }
+  }
+  if (live && reason == evictions && spill) {
+    //appended to the tier's block in memory; the disk write comes later
+    auto deadline = wall_deadline(blk -> expiring ? blk -> ttl().expires : 0);
+    std::string_view value(blk -> data(), blk -> size);
+    std::string text;
+    if (blk -> flags & value_handle::block::integer) {
+      text = std::to_string(integer_of(blk));
+      value = text;
+    }
+    if (spill -> put(hash, key, value, blk -> compressed, deadline)) {
+      counters.add(spills);
+      counters.add(bytes_spilled, blk -> size);
+    } else {
+      counters.add(spills_dropped);
+    }
+  }
+  blk -> release();
+  return live;
+}
 
+// The tier is read without the shard lock. The pair is then taken out of
+// the tier under the lock, unless a set, del or reset got to it first (or
+// another reader promoted it), in which case memory has the answer.
+Cache::value_handle::block* Cache::Impl::fetch_spilled(Shard& shard, std::uint64_t hash, key_view key) {
+  auto resets = shard.resets.load(std::memory_order_acquire);
+  Spill_store::record rec;
+  auto t1 = std::chrono::steady_clock::now();
+  bool found = spill -> get(hash, key, rec);
+  auto t2 = std::chrono::steady_clock::now();
+  counters.add(spill_read_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count());
+  auto expires = found && rec.expires != 0 ? tick_of(rec.expires) : 0;
+  if (!found || (rec.expires != 0 && expires == 0)) {
+    counters.add(spill_misses);
+    return nullptr;
+  }
+  counters.add(spill_hits);
 
+  packed_value packed {val_type {rec.value.data(), rec.value.size()}, rec.value.size(), rec.compressed, {}};
+  if (rec.compressed && rec.value.size() >= sizeof(std::uint64_t)) {
+    std::memcpy(&packed.size, rec.value.data(), sizeof(std::uint64_t));
+  }
+  {
+    std::lock_guard guard(shard.mutex);
+    if (shard.resets.load(std::memory_order_relaxed) != resets) {
+      return nullptr;
+    }
+    if (!spill -> take(hash, key, rec.version)) {
+      auto pos = shard.index.find(hash, key);
+      if (pos == shard.index.npos) {
+        return nullptr;
+      }
+      auto blk = shard.index.value(pos);
+      blk -> acquire();
+      return blk;
+    }
+    if (expires != 0) {
+      start_expirer();
+    }
+    if (set(shard, hash, key, packed, expires, true)) {
+      auto blk = shard.index.value(shard.index.find(hash, key));
+      blk -> acquire();
+      return blk;
+    }
+  }
+  //too big for memory now: serve it once
+  auto copy = value_handle::block::create_owned(hash, key, rec.value.size(), rec.compressed);
+  std::memcpy(copy -> data(), rec.value.data(), rec.value.size());
+  return copy;
+}
+
+bool Cache::Impl::evict(Shard& shard) {
+  shard.drain_touches();
+  auto victim = shard.evictor -> evict_item();
+  if (victim.item != nullptr) {
+    auto blk = static_cast<value_handle::block*>(victim.item);
+    blk -> evictor_handle = Evictor::no_handle;
+    remove(shard, blk -> hash, blk -> key(), evictions);
+    return true;
+  }
+  if (victim.key.empty()) {
+    return false;
+  }
+  remove(shard, hash_of(victim.key), victim.key, evictions);
+  return true;
+}
+
+// Pick the shard that owns a hash. The index uses the low bits (group) and
+// the top 7 bits (tag) of the hash, so shards are chosen from the middle.
+unsigned Cache::Impl::shard_index(std::uint64_t hash) const {
+  return (hash >> 32) % shards.size();
+}
+
+Cache::Impl::Shard& Cache::Impl::shard_for(std::uint64_t hash) {
+  return *shards[shard_index(hash)];
+}
+
+Cache::Cache(size_type maxmem,
+    float max_load_factor,
+    Evictor* evictor,
+    hash_func hasher,
+    unsigned nshards):
+	pImpl_(new Impl(maxmem,
+    max_load_factor,
+	evictor,
+	hasher,
+	nshards))
+{ }
+
+Cache::~Cache() {
+  //the log keeps the contents for the next store
+  pImpl_ -> log.reset();
+  reset();
+  //delete pImpl_;
+}
+
+// Add a <key, value> pair to the cache.
+// If key already exists, it will overwrite the old value.
+// Both the key and the value are to be deep-copied (not just pointer copied).
+// If maxmem capacity is exceeded, enough values will be removed
+// from the cache to accomodate the new value. If unable, the new value
+// isn't inserted to the cache.
+   // Returns true iff the insertion of the data to the store was successful.
+bool Cache::set(key_view key, val_type val, ttl_type ttl) {
+  auto hash = pImpl_ -> hash_of(key);
+  auto expires = pImpl_ -> expiry_for(ttl);
+  auto& shard = pImpl_ -> shard_for(hash);
+  Impl::packed_value packed;
+  pImpl_ -> pack(val, packed);
+  bool stored;
+  {
+    std::lock_guard guard(shard.mutex);
+    stored = pImpl_ -> set(shard, hash, key, packed, expires);
+    if (pImpl_ -> log) {
+      pImpl_ -> log_set(key, val, expires, stored);
+    }
+  }
+  pImpl_ -> commit_log();
+  return stored;
+}
+
+bool Cache::Impl::set(Shard& shard, std::uint64_t hash, key_view key, const packed_value& val, std::uint64_t expires,
+    bool promoted) {
+  //delete old value if it exists, in either tier
+  remove(shard, hash, key, overwrites);
+  if (spill && !promoted) {
+    spill -> erase(hash, key, 0);
+  }
+
+  //reclaim expired items before evicting live ones
+  if (shard.curmem + val.stored.size_ > shard.maxmem && shard.wheel.size() > 0) {
+    auto t = now();
+    while (shard.curmem + val.stored.size_ > shard.maxmem && expire(shard, t, expire_batch) == expire_batch) { }
+  }
+
+  //if no eviction and not enough space, or size greater than total space
+  //(or than an item can hold), cache overflow
+  if((shard.curmem + val.stored.size_ > shard.maxmem && shard.evictor == nullptr) || val.stored.size_ > shard.maxmem
+      || val.stored.size_ > std::numeric_limits<std::uint32_t>::max()) {
+    counters.add(rejected_sets);
+    return false;
+  }
+
+  //evict until enough space, then insert key
+  while (shard.curmem + val.stored.size_ > shard.maxmem) {
+    //evictor has nothing left to offer
+    if (!evict(shard)) {
+      counters.add(rejected_sets);
+      return false;
+    }
+  }
+
+  //allocate from the slabs, evicting until the item's size class has room;
+  //deleted items only give their chunks back once collected
+  auto blk = value_handle::block::create(shard, hash, key, val.stored.data_, val.stored.size_, val.compressed, val.integer,
+      expires);
+  if (blk == nullptr) {
+    //the chunks of items a reset dropped may still be on their way back
+    if (releases_pending.load(std::memory_order_acquire) > 0) {
+      wait_released();
+    }
+    epochs.collect();
+    blk = value_handle::block::create(shard, hash, key, val.stored.data_, val.stored.size_, val.compressed, val.integer,
+      expires);
+  }
+  //with nothing to evict, give the readers holding back the epoch a moment
+  for (unsigned i = 0; i < collect_tries && blk == nullptr && shard.evictor == nullptr
+      && epochs.pending() > 0; i++) {
+    std::this_thread::yield();
+    epochs.collect();
+    blk = value_handle::block::create(shard, hash, key, val.stored.data_, val.stored.size_, val.compressed, val.integer,
+      expires);
+  }
+  while (blk == nullptr) {
+    //a log's segments only come free once emptied, which evicting items
+    //here and there seldom does: clean a sparse one first, and give the
+    //readers that may still see its old copies a moment to move on
+    if (clean(shard, reclaim_below, 1) > 0) {
+      for (unsigned i = 0; i < reclaim_tries && blk == nullptr; i++) {
+        if (i > 0) {
+          std::this_thread::yield();
+        }
+        epochs.collect();
+        blk = value_handle::block::create(shard, hash, key, val.stored.data_, val.stored.size_, val.compressed,
+            val.integer, expires);
+      }
+      continue;
+    }
+    if (shard.evictor == nullptr || !evict(shard)) {
+      counters.add(rejected_sets);
+      return false;
+    }
+    epochs.collect();
+    blk = value_handle::block::create(shard, hash, key, val.stored.data_, val.stored.size_, val.compressed, val.integer,
+      expires);
+  }
+
+  // insert the item; the index grows itself past max_load_factor
+  blk -> flags |= value_handle::block::linked;
+  shard.link(hash, blk);
+  if (blk -> expiring) {
+    shard.wheel.insert(blk);
+  }
+
+  //tell evictor
+  if (shard.evictor != nullptr) {
+    blk -> evictor_handle = shard.evictor -> insert_item(blk, key);
+  }
+
+  //add new size
+  shard.curmem += val.stored.size_;
+  if (promoted) {
+    counters.add(promotions);
+  } else {
+    counters.add(sets);
+    counters.add(bytes_in, val.size);
+  }
+  return true;
+}
+
+
+// Retrieve a copy of the value associated with key in the cache,
+// or nullptr with size 0 if not found.
+// Note that the data_ pointer in the return key is a newly-allocated
+// copy of the data. It is the caller's responsibility to free it.
+Cache::val_type Cache::get(key_view key) const {
+  auto ref = get_ref(key);
+  if (!ref) {
+    return val_type {nullptr, 0};
+  }
+
+  //perform deep copy of exactly size bytes; values are binary
+  byte_type* data = new byte_type[ref.size()];
+  std::memcpy(data, ref.data(), ref.size());
+  return val_type {data, ref.size()};
+}
+
+// Retrieve a handle to the value associated with key in the cache, or an
+// empty handle if not found. The handle shares the stored bytes.
+// Lookups do not take the shard lock; the evictor (which needs it) is told
+// about a hit at once when the lock is free, and by the next holder of the
+// lock otherwise.
+Cache::value_handle Cache::get_ref(key_view key) const {
+  auto hash = pImpl_ -> hash_of(key);
+  auto& shard = pImpl_ -> shard_for(hash);
+
+  //a hot key is read from this thread's copy, but for the sampled gets
+  auto table = pImpl_ -> hot_table();
+  bool sampled = false;
+  if (table != nullptr) {
+    if (--table -> countdown == 0) {
+      table -> countdown = Impl::hot_sample;
+      sampled = true;
+    } else if (auto copy = pImpl_ -> read_replica(*table, shard, hash, key)) {
+      pImpl_ -> counters.add(Impl::hits);
+      pImpl_ -> counters.add(Impl::replica_hits);
+      pImpl_ -> counters.add(Impl::bytes_out, copy.size());
+      return copy;
+    }
+  }
+
+  auto resets = shard.resets.load(std::memory_order_acquire);
+  auto blk = pImpl_ -> find(shard, hash, key);
+  //an item past its TTL is a miss even before the expirer gets to it
+  if (blk != nullptr && blk -> expiring && blk -> expired(pImpl_ -> now())) {
+    blk -> release();
+    blk = nullptr;
+  }
+  if (blk == nullptr && pImpl_ -> spill) {
+    blk = pImpl_ -> fetch_spilled(shard, hash, key);
+  }
+  if (blk == nullptr) {
+    pImpl_ -> counters.add(Impl::misses);
+    return value_handle();
+  }
+  pImpl_ -> counters.add(Impl::hits);
+  pImpl_ -> counters.add(Impl::bytes_out, blk -> raw_size());
+
+  if (shard.evictor != nullptr) {
+    shard.touch_item(blk, resets);
+  }
+  if (!sampled) {
+    return value_handle(pImpl_ -> unpack(blk));
+  }
+  //unpack may drop blk, which a replica has to check later
+  value_handle::block* item = nullptr;
+  if (__atomic_load_n(&blk -> flags, __ATOMIC_ACQUIRE) & value_handle::block::linked) {
+    blk -> acquire();
+    item = blk;
+  }
+  value_handle value(pImpl_ -> unpack(blk));
+  pImpl_ -> sample_hot(*table, hash, key, item, value, resets);
+  return value;
+}
+
+Cache::Impl::replica_table* Cache::Impl::hot_table() {
+  auto i = thread_index();
+  if (i >= Stat_counters::max_threads) {
+    return nullptr;
+  }
+  auto& table = replicas[i];
+  if (hot_k.load(std::memory_order_relaxed) == 0) {
+    table.entries.clear();
+    return nullptr;
+  }
+  //destroyed before the thread gives its index back
+  thread_local replica_owner owner {i};
+  return &table;
+}
+
+Cache::Impl::store_list& Cache::Impl::stores() {
+  static store_list instance;
+  return instance;
+}
+
+Cache::Impl::replica_owner::~replica_owner() {
+  auto& all = stores();
+  std::lock_guard guard(all.mutex);
+  for (auto store : all.list) {
+    auto& entries = store -> replicas[index].entries;
+    store -> counters.add(replicas_dropped, entries.size());
+    entries.clear();
+  }
+}
+
+// A copy stays good while its item is linked, unchanged and unexpired, and
+// the shard has not been reset
+Cache::value_handle Cache::Impl::read_replica(replica_table& table, Shard& shard, std::uint64_t hash,
+    key_view key) {
+  auto& entries = table.entries;
+  for (std::size_t i = 0; i < entries.size(); i++) {
+    auto& r = entries[i];
+    auto item = r.item.blk_;
+    if (r.hash != hash || item -> key() != key) {
+      continue;
+    }
+    if ((__atomic_load_n(&item -> flags, __ATOMIC_ACQUIRE) & value_handle::block::linked)
+        && __atomic_load_n(&item -> version, __ATOMIC_ACQUIRE) == r.version
+        && shard.resets.load(std::memory_order_acquire) == r.resets
+        && !(item -> expiring && item -> expired(now()))) {
+      return r.copy;
+    }
+    entries.erase(entries.begin() + i);
+    counters.add(replicas_dropped);
+    break;
+  }
+  return value_handle();
+}
+
+// The sketch only counts the samples that find its lock free
+void Cache::Impl::sample_hot(replica_table& table, std::uint64_t hash, key_view key,
+    value_handle::block* item, const value_handle& value, std::uint64_t resets) {
+  value_handle held(item);
+  auto k = hot_k.load(std::memory_order_relaxed);
+  bool counted = false;
+  bool hot = false;
+  {
+    std::unique_lock guard(hot_mutex, std::try_to_lock);
+    if (guard.owns_lock()) {
+      counted = true;
+      auto& e = hot_sketch.add(key);
+      auto total = hot_sketch.total();
+      hot = k != 0 && total >= hot_min_samples && (e.count - e.error) * 4 * k >= total
+          && hot_sketch.in_top(key, k);
+      if (total >= hot_decay) {
+        hot_sketch.halve();
+      }
+    }
+  }
+
+  //copies of items that went away are dropped here too, so that they do
+  //not hold on to their memory
+  auto& entries = table.entries;
+  const std::size_t none = -1;
+  std::size_t pos = none;
+  for (std::size_t i = 0; i < entries.size(); ) {
+    auto stale = entries[i].item.blk_;
+    if (!(__atomic_load_n(&stale -> flags, __ATOMIC_ACQUIRE) & value_handle::block::linked)) {
+      entries.erase(entries.begin() + i);
+      counters.add(replicas_dropped);
+      continue;
+    }
+    if (entries[i].hash == hash && stale -> key() == key) {
+      pos = i;
+    }
+    i++;
+  }
+  //a copy older than value must go even when the sketch was busy, or
+  //this thread could read an older value after this one
+  bool current = pos != none && item != nullptr && entries[pos].item.blk_ == item
+      && entries[pos].version == value.version();
+  if (current && (hot || !counted)) {
+    return;
+  }
+  if (!hot || item == nullptr || !value) {
+    if (pos != none) {
+      entries.erase(entries.begin() + pos);
+      counters.add(replicas_dropped);
+    }
+    return;
+  }
+
+  auto copy = value_handle::block::create_owned(hash, key, value.size(), false);
+  std::memcpy(copy -> data(), value.data(), value.size());
+  copy -> version = static_cast<std::uint32_t>(value.version());
+  replica r {hash, std::move(held), copy -> version, resets, value_handle(copy)};
+  if (pos != none) {
+    entries[pos] = std::move(r);
+  } else if (entries.size() < k) {
+    entries.push_back(std::move(r));
+  } else {
+    entries[table.next++ % entries.size()] = std::move(r);
+    counters.add(replicas_dropped);
+  }
+  counters.add(replicas_made);
+}
+
+// The filter learns of the item before any lookup can find it in the index
+void Cache::Impl::Shard::link(std::uint64_t hash, value_handle::block* blk) {
+  if (auto f = filter.load(std::memory_order_relaxed)) {
+    f -> add(hash);
+  }
+  write_section write(*this);
+  index.insert(hash, blk);
+}
+
+// Take an object out of the shard, if it's still there, handing the
+// index's reference to the caller.
+Cache::value_handle::block* Cache::Impl::Shard::take(std::uint64_t hash, key_view key) {
+  //find the key's slot in the index
+  auto pos = index.find(hash, key);
+  if(pos == index.npos) {
+    return nullptr;
+  }
+  auto val = index.value(pos);
+  {
+    write_section write(*this);
+    index.erase(pos);
+  }
+  if (auto f = filter.load(std::memory_order_relaxed)) {
+    f -> remove(hash);
+  }
+  curmem -= val->size;
+  if (val->expiring && wheel_type::contains(val)) {
+    wheel.remove(val);
+  }
+  forget(val);
+  return val;
+}
+
+// Take out an item the wheel already let go of.
+void Cache::Impl::Shard::unlink(value_handle::block* blk) {
+  auto pos = index.find(blk -> hash, blk -> key());
+  {
+    write_section write(*this);
+    index.erase(pos);
+  }
+  if (auto f = filter.load(std::memory_order_relaxed)) {
+    f -> remove(blk -> hash);
+  }
+  curmem -= blk -> size;
+  forget(blk);
+}
+
+// Clear an item's linked flag, and tell the evictor it is gone unless
+// the evictor chose it.
+void Cache::Impl::Shard::forget(value_handle::block* blk) {
+  blk -> flags &= ~value_handle::block::linked;
+  if (blk -> evictor_handle != Evictor::no_handle) {
+    evictor -> remove_item(blk -> evictor_handle);
+    blk -> evictor_handle = Evictor::no_handle;
+  }
+}
+
+// Delete an object from the cache, if it's still there.
+// Returns true iff the object was deleted from the store; an object whose
+// TTL ran out is removed, but was not there any more.
+bool Cache::del(key_view key) {
+  auto hash = pImpl_ -> hash_of(key);
+  auto& shard = pImpl_ -> shard_for(hash);
+  bool deleted;
+  {
+    std::lock_guard guard(shard.mutex);
+    deleted = pImpl_ -> remove(shard, hash, key, Impl::deletes);
+    if (deleted && pImpl_ -> log) {
+      pImpl_ -> log -> log_del(key);
+    }
+  }
+  pImpl_ -> commit_log();
+  return deleted;
+}
+
+Cache::value_handle::block* Cache::Impl::find(Shard& shard, std::uint64_t hash, key_view key) {
+  bool filtered;
+  bool rejected;
+  auto blk = shard.lookup(hash, key, &filtered, &rejected);
+  if (rejected) {
+    counters.add(filter_rejections);
+  } else if (filtered && blk == nullptr) {
+    counters.add(filter_false_positives);
+  }
+  return blk;
+}
+
+Cache::value_handle::block* Cache::Impl::live_item(Shard& shard, std::uint64_t hash, key_view key) {
+  auto pos = shard.index.find(hash, key);
+  if (pos == shard.index.npos) {
+    return nullptr;
+  }
+  auto blk = shard.index.value(pos);
+  return blk -> expiring && blk -> expired(now()) ? nullptr : blk;
+}
+
+std::uint64_t Cache::Impl::version_of(Shard& shard, std::uint64_t hash, key_view key) {
+  auto blk = live_item(shard, hash, key);
+  return blk == nullptr ? 0 : blk -> version;
+}
+
+void Cache::Impl::promote(Shard& shard, std::uint64_t hash, key_view key) {
+  if (!spill) {
+    return;
+  }
+  auto blk = shard.lookup(hash, key);
+  if (blk == nullptr) {
+    blk = fetch_spilled(shard, hash, key);
+  }
+  if (blk != nullptr) {
+    blk -> release();
+  }
+}
+
+bool Cache::cas(key_view key, val_type val, std::uint64_t expected_version, ttl_type ttl) {
+  std::uint64_t current_version;
+  return cas(key, val, expected_version, current_version, ttl);
+}
+
+// A spilled pair has no version, so it is moved back to memory first
+bool Cache::cas(key_view key, val_type val, std::uint64_t expected_version, std::uint64_t& current_version,
+    ttl_type ttl) {
+  auto hash = pImpl_ -> hash_of(key);
+  auto& shard = pImpl_ -> shard_for(hash);
+  pImpl_ -> promote(shard, hash, key);
+  auto expires = pImpl_ -> expiry_for(ttl);
+  Impl::packed_value packed;
+  pImpl_ -> pack(val, packed);
+  bool stored = false;
+  {
+    std::lock_guard guard(shard.mutex);
+    current_version = pImpl_ -> version_of(shard, hash, key);
+    if (current_version != expected_version) {
+      pImpl_ -> counters.add(Impl::cas_mismatches);
+    } else {
+      stored = pImpl_ -> set(shard, hash, key, packed, expires);
+      if (pImpl_ -> log) {
+        pImpl_ -> log_set(key, val, expires, stored);
+      }
+    }
+  }
+  pImpl_ -> commit_log();
+  return stored;
+}
+
+// A value set as text is parsed and stored as a number, keeping its expiry
+bool Cache::Impl::incr(Shard& shard, std::uint64_t hash, key_view key, std::int64_t delta, std::int64_t& value,
+    ttl_type ttl) {
+  auto blk = live_item(shard, hash, key);
+  std::int64_t current = 0;
+  std::uint64_t expires = 0;
+  if (blk != nullptr && (blk -> flags & value_handle::block::integer) && !blk -> mapped) {
+    if (__builtin_add_overflow(integer_of(blk), delta, &value)) {
+      return false;
+    }
+    std::memcpy(blk -> data(), &value, sizeof(value));
+    blk -> publish(blk -> size, shard.next_version());
+    counters.add(incrs);
+    counters.add(in_place_updates);
+    if (log) {
+      auto text = std::to_string(value);
+      log_set(key, val_type {text.data(), text.size()}, blk -> expiring ? blk -> ttl().expires : 0, true);
+    }
+    return true;
+  }
+  if (blk != nullptr) {
+    if (blk -> flags & value_handle::block::integer) {
+      current = integer_of(blk);
+    } else {
+      //a compressed value is never an integer worth parsing, but is read all the same
+      blk -> acquire();
+      auto readable = unpack(blk);
+      if (readable == nullptr) {
+        return false;
+      }
+      auto first = readable -> data();
+      auto last = first + readable -> size;
+      auto result = std::from_chars(first, last, current);
+      readable -> release();
+      if (first == last || result.ec != std::errc() || result.ptr != last) {
+        return false;
+      }
+    }
+    expires = blk -> expiring ? blk -> ttl().expires : 0;
+  } else if (ttl > ttl_type::zero()) {
+    expires = now() + ttl.count();
+  }
+  if (__builtin_add_overflow(current, delta, &value)) {
+    return false;
+  }
+  packed_value packed {val_type {reinterpret_cast<const byte_type*>(&value), sizeof(value)}, sizeof(value), false, {},
+      true};
+  bool stored = set(shard, hash, key, packed, expires);
+  if (log) {
+    auto text = std::to_string(value);
+    log_set(key, val_type {text.data(), text.size()}, expires, stored);
+  }
+  if (stored) {
+    counters.add(incrs);
+  }
+  return stored;
+}
+
+// An append grows a plain item in its chunk when there is room; anything
+// else stores the joined value as a new item
+bool Cache::Impl::append(Shard& shard, std::uint64_t hash, key_view key, val_type val, bool prepend) {
+  using block = value_handle::block;
+  auto blk = live_item(shard, hash, key);
+  if (blk == nullptr) {
+    return false;
+  }
+  auto n = val.size_;
+  bool integer = blk -> flags & block::integer;
+  if (!prepend && !integer && !blk -> compressed && !blk -> mapped && !blk -> expiring
+      && shard.curmem + n <= shard.maxmem && blk -> size + n <= std::numeric_limits<std::uint32_t>::max()
+      && !shard.segments && shard.slabs.resize(blk, blk -> total_size(), block::total_size(blk -> key_size, blk -> size + n, false))) {
+    std::memcpy(blk -> data() + blk -> size, val.data_, n);
+    blk -> publish(static_cast<std::uint32_t>(blk -> size + n), shard.next_version());
+    shard.curmem += n;
+    counters.add(appends);
+    counters.add(in_place_updates);
+    counters.add(bytes_in, n);
+    if (log) {
+      log_set(key, val_type {blk -> data(), blk -> size}, 0, true);
+    }
+    return true;
+  }
+
+  std::string joined;
+  if (integer) {
+    joined = std::to_string(integer_of(blk));
+  } else {
+    blk -> acquire();
+    auto readable = unpack(blk);
+    if (readable == nullptr) {
+      return false;
+    }
+    joined.assign(readable -> data(), readable -> size);
+    readable -> release();
+  }
+  joined.insert(prepend ? 0 : joined.size(), val.data_, n);
+  auto expires = blk -> expiring ? blk -> ttl().expires : 0;
+  packed_value packed;
+  pack(val_type {joined.data(), joined.size()}, packed);
+  bool stored = set(shard, hash, key, packed, expires);
+  if (log) {
+    log_set(key, val_type {joined.data(), joined.size()}, expires, stored);
+  }
+  if (stored) {
+    counters.add(appends);
+  }
+  return stored;
+}
+
+bool Cache::incr(key_view key, std::int64_t delta, std::int64_t& value, ttl_type ttl) {
+  auto hash = pImpl_ -> hash_of(key);
+  auto& shard = pImpl_ -> shard_for(hash);
+  pImpl_ -> promote(shard, hash, key);
+  if (ttl > ttl_type::zero()) {
+    pImpl_ -> start_expirer();
+  }
+  bool stored;
+  {
+    std::lock_guard guard(shard.mutex);
+    stored = pImpl_ -> incr(shard, hash, key, delta, value, ttl);
+  }
+  pImpl_ -> commit_log();
+  return stored;
+}
+
+bool Cache::decr(key_view key, std::int64_t delta, std::int64_t& value, ttl_type ttl) {
+  if (delta == std::numeric_limits<std::int64_t>::min()) {
+    return false;
+  }
+  return incr(key, -delta, value, ttl);
+}
+
+bool Cache::append(key_view key, val_type val) {
+  auto hash = pImpl_ -> hash_of(key);
+  auto& shard = pImpl_ -> shard_for(hash);
+  pImpl_ -> promote(shard, hash, key);
+  bool stored;
+  {
+    std::lock_guard guard(shard.mutex);
+    stored = pImpl_ -> append(shard, hash, key, val, false);
+  }
+  pImpl_ -> commit_log();
+  return stored;
+}
+
+bool Cache::prepend(key_view key, val_type val) {
+  auto hash = pImpl_ -> hash_of(key);
+  auto& shard = pImpl_ -> shard_for(hash);
+  pImpl_ -> promote(shard, hash, key);
+  bool stored;
+  {
+    std::lock_guard guard(shard.mutex);
+    stored = pImpl_ -> append(shard, hash, key, val, true);
+  }
+  pImpl_ -> commit_log();
+  return stored;
+}
+
+// Look up every key of the batch inside one epoch guard. Hits are reported
+// to each shard's evictor together, under one try_lock.
+std::vector<Cache::value_handle> Cache::mget(const std::vector<key_view>& keys) const {
+  std::vector<std::uint64_t> hashes;
+  auto order = pImpl_ -> plan_batch(keys.size(), [&keys](unsigned i) { return keys[i]; }, hashes);
+  std::vector<value_handle> out(keys.size());
+  std::uint64_t hits = 0;
+  std::uint64_t bytes = 0;
+  std::uint64_t now = 0;
+
+  {
+    Epoch_manager::guard epoch_guard(pImpl_ -> epochs);
+    for (std::size_t first = 0; first < order.size(); ) {
+      auto& shard = pImpl_ -> shard_for(hashes[order[first]]);
+      auto resets = shard.resets.load(std::memory_order_acquire);
+      std::size_t last = first;
+      for (; last < order.size() && &pImpl_ -> shard_for(hashes[order[last]]) == &shard; last++) {
+        auto i = order[last];
+        auto blk = pImpl_ -> find(shard, hashes[i], keys[i]);
+        if (blk != nullptr && blk -> expiring) {
+          now = now == 0 ? pImpl_ -> now() : now;
+          if (blk -> expired(now)) {
+            blk -> release();
+            blk = nullptr;
+          }
+        }
+        if (blk != nullptr) {
+          hits++;
+          bytes += blk -> raw_size();
+          out[i] = value_handle(blk);
+        }
+      }
+
+      for (auto j = first; shard.evictor != nullptr && j < last; j++) {
+        if (out[order[j]]) {
+          shard.touch_item(out[order[j]].blk_, resets);
+        }
+      }
+      first = last;
+    }
+  }
+
+  //misses in memory may be in the spill tier, which is read one key at a
+  //time, outside the guard
+  for (std::size_t i = 0; i < keys.size() && pImpl_ -> spill; i++) {
+    if (!out[i]) {
+      if (auto blk = pImpl_ -> fetch_spilled(pImpl_ -> shard_for(hashes[i]), hashes[i], keys[i])) {
+        hits++;
+        bytes += blk -> raw_size();
+        out[i] = value_handle(blk);
+      }
+    }
+  }
+
+  for (auto& handle : out) {
+    if (handle && handle.blk_ -> encoded()) {
+      auto blk = handle.blk_;
+      handle.blk_ = nullptr;
+      handle = value_handle(pImpl_ -> unpack(blk));
+    }
+  }
+  pImpl_ -> counters.add(Impl::hits, hits);
+  pImpl_ -> counters.add(Impl::misses, keys.size() - hits);
+  pImpl_ -> counters.add(Impl::bytes_out, bytes);
+  return out;
+}
+
+// Set the pairs of each shard under one acquisition of its lock. Pairs
+// with the same key are applied in batch order, so the last one wins.
+std::vector<bool> Cache::mset(const std::vector<std::pair<key_view, val_type>>& items, ttl_type ttl) {
+  std::vector<std::uint64_t> hashes;
+  auto order = pImpl_ -> plan_batch(items.size(), [&items](unsigned i) { return items[i].first; }, hashes);
+  std::vector<bool> out(items.size());
+  auto expires = pImpl_ -> expiry_for(ttl);
+  std::vector<Impl::packed_value> packed(items.size());
+  for (std::size_t i = 0; i < items.size(); i++) {
+    pImpl_ -> pack(items[i].second, packed[i]);
+  }
+
+  for (std::size_t first = 0; first < order.size(); ) {
+    auto& shard = pImpl_ -> shard_for(hashes[order[first]]);
+    std::lock_guard guard(shard.mutex);
+    for (; first < order.size() && &pImpl_ -> shard_for(hashes[order[first]]) == &shard; first++) {
+      auto i = order[first];
+      out[i] = pImpl_ -> set(shard, hashes[i], items[i].first, packed[i], expires);
+      if (pImpl_ -> log) {
+        pImpl_ -> log_set(items[i].first, items[i].second, expires, out[i]);
+      }
+    }
+  }
+  pImpl_ -> commit_log();
+  return out;
+}
+
+// Delete the keys of each shard under one acquisition of its lock.
+Cache::size_type Cache::mdel(const std::vector<key_view>& keys) {
+  std::vector<std::uint64_t> hashes;
+  auto order = pImpl_ -> plan_batch(keys.size(), [&keys](unsigned i) { return keys[i]; }, hashes);
+  size_type deleted = 0;
+
+  for (std::size_t first = 0; first < order.size(); ) {
+    auto& shard = pImpl_ -> shard_for(hashes[order[first]]);
+    std::lock_guard guard(shard.mutex);
+    for (; first < order.size() && &pImpl_ -> shard_for(hashes[order[first]]) == &shard; first++) {
+      auto i = order[first];
+      if (pImpl_ -> remove(shard, hashes[i], keys[i], Impl::deletes)) {
+        deleted++;
+        if (pImpl_ -> log) {
+          pImpl_ -> log -> log_del(keys[i]);
+        }
+      }
+    }
+  }
+  pImpl_ -> commit_log();
+  return deleted;
+}
+
+bool Cache::compress_values(size_type min_size) {
+  pImpl_ -> compress_min.store(min_size, std::memory_order_relaxed);
+  return true;
+}
+
+// All shards or none: the shard locks keep sets out while they are checked
+// and remapped
+bool Cache::use_huge_pages(bool use) {
+  std::vector<std::unique_lock<std::mutex>> guards;
+  for (auto& shard : pImpl_ -> shards) {
+    guards.emplace_back(shard -> mutex);
+    if (!shard -> slabs.untouched()) {
+      return false;
+    }
+  }
+  for (auto& shard : pImpl_ -> shards) {
+    shard -> slabs.use_huge_pages(use);
+  }
+  return true;
+}
+
+// All shards or none, as for huge pages. The slabs' arenas stay reserved
+// but are never touched.
+bool Cache::use_log_memory(bool use, double clean_below) {
+  std::vector<std::unique_lock<std::mutex>> guards;
+  for (auto& shard : pImpl_ -> shards) {
+    guards.emplace_back(shard -> mutex);
+    if (!shard -> slabs.untouched() || (shard -> segments && shard -> segments -> memory_used() != 0)) {
+      return false;
+    }
+  }
+  for (auto& shard : pImpl_ -> shards) {
+    shard -> segments.reset();
+    if (use) {
+      auto maxmem = shard -> maxmem;
+      shard -> segments.reset(new Log_allocator(maxmem, Log_allocator::segment_size_for(maxmem), log_item_alignment));
+      if (pImpl_ -> numa) {
+        shard -> segments -> bind(pImpl_ -> numa.get(), shard -> node);
+      }
+    }
+  }
+  pImpl_ -> clean_below.store(clean_below, std::memory_order_relaxed);
+  if (use) {
+    pImpl_ -> start_cleaner();
+  }
+  return true;
+}
+
+// A new filter is filled from the index before lookups can see it
+bool Cache::filter_misses(size_type keys) {
+  auto per_shard = keys / pImpl_ -> shards.size() + 1;
+  for (auto& shard : pImpl_ -> shards) {
+    std::lock_guard guard(shard -> mutex);
+    Counting_bloom* filter = nullptr;
+    if (keys != 0) {
+      filter = new Counting_bloom(per_shard);
+      shard -> index.for_each([filter](value_handle::block* blk) { filter -> add(blk -> hash); });
+    }
+    auto old = shard -> filter.exchange(filter, std::memory_order_acq_rel);
+    if (old != nullptr) {
+      pImpl_ -> epochs.retire(old, [](void* p) { delete static_cast<Counting_bloom*>(p); });
+    }
+  }
+  return true;
+}
+
+// Each thread drops its copies at its next get once tracking stops; the
+// sketch starts over, sized for k, whenever k changes.
+bool Cache::track_hot_keys(unsigned k) {
+  std::lock_guard guard(pImpl_ -> hot_mutex);
+  k = std::min(k, Impl::max_hot_keys);
+  pImpl_ -> hot_sketch = Space_saving(8 * std::max(k, 1u));
+  pImpl_ -> hot_k.store(k, std::memory_order_relaxed);
+  return true;
+}
+
+// The sketch counts sampled gets, so its counts are scaled back up
+std::vector<std::pair<std::string, std::uint64_t>> Cache::hot_keys() const {
+  std::vector<std::pair<std::string, std::uint64_t>> keys;
+  std::lock_guard guard(pImpl_ -> hot_mutex);
+  auto k = pImpl_ -> hot_k.load(std::memory_order_relaxed);
+  for (auto& e : pImpl_ -> hot_sketch.top(k)) {
+    keys.emplace_back(e.key, e.count * Impl::hot_sample);
+  }
+  return keys;
+}
+
+// Compute the total amount of memory used up by all cache values (not keys),
+// as stored: compressed values count their compressed size
+Cache::size_type Cache::space_used() const {
+  size_type used = 0;
+  for (auto& shard : pImpl_ -> shards) {
+    std::lock_guard guard(shard -> mutex);
+    used += shard -> curmem;
+  }
+  return used;
+}
+
+// Return the ratio of successful gets to all gets
+double Cache::hit_rate() const {
+  std::uint64_t hits = pImpl_ -> counters.sum(Impl::hits);
+  std::uint64_t misses = pImpl_ -> counters.sum(Impl::misses);
+	if(hits + misses == 0) {
+		return 0.0;
+	}
+	double hit_rate = (double)hits / (hits + misses);
+	return hit_rate;
+}
+
+// Report the event counters and the rates they give, summed over the
+// shards, with the state of each tier and of the slabs or log
+Cache::stats_type Cache::stats() const {
+  stats_type out;
+  std::vector<Slab_allocator::class_stats> classes;
+  double slab_memory = 0;
+  double slab_limit = 0;
+  double huge_page_shards = 0;
+  double filter_bytes = 0;
+  double filter_saturated = 0;
+  double log_segments = 0;
+  double log_free_segments = 0;
+  double log_memory = 0;
+  double log_live = 0;
+  for (auto& shard : pImpl_ -> shards) {
+    if (shard -> segments) {
+      log_segments += shard -> segments -> segments();
+      log_free_segments += shard -> segments -> free_segments();
+      log_memory += shard -> segments -> memory_used();
+      log_live += shard -> segments -> live_bytes();
+    }
+    {
+      //the filter only changes, or is freed, under the lock
+      std::lock_guard guard(shard -> mutex);
+      if (auto filter = shard -> filter.load(std::memory_order_relaxed)) {
+        filter_bytes += filter -> bytes();
+        filter_saturated += filter -> saturated();
+      }
+    }
+    auto shard_classes = shard -> slabs.stats();
+    classes.resize(shard_classes.size(), Slab_allocator::class_stats {0, 0, 0, 0, 0});
+    for (unsigned i = 0; i < shard_classes.size(); i++) {
+      classes[i].chunk_size = shard_classes[i].chunk_size;
+      classes[i].pages += shard_classes[i].pages;
+      classes[i].chunks += shard_classes[i].chunks;
+      classes[i].used += shard_classes[i].used;
+      classes[i].requested += shard_classes[i].requested;
+    }
+    slab_memory += shard -> slabs.memory_used();
+    slab_limit += shard -> slabs.limit();
+    auto backing = shard -> slabs.page_backing();
+    huge_page_shards += backing == Slab_allocator::backing::explicit_huge
+        || backing == Slab_allocator::backing::transparent_huge;
+  }
+
+  for (unsigned i = 0; i < Impl::ncounters; i++) {
+    out[Impl::counter_names[i]] = pImpl_ -> counters.sum(i);
+  }
+  auto compressed = out["bytes_compressed"];
+  out["compression_ratio"] = compressed == 0 ? 0.0 : out["bytes_uncompressed"] / compressed;
+  auto gets = out["hits"] + out["misses"];
+  auto spill_gets = out["spill_hits"] + out["spill_misses"];
+  out["memory_hit_rate"] = gets == 0 ? 0.0 : (out["hits"] - out["spill_hits"]) / gets;
+  out["spill_hit_rate"] = spill_gets == 0 ? 0.0 : out["spill_hits"] / spill_gets;
+  out["spill_read_latency_ns"] = spill_gets == 0 ? 0.0 : out["spill_read_ns"] / spill_gets;
+  auto filtered = out["filter_rejections"] + out["filter_false_positives"];
+  out["filter_false_positive_rate"] = filtered == 0 ? 0.0 : out["filter_false_positives"] / filtered;
+  out["filter_bytes"] = filter_bytes;
+  out["filter_saturated_counters"] = filter_saturated;
+  if (pImpl_ -> spill) {
+    out["spill_pairs"] = pImpl_ -> spill -> size();
+    out["spill_bytes"] = pImpl_ -> spill -> bytes();
+    out["spill_capacity"] = pImpl_ -> spill -> capacity();
+    out["spill_direct_io"] = pImpl_ -> spill -> direct_io();
+  }
+  out["numa_nodes"] = pImpl_ -> numa ? pImpl_ -> numa -> nodes() : 1;
+  out["slab_memory_used"] = slab_memory;
+  out["slab_memory_limit"] = slab_limit;
+  out["slab_huge_page_shards"] = huge_page_shards;
+  if (log_segments != 0) {
+    out["log_segments"] = log_segments;
+    out["log_free_segments"] = log_free_segments;
+    out["log_memory_used"] = log_memory;
+    out["log_live_bytes"] = log_live;
+    out["log_utilization"] = log_memory == 0 ? 0.0 : log_live / log_memory;
+  }
+  for (unsigned i = 0; i < classes.size(); i++) {
+    auto& c = classes[i];
+    if (c.pages == 0) {
+      continue;
+    }
+    auto prefix = "slab_class_" + std::to_string(i) + "_";
+    out[prefix + "chunk_size"] = c.chunk_size;
+    out[prefix + "pages"] = c.pages;
+    out[prefix + "used_chunks"] = c.used;
+    out[prefix + "total_chunks"] = c.chunks;
+    out[prefix + "utilization"] = (double)c.used / c.chunks;
+    out[prefix + "fragmentation"] = c.used == 0 ? 0.0 : 1.0 - (double)c.requested / (c.used * c.chunk_size);
+  }
+  return out;
+}
+
+// Swap every shard's index for an empty one under all the shard locks; the
+// old items are released in the background.
+bool Cache::reset() {
+  std::vector<std::unique_lock<std::mutex>> locks;
+  for (auto& shard : pImpl_ -> shards) {
+    locks.emplace_back(shard -> mutex);
+  }
+  if (pImpl_ -> log) {
+    pImpl_ -> log -> log_reset();
+  }
+  std::vector<Impl::index_type::detached> dropped;
+  dropped.reserve(pImpl_ -> shards.size());
+  for (auto& shard : pImpl_ -> shards) {
+    Impl::Shard::write_section write(*shard);
+    shard -> resets.fetch_add(1, std::memory_order_release);
+    shard -> wheel.abandon();
+    dropped.push_back(shard -> index.detach());
+    if (auto f = shard -> filter.load(std::memory_order_relaxed)) {
+      f -> clear();
+    }
+    if (shard -> evictor != nullptr) {
+      shard -> evictor -> clear_items();
+    }
+    shard -> curmem = 0;
+  }
+  if (pImpl_ -> spill) {
+    pImpl_ -> spill -> clear();
+  }
+  locks.clear();
+  pImpl_ -> counters.clear();
+  for (auto& items : dropped) {
+    pImpl_ -> release_later(std::move(items));
+  }
+  pImpl_ -> commit_log();
+  return true;
+}
+
+// Snapshots. A snapshot file is laid out so that load_snapshot() can map it
+// and serve its items where they lie:
+//   header   magic, format version, sizeof(block), and where the sections are
+//   items    each item's image (block, key, value and any TTL links) as the
+//            store lays items out in memory, at item_alignment
+//   records  for each item, the offset of its image, its hash, value size
+//            and expiry, and a copy of its key
+// A load reads the header and the records, and nothing of the items, whose
+// pages are faulted in by the first lookups that reach them. The mapping
+// is private, so the reference counts kept in the images never reach the
+// file. Images only make sense to the build that wrote them; block_size
+// and the version stand in for that.
+
+namespace {
+
+const char snapshot_magic[8] = {'C', 'A', 'C', 'H', 'E', 'S', 'N', 'P'};
+const std::uint32_t snapshot_version = 4;
+
+struct snapshot_header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t block_size;
+  std::uint64_t count;            // of records
+  std::uint64_t items_offset;
+  std::uint64_t records_offset;
+  std::uint64_t file_size;
+};
+
+// Followed by the key's bytes, padded to a multiple of 8
+struct snapshot_record {
+  std::uint64_t offset;           // of the item's image
+  std::uint64_t hash;
+  std::uint64_t size;
+  std::int64_t expires;           // wall clock ms since the Unix epoch, 0 for never
+  std::uint32_t key_size;
+  std::uint32_t reserved;
+};
+
+// Write n bytes at offset pos of out, advancing pos
+bool write_bytes(std::FILE* out, std::uint64_t& pos, const void* data, std::size_t n) {
+  pos += n;
+  return std::fwrite(data, 1, n, out) == n;
+}
+
+// Write zeros up to the next multiple of align (at most item_alignment)
+bool write_padding(std::FILE* out, std::uint64_t& pos, std::uint64_t align) {
+  static const char zeros[item_alignment] = {};
+  return write_bytes(out, pos, zeros, (align - pos % align) % align);
+}
+
+// Whether blk is the image save_snapshot() writes for rec and key
+bool valid_image(Cache::value_handle::block* blk, const snapshot_record& rec, key_view key) {
+  using block = Cache::value_handle::block;
+  auto flags = blk -> flags & ~block::integer;
+  return blk -> refs.load(std::memory_order_relaxed) == 1 && flags == block::linked
+      && blk -> evictor_handle == Evictor::no_handle && blk -> mapped && blk -> shard == nullptr
+      && blk -> key_size == rec.key_size && blk -> size == rec.size && blk -> hash == rec.hash
+      && blk -> expiring == (rec.expires != 0)
+      && (!(blk -> flags & block::integer) || rec.size == sizeof(std::int64_t))
+      && (!blk -> compressed || rec.size >= sizeof(std::uint64_t))
+      && blk -> key() == key;
+}
+
+}
+
+bool Cache::Impl::insert_mapped(value_handle::block* blk, std::uint64_t hash, key_view key,
+    size_type size, std::uint64_t expires) {
+  auto& shard = shard_for(hash);
+  std::lock_guard guard(shard.mutex);
+  //a pair that does not fit leaves the one stored in place
+  size_type replaced = 0;
+  auto pos = shard.index.find(hash, key);
+  if (pos != shard.index.npos) {
+    replaced = shard.index.value(pos) -> size;
+  }
+  if (shard.curmem - replaced + size > shard.maxmem) {
+    return false;
+  }
+  if (auto old = shard.take(hash, key)) {
+    old -> release();
+  }
+  blk -> version = shard.next_version();
+  if (expires != 0) {
+    blk -> ttl() = wheel_type::links {expires, nullptr, nullptr};
+    shard.wheel.insert(blk);
+  }
+  shard.link(hash, blk);
+  shard.curmem += size;
+  if (shard.evictor != nullptr) {
+    blk -> evictor_handle = shard.evictor -> insert_item(blk, key);
+  }
+  return true;
+}
+
+// Write every item to a snapshot at path. Each shard's items are gathered
+// (and referenced) under its lock, then written out without it, so writers
+// only wait for the gathering. The file is written beside path and renamed
+// over it once complete.
+bool Cache::save_snapshot(const std::string& path) const {
+  auto tmp = path + ".tmp";
+  std::FILE* out = std::fopen(tmp.c_str(), "wb");
+  if (out == nullptr) {
+    return false;
+  }
+  snapshot_header header {};
+  std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  header.version = snapshot_version;
+  header.block_size = sizeof(value_handle::block);
+  std::uint64_t pos = 0;
+  bool ok = write_bytes(out, pos, &header, sizeof(header)) && write_padding(out, pos, item_alignment);
+  header.items_offset = pos;
+
+  std::string records;
+  std::vector<value_handle::block*> items;
+  for (auto& shard : pImpl_ -> shards) {
+    items.clear();
+    pImpl_ -> gather(*shard, items);
+
+    for (auto blk : items) {
+      //appends and incrs may change the item meanwhile, under the lock
+      std::uint32_t size = blk -> current_size();
+      const byte_type* data = blk -> data();
+      std::int64_t number;
+      if (blk -> flags & value_handle::block::integer) {
+        std::lock_guard guard(shard -> mutex);
+        number = Impl::integer_of(blk);
+        data = reinterpret_cast<const byte_type*>(&number);
+      }
+      ok = ok && write_padding(out, pos, item_alignment);
+      snapshot_record rec {pos, blk -> hash, size, 0, blk -> key_size, 0};
+
+      //the image as a load finds it: linked, held by the index alone, and
+      //outside any shard's slabs
+      alignas(value_handle::block) char image[sizeof(value_handle::block)] = {};
+      auto img = new (image) value_handle::block;
+      img -> refs.store(1, std::memory_order_relaxed);
+      img -> key_size = blk -> key_size;
+      img -> evictor_handle = Evictor::no_handle;
+      img -> flags = value_handle::block::linked | (blk -> flags & value_handle::block::integer);
+      img -> expiring = blk -> expiring;
+      img -> mapped = true;
+      img -> compressed = blk -> compressed;
+      img -> size = size;
+      img -> hash = blk -> hash;
+      img -> version = 0;
+      img -> shard = nullptr;
+      ok = ok && write_bytes(out, pos, image, sizeof(image))
+          && write_bytes(out, pos, blk -> key_data(), blk -> key_size)
+          && write_bytes(out, pos, data, size);
+      if (blk -> expiring) {
+        //the deadline goes in the record; the load fills the links in
+        rec.expires = pImpl_ -> wall_deadline(blk -> ttl().expires);
+        Impl::wheel_type::links links {0, nullptr, nullptr};
+        ok = ok && write_padding(out, pos, alignof(Impl::wheel_type::links))
+            && write_bytes(out, pos, &links, sizeof(links));
+      }
+      records.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+      records.append(blk -> key_data(), blk -> key_size);
+      records.append((8 - records.size() % 8) % 8, '\0');
+      header.count++;
+      blk -> release();
+    }
+  }
+
+  ok = ok && write_padding(out, pos, 8);
+  header.records_offset = pos;
+  ok = ok && write_bytes(out, pos, records.data(), records.size());
+  header.file_size = pos;
+  ok = ok && std::fseek(out, 0, SEEK_SET) == 0
+      && std::fwrite(&header, sizeof(header), 1, out) == 1
+      && std::fflush(out) == 0 && fsync(fileno(out)) == 0;
+  ok = std::fclose(out) == 0 && ok;
+  if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Serve the items of a snapshot from a private mapping of the file. Only
+// the records are read; see above. Items whose TTL ran out are skipped,
+// and so are items that do not fit in their shard's memory.
+bool Cache::load_snapshot(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || std::uint64_t(st.st_size) < sizeof(snapshot_header)) {
+    close(fd);
+    return false;
+  }
+  std::uint64_t length = st.st_size;
+  void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  auto base = static_cast<char*>(addr);
+
+  snapshot_header header;
+  std::memcpy(&header, base, sizeof(header));
+  bool ok = std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) == 0
+      && header.version == snapshot_version
+      && header.block_size == sizeof(value_handle::block)
+      && header.file_size == length
+      && header.items_offset <= header.records_offset
+      && header.records_offset <= length;
+  if (ok) {
+    //lookups will hit the items in no particular order
+    madvise(base, header.records_offset, MADV_RANDOM);
+  }
+
+  auto now = pImpl_ -> now();
+  auto wall_now = wall_clock_ms();
+  bool mapped_any = false;
+  std::uint64_t pos = header.records_offset;
+  std::uint64_t items_end = header.items_offset;
+  for (std::uint64_t i = 0; ok && i < header.count; i++) {
+    snapshot_record rec;
+    if (pos > length || length - pos < sizeof(rec)) {
+      ok = false;
+      break;
+    }
+    std::memcpy(&rec, base + pos, sizeof(rec));
+    pos += sizeof(rec);
+    bool expiring = rec.expires != 0;
+    if (length - pos < rec.key_size || rec.size > length
+        || rec.offset < header.items_offset || rec.offset % item_alignment != 0
+        || rec.offset > header.records_offset
+        || header.records_offset - rec.offset < value_handle::block::total_size(rec.key_size, rec.size, expiring)) {
+      ok = false;
+      break;
+    }
+    key_view key(base + pos, rec.key_size);
+    pos += (rec.key_size + 7) / 8 * 8;
+
+    //images are written in order, and must not share their bytes
+    if (rec.offset < items_end) {
+      ok = false;
+      break;
+    }
+    items_end = rec.offset + value_handle::block::total_size(rec.key_size, rec.size, expiring);
+    //the image has to be the item the record describes, or reads of it
+    //would leave the mapping
+    auto blk = reinterpret_cast<value_handle::block*>(base + rec.offset);
+    if (!valid_image(blk, rec, key) || pImpl_ -> hash_of(key) != rec.hash) {
+      ok = false;
+      break;
+    }
+    std::uint64_t expires = 0;
+    if (expiring) {
+      if (rec.expires <= wall_now) {
+        continue;
+      }
+      pImpl_ -> start_expirer();
+      expires = now + std::uint64_t(rec.expires - wall_now);
+    }
+    mapped_any |= pImpl_ -> insert_mapped(blk, rec.hash, key, rec.size, expires);
+  }
+
+  //once an item is served the mapping has to outlive the store's handles
+  if (mapped_any) {
+    std::lock_guard guard(pImpl_ -> mappings_mutex);
+    pImpl_ -> mappings.emplace_back(addr, length);
+  } else {
+    munmap(addr, length);
+  }
+  return ok;
+}
+
+// Replay the log into the store, then log to it. Replayed sets evict as
+// the store's own would.
+bool Cache::open_log(const std::string& path, std::chrono::milliseconds sync_interval) {
+  if (pImpl_ -> log) {
+    return false;
+  }
+  Mutation_log::handlers replay;
+  replay.set = [this](std::string_view key, std::string_view value, std::int64_t deadline) {
+    auto hash = pImpl_ -> hash_of(key);
+    auto& shard = pImpl_ -> shard_for(hash);
+    auto expires = deadline == 0 ? 0 : pImpl_ -> tick_of(deadline);
+    Impl::packed_value packed;
+    pImpl_ -> pack(val_type {value.data(), value.size()}, packed);
+    std::lock_guard guard(shard.mutex);
+    if (deadline != 0 && expires == 0) {
+      //expired since it was logged
+      pImpl_ -> remove(shard, hash, key, Impl::deletes);
+      return;
+    }
+    if (expires != 0) {
+      pImpl_ -> start_expirer();
+    }
+    pImpl_ -> set(shard, hash, key, packed, expires);
+  };
+  replay.del = [this](std::string_view key) {
+    auto hash = pImpl_ -> hash_of(key);
+    auto& shard = pImpl_ -> shard_for(hash);
+    std::lock_guard guard(shard.mutex);
+    pImpl_ -> remove(shard, hash, key, Impl::deletes);
+  };
+  replay.reset = [this]() { reset(); };
+  if (!Mutation_log::replay(path, replay)) {
+    return false;
+  }
+  //what replay did is not news
+  pImpl_ -> counters.clear();
+
+  try {
+    pImpl_ -> log.reset(new Mutation_log(path, sync_interval));
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+  Impl* impl = pImpl_.get();
+  pImpl_ -> log -> compact([impl](const Mutation_log::emit_func& emit) {
+    std::vector<value_handle::block*> items;
+    for (auto& shard : impl -> shards) {
+      items.clear();
+      impl -> gather(*shard, items);
+      for (auto blk : items) {
+        auto deadline = impl -> wall_deadline(blk -> expiring ? blk -> ttl().expires : 0);
+        //the log holds values as they were set
+        if (auto readable = impl -> unpack(blk)) {
+          emit(readable -> key(), std::string_view(readable -> data(), readable -> current_size()), deadline);
+          readable -> release();
+        }
+      }
+    }
+  });
+  return true;
+}
+
+bool Cache::open_spill(const std::string& path, size_type capacity) {
+  if (pImpl_ -> spill) {
+    return false;
+  }
+  try {
+    pImpl_ -> spill.reset(new Spill_store(path, capacity));
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+  return true;
+}
+
+bool Cache::bind_numa(const Numa_topology& topology) {
+  pImpl_ -> numa.reset(new Numa_topology(topology));
+  for (unsigned i = 0; i < pImpl_ -> shards.size(); i++) {
+    auto& shard = *pImpl_ -> shards[i];
+    shard.node = i % topology.nodes();
+    shard.slabs.bind(pImpl_ -> numa.get(), shard.node);
+    if (shard.segments) {
+      shard.segments -> bind(pImpl_ -> numa.get(), shard.node);
+    }
+  }
+  return true;
+}
+
+unsigned Cache::numa_node(key_view key) const {
+  return pImpl_ -> shard_for(pImpl_ -> hash_of(key)).node;
+}
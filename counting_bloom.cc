@@ -0,0 +1,132 @@
+/*
+ * Counting Bloom filter over 64-bit key hashes.
+ */
+
+#include <algorithm>
+#include <new>
+#include <sys/mman.h>
+#include "counting_bloom.hh"
+
+namespace {
+
+const unsigned counter_bits = 4;
+const std::uint64_t counter_max = (1 << counter_bits) - 1;
+const unsigned counters_per_block = 8 * 64 / counter_bits;
+const std::size_t huge_page_size = 2 << 20;
+
+// MurmurHash3's finalizer: callers' hashes are usually fine, but keys of
+// one shard share the bits that chose the shard
+std::uint64_t mix(std::uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+}
+
+Counting_bloom::Counting_bloom(std::size_t keys)
+	: nblocks_((std::max<std::size_t>(keys, 1) * 10 + counters_per_block - 1) / counters_per_block),
+	blocks_(nullptr),
+	mapped_(0),
+	saturated_(0)
+{
+	auto size = nblocks_ * sizeof(block);
+	if (size >= huge_page_size) {
+		//over-map so that the blocks can start on a huge page boundary
+		auto total = (size + huge_page_size - 1) / huge_page_size * huge_page_size + huge_page_size;
+		auto base = static_cast<char*>(mmap(nullptr, total, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+		if (base != MAP_FAILED) {
+			auto start = reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(base) + huge_page_size - 1)
+				/ huge_page_size * huge_page_size);
+			mapped_ = total - huge_page_size;
+			if (start != base) {
+				munmap(base, start - base);
+			}
+			if (base + total != start + mapped_) {
+				munmap(start + mapped_, base + total - (start + mapped_));
+			}
+			madvise(start, mapped_, MADV_HUGEPAGE);
+			blocks_ = reinterpret_cast<block*>(start);
+			for (std::size_t i = 0; i < nblocks_; i++) {
+				new (&blocks_[i]) block;
+			}
+		}
+	}
+	if (blocks_ == nullptr) {
+		blocks_ = new block[nblocks_];
+	}
+	clear();
+}
+
+Counting_bloom::~Counting_bloom() {
+	if (mapped_ != 0) {
+		munmap(blocks_, mapped_);
+	} else {
+		delete[] blocks_;
+	}
+}
+
+std::size_t Counting_bloom::block_of(std::uint64_t hash, unsigned (&counters)[probes]) const {
+	auto h = mix(hash);
+	//the high half picks the block, a second mix of it the counters
+	auto pick = static_cast<std::size_t>(((h >> 32) * nblocks_) >> 32);
+	auto bits = mix(h + 0x9e3779b97f4a7c15ULL);
+	for (unsigned i = 0; i < probes; i++) {
+		counters[i] = (bits >> (7 * i)) & (counters_per_block - 1);
+	}
+	return pick;
+}
+
+void Counting_bloom::add(std::uint64_t hash) {
+	unsigned counters[probes];
+	auto& blk = blocks_[block_of(hash, counters)];
+	for (auto c : counters) {
+		auto& word = blk.words[c / 16];
+		auto shift = (c % 16) * counter_bits;
+		auto w = word.load(std::memory_order_relaxed);
+		auto n = (w >> shift) & counter_max;
+		if (n != counter_max) {
+			word.store(w + (std::uint64_t(1) << shift), std::memory_order_relaxed);
+			saturated_ += n + 1 == counter_max;
+		}
+	}
+}
+
+void Counting_bloom::remove(std::uint64_t hash) {
+	unsigned counters[probes];
+	auto& blk = blocks_[block_of(hash, counters)];
+	for (auto c : counters) {
+		auto& word = blk.words[c / 16];
+		auto shift = (c % 16) * counter_bits;
+		auto w = word.load(std::memory_order_relaxed);
+		auto n = (w >> shift) & counter_max;
+		if (n != 0 && n != counter_max) {
+			word.store(w - (std::uint64_t(1) << shift), std::memory_order_relaxed);
+		}
+	}
+}
+
+bool Counting_bloom::may_contain(std::uint64_t hash) const {
+	unsigned counters[probes];
+	auto& blk = blocks_[block_of(hash, counters)];
+	for (auto c : counters) {
+		auto w = blk.words[c / 16].load(std::memory_order_relaxed);
+		if (((w >> ((c % 16) * counter_bits)) & counter_max) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Counting_bloom::clear() {
+	for (std::size_t i = 0; i < nblocks_; i++) {
+		for (auto& word : blocks_[i].words) {
+			word.store(0, std::memory_order_relaxed);
+		}
+	}
+	saturated_ = 0;
+}
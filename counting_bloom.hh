@@ -0,0 +1,52 @@
+#ifndef COUNTING_BLOOM_HH
+#define COUNTING_BLOOM_HH
+
+/*
+ * Counting Bloom filter over 64-bit key hashes, blocked so that a query
+ * touches one cache line. Writes must be serialized by the caller; queries
+ * need no lock.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class Counting_bloom {
+public:
+	// Room for about keys keys, with ten counters each: a false positive
+	// rate near 1% when that many are in it.
+	explicit Counting_bloom(std::size_t keys);
+	~Counting_bloom();
+
+	Counting_bloom(const Counting_bloom&) = delete;
+	Counting_bloom& operator=(const Counting_bloom&) = delete;
+
+	void add(std::uint64_t hash);
+	// Undo one add() of hash, which must have been made
+	void remove(std::uint64_t hash);
+	// False only if hash has not been added (or has been removed as often)
+	bool may_contain(std::uint64_t hash) const;
+	void clear();
+
+	// Memory taken by the counters
+	std::size_t bytes() const { return nblocks_ * sizeof(block); }
+	// Counters stuck at their maximum
+	std::size_t saturated() const { return saturated_; }
+
+	static constexpr unsigned probes = 7;
+
+private:
+	struct alignas(64) block {
+		std::atomic<std::uint64_t> words[8];   // 16 counters each
+	};
+
+	// The index of hash's block, and its counters, 0 to 127 within it
+	std::size_t block_of(std::uint64_t hash, unsigned (&counters)[probes]) const;
+
+	std::size_t nblocks_;
+	block* blocks_;
+	std::size_t mapped_;   // bytes mapped for the blocks, or 0 if on the heap
+	std::size_t saturated_;
+};
+
+#endif
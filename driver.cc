@@ -11,6 +11,7 @@
 #include <mutex>
 #include <memory>
 #include <cmath>
+#include <cstring>
 
 using measurment_type = double;
 using throughput_type = double;
@@ -24,7 +25,8 @@ std::vector<std::vector<measurment_type>> final_results {};
 //parses and sends a workload request to the cache. returns true if successful
 bool send_request_to_cache(Cache& c, workload::request r) {
   key_type key{r.key};
-  Cache::val_type val {r.value,sizeof(r.value)};
+  //workload values are NUL terminated strings; send the terminator too
+  Cache::val_type val {r.value,std::strlen(r.value) + 1};
   //c.space_used();
    if(r.type == "get") {
     Cache::val_type ret {c.get(key)};
@@ -0,0 +1,114 @@
+/*
+ * Epoch-based reclamation for memory read without locks.
+ */
+
+#include <algorithm>
+#include "epoch.hh"
+#include "thread_index.hh"
+
+Epoch_manager::Epoch_manager()
+	: global_(1), records_(new record[max_threads]), overflow_{}, since_collect_(0)
+{ }
+
+Epoch_manager::~Epoch_manager() {
+	drain();
+}
+
+unsigned Epoch_manager::record_index() {
+	return std::min(thread_index(), max_threads);
+}
+
+Epoch_manager::guard::guard(Epoch_manager& epochs)
+	: epochs_(epochs), thread_(record_index()), overflow_(0)
+{
+	if (thread_ == max_threads) {
+		//counted in the slot of the epoch seen, as a record would store it
+		overflow_ = epochs_.global_.load(std::memory_order_seq_cst) % 3;
+		epochs_.overflow_[overflow_].fetch_add(1, std::memory_order_seq_cst);
+		return;
+	}
+	auto& r = epochs_.records_[thread_];
+	if (r.depth++ == 0) {
+		//the store is sequentially consistent so that a collect() that
+		//misses it also precedes every read made under this guard
+		r.epoch.store(epochs_.global_.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	}
+}
+
+Epoch_manager::guard::~guard() {
+	if (thread_ == max_threads) {
+		epochs_.overflow_[overflow_].fetch_sub(1, std::memory_order_release);
+		return;
+	}
+	auto& r = epochs_.records_[thread_];
+	if (--r.depth == 0) {
+		r.epoch.store(0, std::memory_order_release);
+	}
+}
+
+bool Epoch_manager::try_advance() {
+	auto e = global_.load(std::memory_order_seq_cst);
+	if (overflow_[(e + 1) % 3].load(std::memory_order_seq_cst) != 0
+			|| overflow_[(e + 2) % 3].load(std::memory_order_seq_cst) != 0) {
+		return false;
+	}
+	unsigned n = std::min(thread_index_limit(), max_threads);
+	for (unsigned i = 0; i < n; i++) {
+		auto re = records_[i].epoch.load(std::memory_order_seq_cst);
+		if (re != 0 && re != e) {
+			return false;
+		}
+	}
+	global_.store(e + 1, std::memory_order_seq_cst);
+	return true;
+}
+
+void Epoch_manager::retire(void* p, free_func free) {
+	bool collect_now;
+	{
+		std::lock_guard guard(mutex_);
+		retired_.push_back(retired {p, free, global_.load(std::memory_order_seq_cst)});
+		collect_now = ++since_collect_ >= collect_every;
+	}
+	if (collect_now) {
+		collect();
+	}
+}
+
+void Epoch_manager::collect() {
+	std::vector<retired> ready;
+	{
+		std::lock_guard guard(mutex_);
+		since_collect_ = 0;
+		//two advances free everything retired before this call when no
+		//reader is in the way
+		if (try_advance()) {
+			try_advance();
+		}
+		auto e = global_.load(std::memory_order_seq_cst);
+		auto keep = std::partition(retired_.begin(), retired_.end(),
+			[e](const retired& r) { return r.epoch + 2 > e; });
+		ready.assign(keep, retired_.end());
+		retired_.erase(keep, retired_.end());
+	}
+	//free outside the lock so that retire() calls do not wait on it
+	for (auto& r : ready) {
+		r.free(r.p);
+	}
+}
+
+void Epoch_manager::drain() {
+	std::vector<retired> ready;
+	{
+		std::lock_guard guard(mutex_);
+		ready.swap(retired_);
+	}
+	for (auto& r : ready) {
+		r.free(r.p);
+	}
+}
+
+std::size_t Epoch_manager::pending() const {
+	std::lock_guard guard(mutex_);
+	return retired_.size();
+}
@@ -0,0 +1,98 @@
+#ifndef EPOCH_HH
+#define EPOCH_HH
+
+/*
+ * Epoch-based reclamation for memory read without locks.
+ *
+ * Readers wrap their lock-free accesses in a guard, which records the
+ * global epoch the thread entered in. Memory unlinked by a writer is
+ * retired rather than freed, tagged with the epoch it was retired in, and
+ * only freed once the global epoch has advanced twice past that: the
+ * epoch only advances when every thread inside a guard has entered in the
+ * current one, so by then no guard that could have seen the memory is
+ * left.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class Epoch_manager {
+public:
+	using free_func = void (*)(void*);
+
+	// Threads with a record of their own; any others share the overflow
+	// counts, which cost them a locked instruction per guard
+	static constexpr unsigned max_threads = 256;
+
+	Epoch_manager();
+	// Frees everything still retired; no guards may be held.
+	~Epoch_manager();
+
+	Epoch_manager(const Epoch_manager&) = delete;
+	Epoch_manager& operator=(const Epoch_manager&) = delete;
+
+	// A reader's critical section. Memory retired after the guard was
+	// created is not freed while the guard exists. Guards nest.
+	class guard {
+	public:
+		explicit guard(Epoch_manager& epochs);
+		~guard();
+		guard(const guard&) = delete;
+		guard& operator=(const guard&) = delete;
+
+	private:
+		Epoch_manager& epochs_;
+		unsigned thread_;
+		unsigned overflow_;   // slot counted in, for threads past max_threads
+	};
+
+	// Hand p to free(p) once no guard can still be reading it.
+	void retire(void* p, free_func free);
+
+	// Advance the epoch if possible and free what is no longer reachable.
+	void collect();
+
+	// Free everything retired, regardless of epochs. Only safe when no
+	// thread holds a guard.
+	void drain();
+
+	// Number of retired objects not freed yet
+	std::size_t pending() const;
+
+private:
+	// Per thread state, on its own cache line. epoch is 0 outside guards.
+	struct alignas(64) record {
+		std::atomic<std::uint64_t> epoch {0};
+		unsigned depth = 0;
+	};
+
+	struct retired {
+		void* p;
+		free_func free;
+		std::uint64_t epoch;
+	};
+
+	// Collect after this many retirements
+	static constexpr std::size_t collect_every = 64;
+
+	// The calling thread's record
+	static unsigned record_index();
+
+	// Move the global epoch forward if every thread in a guard has seen
+	// it. The mutex must be held.
+	bool try_advance();
+
+	std::atomic<std::uint64_t> global_;
+	std::unique_ptr<record[]> records_;
+	// Guards of threads past max_threads, counted by the epoch they entered
+	// in, modulo 3: only the current epoch and the one before can be held
+	std::atomic<std::uint64_t> overflow_[3];
+	mutable std::mutex mutex_;
+	std::vector<retired> retired_;
+	std::size_t since_collect_;
+};
+
+#endif
@@ -4,11 +4,17 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 
 // Data type to use as keys for Cache and Evictors:
 using key_type = std::string;
 
+// Non-owning view of a key, which is all that lookups need
+using key_view = std::string_view;
+
 // Abstract base class to define evictions policies.
 // It allows touching a key (on a set or get event), and request for
 // eviction, which also deletes a key. There is no explicit deletion
@@ -21,9 +27,52 @@ class Evictor {
   Evictor& operator=(const Evictor&) = delete;
 
   // Inform evictor that a certain key has been set or get:
-  virtual void touch_key(const key_type&) = 0;
+  virtual void touch_key(key_view) = 0;
 
   // Request evictor for the next key to evict, and remove it from evictor.
   // If evictor doesn't know what to evict, return an empty key ("").
   virtual const key_type evict() = 0;
+
+  // Create a new, empty evictor with the same policy. The cache store uses
+  // this to give each of its shards an independent evictor.
+  virtual std::unique_ptr<Evictor> clone_empty() const = 0;
+
+  // The cache store tells its evictor about items (opaque pointers) rather
+  // than keys, and passes back the handle the evictor gave each one. The
+  // defaults fall back to the key interface above.
+  using item_ref = void*;
+  using handle_type = std::uint32_t;
+  static constexpr handle_type no_handle = ~handle_type(0);
+
+  // An item holding key was stored. Returns its handle.
+  virtual handle_type insert_item(item_ref, key_view key) {
+    touch_key(key);
+    return no_handle;
+  }
+
+  // The item with handle, holding key, was read.
+  virtual void touch_item(handle_type, key_view key) {
+    touch_key(key);
+  }
+
+  // The item with handle left the store other than through evict_item()
+  // (it was deleted, overwritten or expired); its handle may be reused.
+  virtual void remove_item(handle_type) { }
+
+  // The item with handle was moved, keeping its key and its place: it is
+  // now item. Evictors that keep items must hand out the new one.
+  virtual void move_item(handle_type, item_ref) { }
+
+  // Every item left the store at once.
+  virtual void clear_items() { }
+
+  // Remove and return the next item to evict, or else (item == nullptr) a
+  // key; both are empty if there is nothing to evict.
+  struct victim {
+    item_ref item;
+    key_type key;
+  };
+  virtual victim evict_item() {
+    return victim {nullptr, evict()};
+  }
 };
@@ -9,8 +9,8 @@
 
 
 // Inform evictor that a certain key has been set or get:
-void Fifo_evictor::touch_key(const key_type& key) {
-	Q.push(key);
+void Fifo_evictor::touch_key(key_view key) {
+	Q.emplace(key);
 }
 
 // Request evictor for the next key to evict, and remove it from evictor.
@@ -24,6 +24,11 @@ const key_type Fifo_evictor::evict() {
 	return "";
 }
 
+// Create a new, empty evictor with the same policy.
+std::unique_ptr<Evictor> Fifo_evictor::clone_empty() const {
+	return std::unique_ptr<Evictor>(new Fifo_evictor());
+}
+
 // Fifo_evictor::~Evictor() {
 	
-// }
\ No newline at end of file
+// }
@@ -17,11 +17,14 @@ public:
 	// ~Evictor() = default;
 
 	// Inform evictor that a certain key has been set or get:
-	void touch_key(const key_type&);
+	void touch_key(key_view);
 
 	// Request evictor for the next key to evict, and remove it from evictor.
 	// If evictor doesn't know what to evict, return an empty key ("").
 	const key_type evict();
+
+	// Create a new, empty evictor with the same policy.
+	std::unique_ptr<Evictor> clone_empty() const;
 private:
 	std::queue<key_type> Q; 
 };
@@ -0,0 +1,463 @@
+#ifndef FLAT_TABLE_HH
+#define FLAT_TABLE_HH
+
+/*
+ * Open-addressing hash table used as the cache store's index.
+ *
+ * The layout follows Swiss tables: a byte of control metadata per slot
+ * (empty, deleted, or the top 7 bits of the hash of a full slot) is kept
+ * in a separate array, so a lookup compares the 7-bit tag against a whole
+ * group of 16 slots at once with SSE2 and only touches the slots that
+ * match. Full hashes are stored alongside the entries so that growing
+ * the table never calls the hash function again, and so that most
+ * mismatches are rejected without following an entry to its key. Deletes
+ * leave a tombstone only when the slot's group is full, since otherwise
+ * no probe sequence can run past it.
+ *
+ * Growing is incremental, as in Redis: the full table is kept alongside
+ * a new one, lookups search both, and every insert or erase moves a few
+ * entries over, so no single operation pays for moving all of
+ * them.
+ *
+ * One writer at a time (the caller's lock) may run alongside any number of
+ * readers using read(). A slot's entry is written before its control byte
+ * is published, and tables dropped after a migration or clear() are
+ * handed to an Epoch_manager rather than freed, so a reader inside a guard
+ * never touches freed memory. A reader may still see an entry the writer
+ * is in the middle of replacing or moving: read() results are only
+ * meaningful if the caller validates them, e.g. with a sequence counter
+ * bumped around every write.
+ *
+ * Hashes passed to the table must already be well mixed.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include "epoch.hh"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// V: Entry type, trivially copyable, such as a pointer to storage holding the key.
+// KeyOf: Function object returning an entry's key as a std::string_view.
+template <class V, class KeyOf>
+class Flat_table {
+	static_assert(std::is_trivially_copyable<V>::value, "entries are moved with plain copies");
+
+public:
+	// max_load_factor: Maximum ratio of used (full or deleted) slots to
+	// slots before the table grows, clamped to (0, 15/16].
+	// epochs: Where dropped tables are retired when readers may still be
+	// using them; if nullptr, they are freed at once and read() must not
+	// run concurrently with writes.
+	explicit Flat_table(float max_load_factor = 0.75, Epoch_manager* epochs = nullptr)
+		: max_load_factor_(max_load_factor > 0 && max_load_factor <= 0.9375f ? max_load_factor : 0.9375f),
+		epochs_(epochs), cur_(table::create(group_width)), old_(nullptr), migrated_(0)
+	{ }
+
+	// No readers may be left.
+	~Flat_table() {
+		table::destroy(cur());
+		table::destroy(old());
+	}
+
+	Flat_table(const Flat_table&) = delete;
+	Flat_table& operator=(const Flat_table&) = delete;
+
+	static constexpr std::size_t npos = ~std::size_t(0);
+
+	// Return the position of key in the table, or npos. Positions stay
+	// valid until the next insert or erase.
+	std::size_t find(std::uint64_t hash, std::string_view key) const {
+		std::size_t i = cur() -> find(hash, key);
+		if (i == npos && migrating()) {
+			i = old() -> find(hash, key);
+			if (i != npos) {
+				i |= in_old;
+			}
+		}
+		return i;
+	}
+
+	// Look key up from a thread that does not hold the writer's lock,
+	// inside a guard on the table's Epoch_manager. Copies the entry to out
+	// and returns true if found. The answer may be stale or torn if a
+	// write ran at the same time; see above.
+	bool read(std::uint64_t hash, std::string_view key, V& out) const {
+		const table* t = cur_.load(std::memory_order_acquire);
+		if (t -> read(hash, key, out)) {
+			return true;
+		}
+		t = old_.load(std::memory_order_acquire);
+		return t != nullptr && t -> read(hash, key, out);
+	}
+
+	// Start loading the control bytes and slots a lookup of hash probes
+	// first. Readers must call this inside a guard, like read().
+	void prefetch(std::uint64_t hash) const {
+		const table* t = cur_.load(std::memory_order_acquire);
+		std::size_t g = hash & (t -> ngroups - 1);
+		__builtin_prefetch(t -> ctrl() + g * group_width);
+		__builtin_prefetch(t -> slots() + g * group_width);
+	}
+
+	// Insert an entry whose key is not in the table yet.
+	void insert(std::uint64_t hash, V value) {
+		table* t = cur();
+		if (t -> size + t -> tombstones + 1 > max_load_factor_ * t -> capacity()) {
+			//mostly tombstones: rebuild at the same size rather than grow
+			start_migration(t -> tombstones > t -> size / 2 ? t -> capacity() : 2 * t -> capacity());
+		}
+		cur() -> put(hash, value);
+		migrate_step();
+	}
+
+	// The value at a position returned by find()
+	V& value(std::size_t i) {
+		return i & in_old ? old() -> slots()[i & ~in_old].value : cur() -> slots()[i].value;
+	}
+
+	// Remove the entry at a position returned by find().
+	void erase(std::size_t i) {
+		if (i & in_old) {
+			old() -> erase(i & ~in_old);
+		} else {
+			cur() -> erase(i);
+		}
+		migrate_step();
+	}
+
+	// Call f(value) on every entry.
+	template <class F>
+	void for_each(F f) {
+		cur() -> for_each(f);
+		if (migrating()) {
+			old() -> for_each(f);
+		}
+	}
+
+	// Remove every entry, keeping the current capacity. The emptied table
+	// is swapped for a fresh one, so readers never see half-cleared
+	// control bytes.
+	void clear() {
+		table* t = cur();
+		cur_.store(table::create(t -> capacity()), std::memory_order_release);
+		retire(t);
+		retire(old());
+		old_.store(nullptr, std::memory_order_release);
+	}
+
+	// Entries taken out of a table by detach(), with the tables holding
+	// them. Defined below.
+	class detached;
+
+	// Take every entry out at once, leaving the table empty at its least
+	// capacity. Unlike clear(), the cost does not depend on the number of
+	// entries: they are gone through (and their tables dropped) whenever
+	// and wherever the caller likes.
+	detached detach() {
+		detached out(epochs_, cur(), old());
+		cur_.store(table::create(group_width), std::memory_order_release);
+		old_.store(nullptr, std::memory_order_release);
+		return out;
+	}
+
+	std::size_t size() const { return cur() -> size + (migrating() ? old() -> size : 0); }
+	std::size_t capacity() const { return cur() -> capacity(); }
+	float load_factor() const { return static_cast<float>(size()) / capacity(); }
+
+	// True while entries are still being moved out of the previous table
+	bool migrating() const { return old() != nullptr; }
+
+private:
+	struct slot {
+		std::uint64_t hash;
+		V value;
+	};
+
+	static constexpr std::size_t group_width = 16;
+	static constexpr std::uint8_t empty = 0x80;
+	static constexpr std::uint8_t deleted = 0xfe;
+
+	// Work done per insert or erase while migrating: at most this many
+	// entries moved, out of at most this many slots scanned. The old table
+	// holds no more entries than the new one has room for before it must
+	// grow, so moving at least one entry per insert always finishes first;
+	// moving a few finishes early while keeping each step short.
+	static constexpr std::size_t entries_per_step = 4;
+	static constexpr std::size_t slots_per_step = 64;
+
+	// Marks find() positions that lie in the old table
+	static constexpr std::size_t in_old = std::size_t(1) << (sizeof(std::size_t) * 8 - 1);
+
+	static bool is_full(std::uint8_t c) { return (c & 0x80) == 0; }
+
+	// Control byte of a full slot: the top 7 bits of its hash
+	static std::uint8_t tag(std::uint64_t hash) { return static_cast<std::uint8_t>(hash >> 57); }
+
+	// Bitmasks over the 16 control bytes of a group
+	struct group {
+#ifdef __SSE2__
+		__m128i ctrl;
+		explicit group(const std::uint8_t* p) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) {}
+		std::uint32_t match(std::uint8_t h2) const {
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(h2)), ctrl));
+		}
+		std::uint32_t match_empty() const {
+			return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(empty)), ctrl));
+		}
+		std::uint32_t match_free() const {
+			return _mm_movemask_epi8(ctrl);
+		}
+#else
+		const std::uint8_t* ctrl;
+		explicit group(const std::uint8_t* p) : ctrl(p) {}
+		std::uint32_t match(std::uint8_t h2) const {
+			std::uint32_t m = 0;
+			for (std::size_t i = 0; i < group_width; i++) {
+				m |= static_cast<std::uint32_t>(ctrl[i] == h2) << i;
+			}
+			return m;
+		}
+		std::uint32_t match_empty() const { return match(empty); }
+		std::uint32_t match_free() const {
+			std::uint32_t m = 0;
+			for (std::size_t i = 0; i < group_width; i++) {
+				m |= static_cast<std::uint32_t>(!is_full(ctrl[i])) << i;
+			}
+			return m;
+		}
+#endif
+	};
+
+	// A table's header, slots and control bytes, in one allocation. Only
+	// the writer touches size and tombstones.
+	struct alignas(slot) table {
+		std::size_t ngroups;
+		std::size_t size;
+		std::size_t tombstones;
+
+		std::size_t capacity() const { return ngroups * group_width; }
+		slot* slots() { return reinterpret_cast<slot*>(this + 1); }
+		const slot* slots() const { return reinterpret_cast<const slot*>(this + 1); }
+		std::uint8_t* ctrl() { return reinterpret_cast<std::uint8_t*>(slots() + capacity()); }
+		const std::uint8_t* ctrl() const { return reinterpret_cast<const std::uint8_t*>(slots() + capacity()); }
+
+		static table* create(std::size_t capacity) {
+			void* mem = ::operator new(sizeof(table) + capacity * (sizeof(slot) + 1));
+			table* t = new (mem) table {capacity / group_width, 0, 0};
+			std::memset(t -> ctrl(), empty, capacity);
+			return t;
+		}
+
+		static void destroy(void* p) {
+			::operator delete(p);
+		}
+
+		std::size_t find(std::uint64_t hash, std::string_view key) const {
+			auto h2 = tag(hash);
+			std::size_t mask = ngroups - 1;
+			std::size_t g = hash & mask;
+			for (std::size_t i = 1; ; i++) {
+				group grp(ctrl() + g * group_width);
+				for (auto m = grp.match(h2); m != 0; m &= m - 1) {
+					std::size_t j = g * group_width + __builtin_ctz(m);
+					if (slots()[j].hash == hash && KeyOf()(slots()[j].value) == key) {
+						return j;
+					}
+				}
+				if (grp.match_empty() != 0) {
+					return npos;
+				}
+				g = (g + i) & mask;
+			}
+		}
+
+		// find() for readers racing with the writer: slots are read only
+		// after the control bytes that publish them, and with atomic loads.
+		// A probe that never meets an empty slot, which a racing clear can
+		// cause, gives up after visiting every group.
+		bool read(std::uint64_t hash, std::string_view key, V& out) const {
+			auto h2 = tag(hash);
+			std::size_t mask = ngroups - 1;
+			std::size_t g = hash & mask;
+			for (std::size_t i = 1; i <= ngroups; i++) {
+				group grp(ctrl() + g * group_width);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				for (auto m = grp.match(h2); m != 0; m &= m - 1) {
+					std::size_t j = g * group_width + __builtin_ctz(m);
+					if (__atomic_load_n(&slots()[j].hash, __ATOMIC_RELAXED) != hash) {
+						continue;
+					}
+					V v;
+					__atomic_load(&slots()[j].value, &v, __ATOMIC_RELAXED);
+					if (KeyOf()(v) == key) {
+						out = v;
+						return true;
+					}
+				}
+				if (grp.match_empty() != 0) {
+					return false;
+				}
+				g = (g + i) & mask;
+			}
+			return false;
+		}
+
+		// Store an entry in the first empty or deleted slot on its probe
+		// sequence. The table must have a free slot.
+		void put(std::uint64_t hash, V value) {
+			std::size_t mask = ngroups - 1;
+			std::size_t g = hash & mask;
+			for (std::size_t i = 1; ; i++) {
+				auto m = group(ctrl() + g * group_width).match_free();
+				if (m != 0) {
+					std::size_t j = g * group_width + __builtin_ctz(m);
+					if (ctrl()[j] == deleted) {
+						tombstones--;
+					}
+					__atomic_store_n(&slots()[j].hash, hash, __ATOMIC_RELAXED);
+					__atomic_store(&slots()[j].value, &value, __ATOMIC_RELAXED);
+					__atomic_store_n(&ctrl()[j], tag(hash), __ATOMIC_RELEASE);
+					size++;
+					return;
+				}
+				g = (g + i) & mask;
+			}
+		}
+
+		void erase(std::size_t i) {
+			group grp(ctrl() + i / group_width * group_width);
+			if (grp.match_empty() != 0) {
+				__atomic_store_n(&ctrl()[i], empty, __ATOMIC_RELAXED);
+			} else {
+				__atomic_store_n(&ctrl()[i], deleted, __ATOMIC_RELAXED);
+				tombstones++;
+			}
+			size--;
+		}
+
+		template <class F>
+		void for_each(F& f) {
+			for (std::size_t i = 0; i < capacity(); i++) {
+				if (is_full(ctrl()[i])) {
+					f(slots()[i].value);
+				}
+			}
+		}
+	};
+
+	// The writer's view of the tables
+	table* cur() const { return cur_.load(std::memory_order_relaxed); }
+	table* old() const { return old_.load(std::memory_order_relaxed); }
+
+	// Free a table no longer reachable from cur_ or old_, once no reader
+	// can be in it.
+	void retire(table* t) {
+		retire(epochs_, t);
+	}
+
+	static void retire(Epoch_manager* epochs, table* t) {
+		if (t == nullptr) {
+			return;
+		}
+		if (epochs != nullptr) {
+			epochs -> retire(t, table::destroy);
+		} else {
+			table::destroy(t);
+		}
+	}
+
+	// Make a fresh table of the given capacity current, and start moving
+	// the entries of the previous one into it.
+	void start_migration(std::size_t capacity) {
+		//a migration still running when the new table fills up (which the
+		//step size rules out) is finished first
+		while (migrating()) {
+			migrate_step();
+		}
+		//readers look in cur_ first, so publish the new table there only
+		//once the full one is reachable through old_
+		old_.store(cur(), std::memory_order_release);
+		cur_.store(table::create(capacity), std::memory_order_release);
+		migrated_ = 0;
+	}
+
+	// Move the next few entries of the old table into the current one.
+	void migrate_step() {
+		if (!migrating()) {
+			return;
+		}
+		table* from = old();
+		table* to = cur();
+		std::size_t moved = 0;
+		std::size_t end = std::min(migrated_ + slots_per_step, from -> capacity());
+		for (; migrated_ < end && moved < entries_per_step; migrated_++) {
+			//moved slots become tombstones so that lookups in the old
+			//table still probe past them to entries not moved yet
+			if (is_full(from -> ctrl()[migrated_])) {
+				to -> put(from -> slots()[migrated_].hash, from -> slots()[migrated_].value);
+				__atomic_store_n(&from -> ctrl()[migrated_], deleted, __ATOMIC_RELAXED);
+				from -> size--;
+				moved++;
+			}
+		}
+		if (migrated_ == from -> capacity()) {
+			old_.store(nullptr, std::memory_order_release);
+			retire(from);
+		}
+	}
+
+	float max_load_factor_;
+	Epoch_manager* epochs_;
+	std::atomic<table*> cur_;
+	std::atomic<table*> old_;  // the table being moved out of, if migrating
+	std::size_t migrated_;     // slots of old_ already moved
+
+public:
+	class detached {
+	public:
+		detached(detached&& other) noexcept
+			: epochs_(other.epochs_), cur_(other.cur_), old_(other.old_) {
+			other.cur_ = nullptr;
+			other.old_ = nullptr;
+		}
+		detached(const detached&) = delete;
+		detached& operator=(const detached&) = delete;
+
+		// Drops the tables, through the epochs since readers that were in
+		// them when they were detached may still be.
+		~detached() {
+			retire(epochs_, cur_);
+			retire(epochs_, old_);
+		}
+
+		// Call f(value) on every entry.
+		template <class F>
+		void for_each(F f) {
+			if (cur_ != nullptr) {
+				cur_ -> for_each(f);
+			}
+			if (old_ != nullptr) {
+				old_ -> for_each(f);
+			}
+		}
+
+	private:
+		friend class Flat_table;
+		detached(Epoch_manager* epochs, table* cur, table* old)
+			: epochs_(epochs), cur_(cur), old_(old) { }
+
+		Epoch_manager* epochs_;
+		table* cur_;
+		table* old_;
+	};
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Log-structured allocator for cache items.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <sys/mman.h>
+#include "log_allocator.hh"
+#include "numa.hh"
+
+Log_allocator::Log_allocator(size_type limit, size_type segment_size, size_type alignment)
+	: limit_(std::max(limit, 2 * segment_size)), segment_size_(segment_size), alignment_(alignment),
+	max_small_(segment_size / 4), arena_(nullptr), mapped_(true),
+	words_per_segment_(segment_size / alignment / 64), heads_{none, none}, live_bytes_(0), large_bytes_(0)
+{
+	auto n = limit_ / segment_size_;
+	arena_size_ = n * segment_size_;
+	//segments are only backed once written to, and again after a release
+	void* mem = mmap(nullptr, arena_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		mapped_ = false;
+		mem = std::aligned_alloc(segment_size_, arena_size_);
+		if (mem == nullptr) {
+			throw std::bad_alloc();
+		}
+	}
+	arena_ = static_cast<char*>(mem);
+	segments_.assign(n, segment {0, 0, false});
+	starts_.assign(n * words_per_segment_, 0);
+	//taken from the back: lowest addresses first
+	for (auto i = n; i > 0; i--) {
+		free_.push_back(static_cast<unsigned>(i - 1));
+	}
+}
+
+Log_allocator::~Log_allocator() {
+	if (mapped_) {
+		munmap(arena_, arena_size_);
+	} else {
+		std::free(arena_);
+	}
+}
+
+Log_allocator::size_type Log_allocator::segment_size_for(size_type limit) {
+	size_type segment_size = 4096;
+	while (segment_size < (1 << 20) && segment_size * 2 <= limit / 64) {
+		segment_size *= 2;
+	}
+	return segment_size;
+}
+
+Log_allocator::size_type Log_allocator::round_up(size_type size) const {
+	return (size + alignment_ - 1) / alignment_ * alignment_;
+}
+
+unsigned Log_allocator::take_segment(stream s) {
+	size_type reserve = s == writes ? 1 : 0;
+	if (free_.size() <= reserve) {
+		return none;
+	}
+	auto taken = segments_.size() - free_.size();
+	if ((taken + 1) * segment_size_ + large_bytes_ > limit_) {
+		return none;
+	}
+	auto i = free_.back();
+	free_.pop_back();
+	segments_[i].head = true;
+	return i;
+}
+
+// Released memory reads back as zeros, which the start bits do not rely on
+void Log_allocator::release_segment(unsigned i) {
+	if (mapped_) {
+		madvise(arena_ + i * segment_size_, segment_size_, MADV_DONTNEED);
+	}
+	segments_[i] = segment {0, 0, false};
+	std::fill_n(starts_.begin() + i * words_per_segment_, words_per_segment_, 0);
+	free_.push_back(i);
+}
+
+void* Log_allocator::allocate(size_type size, stream s) {
+	std::lock_guard guard(mutex_);
+	size = round_up(size);
+
+	if (size > max_small_) {
+		auto taken = segments_.size() - free_.size();
+		if (taken * segment_size_ + large_bytes_ + size > limit_) {
+			return nullptr;
+		}
+		large_bytes_ += size;
+		return ::operator new(size, std::align_val_t(alignment_));
+	}
+
+	auto& head = heads_[s];
+	if (head == none || segments_[head].used + size > segment_size_) {
+		auto next = take_segment(s);
+		if (next == none) {
+			return nullptr;
+		}
+		//the old head is full: it is freed like any other segment from now on
+		if (head != none) {
+			segments_[head].head = false;
+			if (segments_[head].live == 0) {
+				release_segment(head);
+			}
+		}
+		head = next;
+	}
+
+	auto& sg = segments_[head];
+	auto offset = sg.used;
+	auto unit = offset / alignment_;
+	starts_[head * words_per_segment_ + unit / 64] |= std::uint64_t(1) << (unit % 64);
+	sg.used += size;
+	sg.live += size;
+	live_bytes_ += size;
+	return arena_ + head * segment_size_ + offset;
+}
+
+void Log_allocator::deallocate(void* p, size_type size) {
+	std::lock_guard guard(mutex_);
+	size = round_up(size);
+
+	auto c = static_cast<char*>(p);
+	if (c < arena_ || c >= arena_ + arena_size_) {
+		large_bytes_ -= size;
+		::operator delete(p, std::align_val_t(alignment_));
+		return;
+	}
+
+	auto i = static_cast<unsigned>((c - arena_) / segment_size_);
+	auto unit = static_cast<size_type>(c - arena_) % segment_size_ / alignment_;
+	starts_[i * words_per_segment_ + unit / 64] &= ~(std::uint64_t(1) << (unit % 64));
+	auto& sg = segments_[i];
+	sg.live -= size;
+	live_bytes_ -= size;
+	if (sg.live == 0 && !sg.head) {
+		release_segment(i);
+	}
+}
+
+Log_allocator::size_type Log_allocator::memory_used() const {
+	std::lock_guard guard(mutex_);
+	return (segments_.size() - free_.size()) * segment_size_ + large_bytes_;
+}
+
+Log_allocator::size_type Log_allocator::live_bytes() const {
+	std::lock_guard guard(mutex_);
+	return live_bytes_ + large_bytes_;
+}
+
+Log_allocator::size_type Log_allocator::free_segments() const {
+	std::lock_guard guard(mutex_);
+	return free_.size();
+}
+
+std::vector<unsigned> Log_allocator::sparse_segments(double max_live, std::size_t n) const {
+	std::lock_guard guard(mutex_);
+	std::vector<std::pair<size_type, unsigned>> sparse;
+	auto bound = static_cast<size_type>(max_live * segment_size_);
+	for (unsigned i = 0; i < segments_.size(); i++) {
+		auto& sg = segments_[i];
+		if (!sg.head && sg.used != 0 && sg.live <= bound) {
+			sparse.emplace_back(sg.live, i);
+		}
+	}
+	n = std::min(n, sparse.size());
+	std::partial_sort(sparse.begin(), sparse.begin() + n, sparse.end());
+	std::vector<unsigned> out;
+	for (std::size_t k = 0; k < n; k++) {
+		out.push_back(sparse[k].second);
+	}
+	return out;
+}
+
+std::vector<void*> Log_allocator::live_in(unsigned segment) const {
+	std::lock_guard guard(mutex_);
+	std::vector<void*> out;
+	auto base = arena_ + segment * segment_size_;
+	for (size_type w = 0; w < words_per_segment_; w++) {
+		auto bits = starts_[segment * words_per_segment_ + w];
+		while (bits != 0) {
+			auto b = static_cast<size_type>(__builtin_ctzll(bits));
+			out.push_back(base + (w * 64 + b) * alignment_);
+			bits &= bits - 1;
+		}
+	}
+	return out;
+}
+
+void Log_allocator::bind(const Numa_topology* topology, unsigned node) {
+	std::lock_guard guard(mutex_);
+	topology->bind_memory(arena_, arena_size_, node);
+}
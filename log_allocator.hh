@@ -0,0 +1,102 @@
+#ifndef LOG_ALLOCATOR_HH
+#define LOG_ALLOCATOR_HH
+
+/*
+ * Log-structured allocator for cache items: allocations are appended to
+ * fixed-size segments, and a segment is freed once nothing in it is live.
+ * The caller cleans sparse segments by moving their live allocations.
+ */
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+class Numa_topology;
+
+class Log_allocator {
+public:
+	using size_type = std::uint64_t;
+
+	// Where an allocation is appended
+	enum stream : unsigned { writes, relocations };
+
+	// limit: Maximum bytes of segments (and large allocations) to hold; at
+	// least two segments are held.
+	// segment_size: Size of a segment, a power of two of at least 4 KiB.
+	// alignment: Alignment of every allocation, a power of two; sizes are
+	// rounded up to a multiple of it.
+	Log_allocator(size_type limit,
+		size_type segment_size = 1 << 20,
+		size_type alignment = 16);
+	~Log_allocator();
+
+	Log_allocator(const Log_allocator&) = delete;
+	Log_allocator& operator=(const Log_allocator&) = delete;
+
+	// Allocate size bytes at the head of stream s, or return nullptr if that
+	// needs a new segment and none is free (to the stream).
+	void* allocate(size_type size, stream s = writes);
+
+	// Return memory obtained from allocate(size) with the same size.
+	void deallocate(void* p, size_type size);
+
+	// Bytes of the segments in use (not free) and of large allocations
+	size_type memory_used() const;
+	// Bytes allocated and not yet returned, as rounded up
+	size_type live_bytes() const;
+
+	size_type limit() const { return limit_; }
+	size_type segment_size() const { return segment_size_; }
+	size_type segments() const { return segments_.size(); }
+	size_type free_segments() const;
+
+	// Up to n full segments (not a stream's head) with at most max_live of
+	// their bytes live, emptiest first
+	std::vector<unsigned> sparse_segments(double max_live, std::size_t n) const;
+
+	// The live allocations of a segment, in address order
+	std::vector<void*> live_in(unsigned segment) const;
+
+	// Place the arena on one node of topology, which must outlive the
+	// allocator. Large allocations are left wherever the system allocator
+	// puts them.
+	void bind(const Numa_topology* topology, unsigned node);
+
+	// A segment size suited to a given limit: a power of two between 4 KiB
+	// and 1 MiB, small enough that the limit spans many segments.
+	static size_type segment_size_for(size_type limit);
+
+private:
+	static constexpr unsigned none = ~0u;
+
+	struct segment {
+		size_type used;   // bytes appended
+		size_type live;   // of those, bytes not returned
+		bool head;        // being appended to
+	};
+
+	size_type round_up(size_type size) const;
+
+	// Take a free segment for stream s, or return none. The mutex must be held.
+	unsigned take_segment(stream s);
+	// Give an empty segment back to the free list. The mutex must be held.
+	void release_segment(unsigned i);
+
+	size_type limit_;
+	size_type segment_size_;
+	size_type alignment_;
+	size_type max_small_;             // larger allocations come from the heap
+	char* arena_;
+	size_type arena_size_;
+	bool mapped_;                     // arena_ is mapped, rather than from the heap
+	std::vector<segment> segments_;
+	std::vector<std::uint64_t> starts_;   // per segment, a bit for each allocation start
+	size_type words_per_segment_;
+	std::vector<unsigned> free_;
+	unsigned heads_[2];
+	size_type live_bytes_;
+	size_type large_bytes_;
+	mutable std::mutex mutex_;
+};
+
+#endif
@@ -9,26 +9,108 @@
 
 
 // Inform evictor that a certain key has been set or get:
-void Lru_evictor::touch_key(const key_type& key) {
-	//If key is present, erase key from list first
-	if (hm.find(key) != hm.end()){
-		dll.erase(hm[key]);
+void Lru_evictor::touch_key(key_view key) {
+	//If key is present, move its node to the front
+	auto it = hm.find(key);
+	if (it != hm.end()){
+		dll.splice(dll.begin(), dll, it->second);
+		return;
 	}
 
-	//move reference to front
-	dll.push_front(key);
-	hm[key] = dll.begin();
+	//otherwise copy it into a new node at the front
+	dll.emplace_front(key);
+	hm[dll.front()] = dll.begin();
 }
 
 // Request evictor for the next key to evict, and remove it from evictor.
 // If evictor doesn't know what to evict, return an empty key ("").
 const key_type Lru_evictor::evict() {
 	if(!dll.empty()) {
-		key_type to_evict = dll.back();
+		//drop the map's view before moving the key out from under it
+		hm.erase(dll.back());
+		key_type to_evict = std::move(dll.back());
 		dll.pop_back();
-		hm.erase(to_evict);
 		return to_evict;
 	}
 	return "";
 	
-}
\ No newline at end of file
+}
+
+// Create a new, empty evictor with the same policy.
+std::unique_ptr<Evictor> Lru_evictor::clone_empty() const {
+	return std::unique_ptr<Evictor>(new Lru_evictor());
+}
+
+
+Evictor::handle_type Lru_evictor::insert_item(item_ref item, key_view) {
+	handle_type handle = unused;
+	if (handle != no_handle) {
+		unused = nodes[handle].next;
+	} else {
+		handle = static_cast<handle_type>(nodes.size());
+		nodes.push_back(node {});
+	}
+	nodes[handle].item = item;
+	link_newest(handle);
+	return handle;
+}
+
+void Lru_evictor::touch_item(handle_type handle, key_view) {
+	if (handle != newest) {
+		unlink(handle);
+		link_newest(handle);
+	}
+}
+
+void Lru_evictor::remove_item(handle_type handle) {
+	unlink(handle);
+	nodes[handle].item = nullptr;
+	nodes[handle].next = unused;
+	unused = handle;
+}
+
+void Lru_evictor::move_item(handle_type handle, item_ref item) {
+	nodes[handle].item = item;
+}
+
+//keeps the nodes' memory, as the store keeps its emptied slab pages, so
+//that this takes the same time however many items there were
+void Lru_evictor::clear_items() {
+	nodes.clear();
+	newest = oldest = unused = no_handle;
+}
+
+Evictor::victim Lru_evictor::evict_item() {
+	if (oldest == no_handle) {
+		return victim {nullptr, evict()};
+	}
+	auto handle = oldest;
+	auto item = nodes[handle].item;
+	remove_item(handle);
+	return victim {item, ""};
+}
+
+void Lru_evictor::link_newest(handle_type handle) {
+	nodes[handle].prev = no_handle;
+	nodes[handle].next = newest;
+	if (newest != no_handle) {
+		nodes[newest].prev = handle;
+	} else {
+		oldest = handle;
+	}
+	newest = handle;
+}
+
+void Lru_evictor::unlink(handle_type handle) {
+	auto& n = nodes[handle];
+	if (n.prev != no_handle) {
+		nodes[n.prev].next = n.next;
+	} else {
+		newest = n.next;
+	}
+	if (n.next != no_handle) {
+		nodes[n.next].prev = n.prev;
+	} else {
+		oldest = n.prev;
+	}
+}
@@ -11,6 +11,7 @@
 #include "evictor.hh"
 #include <list>
 #include <unordered_map>
+#include <vector>
 
 class Lru_evictor: public Evictor{
 public:
@@ -18,14 +19,44 @@ public:
 	// ~Evictor() = default;
 
 	// Inform evictor that a certain key has been set or get:
-	void touch_key(const key_type&);
+	void touch_key(key_view);
 
 	// Request evictor for the next key to evict, and remove it from evictor.
 	// If evictor doesn't know what to evict, return an empty key ("").
 	const key_type evict();
+
+	// Create a new, empty evictor with the same policy.
+	std::unique_ptr<Evictor> clone_empty() const;
+
+	// Items are kept apart from keys, in a list of their own, and evicted
+	// before any key.
+	handle_type insert_item(item_ref item, key_view);
+	void touch_item(handle_type handle, key_view);
+	void remove_item(handle_type handle);
+	void move_item(handle_type handle, item_ref item);
+	void clear_items();
+	victim evict_item();
 private:
 	std::list<key_type> dll; 
-	std::unordered_map<key_type, std::list<key_type>::iterator> hm;
+	//keyed by views of the keys owned by dll's nodes, so that touching a
+	//known key looks it up without copying it
+	std::unordered_map<key_view, std::list<key_type>::iterator> hm;
+
+	//the item list, threaded through a vector by index: an item's handle
+	//is the index of its node, so an item costs 16 bytes and no
+	//allocation of its own. Unused nodes are chained through next.
+	struct node {
+		item_ref item;
+		handle_type prev;
+		handle_type next;
+	};
+	std::vector<node> nodes;
+	handle_type newest = no_handle;
+	handle_type oldest = no_handle;
+	handle_type unused = no_handle;
+
+	void link_newest(handle_type handle);
+	void unlink(handle_type handle);
 };
 
 #endif
\ No newline at end of file
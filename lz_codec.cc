@@ -0,0 +1,181 @@
+/*
+ * A small LZ77 codec for values, in the spirit of LZ4.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "lz_codec.hh"
+
+namespace {
+
+const std::size_t min_match = 4;
+// Matches stop this far from the end, so that finding them can always read
+// four bytes ahead
+const std::size_t last_literals = 5;
+const std::size_t max_offset = 65535;
+// The match finder's table grows with the input, up to 2^max_hash_bits
+const unsigned min_hash_bits = 8;
+const unsigned max_hash_bits = 12;
+
+std::uint32_t read32(const char* p) {
+	std::uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+unsigned hash4(std::uint32_t v, unsigned bits) {
+	return (v * 2654435761u) >> (32 - bits);
+}
+
+// Bytes taken by the continuation of a length whose nibble is full
+std::size_t length_bytes(std::size_t len) {
+	return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+char* put_length(char* op, std::size_t len) {
+	for (len -= 15; len >= 255; len -= 255) {
+		*op++ = char(255);
+	}
+	*op++ = char(len);
+	return op;
+}
+
+bool get_length(const unsigned char*& ip, const unsigned char* end, std::size_t& len) {
+	for (;;) {
+		if (ip == end) {
+			return false;
+		}
+		unsigned b = *ip++;
+		len += b;
+		if (b != 255) {
+			return true;
+		}
+	}
+}
+
+// Write a sequence of nlit literals and a match of match bytes at offset,
+// or no match if match is 0. Returns nullptr if it does not fit before end.
+char* put_sequence(char* op, char* end, const char* literals, std::size_t nlit,
+		std::size_t offset, std::size_t match) {
+	std::size_t ml = match == 0 ? 0 : match - min_match;
+	std::size_t need = 1 + length_bytes(nlit) + nlit + (match == 0 ? 0 : 2 + length_bytes(ml));
+	if (std::size_t(end - op) < need) {
+		return nullptr;
+	}
+	*op++ = char(std::min<std::size_t>(nlit, 15) << 4 | std::min<std::size_t>(ml, 15));
+	if (nlit >= 15) {
+		op = put_length(op, nlit);
+	}
+	std::memcpy(op, literals, nlit);
+	op += nlit;
+	if (match != 0) {
+		*op++ = char(offset & 0xff);
+		*op++ = char(offset >> 8);
+		if (ml >= 15) {
+			op = put_length(op, ml);
+		}
+	}
+	return op;
+}
+
+}
+
+// Greedy parsing; runs without a match move ahead in growing steps
+std::size_t Lz_codec::compress(const char* src, std::size_t n, char* dst, std::size_t capacity) {
+	char* op = dst;
+	char* end = dst + capacity;
+	std::size_t anchor = 0;
+	if (n > min_match + last_literals) {
+		unsigned bits = min_hash_bits;
+		while (bits < max_hash_bits && (std::size_t(1) << bits) < n) {
+			bits++;
+		}
+		std::uint32_t table[1 << max_hash_bits];   // position + 1, or 0
+		std::fill(table, table + (1 << bits), 0);
+		std::size_t limit = n - last_literals;
+		std::size_t ip = 0;
+		unsigned misses = 0;
+		while (ip + min_match <= limit) {
+			auto v = read32(src + ip);
+			auto h = hash4(v, bits);
+			std::size_t ref = table[h];
+			table[h] = std::uint32_t(ip + 1);
+			if (ref == 0 || ip - (ref - 1) > max_offset || read32(src + ref - 1) != v) {
+				ip += 1 + (misses++ >> 5);
+				continue;
+			}
+			ref--;
+			misses = 0;
+			//the bytes before may match as well
+			while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+				ip--;
+				ref--;
+			}
+			std::size_t len = min_match;
+			while (ip + len < limit && src[ip + len] == src[ref + len]) {
+				len++;
+			}
+			op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, len);
+			if (op == nullptr) {
+				return 0;
+			}
+			ip += len;
+			anchor = ip;
+			if (ip + min_match <= limit) {
+				table[hash4(read32(src + ip - 2), bits)] = std::uint32_t(ip - 1);
+			}
+		}
+	}
+	op = put_sequence(op, end, src + anchor, n - anchor, 0, 0);
+	return op == nullptr ? 0 : op - dst;
+}
+
+bool Lz_codec::decompress(const char* src, std::size_t n, char* dst, std::size_t size) {
+	auto ip = reinterpret_cast<const unsigned char*>(src);
+	auto end = ip + n;
+	std::size_t op = 0;
+	for (;;) {
+		if (ip == end) {
+			return false;
+		}
+		unsigned token = *ip++;
+		std::size_t nlit = token >> 4;
+		if (nlit == 15 && !get_length(ip, end, nlit)) {
+			return false;
+		}
+		if (std::size_t(end - ip) < nlit || size - op < nlit) {
+			return false;
+		}
+		std::memcpy(dst + op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == end) {
+			return op == size;
+		}
+
+		if (end - ip < 2) {
+			return false;
+		}
+		std::size_t offset = ip[0] | std::size_t(ip[1]) << 8;
+		ip += 2;
+		std::size_t len = token & 15;
+		if (len == 15 && !get_length(ip, end, len)) {
+			return false;
+		}
+		len += min_match;
+		if (offset == 0 || offset > op || size - op < len) {
+			return false;
+		}
+		char* out = dst + op;
+		if (offset >= len) {
+			std::memcpy(out, out - offset, len);
+		} else {
+			//the match overlaps what it copies: a run
+			for (std::size_t i = 0; i < len; i++) {
+				out[i] = out[i - offset];
+			}
+		}
+		op += len;
+	}
+}
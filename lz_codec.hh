@@ -0,0 +1,27 @@
+#ifndef LZ_CODEC_HH
+#define LZ_CODEC_HH
+
+/*
+ * A small LZ4-style codec for values: literal runs and back-references
+ * into the last 64 KiB, with no entropy coding.
+ */
+
+#include <cstddef>
+
+class Lz_codec {
+public:
+	// Most bytes compress() may write for n input bytes
+	static std::size_t bound(std::size_t n) { return n + n / 255 + 16; }
+
+	// Compress the n bytes at src into dst, which has room for capacity
+	// bytes. Returns the compressed size, or 0 if it does not fit: passing
+	// a capacity below n makes compression succeed only if it saves space.
+	static std::size_t compress(const char* src, std::size_t n, char* dst, std::size_t capacity);
+
+	// Decompress the n bytes at src into exactly size bytes at dst.
+	// Returns false, leaving dst in an unspecified state, if src is not the
+	// compressed form of size bytes; it never reads or writes out of bounds.
+	static bool decompress(const char* src, std::size_t n, char* dst, std::size_t size);
+};
+
+#endif
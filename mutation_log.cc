@@ -0,0 +1,372 @@
+/*
+ * Append-only log of the mutations made to a store, for durability.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mutation_log.hh"
+
+namespace {
+
+// A log file starts with the magic and the format version
+const char log_magic[8] = {'C', 'A', 'C', 'H', 'E', 'L', 'O', 'G'};
+const std::uint32_t log_version = 1;
+const std::size_t file_header_size = 16;
+
+// A record is a fixed header followed by the key and the value:
+//   checksum     u64, of everything after it
+//   type         u32
+//   key size     u32
+//   value size   u64
+//   expires      i64
+const std::size_t record_header_size = 32;
+
+// Dumped records are written in chunks of about this size
+const std::size_t compaction_chunk = 1 << 20;
+
+// 64-bit FNV-1a
+std::uint64_t checksum(const char* data, std::size_t size) {
+	std::uint64_t h = 14695981039346656037ull;
+	for (std::size_t i = 0; i < size; i++) {
+		h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+	}
+	return h;
+}
+
+std::string file_header() {
+	std::string out(log_magic, sizeof(log_magic));
+	out.append(reinterpret_cast<const char*>(&log_version), sizeof(log_version));
+	out.append(file_header_size - out.size(), '\0');
+	return out;
+}
+
+// Sync the directory holding path, so that a rename to path survives a crash
+bool sync_directory(const std::string& path) {
+	auto slash = path.rfind('/');
+	auto dir = slash == std::string::npos ? std::string(".") : path.substr(0, std::max<std::size_t>(slash, 1));
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+}
+
+void Mutation_log::encode(std::string& out, record_type type, std::string_view key,
+		std::string_view value, std::int64_t expires) {
+	auto start = out.size();
+	std::uint32_t key_size = key.size();
+	std::uint64_t value_size = value.size();
+	out.resize(start + record_header_size);
+	char* h = &out[start];
+	std::memcpy(h + 8, &type, 4);
+	std::memcpy(h + 12, &key_size, 4);
+	std::memcpy(h + 16, &value_size, 8);
+	std::memcpy(h + 24, &expires, 8);
+	out.append(key.data(), key.size());
+	out.append(value.data(), value.size());
+	auto sum = checksum(&out[start + 8], out.size() - start - 8);
+	std::memcpy(&out[start], &sum, 8);
+}
+
+bool Mutation_log::write_all(int fd, const char* data, std::size_t size) {
+	while (size > 0) {
+		auto n = ::write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool Mutation_log::replay(const std::string& path, const handlers& h) {
+	int fd = open(path.c_str(), O_RDWR);
+	if (fd < 0) {
+		return true;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	std::size_t length = st.st_size;
+	if (length == 0) {
+		close(fd);
+		return true;
+	}
+	if (length < file_header_size) {
+		close(fd);
+		return false;
+	}
+	void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	auto base = static_cast<const char*>(addr);
+	if (std::string_view(base, file_header_size) != file_header()) {
+		munmap(addr, length);
+		close(fd);
+		return false;
+	}
+	madvise(addr, length, MADV_SEQUENTIAL);
+
+	std::size_t pos = file_header_size;
+	while (length - pos >= record_header_size) {
+		const char* r = base + pos;
+		std::uint64_t sum;
+		std::uint32_t type;
+		std::uint32_t key_size;
+		std::uint64_t value_size;
+		std::int64_t expires;
+		std::memcpy(&sum, r, 8);
+		std::memcpy(&type, r + 8, 4);
+		std::memcpy(&key_size, r + 12, 4);
+		std::memcpy(&value_size, r + 16, 8);
+		std::memcpy(&expires, r + 24, 8);
+		auto rest = length - pos - record_header_size;
+		if (key_size > rest || value_size > rest - key_size) {
+			break;
+		}
+		auto size = record_header_size + key_size + value_size;
+		if (checksum(r + 8, size - 8) != sum) {
+			break;
+		}
+		std::string_view key(r + record_header_size, key_size);
+		std::string_view value(r + record_header_size + key_size, value_size);
+		if (type == set_record) {
+			h.set(key, value, expires);
+		} else if (type == del_record) {
+			h.del(key);
+		} else if (type == reset_record) {
+			h.reset();
+		} else {
+			break;
+		}
+		pos += size;
+	}
+	munmap(addr, length);
+
+	//drop a torn tail, so that new records follow the last whole one
+	bool ok = pos == length || ftruncate(fd, pos) == 0;
+	close(fd);
+	return ok;
+}
+
+Mutation_log::Mutation_log(const std::string& path, std::chrono::milliseconds sync_interval)
+	: path_(path), sync_interval_(sync_interval), fd_(-1), queued_seq_(0), written_seq_(0),
+	synced_seq_(0), sync_wanted_(0), size_(0), failed_(false), stopping_(false),
+	compacting_(false), compacted_fd_(-1)
+{
+	fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	struct stat st;
+	if (fd_ < 0 || fstat(fd_, &st) != 0) {
+		if (fd_ >= 0) {
+			close(fd_);
+		}
+		throw std::runtime_error("cannot open mutation log " + path);
+	}
+	size_ = st.st_size;
+	if (size_ == 0) {
+		auto header = file_header();
+		if (!write_all(fd_, header.data(), header.size())) {
+			close(fd_);
+			throw std::runtime_error("cannot write mutation log " + path);
+		}
+		size_ = header.size();
+	}
+	writer_ = std::thread(&Mutation_log::run_writer, this);
+}
+
+Mutation_log::~Mutation_log() {
+	if (compactor_.joinable()) {
+		compactor_.join();
+	}
+	{
+		std::lock_guard guard(mutex_);
+		stopping_ = true;
+	}
+	queued_.notify_one();
+	writer_.join();
+	close(fd_);
+}
+
+void Mutation_log::queue(record_type type, std::string_view key, std::string_view value, std::int64_t expires) {
+	std::lock_guard guard(mutex_);
+	auto start = buffer_.size();
+	encode(buffer_, type, key, value, expires);
+	if (compacting_) {
+		carried_.append(buffer_, start, std::string::npos);
+	}
+	queued_seq_++;
+	//the writer is already awake if the buffer was not empty
+	if (start == 0) {
+		queued_.notify_one();
+	}
+}
+
+void Mutation_log::log_set(std::string_view key, std::string_view value, std::int64_t expires) {
+	queue(set_record, key, value, expires);
+}
+
+void Mutation_log::log_del(std::string_view key) {
+	queue(del_record, key, std::string_view(), 0);
+}
+
+void Mutation_log::log_reset() {
+	queue(reset_record, std::string_view(), std::string_view(), 0);
+}
+
+void Mutation_log::commit() {
+	if (sync_interval_ != std::chrono::milliseconds::zero()) {
+		return;
+	}
+	std::unique_lock lock(mutex_);
+	auto seq = queued_seq_;
+	synced_.wait(lock, [this, seq]() { return synced_seq_ >= seq || failed_; });
+}
+
+bool Mutation_log::flush() {
+	std::unique_lock lock(mutex_);
+	auto seq = queued_seq_;
+	sync_wanted_ = std::max(sync_wanted_, seq);
+	queued_.notify_one();
+	synced_.wait(lock, [this, seq]() { return synced_seq_ >= seq || failed_; });
+	return !failed_;
+}
+
+std::uint64_t Mutation_log::size() const {
+	std::lock_guard guard(mutex_);
+	return size_;
+}
+
+// Write out a batch per wakeup: whatever was queued since the last one.
+void Mutation_log::run_writer() {
+	using clock = std::chrono::steady_clock;
+	auto last_sync = clock::now();
+	std::unique_lock lock(mutex_);
+	for (;;) {
+		auto has_work = [this]() {
+			return !buffer_.empty() || compacted_fd_ >= 0 || sync_wanted_ > synced_seq_ || stopping_;
+		};
+		if (written_seq_ > synced_seq_ && !failed_) {
+			//records are written but not synced: sync when the interval is up
+			queued_.wait_until(lock, last_sync + sync_interval_, has_work);
+		} else {
+			queued_.wait(lock, has_work);
+		}
+
+		std::string batch;
+		batch.swap(buffer_);
+		auto batch_end = queued_seq_;
+		//a completed compaction's file takes over, with the records queued
+		//since it started (this batch's among them) appended
+		int switch_fd = compacted_fd_;
+		if (switch_fd >= 0) {
+			batch.clear();
+			batch.swap(carried_);
+			compacted_fd_ = -1;
+			compacting_ = false;
+		}
+		bool sync = sync_interval_ == std::chrono::milliseconds::zero() || stopping_
+			|| sync_wanted_ > synced_seq_ || clock::now() - last_sync >= sync_interval_;
+		lock.unlock();
+
+		int fd = switch_fd >= 0 ? switch_fd : fd_;
+		bool ok = write_all(fd, batch.data(), batch.size());
+		if (switch_fd >= 0) {
+			ok = ok && fdatasync(switch_fd) == 0
+				&& std::rename((path_ + ".compact").c_str(), path_.c_str()) == 0;
+			if (ok) {
+				ok = sync_directory(path_);
+				close(fd_);
+				fd_ = switch_fd;
+			} else {
+				close(switch_fd);
+				std::remove((path_ + ".compact").c_str());
+				//keep the old file, which lacks this batch: append all the
+				//carried records, since replaying again the ones it already
+				//holds leaves the same state
+				ok = write_all(fd_, batch.data(), batch.size());
+			}
+		}
+		sync = sync && batch_end > synced_seq_;
+		if (sync) {
+			ok = ok && fdatasync(fd_) == 0;
+			last_sync = clock::now();
+		}
+		struct stat st;
+		bool sized = switch_fd >= 0 && fstat(fd_, &st) == 0;
+
+		lock.lock();
+		failed_ = failed_ || !ok;
+		written_seq_ = batch_end;
+		size_ = sized ? st.st_size : size_ + batch.size();
+		if (sync) {
+			synced_seq_ = batch_end;
+		}
+		synced_.notify_all();
+		if (stopping_ && buffer_.empty() && compacted_fd_ < 0 && (synced_seq_ == queued_seq_ || failed_)) {
+			break;
+		}
+	}
+}
+
+void Mutation_log::compact(std::function<void(const emit_func&)> dump) {
+	std::lock_guard guard(mutex_);
+	if (compacting_) {
+		return;
+	}
+	//the previous compaction has handed its file over, so its thread is done
+	if (compactor_.joinable()) {
+		compactor_.join();
+	}
+	compacting_ = true;
+	carried_.clear();
+	compactor_ = std::thread(&Mutation_log::run_compaction, this, std::move(dump));
+}
+
+void Mutation_log::run_compaction(std::function<void(const emit_func&)> dump) {
+	auto tmp = path_ + ".compact";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = fd >= 0;
+	std::string out = file_header();
+	if (ok) {
+		dump([this, fd, &ok, &out](std::string_view key, std::string_view value, std::int64_t expires) {
+			encode(out, set_record, key, value, expires);
+			if (out.size() >= compaction_chunk) {
+				ok = ok && write_all(fd, out.data(), out.size());
+				out.clear();
+			}
+		});
+		ok = ok && write_all(fd, out.data(), out.size());
+	}
+
+	std::lock_guard guard(mutex_);
+	if (!ok) {
+		if (fd >= 0) {
+			close(fd);
+			std::remove(tmp.c_str());
+		}
+		compacting_ = false;
+		carried_.clear();
+		return;
+	}
+	compacted_fd_ = fd;
+	queued_.notify_one();
+}
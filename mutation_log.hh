@@ -0,0 +1,113 @@
+#ifndef MUTATION_LOG_HH
+#define MUTATION_LOG_HH
+
+/*
+ * Append-only log of the mutations made to a store, for durability.
+ * A writer thread writes and syncs queued records in batches (group commit).
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+class Mutation_log {
+public:
+	// Handlers for the records of a log, in order. expires is the wall
+	// clock time a value expires at, in milliseconds since the Unix epoch,
+	// or 0 for never.
+	struct handlers {
+		std::function<void(std::string_view key, std::string_view value, std::int64_t expires)> set;
+		std::function<void(std::string_view key)> del;
+		std::function<void()> reset;
+	};
+
+	// Feed the records of the log at path to h. A log that ends in a torn
+	// or corrupt record is truncated to the records before it. Returns
+	// false if path exists but does not hold a log; a missing file is an
+	// empty log.
+	static bool replay(const std::string& path, const handlers& h);
+
+	// Open the log at path for appending, creating it if needed.
+	// sync_interval: How often written records are synced, or zero to sync
+	// every batch and make commit() wait for it.
+	// Throws std::runtime_error if the file cannot be opened.
+	Mutation_log(const std::string& path, std::chrono::milliseconds sync_interval);
+	// Writes and syncs everything queued, after any compaction finishes.
+	~Mutation_log();
+
+	Mutation_log(const Mutation_log&) = delete;
+	Mutation_log& operator=(const Mutation_log&) = delete;
+
+	// Queue a record. Thread-safe. Records queued by one thread, or under
+	// a lock the callers share, are replayed in the order they were queued.
+	void log_set(std::string_view key, std::string_view value, std::int64_t expires);
+	void log_del(std::string_view key);
+	void log_reset();
+
+	// With a zero sync interval, wait until every record queued so far is
+	// synced; otherwise return at once.
+	void commit();
+
+	// Wait until every record queued so far is written and synced.
+	// Returns false if a write or sync has failed since the log was opened.
+	bool flush();
+
+	// Receives a set record for each item of the store being dumped.
+	using emit_func = std::function<void(std::string_view key, std::string_view value, std::int64_t expires)>;
+
+	// Rewrite the log in the background as the records dump(emit) emits,
+	// followed by those queued meanwhile. Does nothing if a compaction is
+	// already running.
+	void compact(std::function<void(const emit_func&)> dump);
+
+	// Bytes written to the log file since it was opened or compacted
+	std::uint64_t size() const;
+
+private:
+	enum record_type : std::uint32_t { set_record = 1, del_record = 2, reset_record = 3 };
+
+	// Encode a record onto the end of out
+	static void encode(std::string& out, record_type type, std::string_view key,
+		std::string_view value, std::int64_t expires);
+
+	// Queue an encoded record
+	void queue(record_type type, std::string_view key, std::string_view value, std::int64_t expires);
+
+	void run_writer();
+	void run_compaction(std::function<void(const emit_func&)> dump);
+
+	// Write all of data to fd. Returns false on an error.
+	static bool write_all(int fd, const char* data, std::size_t size);
+
+	std::string path_;
+	std::chrono::milliseconds sync_interval_;
+	int fd_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable queued_;      // the writer has work
+	std::condition_variable synced_;      // synced_seq_ moved on
+	std::string buffer_;                  // records queued for the next batch
+	std::uint64_t queued_seq_;            // records queued so far
+	std::uint64_t written_seq_;           // records written so far
+	std::uint64_t synced_seq_;            // records written and synced so far
+	std::uint64_t sync_wanted_;           // sync at least this far at once
+	std::uint64_t size_;
+	bool failed_;                         // a write or sync failed
+	bool stopping_;
+
+	// While compacting_, queued records are also kept in carried_; the
+	// writer switches to compacted_fd_ once the dump is written.
+	bool compacting_;
+	std::string carried_;
+	int compacted_fd_;
+	std::thread compactor_;
+
+	std::thread writer_;
+};
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * The machine's NUMA nodes, for placing memory and threads on the same one.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "numa.hh"
+
+namespace {
+
+// From the kernel's uapi mempolicy.h: prefer the given node, falling back
+// to others when it is full, and move pages already placed elsewhere
+const int mpol_preferred = 1;
+const unsigned mpol_mf_move = 1 << 1;
+
+const char* const node_directory = "/sys/devices/system/node";
+
+}
+
+Numa_topology::Numa_topology(std::vector<node> nodes) : nodes_(std::move(nodes)) { }
+
+Numa_topology Numa_topology::detect() {
+	std::vector<node> nodes;
+	if (DIR* dir = opendir(node_directory)) {
+		while (dirent* entry = readdir(dir)) {
+			std::string name = entry -> d_name;
+			if (name.size() < 5 || name.compare(0, 4, "node") != 0
+					|| name.find_first_not_of("0123456789", 4) != std::string::npos) {
+				continue;
+			}
+			std::ifstream in(std::string(node_directory) + "/" + name + "/cpulist");
+			std::string list;
+			std::getline(in, list);
+			auto cpus = parse_cpus(list);
+			if (!cpus.empty()) {
+				nodes.push_back(node {static_cast<unsigned>(std::strtoul(name.c_str() + 4, nullptr, 10)), cpus});
+			}
+		}
+		closedir(dir);
+	}
+	std::sort(nodes.begin(), nodes.end(), [](const node& a, const node& b) { return a.id < b.id; });
+
+	if (nodes.empty()) {
+		node all {0, {}};
+		for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++) {
+			all.cpus.push_back(cpu);
+		}
+		nodes.push_back(all);
+	}
+	return Numa_topology(std::move(nodes));
+}
+
+std::vector<unsigned> Numa_topology::parse_cpus(const std::string& list) {
+	std::vector<unsigned> cpus;
+	const char* p = list.c_str();
+	while (*p != '\0' && *p != '\n') {
+		char* end;
+		auto first = std::strtoul(p, &end, 10);
+		auto last = first;
+		if (end == p) {
+			return {};
+		}
+		p = end;
+		if (*p == '-') {
+			last = std::strtoul(++p, &end, 10);
+			if (end == p || last < first) {
+				return {};
+			}
+			p = end;
+		}
+		for (auto cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0' && *p != '\n') {
+			return {};
+		}
+	}
+	return cpus;
+}
+
+bool Numa_topology::bind_thread(unsigned node) const {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto cpu : nodes_[node].cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool Numa_topology::bind_memory(void* addr, std::size_t len, unsigned node) const {
+	const unsigned long bits = 8 * sizeof(unsigned long);
+	unsigned long id = nodes_[node].id;
+	std::vector<unsigned long> mask(id / bits + 1, 0);
+	mask[id / bits] = 1ul << (id % bits);
+	//the kernel reads one bit less than maxnode says
+	return syscall(SYS_mbind, addr, len, mpol_preferred, mask.data(), mask.size() * bits + 1, mpol_mf_move) == 0;
+}
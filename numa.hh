@@ -0,0 +1,55 @@
+#ifndef NUMA_HH
+#define NUMA_HH
+
+/*
+ * The machine's NUMA nodes, for placing memory and threads on the same one.
+ *
+ * Nodes are read from sysfs (/sys/devices/system/node), and numbered here
+ * from 0 in the order of their kernel ids, leaving out nodes without CPUs:
+ * nothing could run next to their memory. A machine without NUMA, or whose
+ * kernel does not say, is a single node holding every CPU, so callers take
+ * the same path either way.
+ *
+ * Placement goes straight to the kernel (sched_setaffinity and mbind), with
+ * no dependency on libnuma; a kernel that refuses it leaves memory and
+ * threads where they were, which costs speed, not correctness.
+ */
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class Numa_topology {
+public:
+	struct node {
+		unsigned id;                 // the kernel's node id
+		std::vector<unsigned> cpus;
+	};
+
+	// The nodes of this machine
+	static Numa_topology detect();
+
+	// The given nodes, which must not be empty
+	explicit Numa_topology(std::vector<node> nodes);
+
+	unsigned nodes() const { return nodes_.size(); }
+	unsigned id(unsigned node) const { return nodes_[node].id; }
+	const std::vector<unsigned>& cpus(unsigned node) const { return nodes_[node].cpus; }
+
+	// Run the calling thread on node's CPUs only. Returns false if the
+	// kernel refused.
+	bool bind_thread(unsigned node) const;
+
+	// Place the pages of the len bytes at addr, which must be page aligned,
+	// on node, moving any already there. Returns false if the kernel refused.
+	bool bind_memory(void* addr, std::size_t len, unsigned node) const;
+
+	// The CPUs in a sysfs list such as "0-3,8,10-11"; an empty list for a
+	// malformed one
+	static std::vector<unsigned> parse_cpus(const std::string& list);
+
+private:
+	std::vector<node> nodes_;
+};
+
+#endif
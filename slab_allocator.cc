@@ -0,0 +1,351 @@
+/*
+ * Memcached-style slab allocator for cache values.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+#include "numa.hh"
+#include "slab_allocator.hh"
+
+namespace {
+
+// Size of a huge page on x86-64 (and of the transparent ones on most
+// other 64-bit systems)
+const std::size_t huge_page_size = 2 << 20;
+
+// Map size bytes of anonymous memory starting at a multiple of align (a
+// power of two, past the system page size): map align bytes more and trim
+// the ends
+void* map_aligned(std::size_t size, std::size_t align) {
+	auto total = size + align;
+	auto base = static_cast<char*>(mmap(nullptr, total, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+	if (base == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	auto start = reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(base) + align - 1) / align * align);
+	if (start != base) {
+		munmap(base, start - base);
+	}
+	munmap(start + size, base + total - (start + size));
+	return start;
+}
+
+}
+
+// Every page starts with this header, followed by its chunks. Pages are
+// aligned to the page size, so a chunk finds its page by masking its address.
+struct Slab_allocator::page {
+	page* prev;          // links in the class's list of partial pages,
+	page* next;          // or in the pool of empty pages
+	void* free_list;     // chunks returned to this page
+	char* unused;        // start of the chunks never handed out
+	char* end;
+	std::uint32_t cls;
+	std::uint32_t live;  // chunks handed out
+};
+
+Slab_allocator::Slab_allocator(size_type limit, size_type page_size, double growth_factor, size_type alignment)
+	: limit_(std::max(limit, page_size)), page_size_(page_size), alignment_(alignment),
+	arena_(nullptr), arena_size_(0), arena_used_(0), huge_(true), backing_(backing::heap),
+	free_pages_(nullptr), large_bytes_(0), topology_(nullptr), node_(0)
+{
+	header_size_ = round_up(sizeof(page));
+	size_type max_chunk = (page_size_ - header_size_) / alignment_ * alignment_;
+	size_type chunk = 64;
+	while (true) {
+		chunk = std::min(round_up(chunk), max_chunk);
+		classes_.push_back(size_class {chunk, max_chunk / chunk, nullptr, 0, 0, 0});
+		if (chunk == max_chunk) {
+			break;
+		}
+		chunk = static_cast<size_type>(chunk * growth_factor);
+	}
+	map_arena(huge_);
+}
+
+Slab_allocator::~Slab_allocator() {
+	if (arena_ != nullptr) {
+		unmap_arena();
+		return;
+	}
+	for (auto p : all_pages_) {
+		std::free(p);
+	}
+}
+
+void Slab_allocator::map_arena(bool huge) {
+	huge_ = huge;
+	arena_size_ = limit_ / page_size_ * page_size_;
+	arena_used_ = 0;
+	void* mem = MAP_FAILED;
+	if (huge && arena_size_ >= huge_page_size) {
+		arena_size_ = (arena_size_ + huge_page_size - 1) / huge_page_size * huge_page_size;
+		//explicit huge pages are reserved here, so this fails if too few are
+		//set aside rather than faulting later
+		mem = mmap(nullptr, arena_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		backing_ = backing::explicit_huge;
+		if (mem == MAP_FAILED) {
+			//transparent huge pages need the arena aligned to one
+			mem = map_aligned(arena_size_, huge_page_size);
+			if (mem != MAP_FAILED) {
+				backing_ = madvise(mem, arena_size_, MADV_HUGEPAGE) == 0 ? backing::transparent_huge : backing::normal;
+			}
+		}
+	} else {
+		//pages find their header by masking, so they must be aligned to
+		//their size
+		mem = map_aligned(arena_size_, page_size_);
+		backing_ = backing::normal;
+	}
+	if (mem == MAP_FAILED) {
+		arena_ = nullptr;
+		backing_ = backing::heap;
+		return;
+	}
+	arena_ = static_cast<char*>(mem);
+	if (topology_ != nullptr) {
+		topology_->bind_memory(arena_, arena_size_, node_);
+	}
+}
+
+void Slab_allocator::unmap_arena() {
+	munmap(arena_, arena_size_);
+	arena_ = nullptr;
+}
+
+Slab_allocator::backing Slab_allocator::page_backing() const {
+	std::lock_guard guard(mutex_);
+	return backing_;
+}
+
+bool Slab_allocator::untouched() const {
+	std::lock_guard guard(mutex_);
+	return all_pages_.empty() && released_.empty() && large_bytes_ == 0;
+}
+
+bool Slab_allocator::use_huge_pages(bool use) {
+	std::lock_guard guard(mutex_);
+	if (!all_pages_.empty() || !released_.empty() || large_bytes_ != 0) {
+		return false;
+	}
+	if (use != huge_) {
+		if (arena_ != nullptr) {
+			unmap_arena();
+		}
+		map_arena(use);
+	}
+	return true;
+}
+
+Slab_allocator::size_type Slab_allocator::page_size_for(size_type limit) {
+	size_type page_size = 4096;
+	while (page_size < (1 << 20) && page_size * 2 <= limit / 64) {
+		page_size *= 2;
+	}
+	return page_size;
+}
+
+Slab_allocator::size_type Slab_allocator::round_up(size_type size) const {
+	return (size + alignment_ - 1) / alignment_ * alignment_;
+}
+
+unsigned Slab_allocator::class_for(size_type size) const {
+	auto it = std::lower_bound(classes_.begin(), classes_.end(), size,
+		[](const size_class& c, size_type s) { return c.chunk_size < s; });
+	return static_cast<unsigned>(it - classes_.begin());
+}
+
+// Take a page from the pool, or from the arena (or the heap) if within the
+// limit: first one given back to the system, then a new one. The mutex
+// must be held.
+Slab_allocator::page* Slab_allocator::new_page(unsigned cls) {
+	page* pg = free_pages_;
+	if (pg != nullptr) {
+		free_pages_ = pg->next;
+	} else {
+		if (all_pages_.size() * page_size_ + large_bytes_ + page_size_ > limit_) {
+			return nullptr;
+		}
+		void* mem;
+		if (!released_.empty()) {
+			mem = released_.back();
+			released_.pop_back();
+		} else if (arena_ != nullptr) {
+			if (arena_used_ + page_size_ > arena_size_) {
+				return nullptr;
+			}
+			mem = arena_ + arena_used_;
+			arena_used_ += page_size_;
+		} else {
+			mem = std::aligned_alloc(page_size_, page_size_);
+			if (mem == nullptr) {
+				return nullptr;
+			}
+			if (topology_ != nullptr) {
+				topology_->bind_memory(mem, page_size_, node_);
+			}
+		}
+		all_pages_.push_back(mem);
+		pg = static_cast<page*>(mem);
+	}
+
+	pg->prev = nullptr;
+	pg->next = nullptr;
+	pg->free_list = nullptr;
+	pg->unused = reinterpret_cast<char*>(pg) + header_size_;
+	pg->end = pg->unused + classes_[cls].chunks_per_page * classes_[cls].chunk_size;
+	pg->cls = cls;
+	pg->live = 0;
+	classes_[cls].pages++;
+	return pg;
+}
+
+// Remove a page from its class's partial list. The mutex must be held.
+void Slab_allocator::unlink(page* pg) {
+	auto& c = classes_[pg->cls];
+	if (pg->prev != nullptr) {
+		pg->prev->next = pg->next;
+	} else {
+		c.partial = pg->next;
+	}
+	if (pg->next != nullptr) {
+		pg->next->prev = pg->prev;
+	}
+	pg->prev = pg->next = nullptr;
+}
+
+void* Slab_allocator::allocate(size_type size) {
+	std::lock_guard guard(mutex_);
+
+	//too big for any class: allocate directly, within the limit,
+	//giving pooled empty pages back to the system to make room
+	if (size > classes_.back().chunk_size) {
+		while (all_pages_.size() * page_size_ + large_bytes_ + size > limit_ && free_pages_ != nullptr) {
+			page* pg = free_pages_;
+			free_pages_ = pg->next;
+			all_pages_.erase(std::find(all_pages_.begin(), all_pages_.end(), pg));
+			if (arena_ != nullptr) {
+				//the page stays in the arena for new_page() to take again
+				madvise(pg, page_size_, MADV_DONTNEED);
+				released_.push_back(pg);
+			} else {
+				std::free(pg);
+			}
+		}
+		if (all_pages_.size() * page_size_ + large_bytes_ + size > limit_) {
+			return nullptr;
+		}
+		large_bytes_ += size;
+		return ::operator new(size, std::align_val_t(alignment_));
+	}
+
+	unsigned cls = class_for(size);
+	auto& c = classes_[cls];
+	page* pg = c.partial;
+	if (pg == nullptr) {
+		pg = new_page(cls);
+		if (pg == nullptr) {
+			return nullptr;
+		}
+		pg->next = c.partial;
+		c.partial = pg;
+	}
+
+	void* chunk;
+	if (pg->free_list != nullptr) {
+		chunk = pg->free_list;
+		pg->free_list = *static_cast<void**>(chunk);
+	} else {
+		chunk = pg->unused;
+		pg->unused += c.chunk_size;
+	}
+	pg->live++;
+	c.used++;
+	c.requested += size;
+
+	//page is full: it no longer belongs on the partial list
+	if (pg->free_list == nullptr && pg->unused == pg->end) {
+		unlink(pg);
+	}
+	return chunk;
+}
+
+void Slab_allocator::deallocate(void* p, size_type size) {
+	std::lock_guard guard(mutex_);
+
+	if (size > classes_.back().chunk_size) {
+		large_bytes_ -= size;
+		::operator delete(p, std::align_val_t(alignment_));
+		return;
+	}
+
+	auto pg = reinterpret_cast<page*>(reinterpret_cast<std::uintptr_t>(p) & ~(page_size_ - 1));
+	auto& c = classes_[pg->cls];
+	bool was_full = pg->free_list == nullptr && pg->unused == pg->end;
+
+	*static_cast<void**>(p) = pg->free_list;
+	pg->free_list = p;
+	pg->live--;
+	c.used--;
+	c.requested -= size;
+
+	if (was_full) {
+		pg->next = c.partial;
+		if (c.partial != nullptr) {
+			c.partial->prev = pg;
+		}
+		c.partial = pg;
+	}
+
+	//page is empty: hand it back to the pool for any class to reuse
+	if (pg->live == 0) {
+		unlink(pg);
+		c.pages--;
+		pg->next = free_pages_;
+		free_pages_ = pg;
+	}
+}
+
+bool Slab_allocator::resize(void* p, size_type old_size, size_type new_size) {
+	std::lock_guard guard(mutex_);
+	if (old_size > classes_.back().chunk_size) {
+		return false;
+	}
+	auto pg = reinterpret_cast<page*>(reinterpret_cast<std::uintptr_t>(p) & ~(page_size_ - 1));
+	auto& c = classes_[pg->cls];
+	if (new_size > c.chunk_size) {
+		return false;
+	}
+	c.requested = c.requested - old_size + new_size;
+	return true;
+}
+
+void Slab_allocator::bind(const Numa_topology* topology, unsigned node) {
+	std::lock_guard guard(mutex_);
+	topology_ = topology;
+	node_ = node;
+	if (arena_ != nullptr) {
+		topology_->bind_memory(arena_, arena_size_, node_);
+		return;
+	}
+	for (auto p : all_pages_) {
+		topology_->bind_memory(p, page_size_, node_);
+	}
+}
+
+Slab_allocator::size_type Slab_allocator::memory_used() const {
+	std::lock_guard guard(mutex_);
+	return all_pages_.size() * page_size_ + large_bytes_;
+}
+
+std::vector<Slab_allocator::class_stats> Slab_allocator::stats() const {
+	std::lock_guard guard(mutex_);
+	std::vector<class_stats> out;
+	for (auto& c : classes_) {
+		out.push_back(class_stats {c.chunk_size, c.pages, c.pages * c.chunks_per_page, c.used, c.requested});
+	}
+	return out;
+}
@@ -0,0 +1,143 @@
+#ifndef SLAB_ALLOCATOR_HH
+#define SLAB_ALLOCATOR_HH
+
+/*
+ * Memcached-style slab allocator for cache values.
+ *
+ * Memory is obtained in fixed-size pages, and each page is carved into
+ * equally sized chunks of one size class. Size classes grow geometrically,
+ * so any request is served from the smallest class that fits it, with
+ * constant-time allocation and deallocation through per-page free lists.
+ * Pages whose chunks are all free go back to a shared pool and can be
+ * reused by any class. Requests larger than a page are allocated directly.
+ *
+ * Pages are carved out of an arena reserved up front, as large as the
+ * limit, so that the chunks the cache touches on every lookup sit on a few
+ * huge pages rather than scattered over many 4 KiB ones, each needing a TLB
+ * entry of its own. The arena is mapped with explicit huge pages
+ * (MAP_HUGETLB) if the system has enough set aside, and otherwise asks for
+ * transparent ones (MADV_HUGEPAGE). Arenas smaller than a huge page use
+ * normal pages; an arena that cannot be mapped at all leaves pages to come
+ * from the heap one by one.
+ */
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+class Numa_topology;
+
+class Slab_allocator {
+public:
+	using size_type = std::uint64_t;
+
+	// Occupancy of one size class
+	struct class_stats {
+		size_type chunk_size;
+		size_type pages;      // pages currently assigned to the class
+		size_type chunks;     // chunks available in those pages
+		size_type used;       // chunks handed out
+		size_type requested;  // bytes requested for the chunks handed out
+	};
+
+	// limit: Maximum bytes of pages (and large allocations) to hold, rounded
+	// up to at least one page.
+	// page_size: Size of a page, a power of two.
+	// growth_factor: Ratio between the chunk sizes of consecutive classes.
+	// alignment: Alignment of every chunk, a power of two; chunk sizes are
+	// rounded up to a multiple of it.
+	Slab_allocator(size_type limit,
+		size_type page_size = 1 << 20,
+		double growth_factor = 1.25,
+		size_type alignment = 16);
+	~Slab_allocator();
+
+	Slab_allocator(const Slab_allocator&) = delete;
+	Slab_allocator& operator=(const Slab_allocator&) = delete;
+
+	// Allocate size bytes, or return nullptr if that would exceed the limit.
+	void* allocate(size_type size);
+
+	// Return memory obtained from allocate(size) with the same size.
+	void deallocate(void* p, size_type size);
+
+	// Let memory from allocate(old_size) hold new_size bytes, if its chunk
+	// is big enough; it is then given back with new_size. Returns false if
+	// it is not.
+	bool resize(void* p, size_type old_size, size_type new_size);
+
+	// Bytes held in pages (including pooled empty pages) and large allocations
+	size_type memory_used() const;
+
+	size_type limit() const { return limit_; }
+
+	// Place the pages held, and every page obtained from then on, on one
+	// node of topology, which must outlive the allocator. Large allocations
+	// are left wherever the system allocator puts them.
+	void bind(const Numa_topology* topology, unsigned node);
+
+	// What the pages come from
+	enum class backing { explicit_huge, transparent_huge, normal, heap };
+	backing page_backing() const;
+
+	// Whether the arena is to ask for huge pages (it does by default).
+	// Remaps it if it changes, so it must be called before the first
+	// allocation; returns false, changing nothing, after it.
+	bool use_huge_pages(bool use);
+
+	// Whether no page has been taken yet, so the arena can still be remapped
+	bool untouched() const;
+
+	// Per size class occupancy, ordered by chunk size
+	std::vector<class_stats> stats() const;
+
+	// A page size suited to a given limit: a power of two between 4 KiB
+	// and 1 MiB, small enough that the limit spans many pages so that
+	// every size class in use can hold some.
+	static size_type page_size_for(size_type limit);
+
+private:
+	struct page;
+	struct size_class {
+		size_type chunk_size;
+		size_type chunks_per_page;
+		page* partial;        // pages with at least one free chunk
+		size_type pages;
+		size_type used;
+		size_type requested;
+	};
+
+	// size rounded up to a multiple of the alignment
+	size_type round_up(size_type size) const;
+
+	// Index of the smallest class whose chunks fit size
+	unsigned class_for(size_type size) const;
+
+	// Reserve the arena, with or without huge pages. The mutex must be
+	// held, and no page be taken.
+	void map_arena(bool huge);
+	void unmap_arena();
+
+	page* new_page(unsigned cls);
+	void unlink(page* pg);
+
+	size_type limit_;
+	size_type page_size_;
+	size_type alignment_;
+	size_type header_size_;
+	std::vector<size_class> classes_;
+	std::vector<void*> all_pages_;   // every page held
+	char* arena_;                    // or nullptr, if pages come from the heap
+	size_type arena_size_;
+	size_type arena_used_;           // bytes at the start of the arena carved into pages
+	bool huge_;
+	backing backing_;
+	std::vector<void*> released_;    // pages of the arena given back to the system
+	page* free_pages_;               // empty pages not assigned to a class
+	size_type large_bytes_;
+	const Numa_topology* topology_;  // or nullptr, if not bound to a node
+	unsigned node_;
+	mutable std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Space-Saving sketch. Capacities are small (a few hundred keys), so the
+ * smallest count is found by a scan, which only keys that are not
+ * monitored pay for.
+ */
+
+#include <algorithm>
+#include "space_saving.hh"
+
+Space_saving::Space_saving(std::size_t capacity)
+	: capacity_(std::max<std::size_t>(capacity, 1)),
+	total_(0)
+{
+	entries_.reserve(capacity_);
+	where_.reserve(capacity_);
+}
+
+const Space_saving::entry& Space_saving::add(std::string_view key, std::uint64_t weight) {
+	total_ += weight;
+	std::string k(key);
+	auto it = where_.find(k);
+	if (it != where_.end()) {
+		auto& e = entries_[it -> second];
+		e.count += weight;
+		return e;
+	}
+	if (entries_.size() < capacity_) {
+		where_.emplace(k, entries_.size());
+		entries_.push_back(entry {std::move(k), weight, 0});
+		return entries_.back();
+	}
+	//the key takes over the least counted one's slot and count
+	auto victim = std::min_element(entries_.begin(), entries_.end(),
+		[](const entry& a, const entry& b) { return a.count < b.count; });
+	where_.erase(victim -> key);
+	where_.emplace(k, victim - entries_.begin());
+	victim -> key = std::move(k);
+	victim -> error = victim -> count;
+	victim -> count += weight;
+	return *victim;
+}
+
+bool Space_saving::in_top(std::string_view key, std::size_t k) const {
+	auto it = where_.find(std::string(key));
+	if (it == where_.end()) {
+		return false;
+	}
+	auto count = entries_[it -> second].count;
+	std::size_t above = 0;
+	for (auto& e : entries_) {
+		above += e.count > count;
+	}
+	return above < k;
+}
+
+std::vector<Space_saving::entry> Space_saving::top(std::size_t k) const {
+	std::vector<entry> out(entries_);
+	auto n = std::min(k, out.size());
+	std::partial_sort(out.begin(), out.begin() + n, out.end(),
+		[](const entry& a, const entry& b) { return a.count > b.count; });
+	out.resize(n);
+	return out;
+}
+
+void Space_saving::halve() {
+	std::vector<entry> kept;
+	kept.reserve(capacity_);
+	where_.clear();
+	for (auto& e : entries_) {
+		if (e.count / 2 != 0) {
+			where_.emplace(e.key, kept.size());
+			kept.push_back(entry {std::move(e.key), e.count / 2, e.error / 2});
+		}
+	}
+	entries_ = std::move(kept);
+	total_ /= 2;
+}
+
+void Space_saving::clear() {
+	entries_.clear();
+	where_.clear();
+	total_ = 0;
+}
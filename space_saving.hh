@@ -0,0 +1,50 @@
+#ifndef SPACE_SAVING_HH
+#define SPACE_SAVING_HH
+
+/*
+ * Space-Saving sketch (Metwally et al.) for the most frequent keys of a
+ * stream, in constant space. Not thread-safe.
+ */
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class Space_saving {
+public:
+	struct entry {
+		std::string key;
+		std::uint64_t count;   // estimated occurrences, at least the true number
+		std::uint64_t error;   // by how much count may overestimate
+	};
+
+	explicit Space_saving(std::size_t capacity);
+
+	// Count weight more occurrences of key. Returns its entry.
+	const entry& add(std::string_view key, std::uint64_t weight = 1);
+
+	// Whether key is among the k keys with the highest counts
+	bool in_top(std::string_view key, std::size_t k) const;
+
+	// The (at most) k keys with the highest counts, highest first
+	std::vector<entry> top(std::size_t k) const;
+
+	// Occurrences counted (and not halved away) so far
+	std::uint64_t total() const { return total_; }
+
+	// Halve every count and error, and forget the keys left with none
+	void halve();
+	void clear();
+
+	std::size_t capacity() const { return capacity_; }
+
+private:
+	std::size_t capacity_;
+	std::vector<entry> entries_;
+	std::unordered_map<std::string, std::size_t> where_;   // key to index in entries_
+	std::uint64_t total_;
+};
+
+#endif
@@ -0,0 +1,316 @@
+/*
+ * File-backed second tier for pairs evicted from memory.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "spill_store.hh"
+
+namespace {
+
+// Offsets, sizes and buffers of direct I/O are multiples of this
+const std::size_t io_alignment = 4096;
+
+// The tier is split into about this many blocks, each between these sizes
+const std::uint64_t target_blocks = 16;
+const std::uint64_t min_block_size = 64 << 10;
+const std::uint64_t max_block_size = 4 << 20;
+
+// A record is a fixed header followed by the key and the value, padded to
+// a multiple of 8:
+//   hash         u64
+//   key size     u32
+//   value size   u32
+//   expires      i64
+//   compressed   u8, then 7 bytes of padding
+const std::size_t record_header_size = 32;
+
+std::uint64_t round_up(std::uint64_t n, std::uint64_t to) {
+	return (n + to - 1) / to * to;
+}
+
+char* allocate_block(std::size_t size) {
+	return static_cast<char*>(::operator new(size, std::align_val_t(io_alignment)));
+}
+
+void free_block(char* p) {
+	::operator delete(p, std::align_val_t(io_alignment));
+}
+
+// An aligned buffer for one read
+class read_buffer {
+public:
+	explicit read_buffer(std::size_t size) : data(allocate_block(size)) { }
+	~read_buffer() { free_block(data); }
+	read_buffer(const read_buffer&) = delete;
+	read_buffer& operator=(const read_buffer&) = delete;
+	char* const data;
+};
+
+}
+
+Spill_store::Spill_store(const std::string& path, std::uint64_t capacity)
+	: path_(path), fd_(-1), direct_(true), fill_(nullptr), fill_block_(0), fill_used_(0),
+	flushing_(nullptr), flushing_block_(no_block), generation_(0), versions_(0), size_(0),
+	bytes_(0), stopping_(false)
+{
+	block_size_ = std::clamp(capacity / target_blocks / io_alignment * io_alignment, min_block_size, max_block_size);
+	nblocks_ = static_cast<std::uint32_t>(std::clamp<std::uint64_t>(capacity / block_size_, 2, no_block - 1));
+
+	fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (fd_ < 0 && errno == EINVAL) {
+		//the filesystem has no direct I/O (tmpfs, for one)
+		direct_ = false;
+		fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd_ < 0) {
+		throw std::runtime_error("cannot open spill file " + path);
+	}
+	if (ftruncate(fd_, block_size_ * nblocks_) != 0) {
+		close(fd_);
+		std::remove(path.c_str());
+		throw std::runtime_error("cannot size spill file " + path);
+	}
+	fill_ = allocate_block(block_size_);
+	flushing_ = allocate_block(block_size_);
+	block_hashes_.resize(nblocks_);
+	block_uses_.resize(nblocks_, 0);
+	writer_ = std::thread(&Spill_store::run_writer, this);
+}
+
+Spill_store::~Spill_store() {
+	{
+		std::lock_guard guard(mutex_);
+		stopping_ = true;
+	}
+	filled_.notify_one();
+	writer_.join();
+	close(fd_);
+	std::remove(path_.c_str());
+	free_block(fill_);
+	free_block(flushing_);
+}
+
+bool Spill_store::put(std::uint64_t hash, std::string_view key, std::string_view value,
+		bool compressed, std::int64_t expires) {
+	auto size = round_up(record_header_size + key.size() + value.size(), 8);
+	if (size > block_size_) {
+		return false;
+	}
+	std::lock_guard guard(mutex_);
+	if (fill_used_ + size > block_size_) {
+		//the writer has not caught up: rather lose this pair than wait
+		if (flushing_block_ != no_block) {
+			return false;
+		}
+		std::swap(fill_, flushing_);
+		flushing_block_ = fill_block_;
+		filled_.notify_one();
+		next_block();
+	}
+
+	char* r = fill_ + fill_used_;
+	std::uint32_t key_size = key.size();
+	std::uint32_t value_size = value.size();
+	std::memset(r, 0, record_header_size);
+	std::memcpy(r, &hash, 8);
+	std::memcpy(r + 8, &key_size, 4);
+	std::memcpy(r + 12, &value_size, 4);
+	std::memcpy(r + 16, &expires, 8);
+	r[24] = compressed;
+	std::memcpy(r + record_header_size, key.data(), key.size());
+	std::memcpy(r + record_header_size + key.size(), value.data(), value.size());
+
+	location loc {std::string(key), fill_block_, static_cast<std::uint32_t>(fill_used_),
+		static_cast<std::uint32_t>(size), generation_, ++versions_, expires};
+	auto it = find(hash, key);
+	if (it == index_.end()) {
+		index_.emplace(hash, std::move(loc));
+	} else {
+		if (it -> second.generation == generation_) {
+			size_--;
+			bytes_ -= it -> second.size;
+		}
+		it -> second = std::move(loc);
+	}
+	block_hashes_[fill_block_].push_back(hash);
+	fill_used_ += size;
+	size_++;
+	bytes_ += size;
+	return true;
+}
+
+// Records in the two blocks in memory are copied under the lock; others are
+// read from the file without it, and only count if their block was not
+// reused by the time the read is done.
+bool Spill_store::get(std::uint64_t hash, std::string_view key, record& out) {
+	std::unique_lock lock(mutex_);
+	auto it = find(hash, key);
+	if (it == index_.end() || it -> second.generation != generation_) {
+		return false;
+	}
+	auto loc = it -> second;
+	std::string bytes;
+	if (loc.block == fill_block_ || loc.block == flushing_block_) {
+		const char* block = loc.block == fill_block_ ? fill_ : flushing_;
+		bytes.assign(block + loc.offset, loc.size);
+	} else {
+		auto uses = block_uses_[loc.block];
+		lock.unlock();
+		std::uint64_t pos = std::uint64_t(loc.block) * block_size_ + loc.offset;
+		std::uint64_t start = pos / io_alignment * io_alignment;
+		std::uint64_t length = round_up(pos + loc.size, io_alignment) - start;
+		read_buffer buffer(length);
+		for (std::uint64_t done = 0; done < length; ) {
+			auto n = pread(fd_, buffer.data + done, length - done, start + done);
+			if (n <= 0) {
+				return false;
+			}
+			done += n;
+		}
+		lock.lock();
+		if (block_uses_[loc.block] != uses) {
+			return false;
+		}
+		bytes.assign(buffer.data + (pos - start), loc.size);
+	}
+	lock.unlock();
+
+	const char* r = bytes.data();
+	std::uint64_t record_hash;
+	std::uint32_t key_size;
+	std::uint32_t value_size;
+	std::memcpy(&record_hash, r, 8);
+	std::memcpy(&key_size, r + 8, 4);
+	std::memcpy(&value_size, r + 12, 4);
+	if (record_hash != hash || record_header_size + std::uint64_t(key_size) + value_size > bytes.size()
+			|| std::string_view(r + record_header_size, key_size) != key) {
+		return false;
+	}
+	std::memcpy(&out.expires, r + 16, 8);
+	out.compressed = r[24] != 0;
+	out.value.assign(r + record_header_size + key_size, value_size);
+	out.version = loc.version;
+	return true;
+}
+
+bool Spill_store::take(std::uint64_t hash, std::string_view key, std::uint64_t version) {
+	std::lock_guard guard(mutex_);
+	auto it = find(hash, key);
+	if (it == index_.end() || it -> second.generation != generation_ || it -> second.version != version) {
+		return false;
+	}
+	drop(it);
+	return true;
+}
+
+bool Spill_store::erase(std::uint64_t hash, std::string_view key, std::int64_t now) {
+	std::lock_guard guard(mutex_);
+	auto it = find(hash, key);
+	if (it == index_.end()) {
+		return false;
+	}
+	if (it -> second.generation != generation_) {
+		index_.erase(it);
+		return false;
+	}
+	bool live = it -> second.expires == 0 || it -> second.expires > now;
+	drop(it);
+	return live;
+}
+
+//entries already in the index are left to their blocks' reuse
+void Spill_store::clear() {
+	std::lock_guard guard(mutex_);
+	generation_++;
+	size_ = 0;
+	bytes_ = 0;
+}
+
+std::uint64_t Spill_store::size() const {
+	std::lock_guard guard(mutex_);
+	return size_;
+}
+
+std::uint64_t Spill_store::bytes() const {
+	std::lock_guard guard(mutex_);
+	return bytes_;
+}
+
+Spill_store::index_type::iterator Spill_store::find(std::uint64_t hash, std::string_view key) {
+	auto range = index_.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it -> second.key == key) {
+			return it;
+		}
+	}
+	return index_.end();
+}
+
+void Spill_store::drop(index_type::iterator it) {
+	size_--;
+	bytes_ -= it -> second.size;
+	index_.erase(it);
+}
+
+void Spill_store::drop_block(std::uint32_t block) {
+	for (auto hash : block_hashes_[block]) {
+		auto range = index_.equal_range(hash);
+		for (auto it = range.first; it != range.second; ) {
+			//the pair may have been put again since, in another block
+			auto next = std::next(it);
+			if (it -> second.block == block) {
+				if (it -> second.generation == generation_) {
+					drop(it);
+				} else {
+					index_.erase(it);
+				}
+			}
+			it = next;
+		}
+	}
+	block_hashes_[block].clear();
+}
+
+void Spill_store::next_block() {
+	fill_block_ = (fill_block_ + 1) % nblocks_;
+	fill_used_ = 0;
+	block_uses_[fill_block_]++;
+	drop_block(fill_block_);
+}
+
+// Write out each filled block as it comes. A block that fails to write
+// loses its pairs.
+void Spill_store::run_writer() {
+	std::unique_lock lock(mutex_);
+	for (;;) {
+		filled_.wait(lock, [this]() { return flushing_block_ != no_block || stopping_; });
+		if (stopping_) {
+			break;
+		}
+		auto block = flushing_block_;
+		const char* data = flushing_;
+		lock.unlock();
+
+		bool ok = true;
+		std::uint64_t pos = std::uint64_t(block) * block_size_;
+		for (std::uint64_t done = 0; ok && done < block_size_; ) {
+			auto n = pwrite(fd_, data + done, block_size_ - done, pos + done);
+			ok = n > 0;
+			done += ok ? n : 0;
+		}
+
+		lock.lock();
+		if (!ok) {
+			drop_block(block);
+		}
+		flushing_block_ = no_block;
+	}
+}
@@ -0,0 +1,122 @@
+#ifndef SPILL_STORE_HH
+#define SPILL_STORE_HH
+
+/*
+ * File-backed second tier for pairs evicted from memory: a ring of blocks
+ * written whole by a thread of its own, with only the index in memory.
+ */
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class Spill_store {
+public:
+	// A record read back by get()
+	struct record {
+		std::string value;        // the bytes given to put()
+		bool compressed;
+		std::int64_t expires;     // wall clock ms since the Unix epoch, 0 for never
+		std::uint64_t version;    // tells this put of the pair apart, for take()
+	};
+
+	// Create the file at path (truncating any old one) as an empty tier
+	// of about capacity bytes, at least two blocks.
+	// Throws std::runtime_error if the file cannot be created.
+	Spill_store(const std::string& path, std::uint64_t capacity);
+	// The tier does not outlive the process: its file is removed.
+	~Spill_store();
+
+	Spill_store(const Spill_store&) = delete;
+	Spill_store& operator=(const Spill_store&) = delete;
+
+	// Add a pair, replacing any with the same key. Returns false, dropping
+	// the pair, if its record would not fit in a block or the writer is
+	// still busy with the previous block. Never waits on the disk.
+	bool put(std::uint64_t hash, std::string_view key, std::string_view value,
+		bool compressed, std::int64_t expires);
+
+	// Read the pair with key into out. Returns false if it is not here or
+	// its read failed.
+	bool get(std::uint64_t hash, std::string_view key, record& out);
+
+	// Remove the pair with key if it is still the put that get() returned
+	// as version. Returns true iff it was removed.
+	bool take(std::uint64_t hash, std::string_view key, std::uint64_t version);
+
+	// Remove the pair with key, if any. Returns true iff one was here and
+	// had not expired by now (wall clock ms).
+	bool erase(std::uint64_t hash, std::string_view key, std::int64_t now);
+
+	// Remove every pair. Takes the same time however many there are.
+	void clear();
+
+	std::uint64_t capacity() const { return block_size_ * nblocks_; }
+	// Pairs held, and the bytes of their records
+	std::uint64_t size() const;
+	std::uint64_t bytes() const;
+	// Whether the file was opened with O_DIRECT
+	bool direct_io() const { return direct_; }
+
+private:
+	// Where a pair's record is. Entries put before the last clear() are
+	// left behind, with an older generation, until their block is reused.
+	// Keys whose hashes collide have an entry each.
+	struct location {
+		std::string key;
+		std::uint32_t block;
+		std::uint32_t offset;
+		std::uint32_t size;
+		std::uint32_t generation;
+		std::uint64_t version;
+		std::int64_t expires;
+	};
+
+	static constexpr std::uint32_t no_block = ~std::uint32_t(0);
+
+	using index_type = std::unordered_multimap<std::uint64_t, location>;
+
+	// The entry for key, or index_.end()
+	index_type::iterator find(std::uint64_t hash, std::string_view key);
+	// Drop the entry at it, which must be of the current generation
+	void drop(index_type::iterator it);
+	// Drop every entry whose record is in block
+	void drop_block(std::uint32_t block);
+	// Start filling the next block of the ring, dropping what it held
+	void next_block();
+	void run_writer();
+
+	std::string path_;
+	int fd_;
+	bool direct_;
+	std::uint64_t block_size_;
+	std::uint32_t nblocks_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable filled_;       // a block is waiting for the writer
+	index_type index_;
+	// Hashes put in each block, to drop when it is reused
+	std::vector<std::vector<std::uint64_t>> block_hashes_;
+	// Bumped when a block starts being reused, so that a read that raced
+	// with its overwriting can tell
+	std::vector<std::uint64_t> block_uses_;
+	char* fill_;                           // the block being filled
+	std::uint32_t fill_block_;
+	std::uint64_t fill_used_;
+	char* flushing_;                       // the block being written
+	std::uint32_t flushing_block_;         // or no_block, if none is
+	std::uint32_t generation_;
+	std::uint64_t versions_;
+	std::uint64_t size_;
+	std::uint64_t bytes_;
+	bool stopping_;
+
+	std::thread writer_;
+};
+
+#endif
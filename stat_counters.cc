@@ -0,0 +1,48 @@
+/*
+ * 64-bit event counters that many threads bump without sharing cache lines.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include "stat_counters.hh"
+#include "thread_index.hh"
+
+namespace {
+
+const unsigned cache_line = 64;
+const unsigned per_line = cache_line / sizeof(std::atomic<std::uint64_t>);
+
+}
+
+Stat_counters::Stat_counters(unsigned ncounters)
+	: ncounters_(ncounters),
+	stride_((ncounters + per_line - 1) / per_line * per_line),
+	storage_(new counter_type[(max_threads + 1) * stride_ + per_line]()),
+	base_(new counter_type[ncounters]())
+{
+	auto p = reinterpret_cast<std::uintptr_t>(storage_.get());
+	rows_ = reinterpret_cast<counter_type*>((p + cache_line - 1) / cache_line * cache_line);
+}
+
+unsigned Stat_counters::thread_row() {
+	return std::min(thread_index(), max_threads);
+}
+
+std::uint64_t Stat_counters::total(unsigned counter) const {
+	std::uint64_t total = 0;
+	unsigned n = std::min(thread_index_limit(), max_threads + 1);
+	for (unsigned i = 0; i < n; i++) {
+		total += row(i)[counter].load(std::memory_order_relaxed);
+	}
+	return total;
+}
+
+std::uint64_t Stat_counters::sum(unsigned counter) const {
+	return total(counter) - base_[counter].load(std::memory_order_relaxed);
+}
+
+void Stat_counters::clear() {
+	for (unsigned c = 0; c < ncounters_; c++) {
+		base_[c].store(total(c), std::memory_order_relaxed);
+	}
+}
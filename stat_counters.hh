@@ -0,0 +1,67 @@
+#ifndef STAT_COUNTERS_HH
+#define STAT_COUNTERS_HH
+
+/*
+ * 64-bit event counters that many threads bump without sharing cache lines.
+ *
+ * Every thread adds to its own row of counters, padded to whole cache
+ * lines, with a plain load and store: no locked instruction, and no line
+ * bouncing between cores. Reading a counter sums it over all rows, so
+ * reads are slower and may miss increments that are in flight, which is
+ * fine for statistics.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+class Stat_counters {
+public:
+	// Threads with a row of their own; any others share one more row,
+	// which they add to with locked instructions
+	static constexpr unsigned max_threads = 256;
+
+	// ncounters: Number of counters, numbered from 0.
+	explicit Stat_counters(unsigned ncounters);
+
+	Stat_counters(const Stat_counters&) = delete;
+	Stat_counters& operator=(const Stat_counters&) = delete;
+
+	// Add n to a counter, from the calling thread's row.
+	void add(unsigned counter, std::uint64_t n = 1) {
+		auto i = thread_row();
+		auto& c = row(i)[counter];
+		if (i < max_threads) {
+			c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		} else {
+			c.fetch_add(n, std::memory_order_relaxed);
+		}
+	}
+
+	// The counter's total since construction or the last clear()
+	std::uint64_t sum(unsigned counter) const;
+
+	// Start every counter over from zero. Rows are never written by other
+	// threads: the current totals are remembered and subtracted instead.
+	void clear();
+
+private:
+	using counter_type = std::atomic<std::uint64_t>;
+
+	// Row of the calling thread; max_threads for the shared row
+	static unsigned thread_row();
+
+	counter_type* row(unsigned i) { return rows_ + i * stride_; }
+	const counter_type* row(unsigned i) const { return rows_ + i * stride_; }
+
+	// Sum of a counter over all rows
+	std::uint64_t total(unsigned counter) const;
+
+	unsigned ncounters_;
+	unsigned stride_;   // counters per row, rounded up to whole cache lines
+	std::unique_ptr<counter_type[]> storage_;
+	counter_type* rows_;   // the first cache line boundary in storage_
+	std::unique_ptr<counter_type[]> base_;   // totals at the last clear()
+};
+
+#endif
@@ -4,9 +4,11 @@
  */
 #define CATCH_CONFIG_MAIN
 #include "cache.hh"
+#include <algorithm>
 #include <assert.h>
 #include <iostream> 
 #include <chrono>
+#include <thread>
 #include "catch.hpp"
 //#include <catch2/catch.hpp>
 
@@ -373,3 +375,116 @@ TEST_CASE("Race Conditions", "[cache]") {
 
 	
 }
+
+TEST_CASE("Binary values", "[cache]") {
+	//embedded NULs, a '/' and no terminator
+	const char bytes[] = {'x', '\0', '/', '\0', '\xff', 'z'};
+	Cache::val_type test_value {bytes, sizeof(bytes)};
+
+	SECTION("Values round trip byte for byte") {
+		REQUIRE(test_cache.set("bin", test_value));
+		Cache::val_type check_value = test_cache.get("bin");
+		REQUIRE(check_value.size_ == sizeof(bytes));
+		for (unsigned i = 0; i < sizeof(bytes); i++) {
+			REQUIRE(check_value.data_[i] == bytes[i]);
+		}
+		delete[] check_value.data_;
+		REQUIRE(test_cache.space_used() == sizeof(bytes));
+	}
+
+	test_cache.reset();
+}
+
+TEST_CASE("Batches", "[cache]") {
+	//binary values, including one holding a newline
+	const char bytes[] = {'x', '\n', '\0', 'y'};
+	Cache::val_type test_value {bytes, sizeof(bytes)};
+
+	SECTION("mset, mget and mdel round trip") {
+		auto stored = test_cache.mset({{"a", test_value}, {"b", Cache::val_type {"bb", 2}}});
+		REQUIRE(stored == std::vector<bool> {true, true});
+
+		auto values = test_cache.mget({"a", "missing", "b"});
+		REQUIRE(values.size() == 3);
+		REQUIRE(values[0].size() == sizeof(bytes));
+		REQUIRE(std::equal(bytes, bytes + sizeof(bytes), values[0].data()));
+		REQUIRE(!values[1]);
+		REQUIRE(std::string(values[2].data(), values[2].size()) == "bb");
+
+		REQUIRE(test_cache.mdel({"a", "missing", "b"}) == 2);
+		REQUIRE(test_cache.space_used() == 0);
+	}
+
+	test_cache.reset();
+}
+
+TEST_CASE("Time to live", "[cache]") {
+	using std::chrono::milliseconds;
+	Cache::val_type test_value {"value", 5};
+
+	REQUIRE(test_cache.set("short", test_value, milliseconds(20)));
+	REQUIRE(test_cache.mset({{"batch", test_value}}, milliseconds(20)) == std::vector<bool> {true});
+	REQUIRE(test_cache.set("forever", test_value));
+	REQUIRE(test_cache.get_ref("short"));
+	std::this_thread::sleep_for(milliseconds(60));
+	REQUIRE(!test_cache.get_ref("short"));
+	REQUIRE(!test_cache.get_ref("batch"));
+	REQUIRE(test_cache.get_ref("forever"));
+
+	test_cache.reset();
+}
+
+TEST_CASE("Compare and swap", "[cache]") {
+	Cache::val_type one {"1", 1};
+	Cache::val_type two {"2", 1};
+
+	REQUIRE(test_cache.cas("k", one, 0));
+	REQUIRE(!test_cache.cas("k", two, 0));
+	auto read = test_cache.get_ref("k");
+	REQUIRE(read.version() != 0);
+	REQUIRE(test_cache.mget({"k"})[0].version() == read.version());
+	REQUIRE(test_cache.cas("k", two, read.version()));
+	std::uint64_t current;
+	REQUIRE(!test_cache.cas("k", one, read.version(), current));
+	auto now = test_cache.get_ref("k");
+	REQUIRE(std::string(now.data(), now.size()) == "2");
+	REQUIRE(now.version() != read.version());
+	REQUIRE(current == now.version());
+
+	test_cache.reset();
+}
+
+TEST_CASE("Counters and appends", "[cache]") {
+	std::int64_t value = 0;
+
+	REQUIRE(test_cache.incr("n", 5, value));
+	REQUIRE(test_cache.decr("n", 2, value));
+	REQUIRE(value == 3);
+	auto read = test_cache.get_ref("n");
+	REQUIRE(std::string(read.data(), read.size()) == "3");
+	REQUIRE(test_cache.set("word", Cache::val_type {"ten", 3}));
+	REQUIRE(!test_cache.incr("word", 1, value));
+
+	REQUIRE(test_cache.append("word", Cache::val_type {"th", 2}));
+	REQUIRE(test_cache.prepend("word", Cache::val_type {"a ", 2}));
+	auto word = test_cache.get_ref("word");
+	REQUIRE(std::string(word.data(), word.size()) == "a tenth");
+	REQUIRE(!test_cache.append("missing", Cache::val_type {"a", 1}));
+
+	test_cache.reset();
+}
+
+TEST_CASE("Hot keys", "[cache]") {
+	REQUIRE(!test_cache.track_hot_keys(4));
+	REQUIRE(test_cache.set("hotkey", Cache::val_type {"value", 5}));
+	for (unsigned i = 0; i < 5000; i++) {
+		auto read = test_cache.get_ref("hotkey");
+		REQUIRE(std::string(read.data(), read.size()) == "value");
+	}
+	//the server tracks hot keys only when started with --hot-keys
+	auto hot = test_cache.hot_keys();
+	auto found = std::find_if(hot.begin(), hot.end(), [](auto& h) { return h.first == "hotkey"; });
+	REQUIRE((hot.empty() || (found != hot.end() && found -> second > 0)));
+
+	test_cache.reset();
+}
@@ -4,9 +4,18 @@
  */
 #define CATCH_CONFIG_MAIN
 #include "cache.hh"
+#include "lru_evictor.hh"
+#include "numa.hh"
+#include <algorithm>
+#include <atomic>
 #include <assert.h>
+#include <cstdio>
+#include <fstream>
 #include <iostream> 
+#include <limits>
 #include <chrono>
+#include <thread>
+#include <vector>
 #include "catch.hpp"
 //#include <catch2/catch.hpp>
 
@@ -22,7 +31,7 @@ void fill_array(char *test_array, unsigned array_size) {
 //and st stored in hf to be passed to a cache constructor 
 //later.
 
-size_t hf_fast(key_type key) {
+size_t hf_fast(key_view key) {
 	size_t hashed = 0;
 	for(auto j = 0; j < (int)key.size(); j++) {
 		hashed += 17 * (int)key[j] % 3;
@@ -30,7 +39,7 @@ size_t hf_fast(key_type key) {
 	return hashed;
 }
 
-size_t hf_slow(key_type key) {
+size_t hf_slow(key_view key) {
 	size_t hashed = 0;
 	for(auto i = 0; i < 1000000; i++) {
 		for(auto j = 0; j < (int)key.size(); j++) {
@@ -45,7 +54,7 @@ size_t hf_slow(key_type key) {
 Cache::hash_func fast = hf_fast;
 Cache::hash_func slow = hf_slow;
 
-Cache test_cache {200,0.75,nullptr,std::hash<key_type>()};
+Cache test_cache {200,0.75,nullptr,std::hash<key_view>()};
 Cache fast_cache {200,0.75,nullptr,hf_fast};
 Cache slow_cache {200,0.75,nullptr,hf_slow};
 
@@ -383,6 +392,39 @@ TEST_CASE("Reset", "[cache]") {
 		test_cache.reset();
 	}
 	
+	SECTION("Reset empties the cache at once and frees it in the background") {
+		Cache cache(100000000, 0.75, nullptr, std::hash<key_view>(), 4);
+		const unsigned NUM_OBJ = 100000;
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			auto key = "key" + std::to_string(i);
+			cache.set(key, Cache::val_type{key.data(), Cache::size_type(key.size())}, std::chrono::seconds(100));
+		}
+		Cache::value_handle held = cache.get_ref("key7");
+		REQUIRE(cache.stats()["slab_memory_used"] > 0);
+
+		REQUIRE(cache.reset());
+		REQUIRE(cache.space_used() == 0);
+		REQUIRE(!cache.get_ref("key7"));
+		REQUIRE(cache.set("key7", Cache::val_type{"new", 3}));
+		REQUIRE(cache.get_ref("key7").size() == 3);
+
+		//everything but the new item and the held one goes back
+		auto used_chunks = [&cache]() {
+			double used = 0;
+			for (auto& stat : cache.stats()) {
+				if (stat.first.find("_used_chunks") != std::string::npos) {
+					used += stat.second;
+				}
+			}
+			return used;
+		};
+		for (int i = 0; i < 5000 && used_chunks() > 2; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		REQUIRE(used_chunks() == 2);
+		REQUIRE(std::string(held.data(), held.size()) == "key7");
+	}
+
 	SECTION("Reset works on empty cache") {
 				
 		REQUIRE(test_cache.reset());
@@ -441,3 +483,1412 @@ TEST_CASE("Hashing", "[cache]") {
 	fast_cache.reset();
 	slow_cache.reset();
 }
+
+TEST_CASE("Sharding", "[cache]") {
+	const unsigned NUM_SHARDS = 8;
+	const unsigned NUM_THREADS = 4;
+	const unsigned NUM_OBJ = 1000;
+	unsigned array_size = 10;
+	char *test_array = new char[array_size];
+	fill_array(test_array, array_size);
+	Cache::val_type test_value {test_array, array_size};
+
+	SECTION("Concurrent sets and gets on a sharded cache") {
+		Cache sharded_cache {1000000, 0.75, nullptr, std::hash<key_view>(), NUM_SHARDS};
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < NUM_THREADS; t++) {
+			threads.emplace_back([&sharded_cache, &test_value, t]() {
+				for (unsigned i = t; i < NUM_OBJ; i += NUM_THREADS) {
+					sharded_cache.set(std::to_string(i), test_value);
+					delete[] sharded_cache.get(std::to_string(i)).data_;
+				}
+			});
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+
+		REQUIRE(sharded_cache.space_used() == NUM_OBJ * array_size);
+		REQUIRE(sharded_cache.hit_rate() == 1.0);
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			Cache::val_type check_value = sharded_cache.get(std::to_string(i));
+			REQUIRE(check_value.size_ == array_size);
+			delete[] check_value.data_;
+		}
+	}
+
+	SECTION("Each shard evicts within its own slice of maxmem") {
+		Lru_evictor lru;
+		Cache sharded_cache {NUM_SHARDS * 10 * array_size, 0.75, &lru, std::hash<key_view>(), NUM_SHARDS};
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(sharded_cache.set(std::to_string(i), test_value));
+			REQUIRE(sharded_cache.space_used() <= NUM_SHARDS * 10 * array_size);
+		}
+		Cache::val_type check_value = sharded_cache.get(std::to_string(NUM_OBJ - 1));
+		REQUIRE(check_value.data_ != nullptr);
+		delete[] check_value.data_;
+	}
+
+	delete[] test_value.data_;
+}
+
+// An evictor that only implements the key interface, evicting keys in the
+// order they were first touched
+class Key_fifo : public Evictor {
+ public:
+	void touch_key(key_view key) {
+		if (std::find(keys.begin(), keys.end(), key) == keys.end()) {
+			keys.emplace_back(key);
+		}
+	}
+	const key_type evict() {
+		if (keys.empty()) {
+			return "";
+		}
+		auto key = keys.front();
+		keys.erase(keys.begin());
+		return key;
+	}
+	std::unique_ptr<Evictor> clone_empty() const {
+		return std::unique_ptr<Evictor>(new Key_fifo());
+	}
+ private:
+	std::vector<key_type> keys;
+};
+
+TEST_CASE("Eviction", "[cache]") {
+	std::string value(10, 'v');
+	Cache::val_type test_value {value.data(), value.size()};
+	auto present = [](Cache& cache, const std::string& key) {
+		return bool(cache.get_ref(key));
+	};
+
+	SECTION("LRU evicts the pair used least recently") {
+		Lru_evictor lru;
+		Cache cache {40, 0.75, &lru, std::hash<key_view>(), 1};
+		for (auto key : {"k0", "k1", "k2", "k3"}) {
+			REQUIRE(cache.set(key, test_value));
+		}
+		REQUIRE(present(cache, "k0"));
+		REQUIRE(cache.set("k4", test_value));
+		REQUIRE(!present(cache, "k1"));
+		REQUIRE(cache.del("k2"));
+		REQUIRE(cache.set("k2", test_value));
+		REQUIRE(cache.set("k5", test_value));
+		REQUIRE(!present(cache, "k3"));
+		REQUIRE(cache.set("k0", test_value));
+		REQUIRE(cache.set("k6", test_value));
+		REQUIRE(!present(cache, "k4"));
+		for (auto key : {"k0", "k2", "k5", "k6"}) {
+			REQUIRE(present(cache, key));
+		}
+
+		cache.reset();
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(cache.set("after" + std::to_string(i), test_value));
+			REQUIRE(cache.space_used() <= 40);
+		}
+		REQUIRE(present(cache, "after99"));
+		REQUIRE(!present(cache, "after95"));
+	}
+
+	SECTION("Evictors that only know keys still work") {
+		Key_fifo fifo;
+		Cache cache {40, 0.75, &fifo, std::hash<key_view>(), 1};
+		for (unsigned i = 0; i < 6; i++) {
+			REQUIRE(cache.set("k" + std::to_string(i), test_value));
+		}
+		REQUIRE(!present(cache, "k0"));
+		REQUIRE(!present(cache, "k1"));
+		//the evictor still offers k2, which is gone
+		REQUIRE(cache.del("k2"));
+		REQUIRE(cache.set("k6", test_value));
+		REQUIRE(cache.set("k7", test_value));
+		REQUIRE(!present(cache, "k3"));
+		for (auto key : {"k4", "k5", "k6", "k7"}) {
+			REQUIRE(present(cache, key));
+		}
+	}
+}
+
+TEST_CASE("Value handles", "[cache]") {
+	unsigned array_size = 10;
+	char *test_array = new char[array_size];
+	fill_array(test_array, array_size);
+	Cache::val_type test_value {test_array, array_size};
+	test_cache.set("a", test_value);
+
+	SECTION("get_ref returns an empty handle on a miss") {
+		Cache::value_handle handle = test_cache.get_ref("b");
+		REQUIRE(!handle);
+		REQUIRE(handle.data() == nullptr);
+		REQUIRE(handle.size() == 0);
+	}
+
+	SECTION("get_ref returns the stored bytes") {
+		Cache::value_handle handle = test_cache.get_ref("a");
+		REQUIRE(handle);
+		REQUIRE(handle.size() == array_size);
+		for(unsigned i = 0; i < array_size; i++) {
+			REQUIRE(handle.data()[i] == test_value.data_[i]);
+		}
+	}
+
+	SECTION("Handles outlive delete and overwrite") {
+		Cache::value_handle handle = test_cache.get_ref("a");
+		Cache::value_handle copy = handle;
+		test_cache.del("a");
+		REQUIRE(copy.data() == handle.data());
+		for(unsigned i = 0; i < array_size; i++) {
+			REQUIRE(handle.data()[i] == test_value.data_[i]);
+		}
+
+		char *new_array = new char[2];
+		fill_array(new_array, 2);
+		Cache::val_type new_value {new_array, 2};
+		test_cache.set("a", new_value);
+		Cache::value_handle new_handle = test_cache.get_ref("a");
+		REQUIRE(new_handle.size() == 2);
+		REQUIRE(handle.size() == array_size);
+		delete[] new_array;
+	}
+
+	delete[] test_value.data_;
+	test_cache.reset();
+}
+
+TEST_CASE("Slab stats", "[cache]") {
+	//the chunks of earlier tests' resets may still be on their way back
+	for (int i = 0; i < 1000 && test_cache.stats().count("slab_class_0_used_chunks") > 0; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	unsigned array_size = 10;
+	char *test_array = new char[array_size];
+	fill_array(test_array, array_size);
+	Cache::val_type test_value {test_array, array_size};
+	test_cache.set("a", test_value);
+	test_cache.set("b", test_value);
+
+	auto stats = test_cache.stats();
+	REQUIRE(stats["slab_memory_used"] > 0);
+	REQUIRE(stats["slab_memory_used"] <= stats["slab_memory_limit"] + 4096);
+	REQUIRE(stats["slab_class_0_used_chunks"] == 2);
+	REQUIRE(stats["slab_class_0_fragmentation"] > 0);
+	REQUIRE(stats["slab_class_0_utilization"] > 0);
+
+	//reset releases the items in the background
+	test_cache.reset();
+	for (int i = 0; i < 1000 && test_cache.stats().count("slab_class_0_used_chunks") > 0; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	stats = test_cache.stats();
+	REQUIRE(stats.count("slab_class_0_used_chunks") == 0);
+
+	delete[] test_value.data_;
+}
+
+TEST_CASE("Binary values", "[cache]") {
+	//embedded NULs and no terminator
+	const char bytes[] = {'x', '\0', 'y', '\0', '\xff', 'z'};
+	Cache::val_type test_value {bytes, sizeof(bytes)};
+
+	SECTION("Values round trip byte for byte") {
+		REQUIRE(test_cache.set("bin", test_value));
+		Cache::val_type check_value = test_cache.get("bin");
+		REQUIRE(check_value.size_ == sizeof(bytes));
+		for (unsigned i = 0; i < sizeof(bytes); i++) {
+			REQUIRE(check_value.data_[i] == bytes[i]);
+		}
+		delete[] check_value.data_;
+
+		Cache::value_handle handle = test_cache.get_ref("bin");
+		REQUIRE(handle.size() == sizeof(bytes));
+		REQUIRE(std::equal(bytes, bytes + sizeof(bytes), handle.data()));
+		REQUIRE(test_cache.space_used() == sizeof(bytes));
+	}
+
+	test_cache.reset();
+}
+
+TEST_CASE("Lock-free lookups", "[cache]") {
+	const unsigned NUM_READERS = 3;
+	const unsigned NUM_KEYS = 64;
+	const unsigned NUM_WRITES = 20000;
+
+	//every value starts with its key and then the round it was written in,
+	//so a reader can tell a torn or misdirected lookup from a stale one
+	auto value_for = [](unsigned key, unsigned round) {
+		return std::to_string(key) + ":" + std::to_string(round) + std::string(round % 50, '.');
+	};
+
+	SECTION("Readers see whole values while a writer overwrites and deletes") {
+		Lru_evictor lru;
+		Cache cache {16 * 1024, 0.75, &lru, std::hash<key_view>(), 2};
+		std::atomic<bool> done {false};
+		std::atomic<unsigned> bad {0};
+		std::vector<std::thread> readers;
+		for (unsigned t = 0; t < NUM_READERS; t++) {
+			readers.emplace_back([&cache, &done, &bad, t]() {
+				for (unsigned i = t; !done.load(); i++) {
+					auto key = std::to_string(i % NUM_KEYS);
+					Cache::value_handle handle = cache.get_ref(key);
+					if (!handle) {
+						continue;
+					}
+					std::string value(handle.data(), handle.size());
+					if (value.compare(0, key.size() + 1, key + ":") != 0) {
+						bad++;
+					}
+				}
+			});
+		}
+		for (unsigned i = 0; i < NUM_WRITES; i++) {
+			unsigned key = i % NUM_KEYS;
+			if (i % 7 == 0) {
+				cache.del(std::to_string(key));
+			} else {
+				auto value = value_for(key, i);
+				cache.set(std::to_string(key), Cache::val_type {value.data(), value.size()});
+			}
+		}
+		done = true;
+		for (auto& t : readers) {
+			t.join();
+		}
+		REQUIRE(bad == 0);
+		REQUIRE(cache.space_used() <= 16 * 1024);
+	}
+
+	SECTION("More readers than the store has per-thread slots") {
+		const unsigned MANY_READERS = 300;
+		Lru_evictor lru;
+		Cache cache {16 * 1024, 0.75, &lru, std::hash<key_view>(), 2};
+		for (unsigned key = 0; key < NUM_KEYS; key++) {
+			auto value = value_for(key, 0);
+			REQUIRE(cache.set(std::to_string(key), Cache::val_type {value.data(), value.size()}));
+		}
+		std::atomic<unsigned> started {0};
+		std::atomic<unsigned> bad {0};
+		std::vector<std::thread> readers;
+		for (unsigned t = 0; t < MANY_READERS; t++) {
+			readers.emplace_back([&cache, &started, &bad, t]() {
+				//every reader is alive at once, so some get no slot of their own
+				started++;
+				while (started != MANY_READERS) {
+					std::this_thread::yield();
+				}
+				try {
+					for (unsigned i = t; i < t + 100; i++) {
+						auto key = std::to_string(i % NUM_KEYS);
+						auto handle = cache.get_ref(key);
+						if (!handle || std::string(handle.data(), handle.size()).compare(0, key.size() + 1, key + ":") != 0) {
+							bad++;
+						}
+					}
+				} catch (...) {
+					bad++;
+				}
+			});
+		}
+		for (auto& t : readers) {
+			t.join();
+		}
+		REQUIRE(bad == 0);
+		REQUIRE(cache.stats()["hits"] == MANY_READERS * 100);
+	}
+}
+
+TEST_CASE("Event counters", "[cache]") {
+	Lru_evictor lru;
+	Cache cache {100, 0.75, &lru};
+	const char bytes[40] = {};
+	Cache::val_type value {bytes, sizeof(bytes)};
+
+	REQUIRE(cache.set("a", value));
+	REQUIRE(cache.set("a", value));
+	REQUIRE(cache.set("b", value));
+	REQUIRE(cache.set("c", value));
+	REQUIRE(!cache.set("big", Cache::val_type {bytes, 101}));
+	cache.get_ref("c");
+	cache.get_ref("a");
+	REQUIRE(cache.del("c"));
+	REQUIRE(!cache.del("c"));
+
+	auto stats = cache.stats();
+	REQUIRE(stats["sets"] == 4);
+	REQUIRE(stats["overwrites"] == 1);
+	REQUIRE(stats["evictions"] == 1);
+	REQUIRE(stats["bytes_evicted"] == sizeof(bytes));
+	REQUIRE(stats["rejected_sets"] == 1);
+	REQUIRE(stats["hits"] == 1);
+	REQUIRE(stats["misses"] == 1);
+	REQUIRE(stats["deletes"] == 1);
+	REQUIRE(stats["bytes_in"] == 4 * sizeof(bytes));
+	REQUIRE(stats["bytes_out"] == sizeof(bytes));
+
+	cache.reset();
+	stats = cache.stats();
+	REQUIRE(stats["sets"] == 0);
+	REQUIRE(stats["hits"] == 0);
+}
+
+TEST_CASE("Batches", "[cache]") {
+	Cache cache {1000000, 0.75, nullptr, std::hash<key_view>(), 4};
+	const unsigned NUM_OBJ = 200;
+	std::vector<std::string> keys;
+	for (unsigned i = 0; i < NUM_OBJ; i++) {
+		keys.push_back("key" + std::to_string(i));
+	}
+
+	SECTION("mset stores every pair and mget returns them in order") {
+		std::vector<std::pair<key_view, Cache::val_type>> items;
+		for (auto& k : keys) {
+			items.emplace_back(k, Cache::val_type {k.data(), k.size()});
+		}
+		auto stored = cache.mset(items);
+		REQUIRE(std::count(stored.begin(), stored.end(), true) == NUM_OBJ);
+
+		std::vector<key_view> lookups(keys.begin(), keys.end());
+		lookups.push_back("missing");
+		auto values = cache.mget(lookups);
+		REQUIRE(values.size() == NUM_OBJ + 1);
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(std::string(values[i].data(), values[i].size()) == keys[i]);
+		}
+		REQUIRE(!values[NUM_OBJ]);
+		REQUIRE(cache.hit_rate() == Approx(double(NUM_OBJ) / (NUM_OBJ + 1)));
+	}
+
+	SECTION("The last pair for a key wins") {
+		auto stored = cache.mset({{"k", Cache::val_type {"1", 1}}, {"k", Cache::val_type {"22", 2}}});
+		REQUIRE(stored == std::vector<bool> {true, true});
+		REQUIRE(cache.get_ref("k").size() == 2);
+		REQUIRE(cache.space_used() == 2);
+	}
+
+	SECTION("mdel counts the keys it deleted") {
+		for (unsigned i = 0; i < NUM_OBJ; i += 2) {
+			cache.set(keys[i], Cache::val_type {"v", 1});
+		}
+		std::vector<key_view> dels(keys.begin(), keys.end());
+		REQUIRE(cache.mdel(dels) == NUM_OBJ / 2);
+		REQUIRE(cache.space_used() == 0);
+		REQUIRE(cache.mdel({}) == 0);
+	}
+}
+
+TEST_CASE("Compare and swap", "[cache]") {
+	Cache cache {1000000, 0.75, nullptr, std::hash<key_view>(), 4};
+	Cache::val_type one {"1", 1};
+	Cache::val_type two {"2", 1};
+
+	SECTION("Every set gives the value a new version") {
+		REQUIRE(cache.get_ref("k").version() == 0);
+		REQUIRE(cache.set("k", one));
+		auto first = cache.get_ref("k").version();
+		REQUIRE(first != 0);
+		REQUIRE(cache.set("k", one));
+		REQUIRE(cache.get_ref("k").version() > first);
+		REQUIRE(cache.mget({"k"})[0].version() == cache.get_ref("k").version());
+	}
+
+	SECTION("A value is only replaced at the version it was read at") {
+		REQUIRE(cache.set("k", one));
+		auto read = cache.get_ref("k");
+		REQUIRE(cache.cas("k", two, read.version()));
+		std::uint64_t current;
+		REQUIRE(!cache.cas("k", one, read.version(), current));
+		REQUIRE(current == cache.get_ref("k").version());
+		REQUIRE(current != read.version());
+		REQUIRE(std::string(cache.get_ref("k").data(), 1) == "2");
+		REQUIRE(cache.stats()["cas_mismatches"] == 1);
+		//the handle still reads what it read
+		REQUIRE(std::string(read.data(), 1) == "1");
+	}
+
+	SECTION("Version 0 only stores a key that is not there") {
+		REQUIRE(cache.cas("k", one, 0));
+		REQUIRE(!cache.cas("k", two, 0));
+		REQUIRE(cache.del("k"));
+		std::uint64_t current;
+		REQUIRE(!cache.cas("k", two, 1, current));
+		REQUIRE(current == 0);
+		REQUIRE(cache.cas("k", two, 0));
+		//a value that cannot fit fails at the version it expected
+		std::string big(2000000, 'x');
+		REQUIRE(!cache.cas("big", Cache::val_type {big.data(), big.size()}, 0, current));
+		REQUIRE(current == 0);
+	}
+
+	SECTION("Concurrent increments through cas lose no update") {
+		const unsigned nthreads = 4;
+		const unsigned per_thread = 2000;
+		std::string zero = "0";
+		REQUIRE(cache.set("counter", Cache::val_type {zero.data(), zero.size()}));
+		std::atomic<bool> lost {false};
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < nthreads; t++) {
+			threads.emplace_back([&cache, &lost]() {
+				for (unsigned i = 0; i < per_thread; i++) {
+					for (;;) {
+						auto current = cache.get_ref("counter");
+						//a lookup racing with the set that replaces the value can miss it
+						if (!current) {
+							if (lost) {
+								return;
+							}
+							continue;
+						}
+						auto next = std::to_string(std::stoul(std::string(current.data(), current.size())) + 1);
+						std::uint64_t now;
+						if (cache.cas("counter", Cache::val_type {next.data(), next.size()}, current.version(), now)) {
+							break;
+						}
+						//a store that failed took the counter with it
+						if (now == 0) {
+							lost = true;
+							return;
+						}
+					}
+				}
+			});
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+		REQUIRE_FALSE(lost);
+		auto total = cache.get_ref("counter");
+		REQUIRE(std::string(total.data(), total.size()) == std::to_string(nthreads * per_thread));
+	}
+}
+
+TEST_CASE("Counters and appends", "[cache]") {
+	Cache cache {1000000, 0.75, nullptr, std::hash<key_view>(), 4};
+	auto text = [](const Cache::value_handle& h) { return std::string(h.data(), h.size()); };
+	std::int64_t value = 0;
+
+	SECTION("A missing key counts from 0, and later increments are made in place") {
+		REQUIRE(cache.incr("n", 5, value));
+		REQUIRE(value == 5);
+		auto first = cache.get_ref("n");
+		REQUIRE(text(first) == "5");
+		REQUIRE(cache.incr("n", 10, value));
+		REQUIRE(cache.decr("n", 3, value));
+		REQUIRE(value == 12);
+		auto now = cache.get_ref("n");
+		REQUIRE(text(now) == "12");
+		REQUIRE(now.version() != first.version());
+		REQUIRE(text(first) == "5");
+		REQUIRE(text(cache.mget({"n"})[0]) == "12");
+		auto stats = cache.stats();
+		REQUIRE(stats["incrs"] == 3);
+		REQUIRE(stats["in_place_updates"] == 2);
+	}
+
+	SECTION("A value set as text is parsed, and anything else is refused") {
+		REQUIRE(cache.set("n", Cache::val_type {"-40", 3}));
+		REQUIRE(cache.incr("n", 2, value));
+		REQUIRE(value == -38);
+		REQUIRE(cache.set("word", Cache::val_type {"ten", 3}));
+		REQUIRE(!cache.incr("word", 1, value));
+		REQUIRE(text(cache.get_ref("word")) == "ten");
+		REQUIRE(cache.set("max", Cache::val_type {"9223372036854775807", 19}));
+		REQUIRE(!cache.incr("max", 1, value));
+		REQUIRE(!cache.decr("n", std::numeric_limits<std::int64_t>::min(), value));
+	}
+
+	SECTION("Concurrent increments lose no update") {
+		const unsigned nthreads = 4;
+		const unsigned per_thread = 2000;
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < nthreads; t++) {
+			threads.emplace_back([&cache]() {
+				std::int64_t v;
+				for (unsigned i = 0; i < per_thread; i++) {
+					cache.incr("counter", 1, v);
+				}
+			});
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+		REQUIRE(text(cache.get_ref("counter")) == std::to_string(nthreads * per_thread));
+	}
+
+	SECTION("Appends grow the value in place while its chunk has room") {
+		REQUIRE(cache.set("s", Cache::val_type {"a", 1}));
+		auto before = cache.get_ref("s");
+		for (int i = 0; i < 40; i++) {
+			REQUIRE(cache.append("s", Cache::val_type {"b", 1}));
+		}
+		REQUIRE(text(cache.get_ref("s")) == "a" + std::string(40, 'b'));
+		REQUIRE(cache.space_used() == 41);
+		auto stats = cache.stats();
+		REQUIRE(stats["appends"] == 40);
+		REQUIRE(stats["in_place_updates"] > 0);
+		REQUIRE(stats["in_place_updates"] < 40);
+		//a handle keeps what it read
+		REQUIRE(text(before) == "a");
+		REQUIRE(cache.get_ref("s").version() != before.version());
+	}
+
+	SECTION("Prepends, and appends to counters, store the joined value") {
+		REQUIRE(cache.set("s", Cache::val_type {"b", 1}));
+		REQUIRE(cache.prepend("s", Cache::val_type {"a", 1}));
+		REQUIRE(text(cache.get_ref("s")) == "ab");
+		REQUIRE(cache.incr("n", 7, value));
+		REQUIRE(cache.append("n", Cache::val_type {"0", 1}));
+		REQUIRE(cache.incr("n", 1, value));
+		REQUIRE(value == 71);
+		REQUIRE(!cache.append("missing", Cache::val_type {"a", 1}));
+		REQUIRE(!cache.get_ref("missing"));
+	}
+
+	SECTION("Both keep the key's time to live") {
+		using std::chrono::milliseconds;
+		REQUIRE(cache.set("s", Cache::val_type {"a", 1}, milliseconds(20)));
+		REQUIRE(cache.incr("n", 1, value, milliseconds(20)));
+		REQUIRE(cache.append("s", Cache::val_type {"b", 1}));
+		REQUIRE(cache.incr("n", 1, value, milliseconds(100000)));
+		std::this_thread::sleep_for(milliseconds(60));
+		REQUIRE(!cache.get_ref("s"));
+		REQUIRE(!cache.get_ref("n"));
+	}
+}
+
+TEST_CASE("Time to live", "[cache]") {
+	Lru_evictor lru;
+	Cache cache {1000, 0.75, &lru, std::hash<key_view>(), 2};
+	const char bytes[40] = {};
+	Cache::val_type value {bytes, sizeof(bytes)};
+	using std::chrono::milliseconds;
+
+	SECTION("An expired key reads as a miss") {
+		REQUIRE(cache.set("short", value, milliseconds(20)));
+		REQUIRE(cache.set("forever", value));
+		REQUIRE(cache.get_ref("short"));
+		std::this_thread::sleep_for(milliseconds(60));
+		REQUIRE(!cache.get_ref("short"));
+		REQUIRE(cache.get("short").data_ == nullptr);
+		REQUIRE(!cache.mget({"short", "forever"})[0]);
+		REQUIRE(cache.get_ref("forever"));
+		REQUIRE(!cache.del("short"));
+	}
+
+	SECTION("Expired items are freed without being read") {
+		for (int i = 0; i < 10; i++) {
+			REQUIRE(cache.set("key" + std::to_string(i), value, milliseconds(10)));
+		}
+		REQUIRE(cache.set("forever", value));
+		for (int i = 0; i < 100 && cache.space_used() != sizeof(bytes); i++) {
+			std::this_thread::sleep_for(milliseconds(10));
+		}
+		REQUIRE(cache.space_used() == sizeof(bytes));
+		auto stats = cache.stats();
+		REQUIRE(stats["expirations"] == 10);
+		REQUIRE(stats["bytes_expired"] == 10 * sizeof(bytes));
+		REQUIRE(stats["evictions"] == 0);
+		REQUIRE(stats["deletes"] == 0);
+	}
+
+	SECTION("Overwriting a key replaces its time to live") {
+		REQUIRE(cache.set("k", value, milliseconds(20)));
+		REQUIRE(cache.set("k", value));
+		REQUIRE(cache.mset({{"m", value}}, milliseconds(20)) == std::vector<bool> {true});
+		std::this_thread::sleep_for(milliseconds(60));
+		REQUIRE(cache.get_ref("k"));
+		REQUIRE(!cache.get_ref("m"));
+		REQUIRE(cache.space_used() == sizeof(bytes));
+	}
+
+	SECTION("Reset forgets pending expirations") {
+		REQUIRE(cache.set("k", value, milliseconds(20)));
+		REQUIRE(cache.reset());
+		REQUIRE(cache.set("k", value));
+		std::this_thread::sleep_for(milliseconds(60));
+		REQUIRE(cache.get_ref("k"));
+	}
+}
+
+TEST_CASE("Snapshots", "[cache]") {
+	const std::string path = "test_cache_store.snapshot";
+	Lru_evictor lru;
+	Cache cache {100000, 0.75, &lru, std::hash<key_view>(), 4};
+	const unsigned NUM_OBJ = 500;
+	Cache::size_type total = 0;
+	for (unsigned i = 0; i < NUM_OBJ; i++) {
+		auto key = "key" + std::to_string(i);
+		std::string val(i % 50 + 1, char('a' + i % 26));
+		total += val.size();
+		REQUIRE(cache.set(key, Cache::val_type {val.data(), val.size()}));
+	}
+	REQUIRE(cache.set("short", Cache::val_type {"s", 1}, std::chrono::milliseconds(20)));
+	REQUIRE(cache.set("long", Cache::val_type {"l", 1}, std::chrono::hours(1)));
+	REQUIRE(cache.save_snapshot(path));
+
+	SECTION("A loaded snapshot serves every pair") {
+		Lru_evictor lru2;
+		Cache restored {100000, 0.75, &lru2, std::hash<key_view>(), 2};
+		REQUIRE(restored.set("key0", Cache::val_type {"old", 3}));
+		std::this_thread::sleep_for(std::chrono::milliseconds(40));
+		REQUIRE(restored.load_snapshot(path));
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			auto value = restored.get_ref("key" + std::to_string(i));
+			REQUIRE(std::string(value.data(), value.size()) == std::string(i % 50 + 1, char('a' + i % 26)));
+		}
+		REQUIRE(!restored.get_ref("short"));
+		REQUIRE(restored.get_ref("long"));
+		REQUIRE(restored.space_used() == total + 1);
+
+		//mapped pairs are overwritten, deleted and saved like any others
+		auto held = restored.get_ref("key1");
+		REQUIRE(restored.set("key1", Cache::val_type {"new", 3}));
+		REQUIRE(restored.del("key2"));
+		REQUIRE(std::string(held.data(), held.size()) == std::string(2, 'b'));
+		REQUIRE(restored.save_snapshot(path));
+
+		Cache again {100000, 0.75, nullptr, std::hash<key_view>(), 3};
+		REQUIRE(again.load_snapshot(path));
+		REQUIRE(std::string(again.get_ref("key1").data(), 3) == "new");
+		REQUIRE(!again.get_ref("key2"));
+		REQUIRE(again.space_used() == restored.space_used());
+		REQUIRE(restored.reset());
+		REQUIRE(restored.space_used() == 0);
+	}
+
+	SECTION("Pairs that do not fit are left out") {
+		Cache small {1000, 0.75, nullptr, std::hash<key_view>(), 1};
+		REQUIRE(small.load_snapshot(path));
+		REQUIRE(small.space_used() <= 1000);
+		REQUIRE(small.space_used() > 900);
+	}
+
+	SECTION("Invalid snapshots are refused") {
+		Cache other {100000, 0.75, nullptr, std::hash<key_view>(), 1};
+		REQUIRE(!other.load_snapshot(path + ".missing"));
+		Cache rehashed {100000, 0.75, nullptr, hf_fast, 1};
+		REQUIRE(!rehashed.load_snapshot(path));
+		REQUIRE(rehashed.space_used() == 0);
+
+		{
+			std::ofstream out(path, std::ios::binary | std::ios::trunc);
+			out << "not a snapshot, but long enough to hold a header";
+		}
+		REQUIRE(!other.load_snapshot(path));
+		REQUIRE(other.space_used() == 0);
+	}
+
+	SECTION("Snapshots whose images and records disagree are refused") {
+		//header: magic, version, block_size, count, items_offset, records_offset
+		auto patch = [&path](std::uint64_t at, const void* data, std::size_t n) {
+			std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+			file.seekp(at);
+			file.write(static_cast<const char*>(data), n);
+		};
+		auto read = [&path](std::uint64_t at, void* data, std::size_t n) {
+			std::ifstream file(path, std::ios::binary);
+			file.seekg(at);
+			file.read(static_cast<char*>(data), n);
+		};
+		std::uint64_t items_offset, records_offset, first_offset;
+		std::uint32_t first_key_size;
+		read(24, &items_offset, 8);
+		read(32, &records_offset, 8);
+		read(records_offset, &first_offset, 8);
+		read(records_offset + 32, &first_key_size, 4);
+		REQUIRE(first_offset == items_offset);
+		Cache other {100000, 0.75, nullptr, std::hash<key_view>(), 1};
+
+		//the first image's key_size, right after its reference count
+		std::uint32_t key_size = 1 << 30;
+		patch(items_offset + 4, &key_size, 4);
+		REQUIRE(!other.load_snapshot(path));
+		REQUIRE(other.space_used() == 0);
+
+		//the second record pointing at the first image
+		REQUIRE(cache.save_snapshot(path));
+		patch(records_offset + 40 + (first_key_size + 7) / 8 * 8, &first_offset, 8);
+		REQUIRE(!other.load_snapshot(path));
+	}
+
+	std::remove(path.c_str());
+}
+
+TEST_CASE("Mutation log", "[cache]") {
+	const std::string path = "test_cache_store.log";
+	std::remove(path.c_str());
+	const char bytes[40] = {};
+	Cache::val_type value {bytes, sizeof(bytes)};
+	using std::chrono::milliseconds;
+
+	SECTION("A reopened store gets its contents back") {
+		{
+			Cache cache {1000000, 0.75, nullptr, std::hash<key_view>(), 4};
+			REQUIRE(cache.open_log(path));
+			REQUIRE(!cache.open_log(path));
+			REQUIRE(cache.set("gone", value));
+			REQUIRE(cache.reset());
+			REQUIRE(cache.set("a", value));
+			REQUIRE(cache.set("b", Cache::val_type {"bb", 2}));
+			REQUIRE(cache.set("b", Cache::val_type {"bbb", 3}));
+			REQUIRE(cache.set("short", value, milliseconds(20)));
+			REQUIRE(cache.set("long", value, std::chrono::hours(1)));
+			REQUIRE(cache.del("a"));
+			cache.mset({{"c", value}, {"d", value}});
+			REQUIRE(cache.mdel({"d", "missing"}) == 1);
+		}
+		std::this_thread::sleep_for(milliseconds(40));
+
+		Cache cache {1000000, 0.75, nullptr, std::hash<key_view>(), 2};
+		REQUIRE(cache.open_log(path));
+		REQUIRE(!cache.get_ref("gone"));
+		REQUIRE(!cache.get_ref("a"));
+		REQUIRE(std::string(cache.get_ref("b").data(), 3) == "bbb");
+		REQUIRE(!cache.get_ref("short"));
+		REQUIRE(cache.get_ref("long"));
+		REQUIRE(cache.get_ref("c"));
+		REQUIRE(!cache.get_ref("d"));
+		REQUIRE(cache.space_used() == 3 + 2 * sizeof(bytes));
+		REQUIRE(cache.stats()["sets"] == 0);
+
+		//mutations after the replay go to the same (compacted) log
+		REQUIRE(cache.del("c"));
+	}
+
+	SECTION("Files that are not logs are refused") {
+		{
+			std::ofstream out(path, std::ios::binary);
+			out << "not a log, and long enough to hold a header";
+		}
+		Cache cache {10000};
+		REQUIRE(!cache.open_log(path));
+	}
+
+	std::remove(path.c_str());
+}
+
+//a JSON-ish record, which compresses well
+std::string json_value(unsigned i, unsigned records) {
+	std::string s = "[";
+	for (unsigned r = 0; r < records; r++) {
+		s += "{\"id\":" + std::to_string(i * 100 + r) + ",\"name\":\"user" + std::to_string(i)
+				+ "\",\"active\":true,\"roles\":[\"reader\",\"writer\"]},";
+	}
+	return s + "]";
+}
+
+TEST_CASE("Compression", "[cache]") {
+	Lru_evictor lru;
+	Cache cache {1000000, 0.75, &lru, std::hash<key_view>(), 4};
+	REQUIRE(cache.compress_values(64));
+	auto big = json_value(1, 40);
+	REQUIRE(cache.set("big", Cache::val_type {big.data(), big.size()}));
+
+	SECTION("Values above the threshold are stored compressed and read back whole") {
+		REQUIRE(cache.space_used() * 3 < big.size());
+		auto handle = cache.get_ref("big");
+		REQUIRE(std::string(handle.data(), handle.size()) == big);
+		auto copy = cache.get("big");
+		REQUIRE(std::string(copy.data_, copy.size_) == big);
+		delete[] copy.data_;
+
+		auto stats = cache.stats();
+		REQUIRE(stats["compressions"] == 1);
+		REQUIRE(stats["bytes_uncompressed"] == big.size());
+		REQUIRE(stats["compression_ratio"] > 3);
+		REQUIRE(stats["decompressions"] == 2);
+		REQUIRE(stats["bytes_out"] == 2 * big.size());
+
+		//a handle owns its decompressed copy
+		REQUIRE(cache.set("big", Cache::val_type {"small", 5}));
+		REQUIRE(std::string(handle.data(), handle.size()) == big);
+		REQUIRE(cache.space_used() == 5);
+	}
+
+	SECTION("Small and incompressible values are stored as they are") {
+		auto used = cache.space_used();
+		std::string small(63, 'a');
+		REQUIRE(cache.set("small", Cache::val_type {small.data(), small.size()}));
+		REQUIRE(cache.space_used() == used + small.size());
+
+		std::string noise;
+		std::uint64_t x = 1;
+		for (unsigned i = 0; i < 1000; i++) {
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+			noise += char(x >> 56);
+		}
+		REQUIRE(cache.set("noise", Cache::val_type {noise.data(), noise.size()}));
+		REQUIRE(cache.space_used() == used + small.size() + noise.size());
+		REQUIRE(std::string(cache.get_ref("noise").data(), noise.size()) == noise);
+		REQUIRE(cache.stats()["incompressible"] == 1);
+	}
+
+	SECTION("Batches compress and decompress each value") {
+		auto other = json_value(2, 40);
+		auto stored = cache.mset({{"a", Cache::val_type {other.data(), other.size()}}, {"b", Cache::val_type {"b", 1}}});
+		REQUIRE(stored == std::vector<bool> {true, true});
+		auto values = cache.mget({"big", "a", "b", "missing"});
+		REQUIRE(std::string(values[0].data(), values[0].size()) == big);
+		REQUIRE(std::string(values[1].data(), values[1].size()) == other);
+		REQUIRE(std::string(values[2].data(), values[2].size()) == "b");
+		REQUIRE(!values[3]);
+	}
+
+	SECTION("Snapshots keep values compressed, and logs keep them as set") {
+		const std::string snapshot = "test_cache_store.compressed.snapshot";
+		REQUIRE(cache.save_snapshot(snapshot));
+		Cache restored {1000000, 0.75, nullptr, std::hash<key_view>(), 2};
+		REQUIRE(restored.load_snapshot(snapshot));
+		REQUIRE(restored.space_used() == cache.space_used());
+		REQUIRE(std::string(restored.get_ref("big").data(), big.size()) == big);
+		std::remove(snapshot.c_str());
+
+		const std::string log = "test_cache_store.compressed.log";
+		std::remove(log.c_str());
+		{
+			Cache logged {1000000, 0.75, nullptr, std::hash<key_view>(), 2};
+			logged.compress_values(64);
+			REQUIRE(logged.open_log(log));
+			REQUIRE(logged.set("big", Cache::val_type {big.data(), big.size()}));
+		}
+		{
+			Cache replayed {1000000, 0.75, nullptr, std::hash<key_view>(), 2};
+			REQUIRE(replayed.open_log(log));
+			REQUIRE(replayed.space_used() == big.size());
+			REQUIRE(std::string(replayed.get_ref("big").data(), big.size()) == big);
+		}
+		std::remove(log.c_str());
+	}
+
+	SECTION("More pairs fit in the same memory") {
+		const unsigned NUM_OBJ = 400;
+		auto hits_with = [NUM_OBJ](bool compress) {
+			Lru_evictor lru;
+			Cache small {100000, 0.75, &lru, std::hash<key_view>(), 1};
+			small.compress_values(compress ? 64 : 0);
+			for (unsigned i = 0; i < NUM_OBJ; i++) {
+				auto value = json_value(i, 20);
+				small.set("key" + std::to_string(i), Cache::val_type {value.data(), value.size()});
+			}
+			unsigned hits = 0;
+			for (unsigned i = 0; i < NUM_OBJ; i++) {
+				auto handle = small.get_ref("key" + std::to_string(i));
+				if (handle) {
+					REQUIRE(std::string(handle.data(), handle.size()) == json_value(i, 20));
+					hits++;
+				}
+			}
+			return hits;
+		};
+		auto plain = hits_with(false);
+		REQUIRE(plain < NUM_OBJ / 2);
+		REQUIRE(hits_with(true) > 5 * plain);
+	}
+}
+
+TEST_CASE("Spill tier", "[cache]") {
+	const std::string path = "test_cache_store.spill";
+	const unsigned NUM_OBJ = 200;
+	auto key_of = [](unsigned i) { return "key" + std::to_string(i); };
+	auto value_of = [](unsigned i) { return "value" + std::to_string(i) + std::string(40, 'v'); };
+	auto read = [](Cache& cache, const std::string& key) {
+		auto handle = cache.get_ref(key);
+		return handle ? std::string(handle.data(), handle.size()) : std::string("(miss)");
+	};
+
+	Lru_evictor lru;
+	Cache cache {1000, 0.75, &lru, std::hash<key_view>(), 1};
+	REQUIRE(cache.open_spill(path, 1 << 20));
+	REQUIRE(!cache.open_spill(path, 1 << 20));
+	for (unsigned i = 0; i < NUM_OBJ; i++) {
+		auto value = value_of(i);
+		REQUIRE(cache.set(key_of(i), Cache::val_type {value.data(), value.size()}));
+	}
+	REQUIRE(cache.space_used() <= 1000);
+	REQUIRE(cache.stats()["spills"] > 0);
+
+	SECTION("Evicted pairs are read back from the tier and move back to memory") {
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(read(cache, key_of(i)) == value_of(i));
+		}
+		auto stats = cache.stats();
+		REQUIRE(cache.hit_rate() == 1.0);
+		REQUIRE(stats["spill_hits"] > 0);
+		REQUIRE(stats["promotions"] == stats["spill_hits"]);
+		REQUIRE(stats["memory_hit_rate"] < 1.0);
+		REQUIRE(stats["spill_hit_rate"] == 1.0);
+
+		//the last pair read is in memory now
+		REQUIRE(read(cache, key_of(NUM_OBJ - 1)) == value_of(NUM_OBJ - 1));
+		REQUIRE(cache.stats()["spill_hits"] == stats["spill_hits"]);
+	}
+
+	SECTION("Batches read spilled pairs too") {
+		std::vector<std::string> names;
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			names.push_back(key_of(i));
+		}
+		auto handles = cache.mget(std::vector<key_view>(names.begin(), names.end()));
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(handles[i]);
+			REQUIRE(std::string(handles[i].data(), handles[i].size()) == value_of(i));
+		}
+	}
+
+	SECTION("Deleting or setting a spilled key replaces its spilled pair") {
+		REQUIRE(cache.del(key_of(0)));
+		REQUIRE(read(cache, key_of(0)) == "(miss)");
+		REQUIRE(!cache.del(key_of(0)));
+		REQUIRE(cache.set(key_of(1), Cache::val_type {"new", 3}));
+		REQUIRE(read(cache, key_of(1)) == "new");
+		REQUIRE(cache.del(key_of(1)));
+		REQUIRE(read(cache, key_of(1)) == "(miss)");
+	}
+
+	SECTION("Spilled keys whose hashes collide are kept apart") {
+		Lru_evictor lru2;
+		Cache colliding {1000, 0.75, &lru2, [](key_view) { return size_t(0); }, 1};
+		REQUIRE(colliding.open_spill(path + "2", 1 << 20));
+		for (unsigned i = 0; i < 50; i++) {
+			auto value = value_of(i);
+			REQUIRE(colliding.set(key_of(i), Cache::val_type {value.data(), value.size()}));
+		}
+		REQUIRE(colliding.stats()["spill_pairs"] > 1);
+		REQUIRE(!colliding.del("never set"));
+		REQUIRE(colliding.set(key_of(0), Cache::val_type {"new", 3}));
+		REQUIRE(colliding.del(key_of(1)));
+		REQUIRE(read(colliding, key_of(0)) == "new");
+		REQUIRE(read(colliding, key_of(1)) == "(miss)");
+		for (unsigned i = 2; i < 50; i++) {
+			REQUIRE(read(colliding, key_of(i)) == value_of(i));
+		}
+	}
+
+	SECTION("Reset empties both tiers") {
+		cache.reset();
+		REQUIRE(cache.stats()["spill_pairs"] == 0);
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(read(cache, key_of(i)) == "(miss)");
+		}
+	}
+
+	SECTION("A miss filter leaves spilled pairs to the tier") {
+		REQUIRE(cache.filter_misses(NUM_OBJ));
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			auto value = value_of(i);
+			REQUIRE(read(cache, key_of(i)) == value);
+		}
+		REQUIRE(cache.stats()["filter_rejections"] > 0);
+	}
+
+	SECTION("Spilled values stay compressed") {
+		Lru_evictor lru2;
+		Cache compressed {1000, 0.75, &lru2, std::hash<key_view>(), 1};
+		compressed.compress_values(64);
+		REQUIRE(compressed.open_spill(path + "2", 1 << 20));
+		std::string big(600, 'z');
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(compressed.set(key_of(i), Cache::val_type {big.data(), big.size()}));
+		}
+		auto stats = compressed.stats();
+		REQUIRE(stats["spills"] > 0);
+		REQUIRE(stats["bytes_spilled"] < stats["spills"] * 100);
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(read(compressed, key_of(i)) == big);
+		}
+	}
+}
+
+TEST_CASE("Numa placement", "[cache]") {
+	auto key_of = [](unsigned i) { return "key" + std::to_string(i); };
+	auto read = [](Cache& cache, const std::string& key) {
+		auto handle = cache.get_ref(key);
+		return handle ? std::string(handle.data(), handle.size()) : std::string("(miss)");
+	};
+
+	Cache cache {1 << 20, 0.75, nullptr, std::hash<key_view>(), 16};
+	Cache::val_type val {"value", 5};
+	//stored before the shards are bound, so their pages have to move
+	REQUIRE(cache.set("before", val));
+
+	SECTION("An unbound store is one node") {
+		REQUIRE(cache.numa_node("before") == 0);
+		REQUIRE(cache.stats()["numa_nodes"] == 1);
+	}
+
+	SECTION("This machine's nodes") {
+		auto topology = Numa_topology::detect();
+		REQUIRE(cache.bind_numa(topology));
+		REQUIRE(cache.stats()["numa_nodes"] == topology.nodes());
+		REQUIRE(cache.numa_node("before") < topology.nodes());
+		REQUIRE(read(cache, "before") == "value");
+	}
+
+	SECTION("Shards are spread over every node") {
+		//node 1 need not exist: memory the kernel cannot place stays put
+		Numa_topology topology({{0, {0}}, {1, {0}}});
+		REQUIRE(cache.bind_numa(topology));
+		REQUIRE(cache.stats()["numa_nodes"] == 2);
+		unsigned on_node[2] = {0, 0};
+		for (unsigned i = 0; i < 100; i++) {
+			auto node = cache.numa_node(key_of(i));
+			REQUIRE(node < 2);
+			on_node[node]++;
+			REQUIRE(cache.set(key_of(i), val));
+		}
+		REQUIRE(on_node[0] > 0);
+		REQUIRE(on_node[1] > 0);
+		REQUIRE(read(cache, "before") == "value");
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(read(cache, key_of(i)) == "value");
+		}
+	}
+}
+
+TEST_CASE("Huge pages", "[cache]") {
+	auto key_of = [](unsigned i) { return "key" + std::to_string(i); };
+	Cache::val_type val {"value", 5};
+
+	SECTION("Shards whose share of maxmem spans a huge page have them by default") {
+		Cache cache {64 << 20, 0.75, nullptr, std::hash<key_view>(), 4};
+		REQUIRE(cache.stats()["slab_huge_page_shards"] == 4);
+		for (unsigned i = 0; i < 1000; i++) {
+			REQUIRE(cache.set(key_of(i), val));
+		}
+		for (unsigned i = 0; i < 1000; i++) {
+			REQUIRE(cache.get_ref(key_of(i)));
+		}
+	}
+
+	SECTION("Huge pages can be turned off until something is stored") {
+		Cache cache {64 << 20, 0.75, nullptr, std::hash<key_view>(), 4};
+		REQUIRE(cache.use_huge_pages(false));
+		REQUIRE(cache.stats()["slab_huge_page_shards"] == 0);
+		REQUIRE(cache.set("key", val));
+		REQUIRE(!cache.use_huge_pages(true));
+		REQUIRE(cache.stats()["slab_huge_page_shards"] == 0);
+		REQUIRE(cache.get_ref("key"));
+	}
+}
+
+TEST_CASE("Miss filter", "[cache]") {
+	const unsigned NUM_OBJ = 2000;
+	auto key_of = [](unsigned i) { return "key" + std::to_string(i); };
+	Cache cache {1 << 20, 0.75, nullptr, std::hash<key_view>(), 4};
+	Cache::val_type val {"value", 5};
+	//half stored before the filter, half after
+	for (unsigned i = 0; i < NUM_OBJ / 2; i++) {
+		REQUIRE(cache.set(key_of(i), val));
+	}
+	REQUIRE(cache.filter_misses(NUM_OBJ));
+	for (unsigned i = NUM_OBJ / 2; i < NUM_OBJ; i++) {
+		REQUIRE(cache.set(key_of(i), val));
+	}
+
+	SECTION("Stored keys are found, and most others answered by the filter") {
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(cache.get_ref(key_of(i)));
+		}
+		for (unsigned i = 0; i < 10 * NUM_OBJ; i++) {
+			REQUIRE(!cache.get_ref("missing" + std::to_string(i)));
+		}
+		auto handles = cache.mget({"key0", "missing0"});
+		REQUIRE(handles[0]);
+		REQUIRE(!handles[1]);
+		auto stats = cache.stats();
+		REQUIRE(stats["misses"] == 10 * NUM_OBJ + 1);
+		REQUIRE(stats["filter_rejections"] + stats["filter_false_positives"] == 10 * NUM_OBJ + 1);
+		REQUIRE(stats["filter_false_positive_rate"] < 0.05);
+		REQUIRE(stats["filter_bytes"] >= NUM_OBJ * 5);
+		REQUIRE(stats["filter_bytes"] < NUM_OBJ * 6);
+	}
+
+	SECTION("Deleted keys become misses the filter answers") {
+		for (unsigned i = 0; i < NUM_OBJ; i += 2) {
+			REQUIRE(cache.del(key_of(i)));
+		}
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(bool(cache.get_ref(key_of(i))) == (i % 2 == 1));
+		}
+		REQUIRE(cache.stats()["filter_rejections"] > NUM_OBJ / 2 * 0.9);
+	}
+
+	SECTION("Evicted and reset keys are forgotten") {
+		Lru_evictor lru;
+		Cache small {1000, 0.75, &lru, std::hash<key_view>(), 1};
+		REQUIRE(small.filter_misses(200));
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(small.set(key_of(i), val));
+		}
+		unsigned found = 0;
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			found += bool(small.get_ref(key_of(i)));
+		}
+		REQUIRE(found > 0);
+		REQUIRE(found * val.size_ == small.space_used());
+		REQUIRE(small.stats()["filter_false_positive_rate"] < 0.05);
+		REQUIRE(small.reset());
+		REQUIRE(!small.get_ref(key_of(NUM_OBJ - 1)));
+		REQUIRE(small.stats()["filter_rejections"] == 1);
+	}
+
+	SECTION("The filter can be removed") {
+		REQUIRE(cache.filter_misses(0));
+		REQUIRE(!cache.get_ref("missing"));
+		REQUIRE(cache.get_ref(key_of(0)));
+		auto stats = cache.stats();
+		REQUIRE(stats["filter_bytes"] == 0);
+		REQUIRE(stats["filter_rejections"] == 0);
+	}
+}
+
+TEST_CASE("Hot keys", "[cache]") {
+	Cache cache {1 << 20, 0.75, nullptr, std::hash<key_view>(), 4};
+	REQUIRE(cache.hot_keys().empty());
+	REQUIRE(cache.track_hot_keys(4));
+	auto as_string = [](const Cache::value_handle& h) { return std::string(h.data(), h.size()); };
+	//nine gets in ten are for "hot", the rest for other keys each read once
+	unsigned cold = 0;
+	auto read = [&](unsigned gets) {
+		for (unsigned i = 0; i < gets; i++) {
+			if (i % 10 == 0) {
+				cache.get_ref("cold" + std::to_string(cold++));
+			} else {
+				REQUIRE(cache.get_ref("hot"));
+			}
+		}
+	};
+	for (unsigned i = 0; i < 100; i++) {
+		REQUIRE(cache.set("cold" + std::to_string(i), Cache::val_type {"c", 1}));
+	}
+	REQUIRE(cache.set("hot", Cache::val_type {"value", 5}));
+	read(20000);
+
+	SECTION("A hot key is listed and read from copies") {
+		auto hot = cache.hot_keys();
+		REQUIRE(!hot.empty());
+		REQUIRE(hot.size() <= 4);
+		REQUIRE(hot[0].first == "hot");
+		REQUIRE(hot[0].second > 5000);
+		auto stats = cache.stats();
+		REQUIRE(stats["replica_hits"] > 5000);
+		REQUIRE(stats["replicas_made"] >= 1);
+		REQUIRE(stats["hits"] == 18000 + 100);
+		auto h = cache.get_ref("hot");
+		REQUIRE(as_string(h) == "value");
+		REQUIRE(h.version() == cache.get_ref("hot").version());
+	}
+
+	SECTION("A thread's copies go when it exits") {
+		auto dropped = cache.stats()["replicas_dropped"];
+		auto made = cache.stats()["replicas_made"];
+		std::thread reader([&cache]() {
+			for (unsigned i = 0; i < 20000; i++) {
+				cache.get_ref("hot");
+			}
+		});
+		reader.join();
+		REQUIRE(cache.stats()["replicas_made"] > made);
+		REQUIRE(cache.stats()["replicas_dropped"] > dropped);
+	}
+
+	SECTION("Writes make the copies stale at once") {
+		REQUIRE(cache.set("hot", Cache::val_type {"other", 5}));
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(as_string(cache.get_ref("hot")) == "other");
+		}
+		REQUIRE(cache.append("hot", Cache::val_type {"!", 1}));
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(as_string(cache.get_ref("hot")) == "other!");
+		}
+		REQUIRE(cache.set("hot", Cache::val_type {"1", 1}));
+		read(20000);
+		std::int64_t n;
+		REQUIRE(cache.incr("hot", 1, n));
+		REQUIRE(n == 2);
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(as_string(cache.get_ref("hot")) == "2");
+		}
+		REQUIRE(cache.del("hot"));
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(!cache.get_ref("hot"));
+		}
+		REQUIRE(cache.stats()["replicas_dropped"] >= 1);
+	}
+
+	SECTION("A reset makes the copies stale") {
+		REQUIRE(cache.reset());
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(!cache.get_ref("hot"));
+		}
+	}
+
+	SECTION("An expired key is not read from its copy") {
+		REQUIRE(cache.set("hot", Cache::val_type {"value", 5}, std::chrono::milliseconds(100)));
+		read(20000);
+		std::this_thread::sleep_for(std::chrono::milliseconds(150));
+		for (unsigned i = 0; i < 100; i++) {
+			REQUIRE(!cache.get_ref("hot"));
+		}
+	}
+
+	SECTION("Readers on many threads see every write in order") {
+		const unsigned NUM_THREADS = 4;
+		const unsigned NUM_WRITES = 2000;
+		REQUIRE(cache.set("hot", Cache::val_type {"0", 1}));
+		std::atomic<bool> done {false};
+		std::atomic<bool> ordered {true};
+		std::vector<std::thread> readers;
+		for (unsigned t = 0; t < NUM_THREADS; t++) {
+			readers.emplace_back([&]() {
+				unsigned last = 0;
+				while (!done.load()) {
+					auto h = cache.get_ref("hot");
+					if (!h) {
+						ordered = false;
+						continue;
+					}
+					unsigned n = std::stoul(std::string(h.data(), h.size()));
+					if (n < last) {
+						ordered = false;
+					}
+					last = n;
+				}
+			});
+		}
+		for (unsigned i = 1; i <= NUM_WRITES; i++) {
+			auto s = std::to_string(i);
+			REQUIRE(cache.set("hot", Cache::val_type {s.data(), static_cast<Cache::size_type>(s.size())}));
+		}
+		done = true;
+		for (auto& t : readers) {
+			t.join();
+		}
+		REQUIRE(ordered);
+		REQUIRE(as_string(cache.get_ref("hot")) == std::to_string(NUM_WRITES));
+	}
+
+	SECTION("Tracking can be stopped") {
+		REQUIRE(cache.track_hot_keys(0));
+		REQUIRE(cache.hot_keys().empty());
+		auto before = cache.stats()["replica_hits"];
+		read(1000);
+		REQUIRE(cache.stats()["replica_hits"] == before);
+	}
+}
+
+TEST_CASE("Log memory", "[cache]") {
+	const unsigned NUM_OBJ = 2000;
+	auto key_of = [](unsigned i) { return "key" + std::to_string(i); };
+	//each value says which key and which write it is, padded to a size of its own
+	auto value_of = [](unsigned i, unsigned round) {
+		auto s = std::to_string(i) + ":" + std::to_string(round) + ":";
+		return s + std::string((i * 7 + round * 13) % 300, 'x');
+	};
+	auto as_string = [](const Cache::value_handle& h) { return std::string(h.data(), h.size()); };
+	auto wait_cleaned = [](Cache& cache) {
+		for (unsigned i = 0; i < 200 && cache.stats()["log_utilization"] < 0.75; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	};
+	Lru_evictor lru;
+	Cache cache {1 << 20, 0.75, &lru, std::hash<key_view>(), 4};
+	REQUIRE(cache.use_log_memory(true));
+	for (unsigned i = 0; i < NUM_OBJ; i++) {
+		auto v = value_of(i, 0);
+		REQUIRE(cache.set(key_of(i), Cache::val_type {v.data(), static_cast<Cache::size_type>(v.size())}));
+	}
+
+	SECTION("Items live in the log, which can only be chosen while empty") {
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			REQUIRE(as_string(cache.get_ref(key_of(i))) == value_of(i, 0));
+		}
+		auto stats = cache.stats();
+		REQUIRE(stats["log_segments"] > 0);
+		REQUIRE(stats["log_live_bytes"] > 0);
+		REQUIRE(stats["log_memory_used"] <= 1 << 20);
+		REQUIRE(stats["slab_memory_used"] == 0);
+		REQUIRE(!cache.use_log_memory(false));
+		REQUIRE(cache.append(key_of(0), Cache::val_type {"!", 1}));
+		REQUIRE(as_string(cache.get_ref(key_of(0))) == value_of(0, 0) + "!");
+	}
+
+	SECTION("The cleaner moves items out of sparse segments, keeping them as they were") {
+		std::vector<std::uint64_t> versions;
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			versions.push_back(cache.get_ref(key_of(i)).version());
+		}
+		REQUIRE(cache.set("expiring", Cache::val_type {"soon", 4}, std::chrono::milliseconds(500)));
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			if (i % 4 != 0) {
+				REQUIRE(cache.del(key_of(i)));
+			}
+		}
+		wait_cleaned(cache);
+		auto stats = cache.stats();
+		REQUIRE(stats["segments_cleaned"] > 0);
+		REQUIRE(stats["items_relocated"] > 0);
+		REQUIRE(stats["log_utilization"] >= 0.75);
+		for (unsigned i = 0; i < NUM_OBJ; i += 4) {
+			auto h = cache.get_ref(key_of(i));
+			REQUIRE(as_string(h) == value_of(i, 0));
+			REQUIRE(h.version() == versions[i]);
+		}
+		REQUIRE(as_string(cache.get_ref("expiring")) == "soon");
+		std::this_thread::sleep_for(std::chrono::milliseconds(600));
+		REQUIRE(!cache.get_ref("expiring"));
+	}
+
+	SECTION("Churn on a full log keeps every pair and most of the memory live") {
+		for (unsigned round = 1; round <= 20; round++) {
+			for (unsigned i = 0; i < NUM_OBJ; i++) {
+				auto v = value_of(i, round);
+				cache.set(key_of(i), Cache::val_type {v.data(), static_cast<Cache::size_type>(v.size())});
+			}
+		}
+		for (unsigned i = 0; i < NUM_OBJ; i++) {
+			auto h = cache.get_ref(key_of(i));
+			if (h) {
+				REQUIRE(as_string(h) == value_of(i, 20));
+			}
+		}
+		wait_cleaned(cache);
+		auto stats = cache.stats();
+		REQUIRE(stats["rejected_sets"] == 0);
+		REQUIRE(stats["log_utilization"] >= 0.75);
+		REQUIRE(stats["log_memory_used"] <= 1 << 20);
+	}
+
+	SECTION("Readers see the right values while items move") {
+		std::atomic<bool> done {false};
+		std::atomic<bool> right {true};
+		std::thread reader([&]() {
+			while (!done.load()) {
+				for (unsigned i = 0; i < NUM_OBJ; i += 4) {
+					auto h = cache.get_ref(key_of(i));
+					//under pressure a pair may be evicted, but never mixed up
+					if (h && as_string(h).rfind(std::to_string(i) + ":", 0) != 0) {
+						right = false;
+					}
+				}
+			}
+		});
+		for (unsigned round = 1; round <= 10; round++) {
+			for (unsigned i = 0; i < NUM_OBJ; i++) {
+				if (i % 4 != 0) {
+					auto v = value_of(i, round);
+					cache.set(key_of(i), Cache::val_type {v.data(), static_cast<Cache::size_type>(v.size())});
+				}
+			}
+			for (unsigned i = 0; i < NUM_OBJ; i++) {
+				if (i % 4 != 0) {
+					cache.del(key_of(i));
+				}
+			}
+		}
+		done = true;
+		reader.join();
+		REQUIRE(right);
+		REQUIRE(cache.stats()["items_relocated"] > 0);
+	}
+}
@@ -0,0 +1,69 @@
+#define CATCH_CONFIG_MAIN
+#include "counting_bloom.hh"
+#include <random>
+#include <vector>
+#include "catch.hpp"
+
+TEST_CASE("Counting Bloom filter", "[Counting_bloom]") {
+  const std::size_t nkeys = 100000;
+  Counting_bloom filter(nkeys);
+  std::mt19937_64 gen(1);
+  std::vector<std::uint64_t> keys(nkeys);
+  for (auto& k : keys) {
+    k = gen();
+  }
+
+  SECTION("Added keys are always found") {
+    for (auto k : keys) {
+      filter.add(k);
+    }
+    for (auto k : keys) {
+      REQUIRE(filter.may_contain(k));
+    }
+    REQUIRE(filter.bytes() >= nkeys * 10 / 2);
+    REQUIRE(filter.bytes() < nkeys * 10 / 2 + 64);
+  }
+
+  SECTION("Other keys are rarely found when the filter is at capacity") {
+    for (auto k : keys) {
+      filter.add(k);
+    }
+    unsigned positives = 0;
+    const unsigned ntries = 100000;
+    for (unsigned i = 0; i < ntries; i++) {
+      positives += filter.may_contain(gen());
+    }
+    REQUIRE(positives < ntries / 40);
+  }
+
+  SECTION("Removed keys are forgotten, and the rest kept") {
+    for (auto k : keys) {
+      filter.add(k);
+    }
+    for (std::size_t i = 0; i < nkeys / 2; i++) {
+      filter.remove(keys[i]);
+    }
+    for (std::size_t i = nkeys / 2; i < nkeys; i++) {
+      REQUIRE(filter.may_contain(keys[i]));
+    }
+    unsigned found = 0;
+    for (std::size_t i = 0; i < nkeys / 2; i++) {
+      found += filter.may_contain(keys[i]);
+    }
+    REQUIRE(found < nkeys / 50);
+  }
+
+  SECTION("A key added more times than a counter holds is never lost") {
+    for (int i = 0; i < 20; i++) {
+      filter.add(keys[0]);
+    }
+    REQUIRE(filter.saturated() > 0);
+    for (int i = 0; i < 20; i++) {
+      filter.remove(keys[0]);
+    }
+    REQUIRE(filter.may_contain(keys[0]));
+    filter.clear();
+    REQUIRE(!filter.may_contain(keys[0]));
+    REQUIRE(filter.saturated() == 0);
+  }
+}
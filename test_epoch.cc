@@ -0,0 +1,114 @@
+#define CATCH_CONFIG_MAIN
+#include "epoch.hh"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+
+namespace {
+
+int freed = 0;
+
+void count_free(void* p) {
+  freed++;
+  delete static_cast<int*>(p);
+}
+
+}
+
+TEST_CASE("Epoch reclamation", "[Epoch_manager]") {
+  Epoch_manager epochs;
+  freed = 0;
+
+  SECTION("Retired memory is freed once no guard is held") {
+    epochs.retire(new int(1), count_free);
+    REQUIRE(epochs.pending() == 1);
+    epochs.collect();
+    REQUIRE(freed == 1);
+    REQUIRE(epochs.pending() == 0);
+  }
+
+  SECTION("A guard keeps memory retired after it was taken") {
+    {
+      Epoch_manager::guard guard(epochs);
+      epochs.retire(new int(1), count_free);
+      epochs.collect();
+      epochs.collect();
+      REQUIRE(freed == 0);
+    }
+    epochs.collect();
+    REQUIRE(freed == 1);
+  }
+
+  SECTION("Guards nest") {
+    {
+      Epoch_manager::guard outer(epochs);
+      {
+        Epoch_manager::guard inner(epochs);
+      }
+      epochs.retire(new int(1), count_free);
+      epochs.collect();
+      REQUIRE(freed == 0);
+    }
+    epochs.collect();
+    REQUIRE(freed == 1);
+  }
+
+  SECTION("A guard on another thread holds memory back") {
+    std::atomic<int> state {0};
+    std::thread reader([&epochs, &state]() {
+      Epoch_manager::guard guard(epochs);
+      state = 1;
+      while (state != 2) {
+        std::this_thread::yield();
+      }
+    });
+    while (state != 1) {
+      std::this_thread::yield();
+    }
+    epochs.retire(new int(1), count_free);
+    epochs.collect();
+    REQUIRE(freed == 0);
+    state = 2;
+    reader.join();
+    epochs.collect();
+    REQUIRE(freed == 1);
+  }
+
+  SECTION("Guards on threads past max_threads hold memory back") {
+    const unsigned nthreads = Epoch_manager::max_threads + 44;
+    std::atomic<unsigned> entered {0};
+    std::atomic<bool> done {false};
+    std::vector<std::thread> readers;
+    for (unsigned t = 0; t < nthreads; t++) {
+      readers.emplace_back([&epochs, &entered, &done]() {
+        Epoch_manager::guard guard(epochs);
+        entered++;
+        while (!done) {
+          std::this_thread::yield();
+        }
+      });
+    }
+    while (entered != nthreads) {
+      std::this_thread::yield();
+    }
+    epochs.retire(new int(1), count_free);
+    epochs.collect();
+    epochs.collect();
+    REQUIRE(freed == 0);
+    done = true;
+    for (auto& t : readers) {
+      t.join();
+    }
+    epochs.collect();
+    REQUIRE(freed == 1);
+  }
+
+  SECTION("drain frees everything") {
+    Epoch_manager::guard guard(epochs);
+    epochs.retire(new int(1), count_free);
+    epochs.retire(new int(2), count_free);
+    epochs.drain();
+    REQUIRE(freed == 2);
+  }
+}
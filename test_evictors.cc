@@ -1,5 +1,6 @@
 #define CATCH_CONFIG_MAIN
 #include "lru_evictor.hh"
+#include <string>
 #include "catch.hpp"
 //#include <catch2/catch.hpp>
 
@@ -29,4 +30,74 @@ TEST_CASE("Lru Eviction", "[Lru_evictor]") {
   }
 }
 
+TEST_CASE("Lru keys from views", "[Lru_evictor]") {
+  Lru_evictor lru {};
 
+  SECTION("Touched keys are copied out of the caller's buffer") {
+    std::string buffer = "a-long-key-that-does-not-fit-inline";
+    lru.touch_key(buffer);
+    lru.touch_key("b");
+    lru.touch_key(key_view(buffer));
+    buffer.assign(buffer.size(), 'x');
+    REQUIRE(lru.evict() == "b");
+    REQUIRE(lru.evict() == "a-long-key-that-does-not-fit-inline");
+    REQUIRE(lru.evict() == "");
+  }
+}
+
+TEST_CASE("Lru items by handle", "[Lru_evictor]") {
+  Lru_evictor lru {};
+  int items[4];
+
+  SECTION("Evicts the least recently touched item") {
+    auto a = lru.insert_item(&items[0], "a");
+    auto b = lru.insert_item(&items[1], "b");
+    lru.insert_item(&items[2], "c");
+    lru.touch_item(a, "a");
+    lru.touch_item(b, "b");
+    REQUIRE(lru.evict_item().item == &items[2]);
+    REQUIRE(lru.evict_item().item == &items[0]);
+    REQUIRE(lru.evict_item().item == &items[1]);
+    auto none = lru.evict_item();
+    REQUIRE(none.item == nullptr);
+    REQUIRE(none.key == "");
+  }
+
+  SECTION("Removed items are not evicted, and their handles are reused") {
+    auto a = lru.insert_item(&items[0], "a");
+    auto b = lru.insert_item(&items[1], "b");
+    lru.remove_item(a);
+    auto c = lru.insert_item(&items[2], "c");
+    REQUIRE(c == a);
+    lru.remove_item(b);
+    REQUIRE(lru.evict_item().item == &items[2]);
+    REQUIRE(lru.evict_item().item == nullptr);
+  }
+
+  SECTION("Moved items keep their place") {
+    auto a = lru.insert_item(&items[0], "a");
+    lru.insert_item(&items[1], "b");
+    lru.move_item(a, &items[3]);
+    REQUIRE(lru.evict_item().item == &items[3]);
+    REQUIRE(lru.evict_item().item == &items[1]);
+  }
+
+  SECTION("Clearing forgets every item") {
+    for (auto& item : items) {
+      lru.insert_item(&item, "x");
+    }
+    lru.clear_items();
+    REQUIRE(lru.evict_item().item == nullptr);
+    lru.insert_item(&items[3], "d");
+    REQUIRE(lru.evict_item().item == &items[3]);
+  }
+
+  SECTION("Keys are evicted once there are no items left") {
+    lru.touch_key("k");
+    lru.insert_item(&items[0], "a");
+    REQUIRE(lru.evict_item().item == &items[0]);
+    auto key = lru.evict_item();
+    REQUIRE(key.item == nullptr);
+    REQUIRE(key.key == "k");
+  }
+}
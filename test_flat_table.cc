@@ -0,0 +1,134 @@
+#define CATCH_CONFIG_MAIN
+#include "flat_table.hh"
+#include <string>
+#include <vector>
+#include "catch.hpp"
+
+//spread small integers over all 64 bits, as the store's hash mixing does
+std::uint64_t mix(std::uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+//entries live outside the table, which only holds pointers to them
+struct entry {
+  std::string key;
+  int value;
+};
+
+struct key_of {
+  std::string_view operator()(const entry* e) const { return e->key; }
+};
+
+TEST_CASE("Flat table", "[Flat_table]") {
+  Flat_table<const entry*, key_of> table {0.75};
+  const int NUM_OBJ = 10000;
+  std::vector<entry> entries;
+  for (int i = 0; i < 100 * NUM_OBJ; i++) {
+    entries.push_back(entry {std::to_string(i), i});
+  }
+
+  SECTION("Missing keys are not found") {
+    REQUIRE(table.find(mix(1), "1") == table.npos);
+  }
+
+  SECTION("Inserted keys are found until erased") {
+    for (int i = 0; i < NUM_OBJ; i++) {
+      table.insert(mix(i), &entries[i]);
+    }
+    REQUIRE(table.size() == NUM_OBJ);
+    REQUIRE(table.load_factor() <= 0.75);
+    for (int i = 0; i < NUM_OBJ; i++) {
+      auto pos = table.find(mix(i), std::to_string(i));
+      REQUIRE(pos != table.npos);
+      REQUIRE(table.value(pos)->value == i);
+    }
+    for (int i = 0; i < NUM_OBJ; i += 2) {
+      table.erase(table.find(mix(i), std::to_string(i)));
+    }
+    REQUIRE(table.size() == NUM_OBJ / 2);
+    for (int i = 0; i < NUM_OBJ; i++) {
+      REQUIRE((table.find(mix(i), std::to_string(i)) == table.npos) == (i % 2 == 0));
+    }
+  }
+
+  SECTION("Entries stay reachable while the table grows") {
+    int n = 0;
+    while (!table.migrating() || n < 1000) {
+      table.insert(mix(n), &entries[n]);
+      n++;
+    }
+    REQUIRE(table.migrating());
+    for (int i = 0; i < n; i++) {
+      REQUIRE(table.find(mix(i), std::to_string(i)) != table.npos);
+    }
+    int erased_below = n;
+    for (int i = 0; i < erased_below; i += 3) {
+      table.erase(table.find(mix(i), std::to_string(i)));
+    }
+    while (table.migrating()) {
+      table.insert(mix(n), &entries[n]);
+      n++;
+    }
+    for (int i = 0; i < n; i++) {
+      REQUIRE((table.find(mix(i), std::to_string(i)) == table.npos) == (i % 3 == 0 && i < erased_below));
+    }
+    REQUIRE(table.size() == static_cast<std::size_t>(n - (erased_below + 2) / 3));
+  }
+
+  SECTION("Colliding hashes are told apart by key") {
+    for (int i = 0; i < 100; i++) {
+      table.insert(42, &entries[i]);
+    }
+    for (int i = 0; i < 100; i++) {
+      REQUIRE(table.value(table.find(42, std::to_string(i)))->value == i);
+    }
+    table.erase(table.find(42, "50"));
+    REQUIRE(table.find(42, "50") == table.npos);
+    REQUIRE(table.value(table.find(42, "99"))->value == 99);
+  }
+
+  SECTION("Churn does not grow the table without bound") {
+    for (int i = 0; i < 100 * NUM_OBJ; i++) {
+      table.insert(mix(i), &entries[i]);
+      if (i >= 100) {
+        table.erase(table.find(mix(i - 100), std::to_string(i - 100)));
+      }
+    }
+    REQUIRE(table.size() == 100);
+    REQUIRE(table.capacity() <= 512);
+  }
+
+  SECTION("Clear removes everything") {
+    for (int i = 0; i < NUM_OBJ; i++) {
+      table.insert(mix(i), &entries[i]);
+    }
+    table.clear();
+    REQUIRE(table.size() == 0);
+    int count = 0;
+    table.for_each([&count](const entry*) { count++; });
+    REQUIRE(count == 0);
+  }
+
+  SECTION("Detached entries stay reachable through what detach returns") {
+    int n = 0;
+    while (!table.migrating()) {
+      table.insert(mix(n), &entries[n]);
+      n++;
+    }
+    auto detached = table.detach();
+    REQUIRE(table.size() == 0);
+    REQUIRE(table.find(mix(0), "0") == table.npos);
+    table.insert(mix(0), &entries[0]);
+    REQUIRE(table.size() == 1);
+
+    //entries being migrated are seen once, from one table or the other
+    std::vector<int> seen(n, 0);
+    detached.for_each([&seen](const entry* e) { seen[e->value]++; });
+    for (int i = 0; i < n; i++) {
+      REQUIRE(seen[i] == 1);
+    }
+  }
+}
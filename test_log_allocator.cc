@@ -0,0 +1,95 @@
+#define CATCH_CONFIG_MAIN
+#include "log_allocator.hh"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "catch.hpp"
+
+TEST_CASE("Log allocation", "[Log_allocator]") {
+  Log_allocator log {64 * 1024, 4096};
+  REQUIRE(log.segments() == 16);
+
+  SECTION("Allocations are appended and aligned") {
+    void* a = log.allocate(100);
+    void* b = log.allocate(50);
+    REQUIRE(a != nullptr);
+    REQUIRE(b == static_cast<char*>(a) + 112);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(b) % 16 == 0);
+    REQUIRE(log.live_bytes() == 112 + 64);
+    REQUIRE(log.memory_used() == 4096);
+    log.deallocate(a, 100);
+    log.deallocate(b, 50);
+    REQUIRE(log.live_bytes() == 0);
+  }
+
+  SECTION("Writes leave the last segment to relocations") {
+    std::vector<void*> items;
+    void* p;
+    while ((p = log.allocate(1000)) != nullptr) {
+      std::memset(p, 1, 1000);
+      items.push_back(p);
+    }
+    REQUIRE(items.size() == 15 * 4);
+    REQUIRE(log.free_segments() == 1);
+    REQUIRE(log.allocate(1000, Log_allocator::relocations) != nullptr);
+    REQUIRE(log.allocate(1000, Log_allocator::relocations) != nullptr);
+    REQUIRE(log.free_segments() == 0);
+    REQUIRE(log.memory_used() <= log.limit());
+  }
+
+  SECTION("A segment is freed once nothing in it is live") {
+    std::vector<void*> items;
+    for (unsigned i = 0; i < 8; i++) {
+      items.push_back(log.allocate(1000));
+    }
+    //the first segment is full, the second is the head
+    REQUIRE(log.free_segments() == 14);
+    for (unsigned i = 0; i < 3; i++) {
+      log.deallocate(items[i], 1000);
+    }
+    REQUIRE(log.free_segments() == 14);
+    log.deallocate(items[3], 1000);
+    REQUIRE(log.free_segments() == 15);
+    //the head stays, even when empty
+    for (unsigned i = 4; i < 8; i++) {
+      log.deallocate(items[i], 1000);
+    }
+    REQUIRE(log.free_segments() == 15);
+    REQUIRE(log.memory_used() == 4096);
+  }
+
+  SECTION("Sparse segments and their live allocations are listed") {
+    std::vector<void*> items;
+    for (unsigned i = 0; i < 16; i++) {
+      items.push_back(log.allocate(1000));
+    }
+    //segments 0-2 are full, 3 is the head; leave 0 with one item, 1 with two
+    for (unsigned i : {0u, 1u, 2u, 5u, 6u}) {
+      log.deallocate(items[i], 1000);
+    }
+    auto sparse = log.sparse_segments(0.5, 8);
+    REQUIRE(sparse.size() == 2);
+    auto live = log.live_in(sparse[0]);
+    REQUIRE(live == std::vector<void*> {items[3]});
+    live = log.live_in(sparse[1]);
+    REQUIRE(live == std::vector<void*> {items[4], items[7]});
+    REQUIRE(log.sparse_segments(0.5, 1).size() == 1);
+    REQUIRE(log.sparse_segments(0.2, 8).size() == 0);
+  }
+
+  SECTION("Large allocations come from the heap, within the limit") {
+    void* p = log.allocate(3000);
+    REQUIRE(p != nullptr);
+    REQUIRE(log.memory_used() == 3008);
+    REQUIRE(log.live_bytes() == 3008);
+    log.deallocate(p, 3000);
+    REQUIRE(log.allocate(100000) == nullptr);
+    REQUIRE(log.memory_used() == 0);
+  }
+}
+
+TEST_CASE("Log segment sizes", "[Log_allocator]") {
+  REQUIRE(Log_allocator::segment_size_for(64 * 1024) == 4096);
+  REQUIRE(Log_allocator::segment_size_for(64 << 20) == 1 << 20);
+  REQUIRE(Log_allocator::segment_size_for(1ull << 34) == 1 << 20);
+}
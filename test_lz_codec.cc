@@ -0,0 +1,86 @@
+#define CATCH_CONFIG_MAIN
+#include "lz_codec.hh"
+#include <random>
+#include <string>
+#include <vector>
+#include "catch.hpp"
+
+// Compress and decompress s, requiring the round trip to give s back.
+// Returns the compressed size.
+std::size_t round_trip(const std::string& s) {
+  std::vector<char> packed(Lz_codec::bound(s.size()));
+  auto n = Lz_codec::compress(s.data(), s.size(), packed.data(), packed.size());
+  REQUIRE(n > 0);
+  REQUIRE(n <= packed.size());
+  std::string out(s.size(), '\0');
+  REQUIRE(Lz_codec::decompress(packed.data(), n, &out[0], out.size()));
+  REQUIRE(out == s);
+  return n;
+}
+
+std::string json_like(unsigned records, std::mt19937_64& gen) {
+  std::string s = "[";
+  for (unsigned i = 0; i < records; i++) {
+    s += "{\"id\":" + std::to_string(gen() % 100000) + ",\"name\":\"user" + std::to_string(gen() % 1000)
+        + "\",\"active\":" + (gen() % 2 ? "true" : "false") + ",\"tags\":[\"a\",\"b\"]},";
+  }
+  return s + "]";
+}
+
+TEST_CASE("LZ codec", "[Lz_codec]") {
+  std::mt19937_64 gen(1);
+
+  SECTION("Short and empty inputs survive a round trip") {
+    for (unsigned n = 0; n < 40; n++) {
+      round_trip(std::string(n, 'x'));
+      std::string s;
+      for (unsigned i = 0; i < n; i++) {
+        s += char(gen());
+      }
+      round_trip(s);
+    }
+  }
+
+  SECTION("Repetitive input shrinks") {
+    auto s = json_like(200, gen);
+    REQUIRE(round_trip(s) * 3 < s.size());
+    std::string run(100000, 'a');
+    REQUIRE(round_trip(run) < 1000);
+  }
+
+  SECTION("Random input survives, and does not shrink") {
+    std::string s;
+    for (unsigned i = 0; i < 100000; i++) {
+      s += char(gen());
+    }
+    REQUIRE(round_trip(s) >= s.size());
+    std::vector<char> packed(s.size() - 1);
+    REQUIRE(Lz_codec::compress(s.data(), s.size(), packed.data(), packed.size()) == 0);
+  }
+
+  SECTION("Long literal runs and long matches use continuation bytes") {
+    std::string s;
+    for (unsigned i = 0; i < 1000; i++) {
+      s += char(gen());
+    }
+    s += std::string(5000, 'z') + s + s.substr(0, 300);
+    round_trip(s);
+  }
+
+  SECTION("Corrupt input is refused without overrunning") {
+    auto s = json_like(50, gen);
+    std::vector<char> packed(Lz_codec::bound(s.size()));
+    auto n = Lz_codec::compress(s.data(), s.size(), packed.data(), packed.size());
+    std::string out(s.size(), '\0');
+    REQUIRE(!Lz_codec::decompress(packed.data(), n - 1, &out[0], out.size()));
+    REQUIRE(!Lz_codec::decompress(packed.data(), n, &out[0], out.size() - 1));
+    std::string bigger(s.size() + 1, '\0');
+    REQUIRE(!Lz_codec::decompress(packed.data(), n, &bigger[0], bigger.size()));
+    for (unsigned i = 0; i < 1000; i++) {
+      auto damaged = packed;
+      damaged[gen() % n] = char(gen());
+      //may or may not decode, but stays within out
+      Lz_codec::decompress(damaged.data(), n, &out[0], out.size());
+    }
+  }
+}
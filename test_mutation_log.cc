@@ -0,0 +1,178 @@
+#define CATCH_CONFIG_MAIN
+#include "mutation_log.hh"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+
+// Replay a log into a map
+std::map<std::string, std::string> replayed(const std::string& path, bool* ok = nullptr) {
+  std::map<std::string, std::string> out;
+  Mutation_log::handlers h;
+  h.set = [&out](std::string_view key, std::string_view value, std::int64_t) {
+    out[std::string(key)] = std::string(value);
+  };
+  h.del = [&out](std::string_view key) { out.erase(std::string(key)); };
+  h.reset = [&out]() { out.clear(); };
+  bool replay_ok = Mutation_log::replay(path, h);
+  if (ok != nullptr) {
+    *ok = replay_ok;
+  }
+  return out;
+}
+
+std::uintmax_t file_size(const std::string& path) {
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  return in.tellg();
+}
+
+TEST_CASE("Mutation log", "[Mutation_log]") {
+  const std::string path = "test_mutation_log.log";
+  std::remove(path.c_str());
+  using std::chrono::milliseconds;
+
+  SECTION("Records replay in order") {
+    {
+      Mutation_log log(path, milliseconds(0));
+      log.log_set("a", "1", 0);
+      log.log_set("b", "2", 0);
+      log.log_del("a");
+      log.log_reset();
+      log.log_set("c", std::string("\0\n3", 3), 0);
+      log.log_set("d", "4", 0);
+      log.commit();
+    }
+    bool ok = false;
+    auto m = replayed(path, &ok);
+    REQUIRE(ok);
+    REQUIRE(m.size() == 2);
+    REQUIRE(m["c"] == std::string("\0\n3", 3));
+    REQUIRE(m["d"] == "4");
+
+    //reopening appends
+    {
+      Mutation_log log(path, milliseconds(1000));
+      log.log_del("d");
+      REQUIRE(log.flush());
+    }
+    REQUIRE(replayed(path).size() == 1);
+  }
+
+  SECTION("Expiry times are kept") {
+    {
+      Mutation_log log(path, milliseconds(0));
+      log.log_set("k", "v", 1234567);
+    }
+    std::int64_t expires = 0;
+    Mutation_log::handlers h;
+    h.set = [&expires](std::string_view, std::string_view, std::int64_t e) { expires = e; };
+    h.del = [](std::string_view) {};
+    h.reset = []() {};
+    REQUIRE(Mutation_log::replay(path, h));
+    REQUIRE(expires == 1234567);
+  }
+
+  SECTION("Concurrent writers are committed in batches") {
+    const unsigned NUM_THREADS = 8;
+    const unsigned NUM_OBJ = 200;
+    {
+      Mutation_log log(path, milliseconds(0));
+      std::vector<std::thread> threads;
+      for (unsigned t = 0; t < NUM_THREADS; t++) {
+        threads.emplace_back([&log, t]() {
+          for (unsigned i = 0; i < NUM_OBJ; i++) {
+            log.log_set("key" + std::to_string(t) + "_" + std::to_string(i), "v", 0);
+            log.commit();
+          }
+        });
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+    }
+    REQUIRE(replayed(path).size() == NUM_THREADS * NUM_OBJ);
+  }
+
+  SECTION("A torn tail is cut off") {
+    {
+      Mutation_log log(path, milliseconds(0));
+      log.log_set("a", "1", 0);
+      log.log_set("b", "2", 0);
+    }
+    auto whole = file_size(path);
+    {
+      std::ofstream out(path, std::ios::binary | std::ios::app);
+      out << "half a record";
+    }
+    REQUIRE(replayed(path).size() == 2);
+    REQUIRE(file_size(path) == whole);
+
+    //a record whose bytes changed is as good as torn
+    {
+      std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+      f.seekp(whole - 1);
+      f.put('x');
+    }
+    auto m = replayed(path);
+    REQUIRE(m.size() == 1);
+    REQUIRE(m.count("a") == 1);
+
+    {
+      Mutation_log log(path, milliseconds(0));
+      log.log_set("c", "3", 0);
+    }
+    REQUIRE(replayed(path).size() == 2);
+  }
+
+  SECTION("Files that are not logs are refused") {
+    {
+      std::ofstream out(path, std::ios::binary);
+      out << "something else entirely";
+    }
+    bool ok = true;
+    replayed(path, &ok);
+    REQUIRE(!ok);
+    std::remove(path.c_str());
+    replayed(path, &ok);
+    REQUIRE(ok);
+  }
+
+  SECTION("Compaction keeps the dumped state and what was logged meanwhile") {
+    {
+      Mutation_log log(path, milliseconds(0));
+      for (unsigned i = 0; i < 1000; i++) {
+        log.log_set("key" + std::to_string(i % 10), std::to_string(i), 0);
+      }
+      REQUIRE(log.flush());
+      auto before = log.size();
+
+      log.compact([&log](const Mutation_log::emit_func& emit) {
+        for (unsigned i = 0; i < 10; i++) {
+          emit("key" + std::to_string(i), std::to_string(990 + i), 0);
+        }
+        //logged while the dump runs, so carried over after it
+        log.log_del("key0");
+        log.log_set("new", "x", 0);
+      });
+      for (int i = 0; i < 1000 && log.size() >= before; i++) {
+        log.log_set("late", std::to_string(i), 0);
+        log.commit();
+      }
+      REQUIRE(log.size() < before);
+      log.log_set("after", "y", 0);
+    }
+    auto m = replayed(path);
+    REQUIRE(m.size() == 12);
+    REQUIRE(m.count("key0") == 0);
+    REQUIRE(m["key9"] == "999");
+    REQUIRE(m["new"] == "x");
+    REQUIRE(m["after"] == "y");
+    REQUIRE(m.count("late") == 1);
+  }
+
+  std::remove(path.c_str());
+}
@@ -0,0 +1,47 @@
+#define CATCH_CONFIG_MAIN
+#include "numa.hh"
+#include <cstdlib>
+#include <set>
+#include <thread>
+#include "catch.hpp"
+
+TEST_CASE("Cpu lists", "[Numa_topology]") {
+  using cpus = std::vector<unsigned>;
+  REQUIRE(Numa_topology::parse_cpus("0") == cpus {0});
+  REQUIRE(Numa_topology::parse_cpus("0-3,8,10-11\n") == (cpus {0, 1, 2, 3, 8, 10, 11}));
+  REQUIRE(Numa_topology::parse_cpus("").empty());
+  REQUIRE(Numa_topology::parse_cpus("3-1").empty());
+  REQUIRE(Numa_topology::parse_cpus("0,x").empty());
+  REQUIRE(Numa_topology::parse_cpus("1-").empty());
+}
+
+TEST_CASE("This machine", "[Numa_topology]") {
+  auto topology = Numa_topology::detect();
+  REQUIRE(topology.nodes() >= 1);
+
+  std::set<unsigned> ids;
+  for (unsigned node = 0; node < topology.nodes(); node++) {
+    REQUIRE(!topology.cpus(node).empty());
+    REQUIRE(ids.insert(topology.id(node)).second);
+  }
+
+  SECTION("Threads run on every node") {
+    for (unsigned node = 0; node < topology.nodes(); node++) {
+      bool bound = false;
+      std::thread([&]() { bound = topology.bind_thread(node); }).join();
+      REQUIRE(bound);
+    }
+  }
+
+  SECTION("Memory can be asked for on every node") {
+    //a kernel without NUMA support may refuse: that only costs speed
+    const std::size_t size = 1 << 16;
+    void* mem = std::aligned_alloc(size, size);
+    REQUIRE(mem != nullptr);
+    for (unsigned node = 0; node < topology.nodes(); node++) {
+      topology.bind_memory(mem, size, node);
+      static_cast<char*>(mem)[0] = 1;
+    }
+    std::free(mem);
+  }
+}
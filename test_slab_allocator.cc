@@ -0,0 +1,189 @@
+#define CATCH_CONFIG_MAIN
+#include "slab_allocator.hh"
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "catch.hpp"
+
+TEST_CASE("Slab allocation", "[Slab_allocator]") {
+  Slab_allocator slabs {64 * 1024, 4096};
+
+  SECTION("Requests are served from the smallest fitting class") {
+    void* p = slabs.allocate(100);
+    REQUIRE(p != nullptr);
+    auto stats = slabs.stats();
+    for (auto& c : stats) {
+      if (c.used == 1) {
+        REQUIRE(c.chunk_size >= 100);
+        REQUIRE(c.chunk_size < 125 + 16);
+        REQUIRE(c.requested == 100);
+      }
+    }
+    slabs.deallocate(p, 100);
+  }
+
+  SECTION("Freed chunks are reused") {
+    void* p = slabs.allocate(40);
+    slabs.deallocate(p, 40);
+    REQUIRE(slabs.allocate(40) == p);
+    slabs.deallocate(p, 40);
+  }
+
+  SECTION("Memory is bounded by the limit") {
+    std::vector<void*> chunks;
+    void* p;
+    while ((p = slabs.allocate(200)) != nullptr) {
+      chunks.push_back(p);
+    }
+    REQUIRE(slabs.memory_used() <= slabs.limit());
+    REQUIRE(chunks.size() > 64 * 1024 / 256 / 2);
+
+    //other classes have to wait for a page to be freed
+    REQUIRE(slabs.allocate(40) == nullptr);
+    slabs.deallocate(chunks.back(), 200);
+    chunks.pop_back();
+
+    for (auto c : chunks) {
+      slabs.deallocate(c, 200);
+    }
+    for (auto& c : slabs.stats()) {
+      REQUIRE(c.used == 0);
+      REQUIRE(c.pages == 0);
+    }
+  }
+
+  SECTION("Empty pages move between classes") {
+    std::vector<void*> chunks;
+    void* p;
+    while ((p = slabs.allocate(200)) != nullptr) {
+      chunks.push_back(p);
+    }
+    for (auto c : chunks) {
+      slabs.deallocate(c, 200);
+    }
+    auto before = slabs.memory_used();
+    chunks.clear();
+    while ((p = slabs.allocate(1000)) != nullptr) {
+      chunks.push_back(p);
+    }
+    REQUIRE(slabs.memory_used() == before);
+    for (auto c : chunks) {
+      slabs.deallocate(c, 1000);
+    }
+  }
+
+  SECTION("Requests larger than a page are allocated directly") {
+    void* p = slabs.allocate(10000);
+    REQUIRE(p != nullptr);
+    REQUIRE(slabs.memory_used() >= 10000);
+    slabs.deallocate(p, 10000);
+    REQUIRE(slabs.allocate(100000) == nullptr);
+  }
+}
+
+TEST_CASE("Aligned slab allocation", "[Slab_allocator]") {
+  Slab_allocator slabs {1 << 20, 4096, 1.25, 64};
+
+  SECTION("Chunks are aligned and sized to the alignment") {
+    std::vector<std::pair<void*, unsigned>> chunks;
+    for (unsigned size = 1; size < 6000; size += 97) {
+      void* p = slabs.allocate(size);
+      REQUIRE(p != nullptr);
+      REQUIRE(reinterpret_cast<std::uintptr_t>(p) % 64 == 0);
+      chunks.push_back({p, size});
+    }
+    for (auto& c : slabs.stats()) {
+      REQUIRE(c.chunk_size % 64 == 0);
+    }
+    for (auto& c : chunks) {
+      slabs.deallocate(c.first, c.second);
+    }
+  }
+
+  SECTION("Chunks grow in place up to their class's size") {
+    auto class_of = [&slabs]() {
+      for (auto& c : slabs.stats()) {
+        if (c.used == 1) {
+          return c;
+        }
+      }
+      return Slab_allocator::class_stats {0, 0, 0, 0, 0};
+    };
+    void* p = slabs.allocate(100);
+    auto chunk = class_of().chunk_size;
+    REQUIRE(chunk >= 100);
+    REQUIRE(slabs.resize(p, 100, chunk));
+    REQUIRE(class_of().requested == chunk);
+    REQUIRE(!slabs.resize(p, chunk, chunk + 1));
+    REQUIRE(class_of().requested == chunk);
+    slabs.deallocate(p, chunk);
+    for (auto& c : slabs.stats()) {
+      REQUIRE(c.requested == 0);
+    }
+
+    void* large = slabs.allocate(8000);
+    REQUIRE(!slabs.resize(large, 8000, 8001));
+    slabs.deallocate(large, 8000);
+  }
+}
+
+TEST_CASE("Slab arena", "[Slab_allocator]") {
+  SECTION("Pages come from an arena with huge pages where it spans one") {
+    Slab_allocator slabs {8 << 20, 1 << 20};
+    REQUIRE(slabs.page_backing() != Slab_allocator::backing::heap);
+    std::vector<void*> chunks;
+    void* p;
+    while ((p = slabs.allocate(1000)) != nullptr) {
+      chunks.push_back(p);
+    }
+    REQUIRE(slabs.memory_used() == 8 << 20);
+    for (auto c : chunks) {
+      static_cast<char*>(c)[999] = 1;
+      slabs.deallocate(c, 1000);
+    }
+  }
+
+  SECTION("An arena smaller than a huge page has normal pages") {
+    Slab_allocator slabs {64 * 1024, 4096};
+    REQUIRE(slabs.page_backing() == Slab_allocator::backing::normal);
+  }
+
+  SECTION("Huge pages can be turned off until the first allocation") {
+    Slab_allocator slabs {8 << 20, 1 << 20};
+    REQUIRE(slabs.use_huge_pages(false));
+    REQUIRE(slabs.page_backing() == Slab_allocator::backing::normal);
+    REQUIRE(slabs.use_huge_pages(true));
+    void* p = slabs.allocate(100);
+    REQUIRE(p != nullptr);
+    REQUIRE(!slabs.use_huge_pages(false));
+    slabs.deallocate(p, 100);
+  }
+
+  SECTION("Pages given back for large allocations are reused") {
+    Slab_allocator slabs {4 << 20, 1 << 20};
+    std::vector<void*> chunks;
+    void* p;
+    while ((p = slabs.allocate(1000)) != nullptr) {
+      chunks.push_back(p);
+    }
+    for (auto c : chunks) {
+      slabs.deallocate(c, 1000);
+    }
+    //the four pooled pages make room for it
+    void* large = slabs.allocate(3 << 20);
+    REQUIRE(large != nullptr);
+    REQUIRE(slabs.memory_used() <= slabs.limit());
+    REQUIRE(slabs.allocate(3 << 20) == nullptr);
+    slabs.deallocate(large, 3 << 20);
+
+    chunks.clear();
+    while ((p = slabs.allocate(1000)) != nullptr) {
+      static_cast<char*>(p)[0] = 1;
+      chunks.push_back(p);
+    }
+    REQUIRE(slabs.memory_used() == 4 << 20);
+    for (auto c : chunks) {
+      slabs.deallocate(c, 1000);
+    }
+  }
+}
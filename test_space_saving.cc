@@ -0,0 +1,63 @@
+#define CATCH_CONFIG_MAIN
+#include "space_saving.hh"
+#include <map>
+#include <random>
+#include <string>
+#include "catch.hpp"
+
+TEST_CASE("Space-Saving sketch", "[Space_saving]") {
+  Space_saving sketch(32);
+
+  SECTION("Keys that fit are counted exactly") {
+    for (int i = 0; i < 10; i++) {
+      for (int j = 0; j <= i; j++) {
+        sketch.add("key" + std::to_string(i));
+      }
+    }
+    auto top = sketch.top(3);
+    REQUIRE(top.size() == 3);
+    REQUIRE(top[0].key == "key9");
+    REQUIRE(top[0].count == 10);
+    REQUIRE(top[0].error == 0);
+    REQUIRE(top[2].key == "key7");
+    REQUIRE(sketch.top(100).size() == 10);
+    REQUIRE(sketch.total() == 55);
+    REQUIRE(sketch.in_top("key8", 2));
+    REQUIRE(!sketch.in_top("key7", 2));
+    REQUIRE(!sketch.in_top("missing", 100));
+  }
+
+  SECTION("Frequent keys are found in a long tail of others") {
+    std::mt19937_64 gen(1);
+    std::map<std::string, std::uint64_t> truth;
+    for (int i = 0; i < 100000; i++) {
+      //a quarter of the stream is five hot keys, the rest a long tail
+      auto key = gen() % 4 == 0 ? "hot" + std::to_string(gen() % 5) : "cold" + std::to_string(gen() % 100000);
+      sketch.add(key);
+      truth[key]++;
+    }
+    auto top = sketch.top(5);
+    for (auto& e : top) {
+      REQUIRE(e.key.substr(0, 3) == "hot");
+      REQUIRE(e.count >= truth[e.key]);
+      REQUIRE(e.count - e.error <= truth[e.key]);
+    }
+    for (int i = 0; i < 5; i++) {
+      REQUIRE(sketch.in_top("hot" + std::to_string(i), 5));
+    }
+  }
+
+  SECTION("Halving lets new keys overtake old ones") {
+    for (int i = 0; i < 100; i++) {
+      sketch.add("old");
+    }
+    sketch.add("rare");
+    sketch.halve();
+    REQUIRE(sketch.total() == 50);
+    REQUIRE(sketch.top(10).size() == 1);
+    sketch.add("new", 60);
+    REQUIRE(sketch.top(1)[0].key == "new");
+    sketch.clear();
+    REQUIRE(sketch.top(10).empty());
+  }
+}
@@ -0,0 +1,126 @@
+#define CATCH_CONFIG_MAIN
+#include "spill_store.hh"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include "catch.hpp"
+
+const std::string path = "test_spill_store.spill";
+
+std::string value_of(unsigned i) {
+  return "value-" + std::to_string(i) + std::string(i % 200, 'v');
+}
+
+// Put a pair, retrying while the writer is still busy with the last block
+void put(Spill_store& spill, unsigned i) {
+  auto key = "key" + std::to_string(i);
+  while (!spill.put(i, key, value_of(i), i % 2 == 0, i)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST_CASE("Spill store", "[Spill_store]") {
+  Spill_store spill(path, 1 << 20);
+  Spill_store::record rec;
+
+  SECTION("Pairs read back as put, from memory and from the file") {
+    const unsigned n = 2000;
+    for (unsigned i = 0; i < n; i++) {
+      put(spill, i);
+    }
+    REQUIRE(spill.size() == n);
+    for (unsigned i = 0; i < n; i++) {
+      REQUIRE(spill.get(i, "key" + std::to_string(i), rec));
+      REQUIRE(rec.value == value_of(i));
+      REQUIRE(rec.compressed == (i % 2 == 0));
+      REQUIRE(rec.expires == i);
+    }
+    REQUIRE(!spill.get(n, "key" + std::to_string(n), rec));
+  }
+
+  SECTION("A key with the same hash as another's is not found") {
+    put(spill, 7);
+    REQUIRE(!spill.get(7, "key8", rec));
+  }
+
+  SECTION("Keys with the same hash are kept apart") {
+    put(spill, 7);
+    REQUIRE(spill.put(7, "key8", "other", false, 0));
+    REQUIRE(spill.size() == 2);
+    REQUIRE(!spill.erase(7, "key9", 0));
+    REQUIRE(spill.get(7, "key7", rec));
+    REQUIRE(rec.value == value_of(7));
+    REQUIRE(!spill.take(7, "key8", rec.version));
+    REQUIRE(spill.erase(7, "key7", 0));
+    REQUIRE(spill.get(7, "key8", rec));
+    REQUIRE(rec.value == "other");
+    REQUIRE(spill.size() == 1);
+  }
+
+  SECTION("A later put replaces an earlier one") {
+    put(spill, 1);
+    REQUIRE(spill.put(1, "key1", "again", false, 0));
+    REQUIRE(spill.get(1, "key1", rec));
+    REQUIRE(rec.value == "again");
+    REQUIRE(spill.size() == 1);
+  }
+
+  SECTION("Taking and erasing remove pairs") {
+    put(spill, 1);
+    put(spill, 2);
+    REQUIRE(spill.get(1, "key1", rec));
+    REQUIRE(!spill.take(1, "key1", rec.version + 1));
+    REQUIRE(spill.take(1, "key1", rec.version));
+    REQUIRE(!spill.get(1, "key1", rec));
+    //key2 expires at 2
+    REQUIRE(!spill.erase(2, "key2", 3));
+    REQUIRE(!spill.get(2, "key2", rec));
+    put(spill, 2);
+    REQUIRE(spill.erase(2, "key2", 1));
+    REQUIRE(spill.size() == 0);
+    REQUIRE(spill.bytes() == 0);
+  }
+
+  SECTION("Clearing forgets every pair") {
+    for (unsigned i = 0; i < 100; i++) {
+      put(spill, i);
+    }
+    spill.clear();
+    REQUIRE(spill.size() == 0);
+    REQUIRE(!spill.get(5, "key5", rec));
+    put(spill, 5);
+    REQUIRE(spill.get(5, "key5", rec));
+  }
+
+  SECTION("Wrapping around drops the oldest pairs") {
+    const unsigned n = 20000;
+    for (unsigned i = 0; i < n; i++) {
+      put(spill, i);
+    }
+    REQUIRE(spill.bytes() <= spill.capacity());
+    REQUIRE(!spill.get(0, "key0", rec));
+    REQUIRE(spill.get(n - 1, "key" + std::to_string(n - 1), rec));
+    unsigned found = 0;
+    for (unsigned i = 0; i < n; i++) {
+      found += spill.get(i, "key" + std::to_string(i), rec);
+    }
+    REQUIRE(found == spill.size());
+  }
+
+  SECTION("Records larger than a block are refused") {
+    REQUIRE(!spill.put(1, "big", std::string(1 << 20, 'x'), false, 0));
+    REQUIRE(spill.size() == 0);
+  }
+}
+
+TEST_CASE("Spill file", "[Spill_store]") {
+  {
+    Spill_store spill(path, 1 << 20);
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    REQUIRE(f != nullptr);
+    std::fclose(f);
+  }
+  REQUIRE(std::fopen(path.c_str(), "rb") == nullptr);
+  REQUIRE_THROWS(Spill_store("no-such-directory/spill", 1 << 20));
+}
@@ -0,0 +1,76 @@
+#define CATCH_CONFIG_MAIN
+#include "stat_counters.hh"
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+
+TEST_CASE("Stat counters", "[Stat_counters]") {
+  Stat_counters counters {3};
+
+  SECTION("Counters start at zero and add up") {
+    REQUIRE(counters.sum(0) == 0);
+    counters.add(0);
+    counters.add(0);
+    counters.add(2, 100);
+    REQUIRE(counters.sum(0) == 2);
+    REQUIRE(counters.sum(1) == 0);
+    REQUIRE(counters.sum(2) == 100);
+  }
+
+  SECTION("Counts from every thread are summed") {
+    const unsigned nthreads = 4;
+    const unsigned nadds = 100000;
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; t++) {
+      threads.emplace_back([&counters]() {
+        for (unsigned i = 0; i < nadds; i++) {
+          counters.add(1);
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    REQUIRE(counters.sum(1) == nthreads * nadds);
+  }
+
+  SECTION("Threads past max_threads share a row") {
+    const unsigned nthreads = Stat_counters::max_threads + 44;
+    std::atomic<unsigned> started {0};
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; t++) {
+      threads.emplace_back([&counters, &started]() {
+        //every thread is alive at once, so some get no row of their own
+        started++;
+        while (started != nthreads) {
+          std::this_thread::yield();
+        }
+        for (unsigned i = 0; i < 1000; i++) {
+          counters.add(2);
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    REQUIRE(counters.sum(2) == nthreads * 1000);
+  }
+
+  SECTION("Counters hold 64-bit totals") {
+    counters.add(0, std::uint64_t(1) << 40);
+    counters.add(0, std::uint64_t(1) << 40);
+    REQUIRE(counters.sum(0) == std::uint64_t(1) << 41);
+  }
+
+  SECTION("clear starts every counter over") {
+    counters.add(0, 5);
+    counters.add(1, 7);
+    counters.clear();
+    REQUIRE(counters.sum(0) == 0);
+    REQUIRE(counters.sum(1) == 0);
+    counters.add(1);
+    REQUIRE(counters.sum(1) == 1);
+  }
+}
@@ -0,0 +1,138 @@
+#define CATCH_CONFIG_MAIN
+#include "timing_wheel.hh"
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "catch.hpp"
+
+struct node;
+struct links_of;
+using wheel_type = Timing_wheel<node, links_of>;
+
+struct node {
+  wheel_type::links links;
+  std::uint64_t expired_at = 0;
+};
+
+struct links_of {
+  wheel_type::links& operator()(node* n) const { return n->links; }
+};
+
+node make_node(std::uint64_t expires) {
+  node n;
+  n.links = wheel_type::links {expires, nullptr, nullptr};
+  return n;
+}
+
+TEST_CASE("Timing wheel", "[Timing_wheel]") {
+  wheel_type wheel {100};
+  auto record = [&wheel](node* n) { n->expired_at = wheel.now() + 1; };
+
+  SECTION("Items expire on the tick of their deadline, at every level") {
+    const unsigned NUM_OBJ = 5000;
+    std::mt19937_64 gen(1);
+    std::vector<node> nodes;
+    for (unsigned i = 0; i < NUM_OBJ; i++) {
+      //deadlines spread over levels 0 to 3
+      unsigned bits = 1 + gen() % 22;
+      nodes.push_back(make_node(100 + gen() % (std::uint64_t(1) << bits)));
+    }
+    for (auto& n : nodes) {
+      wheel.insert(&n);
+    }
+    REQUIRE(wheel.size() == NUM_OBJ);
+
+    std::uint64_t now = 100;
+    bool in_window = true;
+    while (wheel.size() > 0) {
+      std::uint64_t before = now;
+      now += 1 + gen() % 1000;
+      wheel.advance(now, SIZE_MAX, [before, now, &in_window](node* n) {
+        //due in (before, now], or already due when it was inserted
+        in_window = in_window && n->links.expires <= now && (n->links.expires > before || before == 100);
+        n->expired_at = now;
+      });
+    }
+    REQUIRE(in_window);
+    for (auto& n : nodes) {
+      REQUIRE(n.expired_at >= n.links.expires);
+      REQUIRE(!wheel_type::contains(&n));
+    }
+  }
+
+  SECTION("Expiry happens at the exact tick when advancing one tick at a time") {
+    std::vector<node> nodes;
+    for (std::uint64_t e : {101u, 355u, 356u, 100u + 256u * 64u, 100u + 256u * 64u + 1u, 2000000u}) {
+      nodes.push_back(make_node(e));
+    }
+    for (auto& n : nodes) {
+      wheel.insert(&n);
+    }
+    for (std::uint64_t now = 101; wheel.size() > 0; now++) {
+      wheel.advance(now, SIZE_MAX, record);
+    }
+    for (auto& n : nodes) {
+      REQUIRE(n.expired_at == n.links.expires);
+    }
+  }
+
+  SECTION("Removed items never expire") {
+    node a = make_node(150);
+    node b = make_node(150);
+    wheel.insert(&a);
+    wheel.insert(&b);
+    wheel.remove(&a);
+    REQUIRE(wheel.advance(1000, SIZE_MAX, record) == 1);
+    REQUIRE(a.expired_at == 0);
+    REQUIRE(b.expired_at != 0);
+  }
+
+  SECTION("Past deadlines expire on the next advance") {
+    node a = make_node(5);
+    wheel.insert(&a);
+    REQUIRE(wheel.advance(101, SIZE_MAX, record) == 1);
+  }
+
+  SECTION("A limited advance carries on where it stopped") {
+    std::vector<node> nodes(10, make_node(110));
+    for (auto& n : nodes) {
+      wheel.insert(&n);
+    }
+    REQUIRE(wheel.advance(200, 4, record) == 4);
+    REQUIRE(wheel.size() == 6);
+    REQUIRE(wheel.advance(200, 4, record) == 4);
+    REQUIRE(wheel.advance(200, 4, record) == 2);
+    REQUIRE(wheel.size() == 0);
+    REQUIRE(wheel.now() == 200);
+  }
+
+  SECTION("Deadlines past the wheel's span wait until they are due") {
+    node a = make_node((std::uint64_t(1) << 40));
+    wheel.insert(&a);
+    REQUIRE(wheel.advance(5000000, SIZE_MAX, record) == 0);
+    REQUIRE(wheel_type::contains(&a));
+    wheel.remove(&a);
+  }
+
+  SECTION("clear forgets every item") {
+    node a = make_node(150);
+    wheel.insert(&a);
+    wheel.clear();
+    REQUIRE(wheel.size() == 0);
+    REQUIRE(!wheel_type::contains(&a));
+    REQUIRE(wheel.advance(1000, SIZE_MAX, record) == 0);
+  }
+
+  SECTION("abandon forgets every item without touching it") {
+    node a = make_node(150);
+    wheel.insert(&a);
+    wheel.abandon();
+    REQUIRE(wheel.size() == 0);
+    REQUIRE(wheel.advance(1000, SIZE_MAX, record) == 0);
+    REQUIRE(a.expired_at == 0);
+    node b = make_node(1500);
+    wheel.insert(&b);
+    REQUIRE(wheel.advance(2000, SIZE_MAX, record) == 1);
+    REQUIRE(b.expired_at == 1500);
+  }
+}
@@ -10,7 +10,7 @@
 #include "cache.hh"
 
 Cache::size_type maxmem = 1000000;
-Cache test_cache {maxmem,0.75,nullptr,std::hash<key_type>()};
+Cache test_cache {maxmem,0.75,nullptr,std::hash<key_view>()};
 
 //parses and sends a workload request to the cache. returns true if successful
 bool send_request_to_cache(Cache& c, workload::request r) {
@@ -0,0 +1,61 @@
+/*
+ * Small dense indexes for threads.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "thread_index.hh"
+
+namespace {
+
+// Hands out the smallest free thread index to each thread on first use, and
+// takes it back when the thread exits.
+struct thread_indexes {
+	std::mutex mutex;
+	std::vector<bool> used;
+	std::atomic<unsigned> high_water {0};
+
+	unsigned acquire() {
+		std::lock_guard guard(mutex);
+		auto it = std::find(used.begin(), used.end(), false);
+		unsigned i = static_cast<unsigned>(it - used.begin());
+		if (it == used.end()) {
+			used.push_back(true);
+		} else {
+			*it = true;
+		}
+		if (i + 1 > high_water.load(std::memory_order_seq_cst)) {
+			high_water.store(i + 1, std::memory_order_seq_cst);
+		}
+		return i;
+	}
+
+	void release(unsigned i) {
+		std::lock_guard guard(mutex);
+		used[i] = false;
+	}
+};
+
+thread_indexes& indexes() {
+	static thread_indexes instance;
+	return instance;
+}
+
+struct thread_slot {
+	unsigned index;
+	thread_slot() : index(indexes().acquire()) {}
+	~thread_slot() { indexes().release(index); }
+};
+
+}
+
+unsigned thread_index() {
+	thread_local thread_slot slot;
+	return slot.index;
+}
+
+unsigned thread_index_limit() {
+	return indexes().high_water.load(std::memory_order_seq_cst);
+}
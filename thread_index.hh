@@ -0,0 +1,17 @@
+#ifndef THREAD_INDEX_HH
+#define THREAD_INDEX_HH
+
+/*
+ * Small dense indexes for threads, for per-thread state kept in plain
+ * arrays. A thread gets the smallest index not held by a running thread on
+ * first use, and gives it back when it exits, so indexes stay below the
+ * number of threads alive at once.
+ */
+
+// Index of the calling thread, unique among running threads
+unsigned thread_index();
+
+// One more than the largest index handed out so far
+unsigned thread_index_limit();
+
+#endif
@@ -0,0 +1,220 @@
+#ifndef TIMING_WHEEL_HH
+#define TIMING_WHEEL_HH
+
+/*
+ * Hierarchical timing wheel for expiring items, in the style of the Linux
+ * kernel's timer wheel.
+ *
+ * Time advances in ticks. Level 0 has a slot for each of the next 256
+ * ticks; each further level has 64 slots covering 64 times the span of the
+ * level below. An item goes into the slot of the finest level that covers
+ * its deadline, and every time level 0 wraps around, the next slot of the
+ * level above is emptied into the levels below it (a cascade). Inserting
+ * and removing an item are O(1), and an item is moved by a cascade at most
+ * once per level, so expiring n items costs O(n) however they are spread
+ * out; no operation scans for expired items.
+ *
+ * Items are linked into the wheel through links embedded in them, so the
+ * wheel itself allocates nothing after construction.
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+// Node: Item type.
+// LinksOf: Function object returning a reference to a Node's links.
+template <class Node, class LinksOf>
+class Timing_wheel {
+public:
+	// Per item state. pprev is nullptr while the item is not in a wheel.
+	struct links {
+		std::uint64_t expires;   // tick at which the item expires
+		Node* next;
+		Node** pprev;            // the pointer that points at this item
+	};
+
+	// now: The current tick.
+	explicit Timing_wheel(std::uint64_t now = 0) : now_(now), cascaded_(now), size_(0) {
+		for (auto& s : slots_) {
+			s = nullptr;
+		}
+	}
+
+	Timing_wheel(const Timing_wheel&) = delete;
+	Timing_wheel& operator=(const Timing_wheel&) = delete;
+
+	// Add an item expiring at LinksOf()(n).expires. Deadlines already
+	// passed expire on the next advance().
+	void insert(Node* n) {
+		place(n);
+		size_++;
+	}
+
+	// Take an item out of the wheel before it expires.
+	void remove(Node* n) {
+		unlink(n);
+		size_--;
+	}
+
+	static bool contains(Node* n) { return LinksOf()(n).pprev != nullptr; }
+
+	// Move time forward to tick now, removing every item whose deadline
+	// has been reached and passing it to expire(n). Stops early after
+	// limit items; the next call carries on from there. Returns the
+	// number of items expired.
+	template <class F>
+	std::size_t advance(std::uint64_t now, std::size_t limit, F expire) {
+		std::size_t expired = 0;
+		while (now_ < now) {
+			if (size_ == 0) {
+				now_ = cascaded_ = now;
+				break;
+			}
+			std::uint64_t t = now_ + 1;
+			if (cascaded_ != t) {
+				cascaded_ = t;
+				cascade(t);
+			}
+			Node*& head = slots_[t & level0_mask];
+			while (head != nullptr) {
+				if (expired == limit) {
+					return expired;
+				}
+				Node* n = head;
+				unlink(n);
+				if (LinksOf()(n).expires > t) {
+					//only a deadline past the wheel's span ends up here early
+					place(n);
+					continue;
+				}
+				size_--;
+				expired++;
+				expire(n);
+			}
+			now_ = t;
+		}
+		return expired;
+	}
+
+	// Forget every item without expiring it.
+	void clear() {
+		for (auto& s : slots_) {
+			for (Node* n = s; n != nullptr; ) {
+				Node* next = LinksOf()(n).next;
+				LinksOf()(n).pprev = nullptr;
+				n = next;
+			}
+			s = nullptr;
+		}
+		size_ = 0;
+	}
+
+	// Forget every item at once, without touching them. Their links are
+	// left stale, so they must not be passed to remove() or contains()
+	// afterwards.
+	void abandon() {
+		for (auto& s : slots_) {
+			s = nullptr;
+		}
+		size_ = 0;
+	}
+
+	std::size_t size() const { return size_; }
+	std::uint64_t now() const { return now_; }
+
+private:
+	static constexpr unsigned level0_bits = 8;
+	static constexpr unsigned level_bits = 6;
+	static constexpr unsigned levels = 5;
+	static constexpr std::uint64_t level0_mask = (1u << level0_bits) - 1;
+	static constexpr std::uint64_t level_mask = (1u << level_bits) - 1;
+	static constexpr std::size_t nslots = (1u << level0_bits) + (levels - 1) * (1u << level_bits);
+
+	// Bit where level l's slot index starts in a tick, for l >= 1
+	static constexpr unsigned shift(unsigned l) { return level0_bits + (l - 1) * level_bits; }
+
+	// Index in slots_ of level l's slot i, for l >= 1
+	static std::size_t slot_index(unsigned l, std::uint64_t i) {
+		return (1u << level0_bits) + (l - 1) * (1u << level_bits) + i;
+	}
+
+	// Link an item into the slot covering its deadline, counted from the
+	// next tick to process.
+	void place(Node* n) {
+		std::uint64_t base = now_ + 1;
+		std::uint64_t e = LinksOf()(n).expires;
+		if (e < base) {
+			e = base;
+		}
+		//deadlines beyond the top level's span wait in its farthest slot
+		std::uint64_t max_delta = (std::uint64_t(1) << shift(levels)) - 1;
+		if (e - base > max_delta) {
+			e = base + max_delta;
+		}
+		std::uint64_t delta = e - base;
+		std::size_t s;
+		if (delta < (std::uint64_t(1) << level0_bits)) {
+			s = e & level0_mask;
+		} else {
+			unsigned l = 1;
+			while (delta >= (std::uint64_t(1) << shift(l + 1))) {
+				l++;
+			}
+			s = slot_index(l, (e >> shift(l)) & level_mask);
+		}
+		link(n, slots_[s]);
+	}
+
+	static void link(Node* n, Node*& head) {
+		auto& l = LinksOf()(n);
+		l.next = head;
+		l.pprev = &head;
+		if (head != nullptr) {
+			LinksOf()(head).pprev = &l.next;
+		}
+		head = n;
+	}
+
+	static void unlink(Node* n) {
+		auto& l = LinksOf()(n);
+		*l.pprev = l.next;
+		if (l.next != nullptr) {
+			LinksOf()(l.next).pprev = l.pprev;
+		}
+		l.next = nullptr;
+		l.pprev = nullptr;
+	}
+
+	// When tick t starts a new turn of level 0, empty the next slot of
+	// level 1 into the levels below, and so on up while a level wraps too.
+	void cascade(std::uint64_t t) {
+		if ((t & level0_mask) != 0) {
+			return;
+		}
+		//items are placed counting from t itself
+		std::uint64_t saved = now_;
+		now_ = t - 1;
+		for (unsigned l = 1; l < levels; l++) {
+			std::uint64_t i = (t >> shift(l)) & level_mask;
+			Node* n = slots_[slot_index(l, i)];
+			slots_[slot_index(l, i)] = nullptr;
+			while (n != nullptr) {
+				Node* next = LinksOf()(n).next;
+				LinksOf()(n).pprev = nullptr;
+				place(n);
+				n = next;
+			}
+			if (i != 0) {
+				break;
+			}
+		}
+		now_ = saved;
+	}
+
+	std::uint64_t now_;        // last tick fully processed
+	std::uint64_t cascaded_;   // last tick cascaded for
+	std::size_t size_;
+	Node* slots_[nslots];
+};
+
+#endif